@@ -37,13 +37,15 @@ AffineGapVectorizedWithCigar::AffineGapVectorizedWithCigar(
     }
     minScoreParam = subPenalty;
     maxScoreParam = matchReward;
+    maxGaplessEdits = matchReward - subPenalty > 0 ? (gapOpenPenalty - 1) / (matchReward - subPenalty) : -1;
 }
 
 AffineGapVectorizedWithCigar::AffineGapVectorizedWithCigar() :
     matchReward(1),
     subPenalty(-4),
     gapOpenPenalty(7),
-    gapExtendPenalty(1)
+    gapExtendPenalty(1),
+    maxGaplessEdits(1)
 {
     //
     // Initialize nucleotide <-> nucleotide transition matrix
@@ -71,6 +73,7 @@ AffineGapVectorizedWithCigar::init(
     subPenalty = -i_subPenalty;
     gapOpenPenalty = i_gapOpenPenalty + i_gapExtendPenalty;
     gapExtendPenalty = i_gapExtendPenalty;
+    maxGaplessEdits = matchReward - subPenalty > 0 ? (gapOpenPenalty - 1) / (matchReward - subPenalty) : -1;
 
     //
     // Initialize nucleotide <-> nucleotide transition matrix
@@ -1040,6 +1043,64 @@ int AffineGapVectorizedWithCigar::computeFinalCigarString(
     return nEdits;
 }
 
+//
+// The writers call computeGlobalScoreNormalized for every read that scored with any edits, and most of those differ from the
+// reference only by a substitution or two.  A gapless alignment with h mismatches scores (patternLen - h) * matchReward + h * subPenalty,
+// while any alignment with a gap scores at most patternLen * matchReward - gapOpenPenalty.  So when h is no more than maxGaplessEdits (and
+// there are no Ns, which score differently) the gapless alignment is the unique best one, and the dynamic program would produce exactly
+// the CIGAR we can write directly.  k is the score from the aligner, which tells us whether it's worth looking.
+//
+    bool
+AffineGapVectorizedWithCigar::tryGaplessAlignment(
+    const char*     text,
+    const char*     pattern,
+    int             patternLen,
+    int             k,
+    char*           cigarBuf,
+    int             cigarBufLen,
+    bool            useM,
+    int*            o_cigarBufUsed,
+    int*            o_score)
+{
+    if (k < 0 || k > maxGaplessEdits || NULL == text || patternLen <= 0) {
+        return false;
+    }
+
+    int nMismatches = 0;
+    for (int i = 0; i < patternLen; i++) {
+        if (BASE_VALUE[(_uint8)pattern[i]] > 3 || BASE_VALUE[(_uint8)text[i]] > 3) {
+            return false;
+        }
+        if (pattern[i] != text[i]) {
+            nMismatches++;
+            if (nMismatches > maxGaplessEdits) {
+                return false;
+            }
+        }
+    }
+
+    char* cigarBufStart = cigarBuf;
+    if (useM) {
+        if (!writeCigar(&cigarBuf, &cigarBufLen, patternLen, 'M', BAM_CIGAR_OPS)) {
+            return false;
+        }
+    } else {
+        int runStart = 0;
+        for (int i = 1; i <= patternLen; i++) {
+            if (i == patternLen || (pattern[i] != text[i]) != (pattern[runStart] != text[runStart])) {
+                if (!writeCigar(&cigarBuf, &cigarBufLen, i - runStart, pattern[runStart] != text[runStart] ? 'X' : '=', BAM_CIGAR_OPS)) {
+                    return false;
+                }
+                runStart = i;
+            }
+        }
+    }
+
+    *o_cigarBufUsed = (int)(cigarBuf - cigarBufStart);
+    *o_score = nMismatches;
+    return true;
+} // AffineGapVectorizedWithCigar::tryGaplessAlignment
+
 int AffineGapVectorizedWithCigar::computeGlobalScoreNormalized(const char* text, int textLen,
     const char*     pattern, 
     const char*     quality, 
@@ -1065,7 +1126,14 @@ int AffineGapVectorizedWithCigar::computeGlobalScoreNormalized(const char* text,
     int bamBufUsed;
     int score;
 
-    if (patternLen >= (3 * (2 * k + 1))) {
+    if (tryGaplessAlignment(text, pattern, patternLen, k, bamBuf, bamBufLen, useM, &bamBufUsed, &score)) {
+        if (o_netDel != NULL) {
+            *o_netDel = 0;
+        }
+        if (o_tailIns != NULL) {
+            *o_tailIns = 0;
+        }
+    } else if (patternLen >= (3 * (2 * k + 1))) {
         score = computeGlobalScoreBanded(text, (int)textLen, pattern, quality, (int)patternLen, k, MAX_READ_LENGTH, bamBuf, bamBufLen,
                                          useM, BAM_CIGAR_OPS, &bamBufUsed, o_netDel, o_tailIns);
         // The banded affine gap version can give unexpected results when it is unable to find an alignment within the band.
@@ -1420,6 +1420,15 @@ private:
     int minScoreParam;
     int maxScoreParam;
 
+    //
+    // The most mismatches a gapless alignment can have and still score strictly better than any alignment with a gap.  Reads
+    // within this of the reference don't need the dynamic program; see tryGaplessAlignment().
+    //
+    int maxGaplessEdits;
+
+    bool tryGaplessAlignment(const char* text, const char* pattern, int patternLen, int k, char* cigarBuf, int cigarBufLen, bool useM,
+        int* o_cigarBufUsed, int* o_score);
+
     //
     // Precompute query profile which is a table containing the result of
     // matching each letter of the alphabet with each character of the pattern
@@ -36,6 +36,8 @@ Revision History:
 #include "Error.h"
 #include "Util.h"
 #include "CommandProcessor.h"
+#include "MultiInputReadSupplier.h"
+#include "MetricsEmitter.h"
 
 using std::max;
 using std::min;
@@ -66,10 +68,16 @@ AlignerContext::AlignerContext(int i_argc, const char **i_argv, const char *i_ve
     stats(NULL),
     extension(i_extension != NULL ? i_extension : new AlignerExtension()),
     readWriter(NULL),
+    inputScheduler(NULL),
     argc(i_argc),
     argv(i_argv),
     version(i_version),
-    perfFile(NULL)
+    perfFile(NULL),
+    numaReplicas(NULL),
+    metrics(NULL),
+    timeStages(false),
+    numaNode(-1),
+    perfCounters(NULL)
 {
 }
 
@@ -230,7 +238,39 @@ AlignerContext::initializeThread()
 AlignerContext::runThread()
 {
     extension->beginThread();
+    if (numaReplicas != NULL) {
+        //
+        // Align against the replica on whichever node the scheduler put us.  The first thread to land on a node
+        // builds that node's copy, so its pages are first-touched there.
+        //
+        numaNode = GetCurrentNumaNode();
+        index = numaReplicas->getReplicaForNode(numaNode);
+    }
+
+    if (options->hardwareCounters) {
+        perfCounters = new PerfCounters();
+        if (!perfCounters->open()) {
+            static bool warningPrinted = false;
+            if (!warningPrinted) {
+                warningPrinted = true;
+                WriteErrorMessage("WARNING: unable to open performance counters (perf_event_open), so -perf will have nothing to report.  Check /proc/sys/kernel/perf_event_paranoid.\n");
+            }
+            delete perfCounters;
+            perfCounters = NULL;
+        }
+    }
+
+    if (metrics != NULL) {
+        metrics->registerThread(stats);
+    }
+
     runIterationThread();
+
+    if (perfCounters != NULL) {
+        perfCounters->addTo(stats->perfCounts, stats->perfThreadsWithEvent);
+        delete perfCounters;
+        perfCounters = NULL;
+    }
     if (readWriter != NULL) {
         readWriter->close();
         delete readWriter;
@@ -242,6 +282,9 @@ AlignerContext::runThread()
 AlignerContext::finishThread(AlignerContext* common)
 {
     common->stats->add(stats);
+    if (metrics != NULL) {
+        metrics->unregisterThread(stats);
+    }
     delete stats;
     stats = NULL;
     delete extension;
@@ -277,9 +320,26 @@ AlignerContext::initialize()
              WriteStatusMessage("%llds.  %s bases, seed size %d.\n",
                     loadTime / 1000, FormatUIntWithCommas(index->getGenome()->getCountOfBases(), basesBuffer, basesBufferSize), index->getSeedLength());
 
+            if (BigAllocUseHugePages) {
+                PrintBigAllocPageUsage();
+                if (options->mapIndex) {
+                    WriteStatusMessage("The index is memory mapped from its files, so it isn't on huge pages.  Use -map- to load it into huge pages.\n");
+                }
+            }
+
 			 if (index->getMajorVersion() < 5 || (index->getMajorVersion() == 5 && index->getMinorVersion() == 0)) {
 				 WriteErrorMessage("WARNING: The version of the index you're using was built with an earlier version of SNAP and will result in Ns in the reference NOT matching Ns in reads.\n         If you do not want this behavior, rebuild the index.\n");
 			 }
+
+            if (options->numaMode == AlignerOptions::NumaInterleave) {
+                if (GetNumberOfNumaNodes() < 2) {
+                    WriteStatusMessage("Only one NUMA node, not interleaving the index.\n");
+                } else if (index->interleaveAcrossNumaNodes()) {
+                    WriteStatusMessage("Interleaved the index across %d NUMA nodes.\n", GetNumberOfNumaNodes());
+                } else {
+                    WriteErrorMessage("WARNING: unable to interleave the index across NUMA nodes; continuing with the default placement.\n");
+                }
+            }
          } else {
             WriteStatusMessage("no alignment, input/output only\n");
         }
@@ -353,6 +413,16 @@ AlignerContext::beginIteration()
     stats = newStats();
     stats->extra = extension->extraStats();
     extension->beginIteration();
+
+    timeStages = options->profile || options->metricsTarget != NULL;
+    metrics = NULL;
+    if (options->metricsTarget != NULL) {
+        metrics = MetricsEmitter::open(options->metricsTarget, options->metricsInterval);
+        if (NULL == metrics) {
+            soft_exit(1);
+        }
+        metrics->start();
+    }
     
     memset(&readerContext, 0, sizeof(readerContext));
     readerContext.clipping = options->clipping;
@@ -361,7 +431,26 @@ AlignerContext::beginIteration()
     readerContext.ignoreSecondaryAlignments = options->ignoreSecondaryAlignments;
     readerContext.ignoreSupplementaryAlignments = options->ignoreSecondaryAlignments;   // Maybe we should split them out
     readerContext.preserveFASTQComments = options->preserveFASTQComments;
+    readerContext.useIoUring = options->useIoUring;
+    readerContext.directIo = options->directIo;
     DataSupplier::ExpansionFactor = options->expansionFactor;
+    DataSupplier::AdaptiveBuffering = options->adaptiveBuffering;
+    DataSupplier::ParallelStdinParsing = options->parallelStdinParsing;
+    DataSupplier::AdaptiveBufferMemoryLimit = options->adaptiveBufferMemoryLimit;
+    DataWriterSupplier::CompressSortIntermediate = options->compressSortIntermediate;
+    DataWriterSupplier::SortBackgroundMerge = options->sortBackgroundMerge;
+    DataWriterSupplier::SortInMemory = options->sortInMemory;
+    DataWriterSupplier::UseFastDeflate = options->fastDeflate;
+    DataWriterSupplier::BgzfCompressionLevel = options->bgzfCompressionLevel;
+
+    numaReplicas = NULL;
+    if (options->numaMode == AlignerOptions::NumaReplicate && index != NULL) {
+        if (GetNumberOfNumaNodes() < 2) {
+            WriteStatusMessage("Only one NUMA node, not replicating the index.\n");
+        } else {
+            numaReplicas = new NumaIndexReplicas(index);
+        }
+    }
 
     typeSpecificBeginIteration();
 
@@ -371,6 +460,8 @@ AlignerContext::beginIteration()
             format = FileFormat::SAM[options->useM];
         } else if (BAMFile == options->outputFile.fileType) {
             format = FileFormat::BAM[options->useM];
+        } else if (CRAMFile == options->outputFile.fileType) {
+            format = FileFormat::CRAM[options->useM];
         } else {
             //
             // This shouldn't happen, because the command line parser should catch it.  Perhaps you've added a new output file format and just
@@ -394,6 +485,12 @@ AlignerContext::finishIteration()
 {
     extension->finishIteration();
 
+    //
+    // Drop the replicas before the sort, which wants the memory, and before any drop of the primary index.
+    //
+    delete numaReplicas;
+    numaReplicas = NULL;
+
     if (NULL != writerSupplier) {
         if (options->dropIndexBeforeSort) {
             g_index->dropIndex();
@@ -417,6 +514,15 @@ AlignerContext::finishIteration()
         }
     }
 
+    //
+    // Stop reporting after the sort, so that spills and the final counts are in the last report.
+    //
+    if (NULL != metrics) {
+        metrics->stop();
+        delete metrics;
+        metrics = NULL;
+    }
+
     alignTime = /*timeInMillis() - alignStart -- use the time from ParallelTask.h, that may exclude memory allocation time*/ time;
 }
 
@@ -485,6 +591,40 @@ char *pctAndPad(char * buffer, double pct, size_t desiredWidth, size_t bufferLen
     return buffer;
 }
 
+    void
+AlignerContext::recordArenaStats(ArenaAllocator *arena)
+{
+    stats->arenaHits += arena->getHits();
+    stats->arenaMisses += arena->getMisses();
+    stats->arenaGrownInPlace += arena->getGrownInPlace();
+}
+
+    void
+AlignerContext::printPerfCounters()
+{
+    WriteStatusMessage("Performance counters by phase, summed over %lld threads:\n", stats->perfThreadsWithEvent[PerfEventTaskClock]);
+
+    WriteStatusMessage("%-18s", "");
+    for (int event = 0; event < NPerfEvents; event++) {
+        WriteStatusMessage("%16s", PerfCounters::EventNames[event]);
+    }
+    WriteStatusMessage("\n");
+
+    for (int phase = 0; phase < NPerfPhases; phase++) {
+        WriteStatusMessage("%-18s", PerfCounters::PhaseNames[phase]);
+        for (int event = 0; event < NPerfEvents; event++) {
+            if (stats->perfThreadsWithEvent[event] == 0) {
+                WriteStatusMessage("%16s", "n/a");
+            } else if (event == PerfEventTaskClock) {
+                WriteStatusMessage("%16lld", stats->perfCounts[phase][event] / 1000000);  // The task clock counts nanoseconds
+            } else {
+                WriteStatusMessage("%16lld", stats->perfCounts[phase][event]);
+            }
+        }
+        WriteStatusMessage("\n");
+    }
+}
+
     void
 AlignerContext::printStats()
 {
@@ -572,6 +712,23 @@ AlignerContext::printStats()
         fprintf(perfFile,"\n");
     }
 
+    if (options->profile && stats->arenaHits + stats->arenaMisses > 0) {
+        WriteStatusMessage("Result arenas: %lld allocations, %lld spilled, %lld grown in place, %lld reads realigned after overflow\n",
+            stats->arenaHits + stats->arenaMisses, stats->arenaMisses, stats->arenaGrownInPlace, stats->alignmentsRerun);
+    }
+
+    if (options->numaMode == AlignerOptions::NumaReplicate && stats->numaLocalAlignments + stats->numaRemoteAlignments > 0) {
+        WriteStatusMessage("NUMA: %lld alignments ran against their node's index replica, %lld against a remote one (%d nodes)\n",
+            stats->numaLocalAlignments, stats->numaRemoteAlignments, GetNumberOfNumaNodes());
+    }
+
+    if (options->hardwareCounters && stats->perfThreadsWithEvent[PerfEventTaskClock] > 0) {
+        printPerfCounters();
+    }
+
+    if (NULL != inputScheduler) {
+        inputScheduler->printStats();
+    }
 
 #if TIME_HISTOGRAM
     if (stats->backwardsTimeStamps != 0) {
@@ -787,6 +944,11 @@ AlignerContext::parseOptions(
 		return NULL;
     }
 
+    if (!options->checkCombinations()) {
+		delete options;
+		return NULL;
+    }
+
     options->nInputs = nInputs;
     options->inputs = new SNAPFile[nInputs];
     for (int j = nInputs - 1; j >= 0; j --) {
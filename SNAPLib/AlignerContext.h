@@ -32,6 +32,9 @@ Revision History:
 #include "GenomeIndex.h"
 
 class AlignerExtension;
+class InputScheduler;
+class ArenaAllocator;
+class MetricsEmitter;
 
 
 /*++
@@ -90,10 +93,23 @@ public:
 
     friend class AlignerContext2;
  
+    //
+    // Each growable per-read result buffer is carved out of the thread's ResultArena with a slab this big.  The arena
+    // commits lazily, so the slab only costs what a read actually writes into it, and reads with many secondary
+    // alignments or affine gap candidates run further into it instead of overflowing and being realigned.
+    //
+    static const size_t ResultBufferSlabSize = 8 * 1024 * 1024;
+    static const size_t ResultArenaReservation = 64 * 1024 * 1024;
+
+    void recordArenaStats(ArenaAllocator *arena);
+
+    void printPerfCounters();
+
     // common state across all threads
     GenomeIndex                         *index;
     ReadWriterSupplier                  *writerSupplier;
     ReaderContext                        readerContext;
+    InputScheduler                      *inputScheduler;    // Only for multiple inputs; owned by the read supplier generator
     _int64                               alignStart;
     _int64                               alignTime;
     AlignerOptions                      *options;
@@ -112,6 +128,9 @@ public:
     const char                         **argv;
     const char                          *version;
     FILE                                *perfFile;
+    NumaIndexReplicas                   *numaReplicas;      // NULL unless -numa replicate on a multi-node machine
+    MetricsEmitter                      *metrics;           // NULL unless -metrics
+    bool                                 timeStages;        // Keep millisReading/Aligning/Writing (-pro or -metrics)
     DisabledOptimizations                disabledOptimizations;
     bool                                 useAffineGap;
     bool                                 ignoreAlignmentAdjustmentForOm;
@@ -138,6 +157,8 @@ public:
 
     // Per-thread context state used during alignment process
     ReadWriter         *readWriter;
+    int                 numaNode;           // Node whose index replica this thread aligns against
+    PerfCounters       *perfCounters;       // NULL unless -perf
 };
 
 // abstract class for extending base context
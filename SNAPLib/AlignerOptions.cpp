@@ -28,6 +28,7 @@ Revision History:
 #include "FASTQ.h"
 #include "SAM.h"
 #include "Bam.h"
+#include "Cram.h"
 #include "exit.h"
 #include "Error.h"
 #include "BaseAligner.h"
@@ -45,11 +46,15 @@ AlignerOptions::AlignerOptions(
     similarityMapFile(NULL),
     numThreads(GetNumberOfProcessors()),
     bindToProcessors(true),
+    numaMode(NumaOff),
     ignoreMismatchedIDs(false),
     clipping(ClipBack),
     sortOutput(false),
     noIndex(false),
     noDuplicateMarking(false),
+    markUnsortedDuplicates(false),
+    csiMinShift(0),
+    csiDepth(0),
     noQualityCalibration(false),
     sortMemory(0),
     filterFlags(0),
@@ -60,6 +65,8 @@ AlignerOptions::AlignerOptions(
 	extra(NULL),
     rgLineContents("@RG\tID:FASTQ\tPL:Illumina\tPU:pu\tLB:lb\tSM:sm"),
     perfFileName(NULL),
+    metricsTarget(NULL),
+    metricsInterval(10),
     useTimingBarrier(false),
     extraSearchDepth(1),
     defaultReadGroup("FASTQ"),
@@ -93,6 +100,7 @@ AlignerOptions::AlignerOptions(
     sortIntermediateDirectory(NULL),
     profile(false),
     profileAffineGap(false),
+    hardwareCounters(false),
     ignoreAlignmentAdjustmentsForOm(true),
     emitInternalScore(false),
 	altAwareness(true),
@@ -101,7 +109,19 @@ AlignerOptions::AlignerOptions(
     useSoftClipping(true),
     flattenMAPQAtOrBelow(3),
     attachAlignmentTimes(false),
-    preserveFASTQComments(false)
+    preserveFASTQComments(false),
+    useIoUring(false),
+    directIo(false),
+    adaptiveBuffering(true),
+    adaptiveBufferMemoryLimit((_int64)1024 * 1024 * 1024),
+    activeInputs(2),
+    inputsToWarm(2),
+    parallelStdinParsing(true),
+    compressSortIntermediate(true),
+    sortBackgroundMerge(false),
+    sortInMemory(false),
+    fastDeflate(false),
+    bgzfCompressionLevel(-1)
 {
     if (forPairedEnd) {
         maxDist                 = 27;
@@ -132,9 +152,10 @@ AlignerOptions::usage()
         WriteErrorMessage(
             "Usage: \n%s\n"
             "Options:\n"
-            "  -o   filename  output alignments to filename in SAM or BAM format, depending on the file extension or\n"
+            "  -o   filename  output alignments to filename in SAM, BAM or CRAM format, depending on the file extension or\n"
             "       explicit type specifier (see below).  Use a dash with an explicit type specifier to write to\n"
-            "       stdout, so for example -o -sam - would write SAM output to stdout\n"
+            "       stdout, so for example -o -sam - would write SAM output to stdout.  CRAM stores reads as differences\n"
+            "       from the index's genome, which is needed to read it back; it's written without an index\n"
             "  -d   maximum edit distance allowed per read or pair absent indels (default: %d)\n"
             "  -i   maximum distance allowed per read for indels (default: %d)\n"
             "  -n   number of seeds to use per read\n"
@@ -143,6 +164,9 @@ AlignerOptions::usage()
             "  -ms  minimum seed matches per location (default: %d)\n"
             "  -t   number of threads (default is one per core)\n"
             "  -b-  Don't bind each thread to its processor (--b (with two dashes) does the smae thing)\n"
+            " -numa on multi-socket machines, keep the index local to each socket.  -numa replicate (the default) gives each NUMA node its\n"
+            "       own copy of the hash tables and genome, used by the threads bound there (so it takes that much more memory); -numa interleave\n"
+            "       spreads one copy evenly across the nodes instead (Linux only)\n"
             "  -P   disables cache prefetching in the genome; may be helpful for machines\n"
             "       with small caches or lots of cores/cache\n"
             "  -so  sort output file by alignment location\n"
@@ -151,9 +175,23 @@ AlignerOptions::usage()
             "       the aligned reads in batches to a temporary file.  When the aligning is done, it does a merge sort from the temporary file into the\n"
             "       final output file.  By default, the intermediate file is in the same directory as the output file, but for performance or space\n"
             "       reasons, you might want to put it elsewhere.  If so, use this option.\n"
+            " -sc-  Don't compress the sort intermediate file.  Normally each sorted batch is written with a fast compressor, which makes\n"
+            "       the intermediate file several times smaller and cuts the I/O for both writing it and merging it.\n"
+            " -sbm  Merge the sorted batches into larger runs in the background while aligning, so that only a short merge is left at the end.\n"
+            "       This takes some CPU and temporary disk space away from aligning, and helps most with small -sm values and large inputs.\n"
+            " -sim  Keep the sorted batches in memory (up to the -sm limit, on top of the write buffers) rather than writing them to the sort\n"
+            "       intermediate file, which only gets what doesn't fit.  When the whole output fits, sorting doesn't touch the disk until the final merge.\n"
+            "  -cl  compression level for BAM or CRAM output, 1 (fastest) to 9 (smallest).  Default is zlib's default, 6.\n"
+            "  -fd  Compress BAM output with SNAP's own single-shot deflate encoder rather than zlib.  It's several times faster for\n"
+            "       slightly larger files, which are still standard BGZF.\n"
             "  -x   explore some hits of overly popular seeds (useful for filtering)\n"
             "  -S   suppress additional processing (sorted BAM output only)\n"
             "       i=index, d=duplicate marking\n"
+            " -csi  write a CSI index rather than BAI for sorted BAM output.  It may be followed by the minimum shift (log2 of the smallest\n"
+            "       bin size, default 14) and then the depth (levels of bins, default enough for the longest contig).  CSI is written anyway\n"
+            "       when a contig is longer than BAI can index (512Mbp)\n"
+            "  -du  mark duplicates in unsorted BAM output.  The aligner threads keep a table of the reads' duplicate signatures, and the\n"
+            "       duplicates are marked in a final pass over the file, so it needs a file rather than stdout.  It can't be used with -so, which marks them anyway (unless -S d)\n"
             "  -f   stop on first match within edit distance limit (filtering mode)\n"
             "  -F   filter output (a=aligned only, s=single hit only (MAPQ >= %d), u=unaligned only, l=long enough to align (see -mrl))\n"
             "  -E   an alternate (and fully general) way to specify filter options.  Emit only these types s = single hit (MAPQ >= %d), m = multiple hit (MAPQ < %d),\n"
@@ -184,7 +222,14 @@ AlignerOptions::usage()
             "       two characters.  The default is ##.\n"
             " -=    use the new style CIGAR strings with = and X rather than M.  The opposite of -M\n"
             " -pf   specify the name of a file to contain the run speed\n"
-            " -hp   Indicates to use huge pages (this may speed up alignment and slow down index load).\n"
+            " -metrics  Report progress while aligning, as one JSON object per line: reads and bases per second, time each thread spent\n"
+            "       waiting for input, aligning and writing, how many batches of reads are queued for the aligner threads, sort spill\n"
+            "       bytes and the change in the MAPQ histogram.  Follow it with a file name to append to, or with unix:<path> to\n"
+            "       connect to a Unix domain socket that something is already listening on.\n"
+            " -metricsInterval  Seconds between -metrics reports.  Default 10.\n"
+            " -hp   Indicates to use huge pages (this may speed up alignment and slow down index load).  On Linux SNAP tries\n"
+            "       1GB hugetlb pages, then 2MB hugetlb pages (both need pages set aside in /sys/kernel/mm/hugepages), then\n"
+            "       transparent huge pages, and reports what it got after loading the index.\n"
             " -D    Specifies the extra search depth (the edit distance beyond the best hit that SNAP uses to compute MAPQ).  Default %d\n"
             " -rg   Specify the default read group if it is not specified in the input file\n"
             " -R    Specify the entire read group line for the SAM/BAM output.  This must include an ID tag.  If it doesn't start with\n"
@@ -240,6 +285,10 @@ AlignerOptions::usage()
             "       sorting, try using -di.\n"
             " -pro  Profile alignment to give you an idea of how much time is spent aligning and how much waiting for IO\n"
             " -proAg Profile affine-gap scoring to show how often it forces single-end alignment\n"
+            " -perf Count cycles, last level cache misses, dTLB misses and branch misses for each phase of alignment (seed lookup,\n"
+            "       candidate scoring, affine gap, output) using the processor's performance counters.  Linux only.  This makes a system\n"
+            "       call at every phase change, a handful per read, which costs roughly 10-30%% of the reads/s; use it to see where the\n"
+            "       time goes, not to time runs.  Seed lookup includes the bookkeeping for the hits, not just the index lookups.\n"
             " -ae   Apply the end-of-contig soft clipping before the -om processing rather than after it.  A read that's soft clipped because of hanging off one end or the other\n"
             "       of a contig does not have a penalty in its NM tag, but it does in SNAP's internal scoring.  This flag says to use the NM value for -om processing\n"
             "       rather than SNAP's internal score.\n"
@@ -272,6 +321,19 @@ AlignerOptions::usage()
             " -at   Attach AT:i: tags to each read showing the alignment time in microseconds.  For paired-end reads this is the time for the pair.\n"
             " -pfc  Preserve FASTQ comments.  Anything after the first white space on the FASTQ ID line is appended to the SAM/BAM line.  If this is not\n"
             "       in valid SAM/BAM format it will produce incorrect output.\n"
+            " -iou  Do file input and output through io_uring (Linux only; ignored elsewhere).  Reads are batched into a single submission\n"
+            "       and the input buffers are registered with the kernel when the locked memory limit allows it.\n"
+            " -iod  Like -iou, but also bypass the page cache (O_DIRECT) for reads and writes that are suitably aligned.  This helps when\n"
+            "       the input and output are much bigger than memory and would otherwise push the index out of the cache.\n"
+            " -ab-  Don't adapt input buffering.  Normally SNAP watches how long the aligner threads wait for input and adjusts how far ahead\n"
+            "       it reads and how big its reads are.  With -ab- it always uses a fixed number of fixed-size buffers.\n"
+            " -abm  Limit on the memory (in megabytes) that adaptive input buffering may use across all input files.  Default 1024.\n"
+            " -ai   With multiple input files, the number of them that each aligner thread reads from at once.  The threads favor\n"
+            "       whichever of their inputs is delivering reads fastest.  Default 2.\n"
+            " -wi   With multiple input files, the number of files beyond the ones being read that SNAP opens and starts reading in\n"
+            "       the background so that they're ready when the threads move on to them.  Default 2.\n"
+            " -pp-  Don't parse uncompressed FASTQ or SAM from stdin in parallel.  Normally one thread reads the pipe into large chunks\n"
+            "       that end on record boundaries and all of the aligner threads parse them.  With -pp- a single thread reads and parses.\n"
             " -q    Quiet mode: don't print status messages (other than the welcome message which is printed prior to parsing args).  Error messages\n"
             "       are still printed.\n"            
             " -qq   Super quiet mode: don't print status or error messages.\n"
@@ -313,6 +375,7 @@ AlignerOptions::usage()
                       "    -compressedFastq\n"
                       "    -sam\n"
                       "    -bam\n"
+                      "    -cram (input needs the index that it was written against)\n"
                       "    -pairedFastq\n"
                       "    -pairedInterleavedFastq\n"
                       "    -pairedCompressedInterleavedFastq\n"
@@ -450,6 +513,15 @@ AlignerOptions::usage()
         } else if (strcmp(argv[n], "--b") == 0 || strcmp(argv[n], "-b-") == 0) {
             bindToProcessors = false;
             return true;
+        } else if (strcmp(argv[n], "-numa") == 0) {
+            numaMode = NumaReplicate;
+            if (n + 1 < argc && strcmp(argv[n + 1], "replicate") == 0) {
+                n++;
+            } else if (n + 1 < argc && strcmp(argv[n + 1], "interleave") == 0) {
+                numaMode = NumaInterleave;
+                n++;
+            }
+            return true;
         } else if (strcmp(argv[n], "-so") == 0) {
             sortOutput = true;
             return true;
@@ -498,12 +570,52 @@ AlignerOptions::usage()
                 }
                 return true;
             }
+        } else if (strcmp(argv[n], "-csi") == 0) {
+            csiMinShift = 14;
+            bool depthSpecified = false;    // Otherwise csiDepth stays 0, meaning enough for the longest contig
+            if (n + 1 < argc && argv[n + 1][0] >= '0' && argv[n + 1][0] <= '9') {
+                csiMinShift = atoi(argv[n + 1]);
+                n++;
+                if (n + 1 < argc && argv[n + 1][0] >= '0' && argv[n + 1][0] <= '9') {
+                    csiDepth = atoi(argv[n + 1]);
+                    depthSpecified = true;
+                    n++;
+                }
+            }
+            if (csiMinShift < 1 || csiMinShift > 30 || (depthSpecified && (csiDepth < 1 || csiDepth > 10))) {
+                WriteErrorMessage("-csi minimum shift must be from 1 to 30, and depth from 1 to 10\n");
+                return false;
+            }
+            return true;
+        } else if (strcmp(argv[n], "-du") == 0) {
+            markUnsortedDuplicates = true;
+            return true;
         } else if (strcmp(argv[n], "-sm") == 0) {
             if (n + 1 < argc && argv[n + 1][0] >= '0' && argv[n + 1][0] <= '9') {
                 sortMemory = atoi(argv[n + 1]);
                 n++;
                 return true;
             }
+        } else if (strcmp(argv[n], "-sc-") == 0) {
+            compressSortIntermediate = false;
+            return true;
+        } else if (strcmp(argv[n], "-sbm") == 0) {
+            sortBackgroundMerge = true;
+            return true;
+        } else if (strcmp(argv[n], "-sim") == 0) {
+            sortInMemory = true;
+            return true;
+        } else if (strcmp(argv[n], "-cl") == 0) {
+            if (n + 1 < argc && argv[n + 1][0] >= '1' && argv[n + 1][0] <= '9' && argv[n + 1][1] == '\0') {
+                bgzfCompressionLevel = atoi(argv[n + 1]);
+                n++;
+                return true;
+            }
+            WriteErrorMessage("-cl must be followed by a compression level from 1 to 9 (a BGZF block holds 64KB of data, so it can't be stored uncompressed)\n");
+            return false;
+        } else if (strcmp(argv[n], "-fd") == 0) {
+            fastDeflate = true;
+            return true;
         } else if (strcmp(argv[n], "-is") == 0) {
             if (n + 1 >= argc || strlen(argv[n + 1]) != 2 || argv[n + 1][0] < 'X' || argv[n + 1][0] > 'Z' || argv[n + 1][1] < 'A' || argv[n + 1][1] > 'Z') {
                 WriteErrorMessage("-is switch must be followed by two letter tag that consists of X, Y, or Z and a capital letter.\n");
@@ -693,6 +805,9 @@ AlignerOptions::usage()
         } else if (strcmp(argv[n], "-proAg") == 0) {
             profileAffineGap = true;
             return true;
+        } else if (strcmp(argv[n], "-perf") == 0) {
+            hardwareCounters = true;
+            return true;
         } else if (strcmp(argv[n], "-G") == 0) {
             useAffineGap = true;
             return true;
@@ -918,6 +1033,22 @@ AlignerOptions::usage()
                 WriteErrorMessage("-R requires a value");
                 return false;
             }
+        } else if (strcmp(argv[n], "-metrics") == 0) {
+            if (n + 1 < argc) {
+                metricsTarget = argv[n + 1];
+                n++;
+                return true;
+            } else {
+                WriteErrorMessage("Must specify a file name or unix:<socket path> after -metrics\n");
+            }
+        } else if (strcmp(argv[n], "-metricsInterval") == 0) {
+            if (n + 1 < argc) {
+                metricsInterval = atoi(argv[n + 1]);
+                n++;
+                return metricsInterval > 0;
+            } else {
+                WriteErrorMessage("Must specify the number of seconds after -metricsInterval\n");
+            }
         } else if (strcmp(argv[n], "-pf") == 0) {
             if (n + 1 < argc) {
                 perfFileName = argv[n + 1];
@@ -1036,6 +1167,47 @@ AlignerOptions::usage()
         } else if (strcmp(argv[n], "-pfc") == 0) {
             preserveFASTQComments = true;
             return true;
+        } else if (strcmp(argv[n], "-iou") == 0) {
+            useIoUring = true;
+            return true;
+        } else if (strcmp(argv[n], "-iod") == 0) {
+            useIoUring = true;
+            directIo = true;
+            return true;
+        } else if (strcmp(argv[n], "-ab-") == 0) {
+            adaptiveBuffering = false;
+            return true;
+        } else if (strcmp(argv[n], "-abm") == 0) {
+            if (n + 1 >= argc) {
+                WriteErrorMessage("-abm requires an additional value\n");
+                return false;
+            }
+            if (argv[n + 1][0] < '0' || argv[n + 1][0] > '9') {
+                WriteErrorMessage("-abm requires a numerical parameter.\n");
+                return false;
+            }
+            adaptiveBufferMemoryLimit = (_int64)atoi(argv[n + 1]) * 1024 * 1024;
+            n++;
+            return true;
+        } else if (strcmp(argv[n], "-pp-") == 0) {
+            parallelStdinParsing = false;
+            return true;
+        } else if (strcmp(argv[n], "-ai") == 0 || strcmp(argv[n], "-wi") == 0) {
+            if (n + 1 >= argc) {
+                WriteErrorMessage("%s requires an additional value\n", argv[n]);
+                return false;
+            }
+            if (argv[n + 1][0] < '0' || argv[n + 1][0] > '9') {
+                WriteErrorMessage("%s requires a numerical parameter.\n", argv[n]);
+                return false;
+            }
+            if (argv[n][1] == 'a') {
+                activeInputs = __max(1, atoi(argv[n + 1]));
+            } else {
+                inputsToWarm = atoi(argv[n + 1]);
+            }
+            n++;
+            return true;
         } else if (strcmp(argv[n], "-asg") == 0) {
             if (n + 1 < argc) {
                 maxScoreGapToPreferNonALTAlignment = atoi(argv[n + 1]);
@@ -1092,7 +1264,7 @@ AlignerOptions::passFilter(
     PairedReadSupplierGenerator *
 SNAPFile::createPairedReadSupplierGenerator(int numThreads, bool quicklyDropUnpairedReads, const ReaderContext& context)
 {
-    _ASSERT(fileType == SAMFile || fileType == BAMFile || fileType == InterleavedFASTQFile || secondFileName != NULL); // Caller's responsibility to check this
+    _ASSERT(fileType == SAMFile || fileType == BAMFile || fileType == CRAMFile || fileType == InterleavedFASTQFile || secondFileName != NULL); // Caller's responsibility to check this
 
     switch (fileType) {
     case SAMFile:
@@ -1101,6 +1273,9 @@ SNAPFile::createPairedReadSupplierGenerator(int numThreads, bool quicklyDropUnpa
     case BAMFile:
         return BAMReader::createPairedReadSupplierGenerator(fileName,numThreads, quicklyDropUnpairedReads, context);
 
+    case CRAMFile:
+        return CRAMReader::createPairedReadSupplierGenerator(fileName, numThreads, quicklyDropUnpairedReads, context);
+
     case FASTQFile:
         return PairedFASTQReader::createPairedReadSupplierGenerator(fileName, secondFileName, numThreads, context, isCompressed);
 
@@ -1126,6 +1301,9 @@ SNAPFile::createReadSupplierGenerator(int numThreads, const ReaderContext& conte
     case BAMFile:
         return BAMReader::createReadSupplierGenerator(fileName,numThreads, context);
 
+    case CRAMFile:
+        return CRAMReader::createReadSupplierGenerator(fileName, numThreads, context);
+
     case FASTQFile:
         return FASTQReader::createReadSupplierGenerator(fileName, numThreads, context, isCompressed);
 
@@ -1205,6 +1383,10 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
             snapFile->fileType = BAMFile;
             snapFile->isCompressed = true;
             *argsConsumed = 2;
+        } else if (!strcmp(args[0], "-cram")) {
+            snapFile->fileType = CRAMFile;
+            snapFile->isCompressed = true;
+            *argsConsumed = 2;
         } else if (!strcmp(args[0], "-pairedInterleavedFastq") || !strcmp(args[0], "-pairedCompressedInterleavedFastq")) {
             if (!paired) {
                 WriteErrorMessage("Specified %s for a single-end alignment.  To treat it as single-end, just use ordinary fastq (or compressed fastq, as appropriate)\n", args[0]);
@@ -1238,11 +1420,14 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
     } else if (util::stringEndsWith(args[0], ".bam")) {
         snapFile->fileType = BAMFile;
         snapFile->isCompressed = true;
+    } else if (util::stringEndsWith(args[0], ".cram")) {
+        snapFile->fileType = CRAMFile;
+        snapFile->isCompressed = true;
     } else if (!isInput) {
         //
         // No default output file type.
         //
-        WriteErrorMessage("You specified an output file with name '%s', which doesn't end in .sam or .bam, and doesn't have an explicit type\n"
+        WriteErrorMessage("You specified an output file with name '%s', which doesn't end in .sam, .bam or .cram, and doesn't have an explicit type\n"
                           "specifier.  There is no default output file type.  Consider doing something like '-o -bam %s'\n", args[0], args[0]);
 		return false;
     } else if (util::stringEndsWith(args[0], ".fq") || util::stringEndsWith(args[0], ".fastq") ||
@@ -1291,6 +1476,24 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
 		return false;
     }
 
+    return true;
+}
+
+    bool
+AlignerOptions::checkCombinations()
+{
+    if (markUnsortedDuplicates) {
+        if (sortOutput) {
+            WriteErrorMessage("-du is for unsorted output; sorted output (-so) marks duplicates anyway, unless you turn that off with -S d\n");
+            return false;
+        }
+
+        if (outputFile.isStdio) {
+            WriteErrorMessage("-du marks duplicates by patching the output file once it's written, so it can't be used when writing to stdout\n");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -107,6 +107,8 @@ struct AlignerOptions : public AbstractOptions
     unsigned            maxHits;
     int                 minWeightToCheck;
     bool                bindToProcessors;
+    enum NumaMode {NumaOff, NumaReplicate, NumaInterleave};
+    NumaMode            numaMode;
     bool                ignoreMismatchedIDs;
     SNAPFile            outputFile;
     int                 nInputs;
@@ -115,6 +117,9 @@ struct AlignerOptions : public AbstractOptions
     bool                sortOutput;
     bool                noIndex;
     bool                noDuplicateMarking;
+    bool                markUnsortedDuplicates;
+    int                 csiMinShift;            // 0 for a BAI index
+    int                 csiDepth;               // 0 for enough to cover the longest contig
     bool                noQualityCalibration;   // This doesn't appear to be used.  
     unsigned            sortMemory; // total output sorting buffer size in Gb
     unsigned            filterFlags;
@@ -125,6 +130,8 @@ struct AlignerOptions : public AbstractOptions
     AbstractOptions    *extra; // extra options
     const char         *rgLineContents;
     const char         *perfFileName;
+    const char         *metricsTarget;      // -metrics: a file name, or unix:<path> for a Unix domain socket
+    int                 metricsInterval;    // Seconds between -metrics reports
     bool                useTimingBarrier;
     unsigned            extraSearchDepth;
     const char         *defaultReadGroup; // if not specified in input
@@ -153,6 +160,7 @@ struct AlignerOptions : public AbstractOptions
     const char *        sortIntermediateDirectory;
     bool                profile;
     bool                profileAffineGap;
+    bool                hardwareCounters;   // -perf
     bool                ignoreAlignmentAdjustmentsForOm;
     bool                emitInternalScore;
     char                internalScoreTag[3];
@@ -161,6 +169,18 @@ struct AlignerOptions : public AbstractOptions
     bool                emitALTAlignments;
     bool                attachAlignmentTimes;
     bool                preserveFASTQComments;
+    bool                useIoUring;
+    bool                directIo;
+    bool                adaptiveBuffering;
+    _int64              adaptiveBufferMemoryLimit;
+    int                 activeInputs;           // Inputs each thread reads from at once when there are several
+    int                 inputsToWarm;           // Inputs beyond those to open and prefetch ahead of time
+    bool                parallelStdinParsing;
+    bool                compressSortIntermediate;
+    bool                sortBackgroundMerge;
+    bool                sortInMemory;
+    bool                fastDeflate;
+    int                 bgzfCompressionLevel;   // -1 for the default
     
     static bool         useHadoopErrorMessages; // This is static because it's global (and I didn't want to push the options object to every place in the code)
     static bool         outputToStdout;         // Likewise
@@ -171,6 +191,12 @@ struct AlignerOptions : public AbstractOptions
 
     virtual bool parse(const char** argv, int argc, int& n, bool *done);
 
+    //
+    // Checks for options that can't be used together, which parse() can't do because it sees them one at a time.  Call it
+    // once they've all been parsed.  Prints an error and returns false if there's a problem.
+    //
+    bool checkCombinations();
+
     enum FilterFlags
     {
         FilterUnaligned =           0x0001,
@@ -32,6 +32,7 @@ AbstractStats::~AbstractStats()
 AlignerStats::AlignerStats(AbstractStats* i_extra)
 :
     totalReads(0),
+    totalBases(0),
     uselessReads(0),
     singleHits(0), 
     multiHits(0),
@@ -47,12 +48,21 @@ AlignerStats::AlignerStats(AbstractStats* i_extra)
     extraAlignments(0),
     sameComplement(0), 
     agForcedSingleEndAlignment(0),
-    agUsedSingleEndAlignment(0)
+    agUsedSingleEndAlignment(0),
+    arenaHits(0),
+    arenaMisses(0),
+    arenaGrownInPlace(0),
+    alignmentsRerun(0),
+    numaLocalAlignments(0),
+    numaRemoteAlignments(0)
 {
     for (int i = 0; i <= AlignerStats::maxMapq; i++) {
         mapqHistogram[i] = 0;
      }
 
+    memset(perfCounts, 0, sizeof(perfCounts));
+    memset(perfThreadsWithEvent, 0, sizeof(perfThreadsWithEvent));
+
     for (int i = 0; i < maxMaxHits; i++) {
         countOfBestHitsByWeightDepth[i] = 0;
         countOfAllHitsByWeightDepth[i] = 0;
@@ -99,6 +109,7 @@ AlignerStats::add(
 {
     AlignerStats* other = (AlignerStats*) i_other;
     totalReads += other->totalReads;
+    totalBases += other->totalBases;
     uselessReads += other->uselessReads;
     singleHits += other->singleHits;
     multiHits += other->multiHits;
@@ -114,6 +125,12 @@ AlignerStats::add(
     sameComplement += other->sameComplement;
     agForcedSingleEndAlignment += other->agForcedSingleEndAlignment;
     agUsedSingleEndAlignment += other->agUsedSingleEndAlignment;
+    arenaHits += other->arenaHits;
+    arenaMisses += other->arenaMisses;
+    arenaGrownInPlace += other->arenaGrownInPlace;
+    alignmentsRerun += other->alignmentsRerun;
+    numaLocalAlignments += other->numaLocalAlignments;
+    numaRemoteAlignments += other->numaRemoteAlignments;
 
 
     if (extra != NULL && other->extra != NULL) {
@@ -124,6 +141,13 @@ AlignerStats::add(
         mapqHistogram[i] += other->mapqHistogram[i];
     }
 
+    for (int event = 0; event < NPerfEvents; event++) {
+        perfThreadsWithEvent[event] += other->perfThreadsWithEvent[event];
+        for (int phase = 0; phase < NPerfPhases; phase++) {
+            perfCounts[phase][event] += other->perfCounts[phase][event];
+        }
+    }
+
     for (int i = 0; i < maxMaxHits; i++) {
         countOfBestHitsByWeightDepth[i] += other->countOfBestHitsByWeightDepth[i];
         countOfAllHitsByWeightDepth[i] += other->countOfAllHitsByWeightDepth[i];
@@ -28,6 +28,7 @@ Revision History:
 #include "stdafx.h"
 #include "Compat.h"
 #include "options.h"
+#include "PerfCounters.h"
 
 struct AbstractStats
 {
@@ -45,6 +46,7 @@ struct AlignerStats : public AbstractStats
     AlignerStats(AbstractStats* i_extra = NULL);
 
     _int64 totalReads;
+    _int64 totalBases;
     _int64 uselessReads;    // Too short or too many Ns, so unalignable
     _int64 singleHits;
     _int64 multiHits;
@@ -62,6 +64,16 @@ struct AlignerStats : public AbstractStats
     _int64 agForcedSingleEndAlignment;
     _int64 agUsedSingleEndAlignment;
 
+    _int64 arenaHits;           // Per-thread result arena allocations served from its reservation
+    _int64 arenaMisses;         // ...and those that spilled to BigAlloc
+    _int64 arenaGrownInPlace;
+    _int64 alignmentsRerun;     // Reads realigned because a result buffer overflowed even its arena slab
+    _int64 numaLocalAlignments;     // Alignments run while on the node that holds this thread's index replica
+    _int64 numaRemoteAlignments;    // ...and while migrated to some other node
+
+    _int64 perfCounts[NPerfPhases][NPerfEvents];    // Hardware counter totals by alignment phase (-perf)
+    _int64 perfThreadsWithEvent[NPerfEvents];       // How many threads were able to count each event
+
     static const unsigned maxMapq = 70;
     unsigned mapqHistogram[maxMapq+1];
 
@@ -33,12 +33,28 @@ Environment:
 #include "VariableSizeMap.h"
 #include "PairedAligner.h"
 #include "GzipDataWriter.h"
+#include "CramDataWriter.h"
 #include "Error.h"
+#include "zlib.h"
 
 #if _DEBUG
 extern volatile bool _DumpAlignments;
 #endif // _DEBUG
 
+//
+// The nibble and quality decoders have an SSSE3 path that uses PSHUFB as a 16 entry lookup table.  The rest of SNAP is
+// built for SSE2 only, so on gcc/clang we compile just these routines for SSSE3 and pick them at runtime.
+//
+#if defined(_MSC_VER) || ((defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)))
+#define BAM_SIMD_DECODE 1
+#include <tmmintrin.h>
+#ifdef _MSC_VER
+#define BAM_SIMD_TARGET
+#else
+#define BAM_SIMD_TARGET __attribute__((target("ssse3")))
+#endif
+#endif // x86
+
 #define VALIDATE_CIGAR 1
 
 using std::max;
@@ -93,13 +109,7 @@ BAMReader::init(
     _int64 startingOffset,
     _int64 amountOfFileToProcess)
 {
-    // todo: integrate supplier models
-    // might need up to 3x extra for expanded sequence + quality + cigar data
-    if (!strcmp("-", fileName)) {
-        data = DataSupplier::GzipBamStdio->getDataReader(bufferCount, MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor, 0);
-    } else {
-        data = DataSupplier::GzipBamDefault->getDataReader(bufferCount, MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor, 0);
-    }
+    data = createDataReader(fileName, bufferCount);
 
     if (! data->init(fileName)) {
         WriteErrorMessage("Unable to read file %s\n", fileName);
@@ -136,6 +146,20 @@ BAMReader::init(
     }
 }
 
+    DataReader*
+BAMReader::createDataReader(
+    const char* fileName,
+    int bufferCount)
+{
+    // todo: integrate supplier models
+    // might need up to 3x extra for expanded sequence + quality + cigar data
+    if (!strcmp("-", fileName)) {
+        return DataSupplier::GzipBamStdio->getDataReader(bufferCount, MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor, 0);
+    } else {
+        return DataSupplier::GzipBamInput(context.useIoUring, context.directIo)->getDataReader(bufferCount, MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor, 0);
+    }
+}
+
     void
 BAMReader::readHeader(
     const char* fileName)
@@ -280,6 +304,107 @@ const _uint8 BAM_CIGAR_EQUAL = 7;
 const _uint8 BAM_CIGAR_X = 8;
 
 BAMAlignment::_init BAMAlignment::_init_;
+bool BAMAlignment::UseSimdDecode = false;
+
+#ifdef BAM_SIMD_DECODE
+
+    static bool
+CpuSupportsSsse3()
+{
+#ifdef _MSC_VER
+    int cpuInfo[4];
+    __cpuid(cpuInfo, 1);
+    return (cpuInfo[2] & (1 << 9)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3") != 0;
+#endif
+}
+
+//
+// Expand 16 bytes of packed nibbles into 32 bases, high nibble first, translating each 4 bit code through table.
+//
+    static inline BAM_SIMD_TARGET void
+UnpackNibbles(__m128i packed, __m128i table, __m128i* o_first, __m128i* o_second)
+{
+    __m128i lowMask = _mm_set1_epi8(0xf);
+    __m128i high = _mm_and_si128(_mm_srli_epi16(packed, 4), lowMask);
+    __m128i low = _mm_and_si128(packed, lowMask);
+    *o_first = _mm_shuffle_epi8(table, _mm_unpacklo_epi8(high, low));
+    *o_second = _mm_shuffle_epi8(table, _mm_unpackhi_epi8(high, low));
+}
+
+    static inline BAM_SIMD_TARGET __m128i
+ReverseBytes(__m128i v)
+{
+    return _mm_shuffle_epi8(v, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+//
+// BAM qualities are raw phred, with 0xff meaning "missing".  Anything past '~' turns into '!', just like CIGAR_QUAL_TO_SAM.
+//
+    static inline BAM_SIMD_TARGET __m128i
+QualToSam(__m128i qual)
+{
+    __m128i inRange = _mm_cmpeq_epi8(_mm_min_epu8(qual, _mm_set1_epi8('~' - '!')), qual);
+    return _mm_or_si128(_mm_and_si128(inRange, _mm_add_epi8(qual, _mm_set1_epi8('!'))), _mm_andnot_si128(inRange, _mm_set1_epi8('!')));
+}
+
+//
+// Each of these does as many whole 16 byte vectors as it can and returns the number of input bytes consumed, leaving the tail
+// to the table-driven code.
+//
+    static BAM_SIMD_TARGET int
+DecodeSeqSimd(char* o_sequence, const _uint8* nibbles, int pairs)
+{
+    __m128i table = _mm_loadu_si128((const __m128i*)BAMAlignment::CodeToSeq);
+    int i;
+    for (i = 0; i + 16 <= pairs; i += 16) {
+        __m128i first, second;
+        UnpackNibbles(_mm_loadu_si128((const __m128i*)(nibbles + i)), table, &first, &second);
+        _mm_storeu_si128((__m128i*)(o_sequence + 2 * i), first);
+        _mm_storeu_si128((__m128i*)(o_sequence + 2 * i + 16), second);
+    }
+    return i;
+}
+
+    static BAM_SIMD_TARGET int
+DecodeSeqRCSimd(char* o_sequence, const _uint8* nibbles, int bases)
+{
+    __m128i table = _mm_loadu_si128((const __m128i*)BAMAlignment::CodeToSeqRC);
+    int pairs = bases / 2;
+    int i;
+    for (i = 0; i + 16 <= pairs; i += 16) {
+        __m128i first, second;
+        UnpackNibbles(_mm_loadu_si128((const __m128i*)(nibbles + i)), table, &first, &second);
+        char* end = o_sequence + bases - 2 * i;
+        _mm_storeu_si128((__m128i*)(end - 16), ReverseBytes(first));
+        _mm_storeu_si128((__m128i*)(end - 32), ReverseBytes(second));
+    }
+    return i;
+}
+
+    static BAM_SIMD_TARGET int
+DecodeQualSimd(char* o_qual, const char* quality, int bases)
+{
+    int i;
+    for (i = 0; i + 16 <= bases; i += 16) {
+        _mm_storeu_si128((__m128i*)(o_qual + i), QualToSam(_mm_loadu_si128((const __m128i*)(quality + i))));
+    }
+    return i;
+}
+
+    static BAM_SIMD_TARGET int
+DecodeQualRCSimd(char* o_qual, const char* quality, int bases)
+{
+    int i;
+    for (i = 0; i + 16 <= bases; i += 16) {
+        _mm_storeu_si128((__m128i*)(o_qual + bases - i - 16), ReverseBytes(QualToSam(_mm_loadu_si128((const __m128i*)(quality + i)))));
+    }
+    return i;
+}
+
+#endif // BAM_SIMD_DECODE
 
     void
 BAMAlignment::decodeSeq(
@@ -291,7 +416,13 @@ BAMAlignment::decodeSeq(
 
     _uint16 *o_sequence_pairs = (_uint16 *)o_sequence;
     int pairs = bases / 2;
-    for (int i = 0; i < pairs; i++) {
+    int i = 0;
+#ifdef BAM_SIMD_DECODE
+    if (UseSimdDecode) {
+        i = DecodeSeqSimd(o_sequence, nibbles, pairs);
+    }
+#endif // BAM_SIMD_DECODE
+    for (; i < pairs; i++) {
         o_sequence_pairs[i] = CodeToSeqPair[nibbles[i]];
     }
 
@@ -316,7 +447,13 @@ int bases)
 {
     _uint16 *o_sequence_pairs = (_uint16 *)&o_sequence[bases % 2];
     int pairs = bases / 2;
-    for (int i = 0; i < pairs; i++) {
+    int i = 0;
+#ifdef BAM_SIMD_DECODE
+    if (UseSimdDecode) {
+        i = DecodeSeqRCSimd(o_sequence, nibbles, bases);
+    }
+#endif // BAM_SIMD_DECODE
+    for (; i < pairs; i++) {
         o_sequence_pairs[pairs-i-1] = CodeToSeqPairRC[nibbles[i]];
     }
 
@@ -330,7 +467,13 @@ BAMAlignment::decodeQual(
     char* quality,
     int bases)
 {
-    for (int i = 0; i < bases; i++) {
+    int i = 0;
+#ifdef BAM_SIMD_DECODE
+    if (UseSimdDecode) {
+        i = DecodeQualSimd(o_qual, quality, bases);
+    }
+#endif // BAM_SIMD_DECODE
+    for (; i < bases; i++) {
         o_qual[i] = CIGAR_QUAL_TO_SAM[((_uint8*)quality)[i]];
     }
 }
@@ -341,11 +484,35 @@ BAMAlignment::decodeQualRC(
     char* quality,
     int bases)
 {
-    for (int i = 0; i < bases; i++) {
+    int i = 0;
+#ifdef BAM_SIMD_DECODE
+    if (UseSimdDecode) {
+        i = DecodeQualRCSimd(o_qual, quality, bases);
+    }
+#endif // BAM_SIMD_DECODE
+    for (; i < bases; i++) {
         o_qual[bases-i-1] = CIGAR_QUAL_TO_SAM[((_uint8*)quality)[i]];
     }
 }
 
+    void
+BAMAlignment::decodeSeqAndQual(
+    char* o_sequence,
+    char* o_qual,
+    bool reverseComplement)
+{
+    //
+    // Seq and qual are adjacent in the record, so doing them back to back keeps the whole thing in cache.
+    //
+    if (reverseComplement) {
+        decodeSeqRC(o_sequence, seq(), l_seq);
+        decodeQualRC(o_qual, qual(), l_seq);
+    } else {
+        decodeSeq(o_sequence, seq(), l_seq);
+        decodeQual(o_qual, qual(), l_seq);
+    }
+}
+
     bool
 BAMAlignment::decodeCigar(
     char* o_cigar,
@@ -513,6 +680,10 @@ BAMAlignment::_init::_init()
         CodeToSeqPairRC[i] = (CodeToSeqRC[i >> 4] << 8) | CodeToSeqRC[i & 0xf]; // Doubled backwards == forward
     }
 
+#ifdef BAM_SIMD_DECODE
+    UseSimdDecode = CpuSupportsSsse3();
+#endif // BAM_SIMD_DECODE
+
     memset(CigarToCode, 0, 256);
     for (int i = 1; i < 9; i++) {
         CigarToCode[CodeToCigar[i]] = i;
@@ -533,6 +704,24 @@ BAMAlignment::reg2bin(
     return 0;
 }
 
+    _uint32
+BAMAlignment::reg2bin(
+    _int64 beg,
+    _int64 end,
+    int minShift,
+    int depth)
+{
+    --end;
+    _int64 levelStart = (((_int64)1 << (3 * (depth + 1))) - 1) / 7;    // of the bins at the bottom level
+    for (int level = depth, shift = minShift; level > 0; level--, shift += 3) {
+        levelStart -= (_int64)1 << (3 * level);
+        if (beg >> shift == end >> shift) {
+            return (_uint32)(levelStart + (beg >> shift));
+        }
+    }
+    return 0;
+}
+
     int
 BAMAlignment::reg2bins(
     int beg,
@@ -739,23 +928,22 @@ BAMReader::getReadFromLine(
             WriteErrorMessage("Truncated or corrupt BAM file near offset %lld\n", data->getFileOffset());
             soft_exit(1);
         }
-		char* seqBuffer = getExtra(bam->l_seq);
-        char* qualBuffer = getExtra(bam->l_seq);
+        //
+        // Decode directly into the batch's extra space, which is what the Read points at from here on.
+        //
+        char* seqBuffer = getExtra(2 * (_int64)bam->l_seq);
+        char* qualBuffer = seqBuffer + bam->l_seq;
 
         unsigned originalFrontClipping, originalBackClipping, originalFrontHardClipping, originalBackHardClipping;
 
-        if (bam->FLAG & SAM_REVERSE_COMPLEMENT) {
-            BAMAlignment::decodeSeqRC(seqBuffer, bam->seq(), bam->l_seq);
-            BAMAlignment::decodeQualRC(qualBuffer, bam->qual(), bam->l_seq);
+        bam->decodeSeqAndQual(seqBuffer, qualBuffer, (bam->FLAG & SAM_REVERSE_COMPLEMENT) != 0);
 
+        if (bam->FLAG & SAM_REVERSE_COMPLEMENT) {
             //
             // Get the clipping, but reverse the outputs front/back because this is an RC read.
             //
             BAMAlignment::getClippingFromCigar(bam->cigar(), bam->n_cigar_op, &originalBackClipping, &originalFrontClipping, &originalBackHardClipping, &originalFrontHardClipping);
         } else {
-            BAMAlignment::decodeSeq(seqBuffer, bam->seq(), bam->l_seq);
-            BAMAlignment::decodeQual(qualBuffer, bam->qual(), bam->l_seq);
-
             BAMAlignment::getClippingFromCigar(bam->cigar(), bam->n_cigar_op, &originalFrontClipping, &originalBackClipping, &originalFrontHardClipping, &originalBackHardClipping);
         }
 
@@ -813,7 +1001,7 @@ BAMReader::getExtra(
 class BAMFormat : public FileFormat
 {
 public:
-    BAMFormat(bool i_useM) : useM(i_useM) {}
+    BAMFormat(bool i_useM, bool i_cram = false) : useM(i_useM), cram(i_cram) {}
 
     virtual void getSortInfo(const Genome* genome, char* buffer, _int64 bytes, GenomeLocation* o_location, GenomeDistance* o_readBytes, OriginalContigNum* originalContigNum, int* o_pos) const;
 
@@ -873,10 +1061,14 @@ private:
         int editDistance, int internalScore, bool emitInternalScore, char *internalScoreTag, int flags, bool attachAlignmentTime, _int64 alignmentTimeInNanoseconds,
         const char *FASTQComment, unsigned FASTQCommentLength, bool includeQS = false, const char *mateQuality = NULL, unsigned mateFullLength = 0);
 
+    ReadWriterSupplier* getCramWriterSupplier(AlignerOptions* options, const Genome* genome) const;
+
     const bool useM;
+    const bool cram;
 };
 
 const FileFormat* FileFormat::BAM[] = { new BAMFormat(false), new BAMFormat(true) };
+const FileFormat* FileFormat::CRAM[] = { new BAMFormat(false, true), new BAMFormat(true, true) };
 
 void
 BAMFormat::getSortInfo(
@@ -923,6 +1115,10 @@ BAMFormat::getWriterSupplier(
     // when running multiple alignments, either through the comma syntax or in daemon mode.
     //
 
+    if (cram) {
+        return getCramWriterSupplier(options, genome);
+    }
+
     DataWriterSupplier* dataSupplier;
     GzipWriterFilterSupplier* gzipSupplier =
         DataWriterSupplier::gzip(true, BAM_BLOCK, max(1, options->numThreads - 1), false, options->sortOutput); // leaked
@@ -933,9 +1129,39 @@ BAMFormat::getWriterSupplier(
         char *tempFileName = DataWriterSupplier::generateSortIntermediateFilePathName(options); // leaked
 
         DataWriter::FilterSupplier* filters = gzipSupplier;
+        char* indexFileName = NULL;
+        int csiMinShift = 0, csiDepth = 0;
         if (!options->noIndex) {
+            //
+            // BAI's bins only reach 512Mbp, so longer contigs (as plants have) get a CSI index, deep enough for the longest.
+            //
+            _int64 maxContigLength = 0;
+            for (int i = 0; i < genome->getNumContigs(); i++) {
+                maxContigLength = __max(maxContigLength, (_int64)genome->getContigByInternalNumber(InternalContigNum(i))->length);
+            }
+            if (options->csiMinShift != 0 || maxContigLength > ((_int64)1 << 29)) {
+                if (options->csiMinShift == 0) {
+                    WriteStatusMessage("Writing a CSI index rather than BAI, because some contigs are too long for BAI\n");
+                }
+                csiMinShift = options->csiMinShift != 0 ? options->csiMinShift : 14;
+                csiDepth = options->csiDepth;
+                if (csiDepth == 0) {
+                    for (csiDepth = 5; (maxContigLength + 256) > ((_int64)1 << (csiMinShift + 3 * csiDepth)); csiDepth++) {
+                        // deeper until it's enough
+                    }
+                    if (csiDepth > 10) {
+                        WriteErrorMessage("A CSI index would need more than 10 levels with a minimum shift of %d; use a bigger one with -csi\n", csiMinShift);
+                        soft_exit(1);
+                    }
+                } else if (maxContigLength > ((_int64)1 << (csiMinShift + 3 * csiDepth))) {
+                    WriteErrorMessage("A CSI index with -csi %d %d only reaches %lld bases, and the longest contig is %lld\n", csiMinShift, csiDepth,
+                        (_int64)1 << (csiMinShift + 3 * csiDepth), maxContigLength);
+                    soft_exit(1);
+                }
+            }
+
             size_t len = strlen(options->outputFile.fileName);
-            char* indexFileName = (char*)malloc(5 + len); // leaked
+            indexFileName = (char*)malloc(5 + len); // leaked
             if (NULL == indexFileName) {
                 WriteErrorMessage("BAMFormat::getWriterSupplier: Out of memory allocating indexFileName\n");
                 soft_exit(1);
@@ -943,22 +1169,74 @@ BAMFormat::getWriterSupplier(
             }
 
             strcpy(indexFileName, options->outputFile.fileName);
-            strcpy(indexFileName + len, ".bai");
-            filters = DataWriterSupplier::bamIndex(indexFileName, genome, gzipSupplier)->compose(filters);
+            strcpy(indexFileName + len, csiMinShift != 0 ? ".csi" : ".bai");
+            filters = DataWriterSupplier::bamIndex(indexFileName, genome, gzipSupplier, csiMinShift, csiDepth)->compose(filters);
         } // ! noIndex
 
+        //
+        // The merge can be split by genome range into segments that are written in parallel, each marking its own duplicates.
+        // The filters here are for when it isn't split.
+        //
         if (!options->noDuplicateMarking) {
             filters = DataWriterSupplier::bamMarkDuplicates(genome)->compose(filters);
         }
+        SegmentedOutputSupplier* segmentedOutput = DataWriterSupplier::bamSegments(indexFileName, csiMinShift, csiDepth, genome, options->numThreads,
+            options->bindToProcessors, options->emitInternalScore, options->internalScoreTag, !options->noDuplicateMarking);
 
         gzipEncoder = FileEncoder::gzip(gzipSupplier, options->numThreads, options->bindToProcessors);
         dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName,
             options->sortMemory * (1ULL << 30),
             options->numThreads, options->outputFile.fileName, filters, options->writeBufferSize,
-            options->emitInternalScore, options->internalScoreTag,
-            gzipEncoder);
+            options->emitInternalScore, options->internalScoreTag, options->useIoUring, options->directIo,
+            gzipEncoder, segmentedOutput);
+    } else {
+        DataWriter::FilterSupplier* filters = gzipSupplier;
+        if (options->markUnsortedDuplicates) {
+            _ASSERT(!options->outputFile.isStdio);  // AlignerOptions::checkCombinations() rejects that
+            filters = DataWriterSupplier::bamMarkUnsortedDuplicates(genome, options->outputFile.fileName)->compose(filters);
+        }
+        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, options->writeBufferSize, options->emitInternalScore, options->internalScoreTag, filters,
+            NULL, 4, options->useIoUring, options->directIo);
+    }
+
+    return ReadWriterSupplier::create(this, dataSupplier, genome, options->killIfTooSlow, options->emitInternalScore, options->internalScoreTag, 
+                                      options->ignoreAlignmentAdjustmentsForOm, options->matchReward, options->subPenalty, 
+                                      options->gapOpenPenalty, options->gapExtendPenalty, options->attachAlignmentTimes);
+}
+
+//
+// CRAM output goes through the same filters as BAM, except that the CRAM encoder takes the place of BGZF compression.  There's
+// no index (CRAM's is a different format) and no segmented merge, since the pieces are put back together as BGZF.
+//
+    ReadWriterSupplier*
+BAMFormat::getCramWriterSupplier(
+    AlignerOptions* options,
+    const Genome* genome) const
+{
+    DataWriterSupplier* dataSupplier;
+    CramWriterFilterSupplier* cramSupplier = DataWriterSupplier::cram(genome, options->outputFile.fileName, options->sortOutput); // leaked
+
+    if (options->sortOutput) {
+        char *tempFileName = DataWriterSupplier::generateSortIntermediateFilePathName(options); // leaked
+
+        DataWriter::FilterSupplier* filters = cramSupplier;
+        if (!options->noDuplicateMarking) {
+            filters = DataWriterSupplier::bamMarkDuplicates(genome)->compose(filters);
+        }
+
+        FileEncoder* cramEncoder = FileEncoder::cram(cramSupplier, options->numThreads, options->bindToProcessors);
+        dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName,
+            options->sortMemory * (1ULL << 30),
+            options->numThreads, options->outputFile.fileName, filters, options->writeBufferSize,
+            options->emitInternalScore, options->internalScoreTag, options->useIoUring, options->directIo,
+            cramEncoder);
     } else {
-        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, options->writeBufferSize, options->emitInternalScore, options->internalScoreTag, gzipSupplier);
+        if (options->markUnsortedDuplicates) {
+            WriteErrorMessage("-du only works for BAM output; sort CRAM output with -so to mark its duplicates\n");
+            soft_exit(1);
+        }
+        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, options->writeBufferSize, options->emitInternalScore, options->internalScoreTag, cramSupplier,
+            NULL, 4, options->useIoUring, options->directIo);
     }
 
     return ReadWriterSupplier::create(this, dataSupplier, genome, options->killIfTooSlow, options->emitInternalScore, options->internalScoreTag, 
@@ -2586,6 +2864,48 @@ struct DuplicateMateInfo
     }
 }; // DuplicateMateInfo
 
+typedef VariableSizeMap<DuplicateReadKey,DuplicateMateInfo,150,MapNumericHash<DuplicateReadKey>,70,0,-2> DuplicateMateMap;
+
+//
+// A second mate that was marked in a different range of a segmented merge than its first mate.
+//
+struct BamDupMarkSecondMate
+{
+    BamDupMarkSecondMate() : offset(0), isDuplicate(false), readIdLength(0) { readId[0] = '\0'; }
+
+    bool operator<(const BamDupMarkSecondMate& b) const
+    { return offset < b.offset; }
+
+    DuplicateReadKey key;
+    _uint64 offset;         // logical offset of the FLAG byte with SAM_DUPLICATE in it, virtual once the segment is closed
+    bool isDuplicate;       // as it was written
+    int readIdLength;
+    char readId[120];
+};
+
+//
+// What one range of a segmented merge decided about pairs with a mate in another range.  Each range marks its own reads, so the
+// second mates are decided again from their own group, which can break a tie differently than the first mates did.
+// BAMSegmentedOutput::finish makes the second mates agree with the first.
+//
+struct BamDupMarkPartition
+{
+    VariableSizeVector<pair<DuplicateReadKey, DuplicateMateInfo> > firstMates;  // left over: their second mates are later
+    VariableSizeVector<BamDupMarkSecondMate> secondMates;                     // their first mates are earlier
+
+    void addSecondMate(const DuplicateReadKey& key, BAMAlignment* bam, size_t fileOffset)
+    {
+        BamDupMarkSecondMate mate;
+        mate.key = key;
+        mate.offset = fileOffset + offsetof(BAMAlignment, FLAG) + 1;   // little-endian, so SAM_DUPLICATE is in the high byte
+        mate.isDuplicate = (bam->FLAG & SAM_DUPLICATE) != 0;
+        mate.readIdLength = __min((int)sizeof(mate.readId) - 1, bam->l_read_name - 1);
+        memcpy(mate.readId, bam->read_name(), mate.readIdLength);
+        mate.readId[mate.readIdLength] = '\0';
+        secondMates.push_back(mate);
+    }
+};
+
 struct BamDupMarkEntry
 {
     BamDupMarkEntry() : libraryNameHash(0), runOffset(0), mateQual(0), mateInfo(0), info(0) {}
@@ -2619,14 +2939,22 @@ struct BamDupMarkEntry
 class BAMDupMarkFilter : public BAMFilter
 {
 public:
-    BAMDupMarkFilter(const Genome* i_genome) :
+    //
+    // partition is for one range of a segmented merge, and is NULL when the filter sees the whole file.
+    //
+    BAMDupMarkFilter(const Genome* i_genome, BamDupMarkPartition* i_partition = NULL) :
         BAMFilter(DataWriter::DupMarkFilter),
-        genome(i_genome), runOffset(0), runLocation(InvalidGenomeLocation), prevRunLocation(InvalidGenomeLocation), runCount(0), mates(), fragments()
+        genome(i_genome), partition(i_partition), firstLocation(InvalidGenomeLocation), runOffset(0), runLocation(InvalidGenomeLocation), prevRunLocation(InvalidGenomeLocation), runCount(0), mates(), fragments()
     {
     }
 
     ~BAMDupMarkFilter()
     {
+        if (partition != NULL) {
+            for (MateMap::iterator i = mates.begin(); i != mates.end(); i = mates.next(i)) {
+                partition->firstMates.push_back(pair<DuplicateReadKey, DuplicateMateInfo>(i->key, i->value));
+            }
+        }
 #if 0
         if (mates.size() > 0) {
             WriteErrorMessage("duplicate matching ended with %d unmatched reads:\n", mates.size());
@@ -2653,28 +2981,32 @@ public:
 
     void dupMarkBatch(BAMAlignment* lastBam, size_t lastOffset);
 
-protected:
-    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
-
-private:
     static int getTotalQuality(BAMAlignment* bam);
 
     static void getTileXY(const char* id, int* o_tile, int* o_x, int* o_y);
 
+protected:
+    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
+
+private:
     const Genome* genome;
+    BamDupMarkPartition* partition;
+    GenomeLocation firstLocation; // of the first read in a partition; mates before it are in earlier ranges
     size_t runOffset; // offset in file of first read in run
     GenomeLocation runLocation; // location in genome
     GenomeLocation prevRunLocation; // location in genome
     int runCount; // number of aligned reads
 
-    typedef VariableSizeMap<DuplicateReadKey,DuplicateMateInfo,150,MapNumericHash<DuplicateReadKey>,70,0,-2> MateMap;
+    typedef DuplicateMateMap MateMap;
     typedef VariableSizeMap<DuplicateFragmentKey, DuplicateMateInfo, 150, MapNumericHash<DuplicateFragmentKey>, 70, 0, -2> FragmentMap;
     typedef VariableSizeVector<BamDupMarkEntry> RunVector;
+    typedef VariableSizeMap<DuplicateReadKey,int,150,MapNumericHash<DuplicateReadKey>,70,0,-2> KeySet;
 
     RunVector run; // used for paired-end duplicate marking
     RunVector runFragment; // used for single-end duplicate marking 
     MateMap mates;
     FragmentMap fragments;
+    KeySet secondMateKeys; // for a partition, pairs whose first mates were in an earlier range
 };
 
     size_t
@@ -2715,6 +3047,9 @@ BAMDupMarkFilter::onNextBatch(
         GenomeLocation nextLocation = lastBam->getNextLocation(genome);
         GenomeLocation logicalLocation = location != InvalidGenomeLocation ? location : nextLocation;
         logicalLocation = lastBam->getUnclippedStart(logicalLocation);
+        if (partition != NULL && firstLocation == InvalidGenomeLocation) {
+            firstLocation = location;
+        }
 
         //
         // Initialize run
@@ -2920,6 +3255,9 @@ BAMDupMarkFilter::dupMarkBatch(BAMAlignment* lastBam, size_t lastOffset)
             info = &mates[key];
             //fprintf(stderr, "add %u%s/%u%s -> %d\n", key.locations[0], key.isRC[0] ? "rc" : "", key.locations[1], key.isRC[1] ? "rc" : "", mates.size());
             info->isMateMapped = true;
+            if (partition != NULL && record->getNextLocation(genome) < firstLocation) {
+                secondMateKeys.put(key, 0); // the first mates are in an earlier range
+            }
         } else {
             info = &f->value;
         }
@@ -3029,6 +3367,9 @@ BAMDupMarkFilter::dupMarkBatch(BAMAlignment* lastBam, size_t lastOffset)
         if (!readIdsMatch(minfo->getBestReadId(), record->read_name(), record->l_read_name - 1)) {
             record->FLAG |= SAM_DUPLICATE;
         }
+        if (partition != NULL && secondMateKeys.tryFind(key) != NULL) {
+            partition->addSecondMate(key, record, offset);
+        }
     }
 
     // clean up
@@ -3190,19 +3531,32 @@ BAMDupMarkFilter::getTileXY(
 class BAMDupMarkSupplier : public DataWriter::FilterSupplier
 {
 public:
-    BAMDupMarkSupplier(const Genome* i_genome) :
-        FilterSupplier(DataWriter::ReadFilter), genome(i_genome) {}
+    //
+    // For a range of a segmented merge, the reads are marked into partition, and gzipSupplier turns its offsets into virtual ones.
+    //
+    BAMDupMarkSupplier(const Genome* i_genome, BamDupMarkPartition* i_partition = NULL, GzipWriterFilterSupplier* i_gzipSupplier = NULL) :
+        FilterSupplier(DataWriter::ReadFilter), genome(i_genome), partition(i_partition), gzipSupplier(i_gzipSupplier) {}
 
     virtual ~BAMDupMarkSupplier() {}
 
     virtual DataWriter::Filter* getFilter()
-    { return new BAMDupMarkFilter(genome); }
+    { return new BAMDupMarkFilter(genome, partition); }
 
     virtual void onClosing(DataWriterSupplier* supplier) {}
-    virtual void onClosed(DataWriterSupplier* supplier) {}
+
+    virtual void onClosed(DataWriterSupplier* supplier)
+    {
+        if (partition != NULL) {
+            for (_int64 i = 0; i < partition->secondMates.size(); i++) {
+                partition->secondMates[i].offset = gzipSupplier->toVirtualOffset(partition->secondMates[i].offset);
+            }
+        }
+    }
 
 private:
     const Genome* genome;
+    BamDupMarkPartition* partition;
+    GzipWriterFilterSupplier* gzipSupplier;
 };
 
     DataWriter::FilterSupplier*
@@ -3212,6 +3566,97 @@ DataWriterSupplier::bamMarkDuplicates(const Genome* genome)
 }
 
 class BAMIndexSupplier;
+class BAMSegmentedOutput;
+
+//
+// Where the virtual offsets of a segment of segmented output land in the output file: moved by where the segment starts,
+// and by how much any blocks before them grew when they were rewritten.
+//
+class BgzfRelocation
+{
+public:
+    BgzfRelocation() : base(0) {}
+
+    void setBase(_uint64 i_base)
+    { base = i_base; }
+
+    // The block at physical offset block in the segment was rewritten growth bytes longer (or shorter)
+    void addRewrite(_uint64 block, _int64 growth)
+    {
+        moves.push_back(pair<_uint64,_int64>(block, growth + (moves.size() > 0 ? moves[moves.size() - 1].second : 0)));
+    }
+
+    _uint64 relocate(_uint64 virtualOffset) const
+    {
+        _uint64 physical = virtualOffset >> 16;
+        _int64 growth = 0;
+        for (_int64 i = moves.size() - 1; i >= 0; i--) {
+            if (moves[i].first < physical) {
+                growth = moves[i].second;
+                break;
+            }
+        }
+        return ((physical + base + growth) << 16) | (virtualOffset & 0xffff);
+    }
+
+private:
+    _uint64 base;
+    VariableSizeVector< pair<_uint64,_int64> > moves;
+};
+
+//
+// A change to the SAM_DUPLICATE bit of a record that's already been compressed.
+//
+struct BgzfDuplicatePatch
+{
+    BgzfDuplicatePatch() : offset(0), isDuplicate(false) {}
+    BgzfDuplicatePatch(_uint64 i_offset, bool i_isDuplicate) : offset(i_offset), isDuplicate(i_isDuplicate) {}
+
+    _uint64 offset;     // virtual offset of the byte with the bit
+    bool isDuplicate;
+};
+
+typedef VariableSizeVector<BgzfDuplicatePatch> BgzfDuplicatePatchVector;
+
+//
+// How an index divides a reference into bins.  BAI has 16kb windows with 5 levels of bins above them, which only reach
+// 512Mbp; CSI lets both be chosen, so long contigs fit.
+//
+struct BamIndexBinning
+{
+    // a minShift of 0 is for BAI
+    BamIndexBinning(int i_minShift = 0, int i_depth = 0) :
+        csi(i_minShift != 0), minShift(i_minShift != 0 ? i_minShift : 14), depth(i_minShift != 0 ? i_depth : 5) {}
+
+    // the pseudo-bin with the reference's span of the file and its read counts, just past the real ones
+    _uint32 extraBin() const
+    { return (_uint32)((((_int64)1 << (3 * (depth + 1))) - 1) / 7 + 1); }
+
+    _uint32 getBin(BAMAlignment* bam) const
+    {
+        if (!csi) {
+            return bam->bin;    // as written, which is BAI's
+        }
+        // unmapped reads are placed at their mates, with length 1
+        return BAMAlignment::reg2bin(bam->pos, bam->pos + ((bam->FLAG & SAM_UNMAPPED) ? 1 : __max(1, bam->l_ref())), minShift, depth);
+    }
+
+    // the first window under a bin, whose linear offset is the bin's in a CSI index
+    _int64 firstWindow(_uint32 bin) const
+    {
+        int level = 0;
+        _int64 levelStart = 0;
+        while (level < depth && bin >= levelStart + ((_int64)1 << (3 * level))) {
+            levelStart += (_int64)1 << (3 * level);
+            level++;
+        }
+        return (bin - levelStart) << (3 * (depth - level));
+    }
+
+    bool csi;
+    int minShift;
+    int depth;
+};
 
 class BAMIndexFilter : public BAMFilter
 {
@@ -3229,11 +3674,19 @@ private:
 class BAMIndexSupplier : public DataWriter::FilterSupplier
 {
 public:
-    BAMIndexSupplier(const char* i_indexFileName, const Genome* i_genome, GzipWriterFilterSupplier* i_gzipSupplier) :
+    //
+    // For a segment of segmented output, the index information goes to the segmented output (which combines the segments'
+    // and writes the index) instead of to a file.
+    //
+    BAMIndexSupplier(const char* i_indexFileName, const Genome* i_genome, const BamIndexBinning& i_binning, GzipWriterFilterSupplier* i_gzipSupplier,
+            BAMSegmentedOutput* i_segmentedOutput = NULL, int i_segment = 0) :
         FilterSupplier(DataWriter::ReadFilter),
         indexFileName(i_indexFileName),
         genome(i_genome),
+        binning(i_binning),
         gzipSupplier(i_gzipSupplier),
+        segmentedOutput(i_segmentedOutput),
+        segment(i_segment),
         lastRefId(-1),
         lastBin(0), binStart(0), lastBamEnd(0)
     {
@@ -3252,6 +3705,8 @@ public:
 private:
 
     friend class BAMIndexFilter;
+    friend class BAMSegmentedOutput;
+    friend struct BamIndexAppendContext;
 
     struct BAMChunk {
         BAMChunk() : start(0), end(0) {}
@@ -3275,8 +3730,20 @@ private:
 
     void addInterval(int refId, int begin, int end, _uint64 fileOffset);
 
+    // Changes the logical file offsets to virtual ones, except that missing linear index entries stay UINT64_MAX
+    void translateOffsets();
+
+    static void WriteIndex(const char* indexFileName, const Genome* genome, const BamIndexBinning& binning, RefInfo* refs);
+
+    // CSI is BGZF compressed, with an offset per bin instead of a linear index
+    static void WriteCsiIndex(const char* indexFileName, const Genome* genome, const BamIndexBinning& binning, RefInfo* refs);
+
+    // Adds the index information for a segment that's appended to the file where relocation puts it
+    static void AppendSegment(RefInfo* into, RefInfo* from, const BgzfRelocation& relocation, _uint32 extraBin);
+
     const char* indexFileName;
     const Genome* genome;
+    const BamIndexBinning binning;
     int lastRefId;
     _uint32 lastBin;
     _uint64 binStart;
@@ -3285,6 +3752,81 @@ private:
     _uint64 readCounts[2]; // mapped, unmapped
     RefInfo* refs;
     GzipWriterFilterSupplier* gzipSupplier;
+    BAMSegmentedOutput* segmentedOutput;
+    int segment;
+};
+
+//
+// Appends the index information of the later segments of segmented output to the first's, with a thread taking a
+// reference at a time.
+//
+struct BamIndexAppendContext : public TaskContextBase
+{
+    void initializeThread() {}
+    void runThread();
+    void finishThread(BamIndexAppendContext* common) {}
+
+    BAMIndexSupplier::RefInfo** segmentRefs;
+    const BgzfRelocation* relocations;
+    int nSegments;
+    int nRefs;
+    _uint32 extraBin;
+    volatile int* nextRef;
+};
+
+//
+// Sorted BAM output written by several merge threads at once, each taking a range of the genome into a segment of its own
+// with its own compression.  The segments are BGZF without the EOF marker, so they can just be appended to the output, and
+// each keeps its index information in its own virtual offsets, which only need to be moved by where the segment lands.
+//
+class BAMSegmentedOutput : public SegmentedOutputSupplier
+{
+public:
+    BAMSegmentedOutput(const char* i_indexFileName, const Genome* i_genome, const BamIndexBinning& i_binning, int i_numThreads, bool i_bindToProcessors,
+            bool i_emitInternalScore, char* i_internalScoreTag, bool i_markDuplicates) :
+        indexFileName(i_indexFileName), genome(i_genome), binning(i_binning), numThreads(i_numThreads), bindToProcessors(i_bindToProcessors),
+        emitInternalScore(i_emitInternalScore), internalScoreTag(i_internalScoreTag), markDuplicates(i_markDuplicates),
+        nSegments(0), segmentRefs(NULL), partitions(NULL)
+    {}
+
+    virtual ~BAMSegmentedOutput()
+    {
+        delete[] segmentRefs;
+        delete[] partitions;
+    }
+
+    virtual DataWriterSupplier* createSegment(int segment, int i_nSegments, const char* fileName, size_t bufferSize);
+
+    virtual void finish(const char* outputFileName, int i_nSegments, char** segmentFileNames);
+
+    void onSegmentIndex(int segment, BAMIndexSupplier::RefInfo* refs)
+    { segmentRefs[segment] = refs; }
+
+private:
+    const char* indexFileName;  // NULL for no index
+    const Genome* genome;
+    const BamIndexBinning binning;
+    const int numThreads;
+    const bool bindToProcessors;
+    const bool emitInternalScore;
+    char* internalScoreTag;
+    const bool markDuplicates;
+
+    int nSegments;
+    BAMIndexSupplier::RefInfo** segmentRefs;
+    BamDupMarkPartition* partitions;    // when marking duplicates
+
+    //
+    // The cheap second pass of partitioned duplicate marking: the second mates that don't agree with their first mates in an
+    // earlier segment, for each segment.
+    //
+    void matchSecondMates(BgzfDuplicatePatchVector* patches);
+
+    friend class BAMUnsortedDupMarkSupplier;
+
+    // Appends a segment, rewriting the blocks with patches.  Returns the bytes written.
+    static _uint64 CopySegment(FILE* input, FILE* output, const char* outputFileName, BgzfDuplicatePatchVector* patches,
+        BgzfRelocation* relocation, char* copyBuffer, size_t copyBufferSize);
 };
 
     void
@@ -3300,9 +3842,11 @@ BAMIndexFilter::onRead(
 DataWriterSupplier::bamIndex(
     const char* indexFileName,
     const Genome* genome,
-    GzipWriterFilterSupplier* gzipSupplier)
+    GzipWriterFilterSupplier* gzipSupplier,
+    int csiMinShift,
+    int csiDepth)
 {
-    return new BAMIndexSupplier(indexFileName, genome, gzipSupplier);
+    return new BAMIndexSupplier(indexFileName, genome, BamIndexBinning(csiMinShift, csiDepth), gzipSupplier);
 }
 
     void
@@ -3314,16 +3858,17 @@ BAMIndexSupplier::onRead(
     //fprintf(stderr, "index onRead %d:%d+%d @ %lld %d\n", bam->refID, bam->pos, bam->l_ref(), fileOffset, batchIndex);
     if (bam->refID != lastRefId) {
         if (lastRefId != -1) {
-            addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, firstBamStart, lastBamEnd);
-            addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, readCounts[0], readCounts[1]);
+            addChunk(lastRefId, binning.extraBin(), firstBamStart, lastBamEnd);
+            addChunk(lastRefId, binning.extraBin(), readCounts[0], readCounts[1]);
             readCounts[0] = readCounts[1] = 0;
         }
         firstBamStart = fileOffset;
     }
     readCounts[(bam->FLAG & SAM_UNMAPPED) ? 1 : 0]++;
-    if (bam->refID != lastRefId || bam->bin != lastBin || lastRefId == -1) {
+    _uint32 bin = binning.getBin(bam);
+    if (bam->refID != lastRefId || bin != lastBin || lastRefId == -1) {
         addChunk(lastRefId, lastBin, binStart, fileOffset);
-        lastBin = bam->bin;
+        lastBin = bin;
         lastRefId = bam->refID;
         binStart = fileOffset;
     }
@@ -3341,57 +3886,226 @@ BAMIndexSupplier::onClosed(
     // add final chunk
     if (lastRefId != -1) {
         addChunk(lastRefId, lastBin, binStart, lastBamEnd);
-        addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, firstBamStart, lastBamEnd);
-        addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, readCounts[0], readCounts[1]);
+        addChunk(lastRefId, binning.extraBin(), firstBamStart, lastBamEnd);
+        addChunk(lastRefId, binning.extraBin(), readCounts[0], readCounts[1]);
     }
 
-    // write out index file
-    FILE* index = fopen(indexFileName, "wb");
-    char magic[4] = {'B', 'A', 'I', 1};
-    fwrite(magic, sizeof(magic), 1, index);
-    _int32 n_ref = genome->getNumContigs();
-    fwrite(&n_ref, sizeof(n_ref), 1, index);
+    translateOffsets();
 
-    for (int i = 0; i < n_ref; i++) {
-        RefInfo* info = getRefInfo(i);
-        _int32 n_bin, n_intv;
-        if (info == NULL) {
-            n_bin = 0;
-            fwrite(&n_bin, sizeof(n_bin), 1, index);
-            n_intv = 0;
-            fwrite(&n_intv, sizeof(n_intv), 1, index);
-            continue;
+    if (segmentedOutput != NULL) {
+        segmentedOutput->onSegmentIndex(segment, refs);
+        refs = NULL;
+        return;
+    }
+
+    WriteIndex(indexFileName, genome, binning, refs);
+}
+
+    void
+BAMIndexSupplier::translateOffsets()
+{
+    for (int i = 0; i < genome->getNumContigs(); i++) {
+        RefInfo* info = &refs[i];
+        for (BinMap::iterator j = info->bins.begin(); j != info->bins.end(); j = info->bins.next(j)) {
+            if (j->key != binning.extraBin()) {
+                for (ChunkVec::iterator k = j->value.begin(); k != j->value.end(); k++) {
+                    k->start = gzipSupplier->toVirtualOffset(k->start);
+                    k->end = gzipSupplier->toVirtualOffset(k->end);
+                }
+            } else {
+                // the second chunk holds the mapped & unmapped read counts
+                j->value[0].start = gzipSupplier->toVirtualOffset(j->value[0].start);
+                j->value[0].end = gzipSupplier->toVirtualOffset(j->value[0].end);
+            }
+        }
+        for (LinearMap::iterator m = info->intervals.begin(); m != info->intervals.end(); m++) {
+            if (*m != UINT64_MAX) {
+                *m = gzipSupplier->toVirtualOffset(*m);
+            }
         }
-        n_bin = info->bins.size();
+    }
+}
+
+    void
+BAMIndexSupplier::WriteIndex(
+    const char* indexFileName,
+    const Genome* genome,
+    const BamIndexBinning& binning,
+    RefInfo* refs)
+{
+    if (binning.csi) {
+        WriteCsiIndex(indexFileName, genome, binning, refs);
+        return;
+    }
+
+    FILE* index = fopen(indexFileName, "wb");
+    char magic[4] = {'B', 'A', 'I', 1};
+    fwrite(magic, sizeof(magic), 1, index);
+    _int32 n_ref = genome->getNumContigs();
+    fwrite(&n_ref, sizeof(n_ref), 1, index);
+
+    for (int i = 0; i < n_ref; i++) {
+        RefInfo* info = &refs[i];
+        _int32 n_bin = info->bins.size();
         fwrite(&n_bin, sizeof(n_bin), 1, index);
         for (BinMap::iterator j = info->bins.begin(); j != info->bins.end(); j = info->bins.next(j)) {
             _uint32 bin = j->key;
             fwrite(&bin, sizeof(bin), 1, index);
             _int32 n_chunk = (_int32) j->value.size();
             fwrite(&n_chunk, sizeof(n_chunk), 1, index);
-            if (bin != BAMAlignment::BAM_EXTRA_BIN) {
-                for (ChunkVec::iterator k = j->value.begin(); k != j->value.end(); k++) {
-                    _uint64 chunk[2] = {gzipSupplier->toVirtualOffset(k->start), gzipSupplier->toVirtualOffset(k->end)};
-                    fwrite(&chunk, sizeof(chunk), 1, index);
-                }
-            } else {
-                _uint64 chunk[2] = {gzipSupplier->toVirtualOffset(j->value[0].start), gzipSupplier->toVirtualOffset(j->value[0].end)};
-                fwrite(&chunk, sizeof(chunk), 1, index);
-                chunk[0] = j->value[1].start;
-                chunk[1] = j->value[1].end;
+            for (ChunkVec::iterator k = j->value.begin(); k != j->value.end(); k++) {
+                _uint64 chunk[2] = {k->start, k->end};
                 fwrite(&chunk, sizeof(chunk), 1, index);
             }
         }
-        n_intv = (_int32) info->intervals.size();
+        _int32 n_intv = (_int32) info->intervals.size();
         fwrite(&n_intv, sizeof(n_intv), 1, index);
         for (LinearMap::iterator m = info->intervals.begin(); m != info->intervals.end(); m++) {
-            _uint64 ioffset = gzipSupplier->toVirtualOffset(*m);
+            _uint64 ioffset = *m == UINT64_MAX ? 0 : *m;
             fwrite(&ioffset, sizeof(ioffset), 1, index);
         }
     }
     fclose(index);
 }
 
+//
+// Appends bytes to a buffer that's being built up.
+//
+    static void
+AppendIndexBytes(
+    VariableSizeVector<char>* buffer,
+    const void* data,
+    size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++) {
+        buffer->push_back(((const char*)data)[i]);
+    }
+}
+
+    void
+BAMIndexSupplier::WriteCsiIndex(
+    const char* indexFileName,
+    const Genome* genome,
+    const BamIndexBinning& binning,
+    RefInfo* refs)
+{
+    VariableSizeVector<char> csi;
+    char magic[4] = {'C', 'S', 'I', 1};
+    AppendIndexBytes(&csi, magic, sizeof(magic));
+    _int32 header[3] = {binning.minShift, binning.depth, 0};  // no auxiliary data
+    AppendIndexBytes(&csi, header, sizeof(header));
+    _int32 n_ref = genome->getNumContigs();
+    AppendIndexBytes(&csi, &n_ref, sizeof(n_ref));
+
+    for (int i = 0; i < n_ref; i++) {
+        RefInfo* info = &refs[i];
+
+        //
+        // A bin's offset is the linear index entry of the first window under it.  Windows no read overlaps take the offset of
+        // the one before, or for the first ones the start of the reference's reads, as samtools does.
+        //
+        ChunkVec* extra = info->bins.tryFind(binning.extraBin());
+        _uint64 offset = extra != NULL && extra->size() > 0 ? (*extra)[0].start : 0;
+        for (_int64 m = 0; m < info->intervals.size(); m++) {
+            if (info->intervals[m] == UINT64_MAX) {
+                info->intervals[m] = offset;
+            }
+            offset = info->intervals[m];
+        }
+
+        _int32 n_bin = info->bins.size();
+        AppendIndexBytes(&csi, &n_bin, sizeof(n_bin));
+        for (BinMap::iterator j = info->bins.begin(); j != info->bins.end(); j = info->bins.next(j)) {
+            _uint32 bin = j->key;
+            AppendIndexBytes(&csi, &bin, sizeof(bin));
+            _int64 window = bin == binning.extraBin() ? -1 : binning.firstWindow(bin);
+            _uint64 loffset = window >= 0 && window < info->intervals.size() ? info->intervals[window] : 0;
+            AppendIndexBytes(&csi, &loffset, sizeof(loffset));
+            _int32 n_chunk = (_int32) j->value.size();
+            AppendIndexBytes(&csi, &n_chunk, sizeof(n_chunk));
+            for (ChunkVec::iterator k = j->value.begin(); k != j->value.end(); k++) {
+                _uint64 chunk[2] = {k->start, k->end};
+                AppendIndexBytes(&csi, chunk, sizeof(chunk));
+            }
+        }
+    }
+
+    //
+    // Compress it into BGZF blocks, the same size as samtools' so they're sure to fit compressed.
+    //
+    FILE* index = fopen(indexFileName, "wb");
+    if (index == NULL) {
+        WriteErrorMessage("Unable to open index file %s\n", indexFileName);
+        soft_exit(1);
+    }
+    const size_t blockData = 0xff00;
+    const size_t compressedSize = 2 * BAM_BLOCK;
+    char* compressed = (char*)BigAlloc(compressedSize);
+    DeflateBackend* deflater = DeflateBackend::create(BAM_BLOCK);
+    for (_int64 done = 0; done < csi.size(); done += blockData) {
+        size_t bytes = (size_t)__min((_int64)blockData, csi.size() - done);
+        size_t used = deflater->compressChunk(true, compressed, compressedSize, csi.begin() + done, bytes);
+        if (fwrite(compressed, 1, used, index) != used) {
+            WriteErrorMessage("Write to index file %s failed\n", indexFileName);
+            soft_exit(1);
+        }
+    }
+    delete deflater;
+    BigDealloc(compressed);
+    if (fwrite(GzipWriterFilterSupplier::BamEofMarker, 1, sizeof(GzipWriterFilterSupplier::BamEofMarker), index) != sizeof(GzipWriterFilterSupplier::BamEofMarker) ||
+            fclose(index) != 0) {
+        WriteErrorMessage("Write to index file %s failed\n", indexFileName);
+        soft_exit(1);
+    }
+}
+
+    void
+BAMIndexSupplier::AppendSegment(
+    RefInfo* into,
+    RefInfo* from,
+    const BgzfRelocation& relocation,
+    _uint32 extraBin)
+{
+    for (BinMap::iterator j = from->bins.begin(); j != from->bins.end(); j = from->bins.next(j)) {
+        ChunkVec* chunks = into->bins.tryFind(j->key);
+        if (chunks == NULL) {
+            ChunkVec empty;
+            into->bins.tryAdd(j->key, empty, &chunks);
+        }
+        if (j->key == extraBin) {
+            // the reference's reads span both segments, and the counts add up
+            if (chunks->size() == 0) {
+                BAMChunk chunk;
+                chunk.start = relocation.relocate(j->value[0].start);
+                chunks->push_back(chunk);
+                chunks->push_back(BAMChunk());
+            }
+            (*chunks)[0].end = relocation.relocate(j->value[0].end);
+            (*chunks)[1].start += j->value[1].start;
+            (*chunks)[1].end += j->value[1].end;
+            continue;
+        }
+        for (ChunkVec::iterator k = j->value.begin(); k != j->value.end(); k++) {
+            BAMChunk chunk;
+            chunk.start = relocation.relocate(k->start);
+            chunk.end = relocation.relocate(k->end);
+            if (chunks->size() > 0 && (*chunks)[chunks->size() - 1].end == chunk.start) {
+                (*chunks)[chunks->size() - 1].end = chunk.end;  // a chunk that was split at the segment boundary
+            } else {
+                chunks->push_back(chunk);
+            }
+        }
+    }
+
+    //
+    // A linear index entry is set by the first read that overlaps its window, which is in the first segment that
+    // has the entry.
+    //
+    for (_int64 i = into->intervals.size(); i < from->intervals.size(); i++) {
+        into->intervals.push_back(from->intervals[i] == UINT64_MAX ? UINT64_MAX : relocation.relocate(from->intervals[i]));
+    }
+}
+
    BAMIndexSupplier::RefInfo*
 BAMIndexSupplier::getRefInfo(
     int refId)
@@ -3432,13 +4146,663 @@ BAMIndexSupplier::addInterval(
     if (info == NULL) {
         return;
     }
-    int slot = end <= 0 ? 0 : ((end - 1) / 16384);
-    if (slot >= info->intervals.size()) {
-        for (_int64 i = info->intervals.size(); i < slot; i++) {
-            info->intervals.push_back(UINT64_MAX);
+    //
+    // Every window the read overlaps that no earlier read did starts with it.  The reads come in order of their starts,
+    // so windows that are already there stay as they are.
+    //
+    _int64 first = begin < 0 ? 0 : (begin >> binning.minShift);
+    _int64 last = end <= begin ? first : (end >> binning.minShift);
+    for (_int64 i = info->intervals.size(); i <= last; i++) {
+        info->intervals.push_back(i < first ? UINT64_MAX : fileOffset);
+    }
+}
+
+    DataWriterSupplier*
+BAMSegmentedOutput::createSegment(
+    int segment,
+    int i_nSegments,
+    const char* fileName,
+    size_t bufferSize)
+{
+    if (segmentRefs == NULL) {
+        nSegments = i_nSegments;
+        segmentRefs = new BAMIndexSupplier::RefInfo*[nSegments];
+        for (int i = 0; i < nSegments; i++) {
+            segmentRefs[i] = NULL;
+        }
+    }
+    _ASSERT(i_nSegments == nSegments && segment >= 0 && segment < nSegments);
+
+    if (markDuplicates && partitions == NULL) {
+        partitions = new BamDupMarkPartition[nSegments];
+    }
+
+    int threadsPerSegment = max(1, numThreads / nSegments);
+    GzipWriterFilterSupplier* gzipSupplier = DataWriterSupplier::gzip(true, BAM_BLOCK, threadsPerSegment, false, true);
+    gzipSupplier->omitEofMarker();
+
+    DataWriter::FilterSupplier* filters = gzipSupplier;
+    if (indexFileName != NULL) {
+        filters = (new BAMIndexSupplier(NULL, genome, binning, gzipSupplier, this, segment))->compose(filters);
+    }
+    if (markDuplicates) {
+        filters = (new BAMDupMarkSupplier(genome, &partitions[segment], gzipSupplier))->compose(filters);
+    }
+
+    FileEncoder* encoder = FileEncoder::gzip(gzipSupplier, threadsPerSegment, bindToProcessors); // leaked, like the one for unsegmented output
+    return DataWriterSupplier::create(fileName, bufferSize, emitInternalScore, internalScoreTag, filters, encoder, 6);
+}
+
+    void
+BamIndexAppendContext::runThread()
+{
+    for (int ref = InterlockedIncrementAndReturnNewValue(nextRef) - 1; ref < nRefs; ref = InterlockedIncrementAndReturnNewValue(nextRef) - 1) {
+        for (int i = 1; i < nSegments; i++) {
+            BAMIndexSupplier::AppendSegment(&segmentRefs[0][ref], &segmentRefs[i][ref], relocations[i], extraBin);
+        }
+    }
+}
+
+    void
+BAMSegmentedOutput::finish(
+    const char* outputFileName,
+    int i_nSegments,
+    char** segmentFileNames)
+{
+    _ASSERT(i_nSegments == nSegments);
+    BgzfRelocation* relocations = new BgzfRelocation[nSegments];
+    BgzfDuplicatePatchVector* patches = new BgzfDuplicatePatchVector[nSegments];
+    if (partitions != NULL) {
+        matchSecondMates(patches);
+    }
+
+    FILE* output = fopen(outputFileName, "ab");
+    if (output == NULL) {
+        WriteErrorMessage("BAMSegmentedOutput: unable to open %s to append segments\n", outputFileName);
+        soft_exit(1);
+    }
+
+    const size_t copyBufferSize = 16 * 1024 * 1024;
+    char* copyBuffer = (char*)BigAlloc(copyBufferSize);
+    _uint64 outputSize = QueryFileSize(outputFileName);
+    for (int i = 1; i < nSegments; i++) {
+        relocations[i].setBase(outputSize);
+        FILE* input = fopen(segmentFileNames[i], "rb");
+        if (input == NULL) {
+            WriteErrorMessage("BAMSegmentedOutput: unable to open segment %s\n", segmentFileNames[i]);
+            soft_exit(1);
+        }
+        outputSize += CopySegment(input, output, outputFileName, &patches[i], &relocations[i], copyBuffer, copyBufferSize);
+        fclose(input);
+    }
+    BigDealloc(copyBuffer);
+    delete[] patches;
+
+    if (fwrite(GzipWriterFilterSupplier::BamEofMarker, 1, sizeof(GzipWriterFilterSupplier::BamEofMarker), output) != sizeof(GzipWriterFilterSupplier::BamEofMarker) ||
+            fclose(output) != 0) {
+        WriteErrorMessage("BAMSegmentedOutput: write to %s failed\n", outputFileName);
+        soft_exit(1);
+    }
+
+    if (indexFileName != NULL) {
+        //
+        // Each segment indexed its own reads as it was merged, so what's left is putting them together, which is done a
+        // reference at a time on all the threads.
+        //
+        BamIndexAppendContext context;
+        context.totalThreads = __max(1, __min(numThreads, genome->getNumContigs()));
+        context.bindToProcessors = false;
+        context.segmentRefs = segmentRefs;
+        context.relocations = relocations;
+        context.nSegments = nSegments;
+        context.nRefs = genome->getNumContigs();
+        context.extraBin = binning.extraBin();
+        volatile int nextRef = 0;
+        context.nextRef = &nextRef;
+        ParallelTask<BamIndexAppendContext> task(&context);
+        task.run();
+
+        BAMIndexSupplier::RefInfo* refs = segmentRefs[0];
+        for (int i = 1; i < nSegments; i++) {
+            delete[] segmentRefs[i];
+            segmentRefs[i] = NULL;
+        }
+        BAMIndexSupplier::WriteIndex(indexFileName, genome, binning, refs);
+        delete[] refs;
+        segmentRefs[0] = NULL;
+    }
+
+    delete[] relocations;
+}
+
+    void
+BAMSegmentedOutput::matchSecondMates(
+    BgzfDuplicatePatchVector* patches)
+{
+    DuplicateMateMap firstMates;
+    _int64 nPatches = 0;
+    for (int i = 0; i < nSegments; i++) {
+        //
+        // A read can be marked again by an overlapping run, and the last time is what was written.
+        //
+        VariableSizeVector<BamDupMarkSecondMate>* secondMates = &partitions[i].secondMates;
+        std::stable_sort(secondMates->begin(), secondMates->end());
+        for (_int64 j = 0; j < secondMates->size(); j++) {
+            BamDupMarkSecondMate* mate = &(*secondMates)[j];
+            if (j + 1 < secondMates->size() && (*secondMates)[j + 1].offset == mate->offset) {
+                continue;
+            }
+            DuplicateMateInfo* first = firstMates.tryFind(mate->key);
+            if (first == NULL) {
+                continue;   // the pair wasn't a duplicate in the first mates' range either
+            }
+            bool isDuplicate = !readIdsMatch(first->getBestReadId(), mate->readId, mate->readIdLength);
+            if (isDuplicate != mate->isDuplicate) {
+                patches[i].push_back(BgzfDuplicatePatch(mate->offset, isDuplicate));
+                nPatches++;
+            }
+        }
+        secondMates->clear();
+
+        VariableSizeVector<pair<DuplicateReadKey, DuplicateMateInfo> >* left = &partitions[i].firstMates;
+        for (_int64 j = 0; j < left->size(); j++) {
+            DuplicateMateInfo* value;
+            firstMates.tryAdd((*left)[j].first, (*left)[j].second, &value);
+        }
+        left->clear();
+    }
+
+    if (nPatches > 0) {
+        WriteStatusMessage("changed duplicate marking of %lld mates to agree with mates sorted into another range\n", nPatches);
+    }
+}
+
+    _uint64
+BAMSegmentedOutput::CopySegment(
+    FILE* input,
+    FILE* output,
+    const char* outputFileName,
+    BgzfDuplicatePatchVector* patches,
+    BgzfRelocation* relocation,
+    char* copyBuffer,
+    size_t copyBufferSize)
+{
+    _uint64 inputOffset = 0, written = 0;
+    char* block = NULL;
+    char* data = NULL;
+    char* recompressed = NULL;
+    DeflateBackend* deflater = NULL;
+    const size_t recompressedSize = 2 * BAM_BLOCK;
+
+    for (_int64 p = 0; ; ) {
+        //
+        // Copy through to the next block that needs a patch, or the end.
+        //
+        _uint64 copyEnd = p < patches->size() ? (*patches)[p].offset >> 16 : UINT64_MAX;
+        while (inputOffset < copyEnd) {
+            size_t bytes = fread(copyBuffer, 1, (size_t)__min((_uint64)copyBufferSize, copyEnd - inputOffset), input);
+            if (bytes == 0) {
+                break;
+            }
+            if (fwrite(copyBuffer, 1, bytes, output) != bytes) {
+                WriteErrorMessage("BAMSegmentedOutput: write to %s failed\n", outputFileName);
+                soft_exit(1);
+            }
+            inputOffset += bytes;
+            written += bytes;
+        }
+        if (p >= patches->size()) {
+            break;
+        }
+        if (inputOffset != copyEnd) {
+            WriteErrorMessage("BAMSegmentedOutput: segment ended before a duplicate marking patch\n");
+            soft_exit(1);
+        }
+
+        if (block == NULL) {
+            block = (char*)BigAlloc(BAM_BLOCK);
+            data = (char*)BigAlloc(BAM_BLOCK);
+            recompressed = (char*)BigAlloc(recompressedSize);
+            deflater = DeflateBackend::create(BAM_BLOCK);
+        }
+
+        //
+        // Inflate the block, change the bits and, if any changed, compress it again.
+        //
+        const size_t headerSize = 18;   // with just the BC extra field, as BGZF blocks written here have
+        BgzfHeader* header = (BgzfHeader*)block;
+        if (fread(block, 1, headerSize, input) != headerSize || header->XLEN != 6) {
+            WriteErrorMessage("BAMSegmentedOutput: bad BGZF block in segment\n");
+            soft_exit(1);
+        }
+        size_t blockSize = header->BSIZE() + 1;
+        if (blockSize <= headerSize + 8 || fread(block + headerSize, 1, blockSize - headerSize, input) != blockSize - headerSize) {
+            WriteErrorMessage("BAMSegmentedOutput: bad BGZF block in segment\n");
+            soft_exit(1);
+        }
+        _uint32 dataSize = header->ISIZE();
+
+        z_stream zstream;
+        memset(&zstream, 0, sizeof(zstream));
+        zstream.next_in = (Bytef*)block + headerSize;
+        zstream.avail_in = (uInt)(blockSize - headerSize - 8);
+        zstream.next_out = (Bytef*)data;
+        zstream.avail_out = BAM_BLOCK;
+        if (inflateInit2(&zstream, -15) != Z_OK || inflate(&zstream, Z_FINISH) != Z_STREAM_END || zstream.total_out != dataSize) {
+            WriteErrorMessage("BAMSegmentedOutput: unable to inflate BGZF block in segment\n");
+            soft_exit(1);
+        }
+        inflateEnd(&zstream);
+
+        bool changed = false;
+        for (; p < patches->size() && ((*patches)[p].offset >> 16) == inputOffset; p++) {
+            _uint32 within = (_uint32)((*patches)[p].offset & 0xffff);
+            if (within >= dataSize) {
+                WriteErrorMessage("BAMSegmentedOutput: duplicate marking patch is outside its block\n");
+                soft_exit(1);
+            }
+            _uint8 old = (_uint8)data[within];
+            _uint8 bit = SAM_DUPLICATE >> 8;
+            data[within] = (char)((*patches)[p].isDuplicate ? old | bit : old & ~bit);
+            changed |= (_uint8)data[within] != old;
+        }
+
+        char* out = block;
+        size_t outSize = blockSize;
+        if (changed) {
+            out = recompressed;
+            outSize = deflater->compressChunk(true, recompressed, recompressedSize, data, dataSize);
+            relocation->addRewrite(inputOffset, (_int64)outSize - (_int64)blockSize);
+        }
+        if (fwrite(out, 1, outSize, output) != outSize) {
+            WriteErrorMessage("BAMSegmentedOutput: write to %s failed\n", outputFileName);
+            soft_exit(1);
+        }
+        inputOffset += blockSize;
+        written += outSize;
+    }
+
+    if (block != NULL) {
+        BigDealloc(block);
+        BigDealloc(data);
+        BigDealloc(recompressed);
+        delete deflater;
+    }
+    return written;
+}
+
+    SegmentedOutputSupplier*
+DataWriterSupplier::bamSegments(
+    const char* indexFileName,
+    int csiMinShift,
+    int csiDepth,
+    const Genome* genome,
+    int numThreads,
+    bool bindToProcessors,
+    bool emitInternalScore,
+    char* internalScoreTag,
+    bool markDuplicates)
+{
+    return new BAMSegmentedOutput(indexFileName, genome, BamIndexBinning(csiMinShift, csiDepth), numThreads, bindToProcessors, emitInternalScore,
+        internalScoreTag, markDuplicates);
+}
+
+//
+// Duplicate marking for unsorted output.  The aligner threads work out each read's duplicate signature as they write it, with
+// the same keys as sorted marking (library, unclipped 5' ends and orientations of both mates), and keep the best read of each
+// signature in a table they share.  Once the file is written, the reads that lost are patched to have SAM_DUPLICATE set.
+//
+
+//
+// The best read with a signature.  The reads don't come in a repeatable order the way they do when sorted, so a tie on quality
+// and tile/x/y goes to the smaller hash of the read name, which both mates of a pair have.
+//
+struct BamSignatureGroup
+{
+    BamSignatureGroup() : quality(INT_MIN), tile(0), x(0), y(0), nameHash(0), isMateMapped(false) {}
+
+    bool isBetter(int i_quality, int i_tile, int i_x, int i_y, _uint32 i_nameHash) const
+    {
+        if (i_quality != quality) {
+            return i_quality > quality;
+        }
+        if (i_tile != tile) {
+            return i_tile < tile;
+        }
+        if (i_x != x) {
+            return i_x < x;
+        }
+        if (i_y != y) {
+            return i_y < y;
+        }
+        return i_nameHash < nameHash;
+    }
+
+    void setBest(int i_quality, int i_tile, int i_x, int i_y, _uint32 i_nameHash)
+    { quality = i_quality; tile = i_tile; x = i_x; y = i_y; nameHash = i_nameHash; }
+
+    int quality;
+    int tile;
+    int x;
+    int y;
+    _uint32 nameHash;
+    bool isMateMapped;  // for fragments, that a read with a mapped mate has the signature, which wins over any fragment
+};
+
+//
+// Signatures to their groups, split into shards with a lock each so the aligner threads seldom wait for each other.  A group is
+// named by its index times NumShards plus its shard, which stays good as the shard grows.
+//
+template<class Key> class BamSignatureTable
+{
+public:
+    static const int NumShards = 64;
+
+    BamSignatureTable()
+    {
+        for (int i = 0; i < NumShards; i++) {
+            InitializeExclusiveLock(&shards[i].lock);
+        }
+    }
+
+    ~BamSignatureTable()
+    {
+        for (int i = 0; i < NumShards; i++) {
+            DestroyExclusiveLock(&shards[i].lock);
+        }
+    }
+
+    //
+    // Counts a read with the key as a candidate for best, unless it's already marked as a duplicate.  mateMapped is only
+    // for fragments.  Returns the group.
+    //
+    _uint64 add(Key key, bool candidate, bool mateMapped, int quality, int tile, int x, int y, _uint32 nameHash)
+    {
+        _uint64 hash = ((_uint64)key ^ key.libraryHash) * 0x9e3779b97f4a7c15;
+        int shardIndex = (int)(hash >> 58);
+        Shard* shard = &shards[shardIndex];
+
+        AcquireExclusiveLock(&shard->lock);
+        _uint32* index;
+        if (shard->keys.tryAdd(key, (_uint32)shard->groups.size(), &index)) {
+            shard->groups.push_back(BamSignatureGroup());
+        }
+        BamSignatureGroup* group = &shard->groups[*index];
+        if (candidate) {
+            if (mateMapped && !group->isMateMapped) {
+                group->isMateMapped = true;
+                group->setBest(quality, tile, x, y, nameHash);
+            } else if (mateMapped == group->isMateMapped && group->isBetter(quality, tile, x, y, nameHash)) {
+                group->setBest(quality, tile, x, y, nameHash);
+            }
+        }
+        _uint64 result = (_uint64)*index * NumShards + shardIndex;
+        ReleaseExclusiveLock(&shard->lock);
+        return result;
+    }
+
+    // only once the aligner threads are done
+    const BamSignatureGroup& getGroup(_uint64 group) const
+    { return shards[group % NumShards].groups[group / NumShards]; }
+
+private:
+    struct Shard
+    {
+        ExclusiveLock lock;
+        VariableSizeMap<Key, _uint32, 150, MapNumericHash<Key>, 70, 0, -2> keys;
+        VariableSizeVector<BamSignatureGroup> groups;
+    };
+
+    Shard shards[NumShards];
+};
+
+//
+// A read that may be a duplicate.  Its place in the file is the logical offset of the FLAG byte with SAM_DUPLICATE in it
+// within the batch it was written in, and where that batch's compressed data starts, which the filter only finds out once
+// the batch is placed.
+//
+struct BamSignatureRead
+{
+    bool operator<(const BamSignatureRead& b) const
+    { return batch < b.batch || (batch == b.batch && within < b.within); }
+
+    _uint64 batch;
+    _uint64 group;      // times two, plus one for a fragment
+    _uint32 within;
+    _uint32 nameHash;
+};
+
+class BAMUnsortedDupMarkSupplier;
+
+class BAMUnsortedDupMarkFilter : public BAMFilter
+{
+public:
+    BAMUnsortedDupMarkFilter(BAMUnsortedDupMarkSupplier* i_supplier) :
+        BAMFilter(DataWriter::ReadFilter), supplier(i_supplier) {}
+
+    ~BAMUnsortedDupMarkFilter();
+
+    virtual void onBatchPlaced(size_t fileOffset, size_t bytes);
+
+protected:
+    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
+
+private:
+    BAMUnsortedDupMarkSupplier* supplier;
+    VariableSizeVector<BamSignatureRead> pending;   // in the batch that's being written
+    VariableSizeVector<BamSignatureRead> reads;
+};
+
+class BAMUnsortedDupMarkSupplier : public DataWriter::FilterSupplier
+{
+public:
+    BAMUnsortedDupMarkSupplier(const Genome* i_genome, const char* i_fileName) :
+        FilterSupplier(DataWriter::ReadFilter), genome(i_genome), fileName(i_fileName)
+    {
+        InitializeExclusiveLock(&lock);
+    }
+
+    virtual ~BAMUnsortedDupMarkSupplier()
+    {
+        DestroyExclusiveLock(&lock);
+    }
+
+    virtual DataWriter::Filter* getFilter()
+    { return new BAMUnsortedDupMarkFilter(this); }
+
+    virtual void onClosing(DataWriterSupplier* supplier) {}
+
+    // the final pass, when the file is complete
+    virtual void onClosed(DataWriterSupplier* supplier);
+
+private:
+    friend class BAMUnsortedDupMarkFilter;
+
+    void addReads(VariableSizeVector<BamSignatureRead>* more)
+    {
+        AcquireExclusiveLock(&lock);
+        reads.append(more);
+        ReleaseExclusiveLock(&lock);
+    }
+
+    // Changes the reads' places to virtual offsets in patches, given the reads are sorted
+    void findBlocks(VariableSizeVector<BamSignatureRead>* duplicates, BgzfDuplicatePatchVector* patches);
+
+    const Genome* genome;
+    const char* fileName;
+    BamSignatureTable<DuplicateReadKey> pairs;
+    BamSignatureTable<DuplicateFragmentKey> fragments;
+    ExclusiveLock lock;
+    VariableSizeVector<BamSignatureRead> reads;
+};
+
+BAMUnsortedDupMarkFilter::~BAMUnsortedDupMarkFilter()
+{
+    supplier->addReads(&reads);
+}
+
+    void
+BAMUnsortedDupMarkFilter::onRead(
+    BAMAlignment* bam,
+    size_t fileOffset,
+    int batchIndex)
+{
+    //
+    // Secondary and supplementary alignments and unmapped reads aren't marked, as when sorted.
+    //
+    if ((bam->FLAG & (SAM_SECONDARY | SAM_SUPPLEMENTARY | SAM_UNMAPPED)) != 0) {
+        return;
+    }
+
+    _int32 mateQuality = -1;
+    size_t libraryHash = 0;
+    bool foundLibraryTag = false;
+    for (BAMAlignAux* aux = bam->firstAux(); aux != NULL && aux->isValidValType() && aux < bam->endAux(); aux = aux->next()) {
+        if (aux->tag[0] == 'Q' && aux->tag[1] == 'S' && aux->val_type == 'i') {
+            mateQuality = *(_int32*)aux->value();
+        }
+        if (!foundLibraryTag && aux->tag[0] == 'L' && aux->tag[1] == 'B' && aux->val_type == 'Z') {
+            foundLibraryTag = true;
+            libraryHash = BamDupMarkEntry::hash((char*)aux->value());
         }
-        info->intervals.push_back(fileOffset);
     }
+
+    bool candidate = (bam->FLAG & SAM_DUPLICATE) == 0;
+    bool mateMapped = (bam->FLAG & SAM_MULTI_SEGMENT) != 0 && (bam->FLAG & SAM_NEXT_UNMAPPED) == 0;
+    int quality = BAMDupMarkFilter::getTotalQuality(bam);
+    int tile, x, y;
+    BAMDupMarkFilter::getTileXY(bam->read_name(), &tile, &x, &y);
+
+    BamSignatureRead read;
+    read.nameHash = (_uint32)BamDupMarkEntry::hash(bam->read_name());
+    read.within = (_uint32)(fileOffset - currentOffset + offsetof(BAMAlignment, FLAG) + 1);   // little-endian, so SAM_DUPLICATE is in the high byte
+    read.batch = 0;
+
+    //
+    // A read with a mapped mate is decided with its pair, and also beats any fragment with its own signature.
+    //
+    _uint64 fragmentGroup = supplier->fragments.add(DuplicateFragmentKey(bam, supplier->genome, libraryHash), candidate, mateMapped,
+        mateMapped ? quality + mateQuality : quality, tile, x, y, read.nameHash);
+    if (mateMapped) {
+        read.group = 2 * supplier->pairs.add(DuplicateReadKey(bam, supplier->genome, libraryHash), candidate, false,
+            quality + mateQuality, tile, x, y, read.nameHash);
+    } else {
+        read.group = 2 * fragmentGroup + 1;
+    }
+    pending.push_back(read);
+}
+
+    void
+BAMUnsortedDupMarkFilter::onBatchPlaced(
+    size_t fileOffset,
+    size_t bytes)
+{
+    for (_int64 i = 0; i < pending.size(); i++) {
+        pending[i].batch = fileOffset;
+        reads.push_back(pending[i]);
+    }
+    pending.clear();
+}
+
+    void
+BAMUnsortedDupMarkSupplier::onClosed(
+    DataWriterSupplier* supplier)
+{
+    _int64 nDuplicates = 0;
+    for (_int64 i = 0; i < reads.size(); i++) {
+        const BamSignatureGroup& group = (reads[i].group & 1) ? fragments.getGroup(reads[i].group / 2) : pairs.getGroup(reads[i].group / 2);
+        if (group.nameHash != reads[i].nameHash) {
+            reads[nDuplicates++] = reads[i];
+        }
+    }
+    reads.truncate(nDuplicates);
+    if (nDuplicates == 0) {
+        return;
+    }
+    std::sort(reads.begin(), reads.end());
+
+    BgzfDuplicatePatchVector patches;
+    findBlocks(&reads, &patches);
+    reads.clear();
+
+    //
+    // Copy the file with the patched blocks, and put the copy in its place.
+    //
+    size_t len = strlen(fileName);
+    char* tempFileName = new char[len + 5];
+    strcpy(tempFileName, fileName);
+    strcpy(tempFileName + len, ".dup");
+    FILE* input = fopen(fileName, "rb");
+    FILE* output = fopen(tempFileName, "wb");
+    if (input == NULL || output == NULL) {
+        WriteErrorMessage("BAMUnsortedDupMarkSupplier: unable to open %s and %s to mark duplicates\n", fileName, tempFileName);
+        soft_exit(1);
+    }
+    const size_t copyBufferSize = 16 * 1024 * 1024;
+    char* copyBuffer = (char*)BigAlloc(copyBufferSize);
+    BgzfRelocation relocation;  // there's no index to move
+    BAMSegmentedOutput::CopySegment(input, output, tempFileName, &patches, &relocation, copyBuffer, copyBufferSize);
+    BigDealloc(copyBuffer);
+    fclose(input);
+    if (fclose(output) != 0) {
+        WriteErrorMessage("BAMUnsortedDupMarkSupplier: write to %s failed\n", tempFileName);
+        soft_exit(1);
+    }
+    if (!DeleteSingleFile(fileName) || !MoveSingleFile(tempFileName, fileName)) {
+        WriteErrorMessage("BAMUnsortedDupMarkSupplier: unable to replace %s with %s\n", fileName, tempFileName);
+        soft_exit(1);
+    }
+    delete[] tempFileName;
+
+    WriteStatusMessage("marked %lld reads as duplicates in the unsorted output\n", nDuplicates);
+}
+
+    void
+BAMUnsortedDupMarkSupplier::findBlocks(
+    VariableSizeVector<BamSignatureRead>* duplicates,
+    BgzfDuplicatePatchVector* patches)
+{
+    FILE* input = fopen(fileName, "rb");
+    if (input == NULL) {
+        WriteErrorMessage("BAMUnsortedDupMarkSupplier: unable to open %s to mark duplicates\n", fileName);
+        soft_exit(1);
+    }
+
+    //
+    // Walk the BGZF blocks of each batch from its start to the one with the read, just reading their headers and sizes.
+    //
+    _uint64 batch = UINT64_MAX, block = 0, blockSize = 0, blockStart = 0, blockEnd = 0;
+    for (_int64 i = 0; i < duplicates->size(); i++) {
+        const BamSignatureRead& read = (*duplicates)[i];
+        if (read.batch != batch) {
+            batch = block = read.batch;
+            blockSize = blockStart = blockEnd = 0;
+        }
+        while (read.within >= blockEnd) {
+            block += blockSize;
+            blockStart = blockEnd;
+            const size_t headerSize = 18;
+            char header[headerSize];
+            _uint32 isize;
+            if (_fseek64bit(input, block, SEEK_SET) != 0 || fread(header, 1, headerSize, input) != headerSize ||
+                    ((BgzfHeader*)header)->XLEN != 6 || (blockSize = ((BgzfHeader*)header)->BSIZE() + 1) <= headerSize + 8 ||
+                    _fseek64bit(input, block + blockSize - 4, SEEK_SET) != 0 || fread(&isize, 1, 4, input) != 4) {
+                WriteErrorMessage("BAMUnsortedDupMarkSupplier: bad BGZF block in %s\n", fileName);
+                soft_exit(1);
+            }
+            blockEnd = blockStart + isize;
+        }
+        patches->push_back(BgzfDuplicatePatch((block << 16) | (read.within - blockStart), true));
+    }
+    fclose(input);
+}
+
+    DataWriter::FilterSupplier*
+DataWriterSupplier::bamMarkUnsortedDuplicates(
+    const Genome* genome,
+    const char* fileName)
+{
+    return new BAMUnsortedDupMarkSupplier(genome, fileName);
 }
 
     bool
@@ -3463,8 +4827,9 @@ BgzfHeader::validate(
     size_t compressed,
     size_t uncompressed)
 {
+    // XFL isn't checked, since zlib sets it from the compression level
     return ID1 == 0x1f && ID2 == 0x8b && CM == 8 && FLG == 4 &&
-        MTIME == 0 && XFL == 0 && OS == 0 &&
+        MTIME == 0 && OS == 0 &&
         ISIZE() == uncompressed&&
         BSIZE() + 1 == compressed;
 }
@@ -149,6 +149,12 @@ struct BAMAlignment
     static void decodeQual(char* o_qual, char* quality, int bases);
     static void decodeSeqRC(char* o_sequence, const _uint8* nibbles, int bases);
     static void decodeQualRC(char* o_qual, char* quality, int bases);
+
+    // decode this record's bases & qualities in one pass, reverse complementing both if asked
+    void decodeSeqAndQual(char* o_sequence, char* o_qual, bool reverseComplement);
+
+    // set at startup if the CPU can run the vectorized (PSHUFB) decoders
+    static bool UseSimdDecode;
     static bool decodeCigar(char* o_cigar, int cigarSize, _uint32* cigar, int ops);
     static void getClippingFromCigar(_uint32 *cigar, int ops, unsigned *o_frontClipping, unsigned *o_backClipping, unsigned *o_frontHardClipping, unsigned *o_backHardClipping);
 
@@ -169,6 +175,8 @@ struct BAMAlignment
 
     /* calculate bin given an alignment covering [beg,end) (zero-based, half-close-half-open) */
     static int reg2bin(int beg, int end);
+    /* the same for a CSI index, whose windows are 2^minShift bases with depth levels above them (BAI is 14 and 5) */
+    static _uint32 reg2bin(_int64 beg, _int64 end, int minShift, int depth);
     /* calculate the list of bins that may overlap with region [beg,end) (zero-based) */
     static const int MAX_BIN = (((1<<18)-1)/7);
     static int reg2bins(int beg, int end, _uint16* list/*[MAX_BIN]*/);
@@ -468,6 +476,9 @@ protected:
                         GenomeLocation *genomeLocation, bool *isRC, unsigned *mapQ, 
                         size_t *lineLength, unsigned *flag, const char **cigar, ReadClippingType clipping);
 
+        // The reader for the uncompressed BAM stream (header and records) in the file.
+        virtual DataReader* createDataReader(const char* fileName, int bufferCount);
+
 private:
         void readHeader(const char* fileName);
 
@@ -76,7 +76,7 @@ BaseAligner::BaseAligner(
         genomeIndex(i_genomeIndex), maxHitsToConsider(i_maxHitsToConsider), maxK(i_maxK),
         maxReadSize(i_maxReadSize), maxSeedsToUseFromCommandLine(i_maxSeedsToUseFromCommandLine),
         maxSeedCoverage(i_maxSeedCoverage), readId(-1), extraSearchDepth(i_extraSearchDepth),
-        explorePopularSeeds(false), stopOnFirstHit(false), stats(i_stats), 
+        explorePopularSeeds(false), stopOnFirstHit(false), stats(i_stats), perfCounters(NULL),
         disabledOptimizations(i_disabledOptimizations),
 		useAffineGap(i_useAffineGap), matchReward(i_matchReward), subPenalty(i_subPenalty), 
         gapOpenPenalty(i_gapOpenPenalty), gapExtendPenalty(i_gapExtendPenalty),
@@ -448,6 +448,12 @@ Return Value:
     nSeedsApplied[FORWARD] = nSeedsApplied[RC] = 0;
     lvScoresAfterBestFound = 0;
 
+    //
+    // The whole seed loop counts as seed lookup, except for the calls to score() and affine gap it makes, which switch
+    // phases themselves.  Switching around each lookupSeed() call would cost two system calls per seed with -perf.
+    //
+    PerfPhaseScope seedLookupScope(perfCounters, PerfPhaseSeedLookup);
+
     while (nSeedsApplied[FORWARD] + nSeedsApplied[RC] < maxSeedsToUse) {
         //
         // Choose the next seed to use.  Choose the first one that isn't used
@@ -777,6 +783,8 @@ BaseAligner::scoreLocationWithAffineGap(
     int* agScore
 )
 {
+    PerfPhaseScope affineGapScope(perfCounters, PerfPhaseAffineGap);
+
     Read* readToScore = reads[direction];
     unsigned readDataLength = readToScore->getDataLength();
     GenomeDistance genomeDataLength = (GenomeDistance)readDataLength + MAX_K; // Leave extra space in case the read has deletions
@@ -959,6 +967,8 @@ Return Value:
 
 --*/
 {
+    PerfPhaseScope scoringScope(perfCounters);    // Not entered until we score a candidate, which many calls don't
+
 #if _DEBUG
     const size_t genomeLocationBufferSize = 200;
     char genomeLocationBuffer[genomeLocationBufferSize];
@@ -1125,6 +1135,8 @@ Return Value:
                 int agScore = -1;
                 int scoreGapless = -1;
 
+                scoringScope.enter(PerfPhaseScoring);
+
                 if (data != NULL) {
                     Read *readToScore = read[elementToScore->direction];
 
@@ -1204,6 +1216,7 @@ Return Value:
                             score1 = 0;  score2 = 0;  agScore1 = seedLen; agScore2 = 0;
                             usedAffineGapScoring = true;
                             nLocationsScoredWithAffineGap++;
+                            PerfPhaseScope affineGapScope(perfCounters, PerfPhaseAffineGap);
 
                             if (tailStart != readLen) {
                                 int patternLen = readLen - tailStart;
@@ -119,6 +119,8 @@ public:
 
     inline void setReadId(int readId_) {readId = readId_;}
 
+    inline void setPerfCounters(PerfCounters *perfCounters_) {perfCounters = perfCounters_;}
+
     const char *getName() const {return "Base Aligner";}
 
     inline bool checkedAllSeeds() {return popularSeedsSkipped == 0;}
@@ -472,6 +474,7 @@ private:
                               // maxK edit distance (useful when using SNAP for filtering only).
 
     AlignerStats *stats;
+    PerfCounters *perfCounters;     // Per-phase hardware counters, or NULL if we're not collecting them
 
     unsigned *hitCountByExtraSearchDepth;   // How many hits at each depth bigger than the current best edit distance.
                                             // So if the current best hit has edit distance 2, then hitCountByExtraSearchDepth[0] would
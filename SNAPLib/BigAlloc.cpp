@@ -28,6 +28,22 @@ Revision History:
 
 bool BigAllocUseHugePages = false;
 
+//
+// The kind of pages an allocation ended up on.  With -hp we try for the biggest pages that fit and fall back
+// until something works, so this records what we actually got.
+//
+enum BigAllocPageKind {OneGBPages, TwoMBPages, TransparentHugePages, SmallPages, NPageKinds};
+static const char *PageKindNames[NPageKinds] = {"1GB", "2MB", "THP", "4KB"};
+
+static volatile _int64 BytesByPageKind[NPageKinds];
+
+static void RecordPageKind(BigAllocPageKind pageKind, size_t bytes)
+{
+    InterlockedAdd64AndReturnNewValue(&BytesByPageKind[pageKind], (_int64)bytes);
+}
+
+static _int64 TransparentHugePageBytesInUse();
+
 
 #ifdef PROFILE_BIGALLOC
 
@@ -35,10 +51,15 @@ _int64 totalBigAllocated = 0;
 
 struct ProfileEntry
 {
-    ProfileEntry() : caller(NULL), total(0), count(0) {}
+    ProfileEntry() : caller(NULL), total(0), count(0) {
+        for (int i = 0; i < NPageKinds; i++) {
+            byPageKind[i] = 0;
+        }
+    }
     const char*   caller;
     size_t  total;
     size_t  count;
+    size_t  byPageKind[NPageKinds];
 };
 
 static const int MaxCallers = 1000;
@@ -52,10 +73,11 @@ static ProfileEntry LastPrintProfile;
 void *BigAllocInternal(
         size_t      sizeToAllocate,
         size_t      *sizeAllocated,
-        bool        reserveOnly = FALSE,
-        size_t      *pageSize = NULL);
+        bool        reserveOnly = false,
+        size_t      *pageSize = NULL,
+        BigAllocPageKind *pageKind = NULL);
 
-void RecordAllocProfile(size_t bytes, const char* caller, void *result)
+void RecordAllocProfile(size_t bytes, const char* caller, void *result, BigAllocPageKind pageKind)
 {
     static ExclusiveLock lock;
     //
@@ -75,7 +97,7 @@ void RecordAllocProfile(size_t bytes, const char* caller, void *result)
         }
         else {
             while (!lockIsInitialized) {
-                Sleep(100);
+                SleepForMillis(100);
             }
         }
     }
@@ -101,13 +123,15 @@ void RecordAllocProfile(size_t bytes, const char* caller, void *result)
         if (LastCaller < MaxCallers) {
             AllocProfile[LastCaller].count++;
             AllocProfile[LastCaller].total += bytes;
+            AllocProfile[LastCaller].byPageKind[pageKind] += bytes;
         }
     }
     ProfileTotal.count++;
     ProfileTotal.total += bytes;
+    ProfileTotal.byPageKind[pageKind] += bytes;
     InterlockedAdd64AndReturnNewValue(&totalBigAllocated, (_int64)bytes);
     if (ProfileTotal.count - LastPrintProfile.count >= 1000 || ProfileTotal.total - LastPrintProfile.total >= ((size_t)1 << 30) || true) {
-        fprintf(stderr, "BigAlloc(%lld)->0x%llx: BigAllocProfile %lld allocs, %lld total; caller %s total allocated %lld\n", bytes, result, ProfileTotal.count, ProfileTotal.total, caller ? caller : "?", totalBigAllocated);
+        fprintf(stderr, "BigAlloc(%lld)->0x%llx on %s pages: BigAllocProfile %lld allocs, %lld total; caller %s total allocated %lld\n", bytes, result, PageKindNames[pageKind], ProfileTotal.count, ProfileTotal.total, caller ? caller : "?", totalBigAllocated);
         LastPrintProfile = ProfileTotal;
     }
     ReleaseExclusiveLock(&lock);
@@ -118,8 +142,9 @@ void *BigAllocProfile(
         size_t      *sizeAllocated,
         const char  *caller)
 {
-    void* result = BigAllocInternal(sizeToAllocate, sizeAllocated);
-    RecordAllocProfile(sizeToAllocate, caller, result);
+    BigAllocPageKind pageKind;
+    void* result = BigAllocInternal(sizeToAllocate, sizeAllocated, false, NULL, &pageKind);
+    RecordAllocProfile(sizeToAllocate, caller, result, pageKind);
     return result;
 }
 
@@ -197,7 +222,8 @@ void *BigAllocInternal(
         size_t      sizeToAllocate,
         size_t      *sizeAllocated,
         bool        reserveOnly,
-        size_t      *pageSize)
+        size_t      *pageSize,
+        BigAllocPageKind *pageKind)
 /*++
 
 Routine Description:
@@ -214,6 +240,7 @@ Arguments:
                           will always be >= sizeToAllocate (unless the allocation fails).
     reserveOnly         - If TRUE, will only reserve address space, must call BigCommit to commit memory
     pageSize            - Optional parameter that if provided returns the page size (not large page size)
+    pageKind            - Optional parameter that if provided returns the kind of pages the memory ended up on
 
 Return Value:
 
@@ -276,6 +303,11 @@ Return Value:
             if (NULL != sizeAllocated) {
                 *sizeAllocated = largePageSizeToAllocate;
             }
+            BigAllocPageKind kind = (BigAllocUseHugePages && !reserveOnly) ? TwoMBPages : SmallPages;
+            if (NULL != pageKind) {
+                *pageKind = kind;
+            }
+            RecordPageKind(kind, largePageSizeToAllocate);
             return allocatedMemory;
         } else if (!warningPrinted) {
             //
@@ -309,10 +341,20 @@ Return Value:
         soft_exit(1);
     }
 
+    if (NULL != pageKind) {
+        *pageKind = SmallPages;
+    }
+    RecordPageKind(SmallPages, virtualAllocSize);
+
     return allocatedMemory;
 
 }
 
+static _int64 TransparentHugePageBytesInUse()
+{
+    return -1;  // Windows has no transparent huge pages
+}
+
 
 void BigDeallocInternal(void *memory)
 /*++
@@ -351,7 +393,7 @@ void* BigAlloc(
     size_t      sizeToAllocate,
     size_t* sizeAllocated)
 {
-    return BigAllocInternal(sizeToAllocate, sizeAllocated, FALSE, NULL);
+    return BigAllocInternal(sizeToAllocate, sizeAllocated, FALSE, NULL, NULL);
 }
 
 void BigDealloc(void* memory) {
@@ -378,8 +420,9 @@ void *BigReserveProfile(
     char buffer[1000];
     strncpy(buffer, caller, sizeof(buffer));
     strncat(buffer, "(RESERVE)", sizeof(buffer));
-    void *result =  BigAllocInternal(sizeToReserve, sizeReserved, TRUE, pageSize);
-    RecordAllocProfile(sizeToReserve, buffer, result);
+    BigAllocPageKind pageKind;
+    void *result =  BigAllocInternal(sizeToReserve, sizeReserved, TRUE, pageSize, &pageKind);
+    RecordAllocProfile(sizeToReserve, buffer, result, pageKind);
     return result;
 }
 
@@ -395,7 +438,7 @@ bool BigCommitProfile(
     if (allocatedMemory == NULL) {
         WriteErrorMessage("BigCommit VirtualAlloc failed with error 0x%x\n", GetLastError());
     }
-    RecordAllocProfile(sizeToCommit, buffer, allocatedMemory);
+    RecordAllocProfile(sizeToCommit, buffer, allocatedMemory, SmallPages);    // Committing reserved memory never gets large pages
 
     return allocatedMemory != NULL;
 }
@@ -405,7 +448,7 @@ void *BigReserve(
         size_t      *sizeReserved,
         size_t      *pageSize)
 {
-    return BigAllocInternal(sizeToReserve, sizeReserved, TRUE, pageSize);
+    return BigAllocInternal(sizeToReserve, sizeReserved, TRUE, pageSize, NULL);
 }
 
 bool BigCommit(
@@ -423,13 +466,47 @@ bool BigCommit(
 
 #else /* no _MSC_VER */
 
-#ifdef PROFILE_BIGALLOC
-void *BigAllocInternal(
-#else
-void *BigAlloc(
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT  26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB    (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB    (30 << MAP_HUGE_SHIFT)
 #endif
+
+//
+// Try for an explicit hugetlb mapping with the given page size.  These come out of the pools set up in /sys/kernel/mm/hugepages
+// (1GB pages generally need hugepagesz=1G on the kernel command line), and mmap fails right away if the pool doesn't have enough
+// free pages, so trying is cheap.  Returns NULL if it didn't work, otherwise updates sizeToAllocate to the rounded-up size.
+//
+static char *MapHugeTLB(size_t *sizeToAllocate, size_t hugePageSize, int hugePageFlag)
+{
+#ifdef MAP_HUGETLB
+    size_t roundedSize = ((*sizeToAllocate + hugePageSize - 1) / hugePageSize) * hugePageSize;
+    if (roundedSize - *sizeToAllocate > *sizeToAllocate / 8) {
+        return NULL;    // Not worth wasting that much of the pool on the last page
+    }
+
+    char *mem = (char *)mmap(NULL, roundedSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|hugePageFlag, -1, 0);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+
+    *sizeToAllocate = roundedSize;
+    return mem;
+#else   // MAP_HUGETLB
+    return NULL;
+#endif  // MAP_HUGETLB
+}
+
+void *BigAllocInternal(
         size_t      sizeToAllocate,
-        size_t      *sizeAllocated)
+        size_t      *sizeAllocated,
+        bool        reserveOnly,
+        size_t      *pageSize,
+        BigAllocPageKind *pageKind)
 {
     // Make space to include the allocated size at the start of our region; this is necessary
     // so that we can BigDealloc the memory later.
@@ -439,39 +516,71 @@ void *BigAlloc(
     if (sizeToAllocate % ALIGN_SIZE != 0) {
         sizeToAllocate += ALIGN_SIZE - (sizeToAllocate % ALIGN_SIZE);
     }
-    if (sizeAllocated != NULL) {
-      *sizeAllocated = sizeToAllocate - sizeof(size_t);
+    if (pageSize != NULL) {
+        *pageSize = ALIGN_SIZE;
     }
 
-    int flags = MAP_PRIVATE|MAP_ANONYMOUS;
-#ifdef USE_HUGETLB
-    flags |= MAP_HUGETLB;
-#endif
-    char *mem = (char *) mmap(NULL, sizeToAllocate, PROT_READ|PROT_WRITE, flags, -1, 0);
-    if (mem == MAP_FAILED) {
-        perror("mmap");
-        soft_exit(1);
+    //
+    // With huge pages on, try 1GB hugetlb pages, then 2MB hugetlb pages, then transparent huge pages and finally
+    // just take ordinary pages.  Like the Windows large page path, skip hugetlb for reservations: those pages are
+    // pinned as soon as they're mapped, and reserved memory may never be touched.
+    //
+    const size_t OneGB = (size_t)1 << 30;
+    const size_t TwoMB = (size_t)2 << 20;
+    char *mem = NULL;
+    BigAllocPageKind kind = SmallPages;
+
+    if (BigAllocUseHugePages && !reserveOnly) {
+        if (sizeToAllocate >= OneGB) {
+            mem = MapHugeTLB(&sizeToAllocate, OneGB, MAP_HUGE_1GB);
+            kind = OneGBPages;
+        }
+        if (mem == NULL && sizeToAllocate >= TwoMB) {
+            mem = MapHugeTLB(&sizeToAllocate, TwoMB, MAP_HUGE_2MB);
+            kind = TwoMBPages;
+        }
     }
 
-#if (defined(MADV_HUGEPAGE) && !defined(USE_HUGETLB))
-    // Tell Linux to use huge pages for this range
-    if (BigAllocUseHugePages) {
-        if (madvise(mem, sizeToAllocate, MADV_HUGEPAGE) == -1) {
-            WriteErrorMessage("WARNING: failed to enable huge pages -- your kernel may not support it\n"); 
+    if (mem == NULL) {
+        kind = SmallPages;
+        mem = (char *) mmap(NULL, sizeToAllocate, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            perror("mmap");
+            soft_exit(1);
+        }
+
+#ifdef MADV_HUGEPAGE
+        if (BigAllocUseHugePages) {
+            if (madvise(mem, sizeToAllocate, MADV_HUGEPAGE) == 0) {
+                kind = TransparentHugePages;
+            } else {
+                static bool warningPrinted = false;
+                if (!warningPrinted) {
+                    warningPrinted = true;
+                    WriteErrorMessage("WARNING: failed to enable huge pages -- your kernel may not support it\n");
+                }
+            }
         }
+#endif  // MADV_HUGEPAGE
     }
-#endif
+
+    if (sizeAllocated != NULL) {
+      *sizeAllocated = sizeToAllocate - sizeof(size_t);
+    }
+    if (pageKind != NULL) {
+        *pageKind = kind;
+    }
+    RecordPageKind(kind, sizeToAllocate);
 
     // Remember the size allocated in the first sizeof(size_t) bytes
     *((size_t *) mem) = sizeToAllocate;
     return (void *) (mem + sizeof(size_t));
 }
 
-
-void BigDealloc(void *memory)
+void BigDeallocInternal(void *memory)
 {
     if (NULL == memory) return;
-    // Figure out the size we had allocated
+    // Figure out the size we had allocated.  For hugetlb mappings this is already a multiple of the huge page size, which munmap requires.
     char *startAddress = ((char *) memory) - sizeof(size_t);
     size_t sizeAllocated = *((size_t *) startAddress);
     if (munmap(startAddress, sizeAllocated) != 0) {
@@ -480,20 +589,81 @@ void BigDealloc(void *memory)
     }
 }
 
+//
+// How much anonymous memory the kernel has actually backed with transparent huge pages, from /proc/self/smaps_rollup.
+// Returns -1 if that isn't available (it's new in Linux 4.14).
+//
+static _int64 TransparentHugePageBytesInUse()
+{
+    FILE *smaps = fopen("/proc/self/smaps_rollup", "r");
+    if (NULL == smaps) {
+        return -1;
+    }
+
+    _int64 kb = -1;
+    char line[256];
+    while (NULL != fgets(line, sizeof(line), smaps)) {
+        if (1 == sscanf(line, "AnonHugePages: %lld kB", &kb)) {
+            break;
+        }
+    }
+    fclose(smaps);
+
+    return kb < 0 ? -1 : kb * 1024;
+}
+
+#ifdef PROFILE_BIGALLOC
+void BigDeallocProfile(void* memory, const char* caller)
+{
+    if (NULL == memory) return;
+
+    fprintf(stderr, "BigDealloc(0x%llx) %s\n", memory, caller);
+
+    BigDeallocInternal(memory);
+}
+
+void *BigReserveProfile(
+    size_t      sizeToReserve,
+    size_t      *sizeReserved,
+    size_t      *pageSize,
+    const char* caller)
+{
+    char buffer[1000];
+    strncpy(buffer, caller, sizeof(buffer));
+    strncat(buffer, "(RESERVE)", sizeof(buffer));
+    BigAllocPageKind pageKind;
+    void *result =  BigAllocInternal(sizeToReserve, sizeReserved, true, pageSize, &pageKind);
+    RecordAllocProfile(sizeToReserve, buffer, result, pageKind);
+    return result;
+}
+
+bool BigCommitProfile(
+    void        *memoryToCommit,
+    size_t      sizeToCommit,
+    const char* caller)
+{
+    return true;    // Reserved memory is already mapped and gets faulted in on demand, so there's nothing new to record
+}
+#else   // PROFILE_BIGALLOC
+void *BigAlloc(
+        size_t      sizeToAllocate,
+        size_t      *sizeAllocated)
+{
+    return BigAllocInternal(sizeToAllocate, sizeAllocated, false, NULL, NULL);
+}
+
+void BigDealloc(void *memory)
+{
+    BigDeallocInternal(memory);
+}
+
 void *BigReserve(
         size_t      sizeToReserve,
         size_t      *sizeReserved,
         size_t      *pageSize)
 {
     // TODO: use actual reserve/commit API; this is a temporary hack
-    if (pageSize != NULL) {
-        *pageSize = 4096;
-    }
-#ifdef PROFILE_BIGALLOC
-    return BigAllocInternal(sizeToReserve, sizeReserved);
-#else
-    return BigAlloc(sizeToReserve, sizeReserved);
-#endif
+    return BigAllocInternal(sizeToReserve, sizeReserved, true, pageSize, NULL);
 }
 
 bool BigCommit(
@@ -503,8 +673,7 @@ bool BigCommit(
     // TODO: use actual reserve/commit API; this is a temporary hack
     return true;
 }
-
-
+#endif  // PROFILE_BIGALLOC
 
 #endif /* _MSC_VER */
 
@@ -609,17 +778,116 @@ CountingBigAllocator::~CountingBigAllocator()
     }
 }
 
+ArenaAllocator::ArenaAllocator(size_t i_reservation) : 
+    top(0), committed(0), lastAllocation(NULL), spills(NULL), hits(0), misses(0), grownInPlace(0), resets(0)
+{
+    basePointer = (char *)BigReserve2(i_reservation, &reservation);
+}
+
+ArenaAllocator::~ArenaAllocator()
+{
+    reset();
+    BigDealloc(basePointer);
+}
+
+    bool
+ArenaAllocator::commitThrough(size_t newTop)
+{
+    if (newTop > reservation) {
+        return false;
+    }
+
+    if (newTop > committed) {
+        size_t newCommitted = __min(reservation, ((newTop + commitGranularity - 1) / commitGranularity) * commitGranularity);
+        if (!BigCommit(basePointer + committed, newCommitted - committed)) {
+            return false;
+        }
+        committed = newCommitted;
+    }
+
+    return true;
+}
+
+    void *
+ArenaAllocator::allocate(size_t amountToAllocate)
+{
+    size_t start = top + (allocationGranularity - (size_t)(basePointer + top) % allocationGranularity) % allocationGranularity;
+
+    if (commitThrough(start + amountToAllocate)) {
+        hits++;
+        top = start + amountToAllocate;
+        lastAllocation = basePointer + start;
+        return lastAllocation;
+    }
+
+    misses++;
+    Spill *spill = (Spill *)BigAlloc(sizeof(Spill) + amountToAllocate);
+    spill->next = spills;
+    spills = spill;
+
+    return spill + 1;
+}
+
+    void *
+ArenaAllocator::grow(void *memory, size_t oldSize, size_t newSize)
+{
+    if (newSize <= oldSize) {
+        return memory;
+    }
+
+    if (memory == lastAllocation && commitThrough((lastAllocation - basePointer) + newSize)) {
+        grownInPlace++;
+        top = (lastAllocation - basePointer) + newSize;
+        return memory;
+    }
+
+    void *newMemory = allocate(newSize);
+    memcpy(newMemory, memory, oldSize);
+    return newMemory;
+}
+
+    void
+ArenaAllocator::reset()
+{
+    while (NULL != spills) {
+        Spill *spill = spills;
+        spills = spill->next;
+        BigDealloc(spill);
+    }
+
+    top = 0;
+    lastAllocation = NULL;
+    resets++;
+}
+
 void PrintBigAllocProfile()
 {
 #ifdef PROFILE_BIGALLOC
     WriteStatusMessage("BigAlloc usage\n");
     for (int i = 0; i < NCallers; i++) {
-        WriteStatusMessage("%7.1f Mb %7lld %s\n", 
-            AllocProfile[i].total * 1e-6, AllocProfile[i].count, AllocProfile[i].caller);
+        WriteStatusMessage("%7.1f Mb %7lld %s (1GB %.1f, 2MB %.1f, THP %.1f, 4KB %.1f Mb)\n", 
+            AllocProfile[i].total * 1e-6, AllocProfile[i].count, AllocProfile[i].caller,
+            AllocProfile[i].byPageKind[OneGBPages] * 1e-6, AllocProfile[i].byPageKind[TwoMBPages] * 1e-6,
+            AllocProfile[i].byPageKind[TransparentHugePages] * 1e-6, AllocProfile[i].byPageKind[SmallPages] * 1e-6);
     }
 #endif
 }
 
+void PrintBigAllocPageUsage()
+{
+    const _int64 MB = 1024 * 1024;
+    _int64 thpInUse = TransparentHugePageBytesInUse();
+    char thpBacked[100];
+    if (thpInUse < 0) {
+        thpBacked[0] = '\0';
+    } else {
+        snprintf(thpBacked, sizeof(thpBacked), " (%lld MB backed so far)", thpInUse / MB);
+    }
+
+    WriteStatusMessage("Huge pages: %lld MB on 1GB pages, %lld MB on 2MB pages, %lld MB advised for transparent huge pages%s, %lld MB on small pages\n",
+        BytesByPageKind[OneGBPages] / MB, BytesByPageKind[TwoMBPages] / MB, BytesByPageKind[TransparentHugePages] / MB, thpBacked, BytesByPageKind[SmallPages] / MB);
+}
+
 void* zalloc(void* opaque, unsigned items, unsigned size)
 {
     size_t bytes = items * (size_t) size;
@@ -39,6 +39,7 @@ inline unsigned RoundUpToPageSize(unsigned size)
 #define BigAlloc(s) BigAllocProfile((s), NULL, __FUNCTION__)
 #define BigAlloc2(s,p) BigAllocProfile((s), (p), __FUNCTION__)
 #define BigReserve(s) BigReserveProfile((s), NULL, NULL, __FUNCTION__)
+#define BigReserve2(s,r) BigReserveProfile((s), (r), NULL, __FUNCTION__)
 #define BigCommit(p, s) BigCommitProfile((p), (s), __FUNCTION__)
 #define BigDealloc(p) BigDeallocProfile((p), __FUNCTION__)
 
@@ -66,6 +67,7 @@ void *BigAlloc(
         size_t      sizeToAllocate,
         size_t      *sizeAllocated = NULL);
 #define BigAlloc2(s,p) BigAlloc((s), (p))
+#define BigReserve2(s,r) BigReserve((s), (r))
 
 void *BigReserve(
     size_t      sizeToReserve,
@@ -82,6 +84,11 @@ void BigDealloc(void* memory);
 
 void PrintBigAllocProfile();
 
+//
+// Report how much BigAlloc memory landed on each page size (1GB/2MB hugetlb, transparent huge pages, small pages).
+//
+void PrintBigAllocPageUsage();
+
 //
 // This class is used to allocate a group of objects all onto a single set of big pages.  It requires knowing
 // the amount of memory to be allocated when it's created.  It does not support deleting memory other than
@@ -144,6 +151,56 @@ private:
     } *allocations;
 };
 
+//
+// A per-thread bump allocator for the transient memory that goes with aligning reads: result arrays and the
+// secondary and affine gap candidate buffers.  It reserves its address space up front and commits it as the
+// bump pointer advances, so a large slab costs only the pages that actually get touched, and the most recent
+// allocation can grow in place.  reset() discards everything at once; the aligner contexts call it at batch
+// boundaries.  Allocations that don't fit in the reservation spill to BigAlloc and count as misses.
+//
+class ArenaAllocator {
+public:
+    ArenaAllocator(size_t i_reservation);
+    ~ArenaAllocator();
+
+    void *allocate(size_t amountToAllocate);
+
+    //
+    // Grow an allocation from oldSize to newSize bytes, preserving its contents.  It stays where it is if it was
+    // the last thing allocated and the reservation has room, otherwise it moves.
+    //
+    void *grow(void *memory, size_t oldSize, size_t newSize);
+
+    void reset();
+
+    size_t getHits() {return hits;}
+    size_t getMisses() {return misses;}
+    size_t getGrownInPlace() {return grownInPlace;}
+    size_t getResets() {return resets;}
+
+private:
+
+    bool commitThrough(size_t newTop);
+
+    char    *basePointer;
+    size_t  reservation;
+    size_t  top;
+    size_t  committed;
+    char    *lastAllocation;
+
+    struct Spill {
+        Spill   *next;
+    } *spills;
+
+    size_t  hits;
+    size_t  misses;
+    size_t  grownInPlace;
+    size_t  resets;
+
+    static const size_t allocationGranularity = 16;
+    static const size_t commitGranularity = 64 * 1024;
+};
+
 extern bool BigAllocUseHugePages;
 
 
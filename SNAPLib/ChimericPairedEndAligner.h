@@ -99,6 +99,11 @@ public:
     void *operator new(size_t size) {return BigAlloc(size);}
     void operator delete(void *ptr) {BigDealloc(ptr);}
 
+    virtual void setPerfCounters(PerfCounters *perfCounters) {
+        underlyingPairedEndAligner->setPerfCounters(perfCounters);
+        singleAligner->setPerfCounters(perfCounters);
+    }
+
     virtual _int64 getLocationsScoredWithLandauVishkin() const {
         return underlyingPairedEndAligner->getLocationsScoredWithLandauVishkin() + singleAligner->getLocationsScoredWithLandauVishkin();
     }
@@ -34,6 +34,15 @@ Revision History:
 #include <sys/types.h>
 #include <sys/stat.h>
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>    // For mbind
+#endif
+#ifdef SNAP_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
 #include "exit.h"
 #ifdef PROFILE_WAIT
 #include <map>
@@ -330,6 +339,36 @@ unsigned GetNumberOfProcessors()
     return systemInfo->dwNumberOfProcessors;
 }
 
+int GetNumberOfNumaNodes()
+{
+    ULONG highestNode;
+    if (!GetNumaHighestNodeNumber(&highestNode)) {
+        return 1;
+    }
+
+    return (int)highestNode + 1;
+}
+
+int GetNumaNodeOfProcessor(unsigned processorNumber)
+{
+    UCHAR node;
+    if (processorNumber > 255 || !GetNumaProcessorNode((UCHAR)processorNumber, &node) || 0xff == node) {
+        return 0;
+    }
+
+    return node;
+}
+
+int GetCurrentNumaNode()
+{
+    return GetNumaNodeOfProcessor(GetCurrentProcessorNumber());
+}
+
+bool InterleaveMemoryAcrossNumaNodes(void *memory, size_t bytes)
+{
+    return false;   // Windows only sets a NUMA preference when memory is allocated (VirtualAllocExNuma), it can't move it afterward.
+}
+
 _int64 QueryFileSize(const char *fileName) {
     HANDLE hFile = CreateFile(fileName,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
     if (INVALID_HANDLE_VALUE == hFile) {
@@ -505,6 +544,11 @@ void AdviseMemoryMappedFilePrefetch(const MemoryMappedFile *mappedFile)
   // No-op on WIndows.
 }
 
+void AdviseFilePrefetch(const char *fileName, _int64 length)
+{
+    // No-op on Windows.
+}
+
 
 class WindowsAsyncFile : public AsyncFile
 {
@@ -1611,6 +1655,116 @@ unsigned GetNumberOfProcessors()
     return (unsigned) sysconf(_SC_NPROCESSORS_ONLN);
 }
 
+#ifdef __linux__
+//
+// The node of each processor, from sysfs.  It's filled in on first use (before the aligner threads start, from -numa); a
+// race would only build the same table twice.
+//
+static int *NumaNodeOfProcessor = NULL;
+static int NumberOfNumaNodes = 0;
+static int NumberOfProcessorsWithNumaNodes = 0;
+
+static void LoadNumaTopology()
+{
+    if (NULL != NumaNodeOfProcessor) {
+        return;
+    }
+
+    int nNodes = 1;
+    FILE *onlineFile = fopen("/sys/devices/system/node/online", "r");   // Like "0-3" or "0,2"
+    if (NULL != onlineFile) {
+        int node;
+        char separator;
+        while (1 == fscanf(onlineFile, "%d", &node)) {
+            nNodes = __max(nNodes, node + 1);
+            if (1 != fscanf(onlineFile, "%c", &separator)) {
+                break;
+            }
+        }
+        fclose(onlineFile);
+    }
+
+    int nProcessors = (int)sysconf(_SC_NPROCESSORS_CONF);
+    int *nodeOfProcessor = new int[nProcessors];
+    for (int processor = 0; processor < nProcessors; processor++) {
+        nodeOfProcessor[processor] = 0;
+        for (int node = 0; node < nNodes; node++) {
+            char path[100];
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", processor, node);
+            if (0 == access(path, F_OK)) {
+                nodeOfProcessor[processor] = node;
+                break;
+            }
+        }
+    }
+
+    NumberOfNumaNodes = nNodes;
+    NumberOfProcessorsWithNumaNodes = nProcessors;
+    NumaNodeOfProcessor = nodeOfProcessor;
+}
+#endif // __linux__
+
+int GetNumberOfNumaNodes()
+{
+#ifdef __linux__
+    LoadNumaTopology();
+    return NumberOfNumaNodes;
+#else
+    return 1;
+#endif
+}
+
+int GetNumaNodeOfProcessor(unsigned processorNumber)
+{
+#ifdef __linux__
+    LoadNumaTopology();
+    if (processorNumber >= (unsigned)NumberOfProcessorsWithNumaNodes) {
+        return 0;
+    }
+    return NumaNodeOfProcessor[processorNumber];
+#else
+    return 0;
+#endif
+}
+
+int GetCurrentNumaNode()
+{
+#ifdef __linux__
+    int processor = sched_getcpu();
+    return processor < 0 ? 0 : GetNumaNodeOfProcessor(processor);
+#else
+    return 0;
+#endif
+}
+
+bool InterleaveMemoryAcrossNumaNodes(void *memory, size_t bytes)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    const int mpolInterleave = 3;       // MPOL_INTERLEAVE and MPOL_MF_MOVE from <numaif.h>, which would need libnuma's headers
+    const unsigned mpolMoveFlag = 1 << 1;
+    const int maxNodes = 1024;
+
+    int nNodes = GetNumberOfNumaNodes();
+    if (NULL == memory || 0 == bytes || nNodes > maxNodes) {
+        return false;
+    }
+
+    unsigned long nodeMask[maxNodes / (8 * sizeof(unsigned long))];
+    memset(nodeMask, 0, sizeof(nodeMask));
+    for (int node = 0; node < nNodes; node++) {
+        nodeMask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+    }
+
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    char *start = (char *)((size_t)memory & ~(pageSize - 1));
+    size_t length = (char *)memory + bytes - start;
+
+    return 0 == syscall(SYS_mbind, start, length, mpolInterleave, nodeMask, (unsigned long)maxNodes, mpolMoveFlag);
+#else
+    return false;
+#endif
+}
+
 void SleepForMillis(unsigned millis)
 {
   usleep(millis*1000);
@@ -1762,6 +1916,18 @@ void AdviseMemoryMappedFilePrefetch(const MemoryMappedFile *mappedFile)
   }
 }
 
+void AdviseFilePrefetch(const char *fileName, _int64 length)
+{
+#ifdef __linux__
+    int fd = ::open(fileName, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    posix_fadvise(fd, 0, length, POSIX_FADV_WILLNEED);
+    ::close(fd);
+#endif // __linux__
+}
+
 #ifdef __linux__
 
 class PosixAsyncFile : public AsyncFile
@@ -2212,6 +2378,666 @@ PosixAsyncFile::Reader::waitForCompletion()
     return true;
 }
 
+#ifdef SNAP_IO_URING
+
+//
+// An AsyncFile that does its IO through io_uring.  There's no liburing dependency; the ring is set up and driven with
+// the raw system calls.  Each file gets its own ring and a completion thread that reaps completions and wakes up whoever
+// is waiting for them.  Reads are queued and handed to the kernel in batches (when the DataReader is done starting IO on
+// all of the buffers that are ready, or when someone waits), writes are submitted right away.
+//
+// If the caller registers its buffer memory, IOs that fall entirely within it use the fixed-buffer opcodes, which saves
+// the kernel from pinning and unpinning the pages for every request.  With directIo we also open an O_DIRECT descriptor,
+// and requests whose buffer, offset and length are all sector aligned go through it.  Anything else (the tail of a file,
+// an odd sized write) uses the regular descriptor, so callers don't have to care.
+//
+
+class IoUringAsyncFile : public AsyncFile
+{
+public:
+    // *o_ringFailed says whether it was io_uring rather than the file itself that failed, in which case the caller can fall back
+    static IoUringAsyncFile* open(const char* filename, bool write, bool directIo, bool* o_ringFailed);
+
+    virtual bool close();
+
+    virtual _int64 getSize();
+
+    virtual bool registerBuffers(void* buffer, size_t length);
+
+    virtual void submitPending();
+
+    //
+    // One outstanding IO.  Readers and writers each own one, since they only allow a single IO at a time.
+    //
+    struct Request {
+        SingleWaiterObject  done;
+        bool                inFlight;
+        bool                write;
+        char*               buffer;
+        size_t              length;
+        size_t              offset;
+        size_t              transferred;
+        int                 error;
+        struct iovec        iov;    // Must stay put until the kernel has consumed the SQE
+    };
+
+    class Writer : public AsyncFile::Writer
+    {
+    public:
+        Writer(IoUringAsyncFile* i_file);
+
+        virtual bool close();
+
+        virtual bool beginWrite(void* buffer, size_t length, size_t offset, size_t *bytesWritten);
+
+        virtual bool waitForCompletion();
+
+    private:
+        IoUringAsyncFile*   file;
+        Request             request;
+        size_t*             result;
+    };
+
+    virtual AsyncFile::Writer* getWriter();
+
+    class Reader : public AsyncFile::Reader
+    {
+    public:
+        Reader(IoUringAsyncFile* i_file);
+
+        virtual bool close();
+
+        virtual bool beginRead(void* buffer, size_t length, size_t offset, size_t *bytesRead);
+
+        virtual bool waitForCompletion();
+
+    private:
+        IoUringAsyncFile*   file;
+        Request             request;
+        size_t*             result;
+    };
+
+    virtual AsyncFile::Reader* getReader();
+
+private:
+
+    IoUringAsyncFile(int i_fd, int i_directFd);
+
+    bool setupRing();
+
+    bool begin(Request* request, char* buffer, size_t length, size_t offset, bool write);
+    bool wait(Request* request);
+
+    // must hold the lock to call
+    bool queueRequest(Request* request);
+    // must hold the lock to call
+    void submitQueued();
+
+    static void CompletionThreadMain(void* param);
+    void completionThread();
+
+    static const unsigned   RingEntries = 256;
+    static const size_t     DirectIoAlignment = 4096;
+
+    int                     fd;
+    int                     directFd;
+    bool                    fixedFiles;     // Did IORING_REGISTER_FILES work?  Then fd is index 0 and directFd index 1.
+
+    char*                   registeredBuffer;
+    size_t                  registeredLength;
+
+    int                     ringFd;
+    void*                   sqRing;
+    size_t                  sqRingSize;
+    void*                   cqRing;
+    size_t                  cqRingSize;
+    struct io_uring_sqe*    sqes;
+    size_t                  sqesSize;
+
+    unsigned*               sqHead;
+    unsigned*               sqTail;
+    unsigned                sqMask;
+    unsigned*               sqArray;
+    unsigned                sqEntries;
+    unsigned*               cqHead;
+    unsigned*               cqTail;
+    unsigned                cqMask;
+    struct io_uring_cqe*    cqes;
+
+    ExclusiveLock           lock;           // Protects the submission queue
+    unsigned                queued;         // SQEs we've filled in but not yet told the kernel about
+
+    SingleWaiterObject      completionThreadExited;
+};
+
+static int
+io_uring_setup_syscall(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+io_uring_enter_syscall(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int
+io_uring_register_syscall(int ringFd, unsigned opcode, void* arg, unsigned nrArgs)
+{
+    return (int)syscall(__NR_io_uring_register, ringFd, opcode, arg, nrArgs);
+}
+
+IoUringAsyncFile::IoUringAsyncFile(int i_fd, int i_directFd)
+    : fd(i_fd), directFd(i_directFd), fixedFiles(false), registeredBuffer(NULL), registeredLength(0), ringFd(-1),
+    sqRing(MAP_FAILED), sqRingSize(0), cqRing(MAP_FAILED), cqRingSize(0), sqes((struct io_uring_sqe*)MAP_FAILED), sqesSize(0), queued(0)
+{
+}
+
+    bool
+IoUringAsyncFile::setupRing()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ringFd = io_uring_setup_syscall(RingEntries, &params);
+    if (ringFd < 0) {
+        WriteErrorMessage("IoUringAsyncFile: io_uring_setup failed, %d (%s)\n", errno, strerror(errno));
+        return false;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMmap) {
+        sqRingSize = cqRingSize = __max(sqRingSize, cqRingSize);
+    }
+
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+        WriteErrorMessage("IoUringAsyncFile: unable to map submission ring, %d (%s)\n", errno, strerror(errno));
+        return false;
+    }
+
+    if (singleMmap) {
+        cqRing = sqRing;
+    } else {
+        cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            WriteErrorMessage("IoUringAsyncFile: unable to map completion ring, %d (%s)\n", errno, strerror(errno));
+            return false;
+        }
+    }
+
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe*)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        WriteErrorMessage("IoUringAsyncFile: unable to map submission queue entries, %d (%s)\n", errno, strerror(errno));
+        return false;
+    }
+
+    sqHead = (unsigned*)((char*)sqRing + params.sq_off.head);
+    sqTail = (unsigned*)((char*)sqRing + params.sq_off.tail);
+    sqMask = *(unsigned*)((char*)sqRing + params.sq_off.ring_mask);
+    sqArray = (unsigned*)((char*)sqRing + params.sq_off.array);
+    sqEntries = params.sq_entries;
+    cqHead = (unsigned*)((char*)cqRing + params.cq_off.head);
+    cqTail = (unsigned*)((char*)cqRing + params.cq_off.tail);
+    cqMask = *(unsigned*)((char*)cqRing + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)((char*)cqRing + params.cq_off.cqes);
+
+    //
+    // Registering the descriptors saves a file table lookup per IO.  It's only an optimization, so failure is fine.
+    //
+    int files[2] = {fd, directFd};
+    fixedFiles = io_uring_register_syscall(ringFd, IORING_REGISTER_FILES, files, directFd == -1 ? 1 : 2) == 0;
+
+    InitializeExclusiveLock(&lock);
+    if (!CreateSingleWaiterObject(&completionThreadExited)) {
+        WriteErrorMessage("IoUringAsyncFile: cannot create waiter\n");
+        soft_exit(1);
+    }
+
+    if (!StartNewThread(CompletionThreadMain, this)) {
+        WriteErrorMessage("IoUringAsyncFile: unable to start completion thread\n");
+        soft_exit(1);
+    }
+
+    return true;
+}
+
+    IoUringAsyncFile*
+IoUringAsyncFile::open(
+    const char* filename,
+    bool write,
+    bool directIo,
+    bool* o_ringFailed)
+{
+    *o_ringFailed = false;
+    int fd = ::open(filename, write ? O_CREAT | O_RDWR | O_TRUNC : O_RDONLY, write ? S_IRWXU | S_IRGRP : 0);
+    if (fd < 0) {
+        WriteErrorMessage("Unable to open file '%s', %d (%s)\n", filename, errno, strerror(errno));
+        return NULL;
+    }
+
+    int directFd = -1;
+    if (directIo) {
+        directFd = ::open(filename, (write ? O_RDWR : O_RDONLY) | O_DIRECT);
+        if (directFd < 0) {
+            WriteErrorMessage("IoUringAsyncFile: unable to open '%s' with O_DIRECT, %d (%s); using the page cache\n", filename, errno, strerror(errno));
+        }
+    }
+
+    IoUringAsyncFile* file = new IoUringAsyncFile(fd, directFd);
+    if (!file->setupRing()) {
+        //
+        // Nothing's in flight and there's no completion thread yet, so just unwind what we did.
+        //
+        if (file->sqes != MAP_FAILED) munmap(file->sqes, file->sqesSize);
+        if (file->cqRing != MAP_FAILED && file->cqRing != file->sqRing) munmap(file->cqRing, file->cqRingSize);
+        if (file->sqRing != MAP_FAILED) munmap(file->sqRing, file->sqRingSize);
+        if (file->ringFd >= 0) ::close(file->ringFd);
+        if (directFd >= 0) ::close(directFd);
+        ::close(fd);
+        delete file;
+        *o_ringFailed = true;
+        return NULL;
+    }
+
+    return file;
+}
+
+    bool
+IoUringAsyncFile::close()
+{
+    //
+    // Send a NOP with a null user_data through the ring to tell the completion thread to exit.  All of the readers and writers
+    // have been closed (and so waited for their IO), so it's the last thing the thread will see.
+    //
+    AcquireExclusiveLock(&lock);
+    while (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) + queued >= sqEntries) {
+        submitQueued();
+    }
+    unsigned tail = *sqTail + queued;
+    unsigned index = tail & sqMask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = 0;
+    sqArray[index] = index;
+    queued++;
+    submitQueued();
+    ReleaseExclusiveLock(&lock);
+
+    WaitForSingleWaiterObject(&completionThreadExited);
+    DestroySingleWaiterObject(&completionThreadExited);
+    DestroyExclusiveLock(&lock);
+
+    munmap(sqes, sqesSize);
+    if (cqRing != sqRing) {
+        munmap(cqRing, cqRingSize);
+    }
+    munmap(sqRing, sqRingSize);
+    ::close(ringFd);     // Also drops the buffer and file registrations
+
+    bool closeWorked = true;
+    if (directFd >= 0) {
+        closeWorked = ::close(directFd) == 0;
+    }
+    closeWorked = (::close(fd) == 0) && closeWorked;
+
+    return closeWorked;
+}
+
+    _int64
+IoUringAsyncFile::getSize()
+{
+    struct stat statBuffer;
+    if (-1 == fstat(fd, &statBuffer)) {
+        WriteErrorMessage("IoUringAsyncFile: fstat failed, %d (%s)\n", errno, strerror(errno));
+        return -1;
+    }
+
+    return statBuffer.st_size;
+}
+
+    bool
+IoUringAsyncFile::registerBuffers(
+    void* buffer,
+    size_t length)
+{
+    if (registeredBuffer != NULL) {
+        return false;   // The kernel only lets us register once per ring, and we only use one region.
+    }
+
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = length;
+    if (io_uring_register_syscall(ringFd, IORING_REGISTER_BUFFERS, &iov, 1) != 0) {
+        //
+        // Most likely RLIMIT_MEMLOCK.  The IO still works, it just doesn't use the fixed buffer opcodes.
+        //
+        return false;
+    }
+
+    registeredBuffer = (char*)buffer;
+    registeredLength = length;
+    return true;
+}
+
+    void
+IoUringAsyncFile::submitQueued()
+{
+    AssertExclusiveLockHeld(&lock);
+
+    if (queued == 0) {
+        return;
+    }
+
+    __atomic_store_n(sqTail, *sqTail + queued, __ATOMIC_RELEASE);
+    unsigned toSubmit = queued;
+    queued = 0;
+
+    while (toSubmit > 0) {
+        int submitted = io_uring_enter_syscall(ringFd, toSubmit, 0, 0);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            WriteErrorMessage("IoUringAsyncFile: io_uring_enter failed, %d (%s)\n", errno, strerror(errno));
+            soft_exit(1);
+        }
+        toSubmit -= submitted;
+    }
+}
+
+    void
+IoUringAsyncFile::submitPending()
+{
+    AcquireExclusiveLock(&lock);
+    submitQueued();
+    ReleaseExclusiveLock(&lock);
+}
+
+    bool
+IoUringAsyncFile::queueRequest(
+    Request* request)
+{
+    AssertExclusiveLockHeld(&lock);
+
+    while (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) + queued >= sqEntries) {
+        submitQueued();     // The kernel consumes SQEs on submission, so this frees up space.
+    }
+
+    char* buffer = request->buffer + request->transferred;
+    size_t length = request->length - request->transferred;
+    size_t offset = request->offset + request->transferred;
+
+    bool direct = directFd != -1 && ((size_t)buffer % DirectIoAlignment) == 0 && (length % DirectIoAlignment) == 0 && (offset % DirectIoAlignment) == 0;
+    bool fixedBuffer = registeredBuffer != NULL && buffer >= registeredBuffer && buffer + length <= registeredBuffer + registeredLength;
+
+    unsigned index = (*sqTail + queued) & sqMask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+
+    if (fixedFiles) {
+        sqe->fd = direct ? 1 : 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = direct ? directFd : fd;
+    }
+    sqe->off = offset;
+
+    if (fixedBuffer) {
+        sqe->opcode = request->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (unsigned long)buffer;
+        sqe->len = (unsigned)__min(length, (size_t)0x7ffff000);
+        sqe->buf_index = 0;
+    } else {
+        request->iov.iov_base = buffer;
+        request->iov.iov_len = __min(length, (size_t)0x7ffff000);   // The most Linux will transfer in one go anyway
+        sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (unsigned long)&request->iov;
+        sqe->len = 1;
+    }
+    sqe->user_data = (unsigned long)request;
+
+    sqArray[index] = index;
+    queued++;
+
+    return true;
+}
+
+    bool
+IoUringAsyncFile::begin(
+    Request* request,
+    char* buffer,
+    size_t length,
+    size_t offset,
+    bool write)
+{
+    _ASSERT(!request->inFlight);
+
+    request->write = write;
+    request->buffer = buffer;
+    request->length = length;
+    request->offset = offset;
+    request->transferred = 0;
+    request->error = 0;
+    request->inFlight = true;
+
+    if (length == 0) {
+        SignalSingleWaiterObject(&request->done);
+        return true;
+    }
+
+    AcquireExclusiveLock(&lock);
+    bool worked = queueRequest(request);
+    if (write) {
+        submitQueued();
+    }
+    ReleaseExclusiveLock(&lock);
+
+    return worked;
+}
+
+    bool
+IoUringAsyncFile::wait(
+    Request* request)
+{
+    if (!request->inFlight) {
+        return true;
+    }
+
+    submitPending();
+    WaitForSingleWaiterObject(&request->done);
+    ResetSingleWaiterObject(&request->done);
+    request->inFlight = false;
+
+    if (request->error != 0) {
+        WriteErrorMessage("IoUringAsyncFile: %s of %lld bytes at offset %lld failed, %d (%s)\n", request->write ? "write" : "read",
+            (_int64)request->length, (_int64)request->offset, request->error, strerror(request->error));
+        return false;
+    }
+
+    return true;
+}
+
+    void
+IoUringAsyncFile::CompletionThreadMain(
+    void* param)
+{
+    ((IoUringAsyncFile*)param)->completionThread();
+}
+
+    void
+IoUringAsyncFile::completionThread()
+{
+    for (;;) {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            if (io_uring_enter_syscall(ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN) {
+                WriteErrorMessage("IoUringAsyncFile: io_uring_enter (wait) failed, %d (%s)\n", errno, strerror(errno));
+                soft_exit(1);
+            }
+            continue;
+        }
+
+        while (head != tail) {
+            struct io_uring_cqe* cqe = &cqes[head & cqMask];
+            Request* request = (Request*)cqe->user_data;
+            int res = cqe->res;
+            head++;
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+            if (request == NULL) {
+                SignalSingleWaiterObject(&completionThreadExited);
+                return;
+            }
+
+            if (res < 0) {
+                if (res == -EAGAIN || res == -EINTR) {
+                    AcquireExclusiveLock(&lock);
+                    queueRequest(request);
+                    submitQueued();
+                    ReleaseExclusiveLock(&lock);
+                } else {
+                    request->error = -res;
+                    SignalSingleWaiterObject(&request->done);
+                }
+                continue;
+            }
+
+            request->transferred += res;
+            if (request->transferred < request->length && (res > 0 || request->write)) {
+                if (res == 0) {
+                    request->error = ENOSPC;    // A write that makes no progress isn't going to make any on retry
+                    SignalSingleWaiterObject(&request->done);
+                    continue;
+                }
+
+                //
+                // Short transfer.  Send off the rest of it.
+                //
+                AcquireExclusiveLock(&lock);
+                queueRequest(request);
+                submitQueued();
+                ReleaseExclusiveLock(&lock);
+            } else {
+                SignalSingleWaiterObject(&request->done);   // Done, or a read that hit EOF
+            }
+        } // for each completion
+    } // forever
+}
+
+    AsyncFile::Writer*
+IoUringAsyncFile::getWriter()
+{
+    return new Writer(this);
+}
+
+IoUringAsyncFile::Writer::Writer(IoUringAsyncFile* i_file)
+    : file(i_file), result(NULL)
+{
+    memset(&request, 0, sizeof(request));
+    if (!CreateSingleWaiterObject(&request.done)) {
+        WriteErrorMessage("IoUringAsyncFile: cannot create waiter\n");
+        soft_exit(1);
+    }
+}
+
+    bool
+IoUringAsyncFile::Writer::close()
+{
+    bool worked = waitForCompletion();
+    DestroySingleWaiterObject(&request.done);
+    return worked;
+}
+
+    bool
+IoUringAsyncFile::Writer::beginWrite(
+    void* buffer,
+    size_t length,
+    size_t offset,
+    size_t *bytesWritten)
+{
+    if (!waitForCompletion()) {
+        return false;
+    }
+
+    result = bytesWritten;
+    return file->begin(&request, (char*)buffer, length, offset, true);
+}
+
+    bool
+IoUringAsyncFile::Writer::waitForCompletion()
+{
+    bool wasInFlight = request.inFlight;
+    bool worked = file->wait(&request);
+
+    if (wasInFlight && result != NULL) {
+        *result = request.transferred;
+    }
+
+    return worked;
+}
+
+    AsyncFile::Reader*
+IoUringAsyncFile::getReader()
+{
+    return new Reader(this);
+}
+
+IoUringAsyncFile::Reader::Reader(IoUringAsyncFile* i_file)
+    : file(i_file), result(NULL)
+{
+    memset(&request, 0, sizeof(request));
+    if (!CreateSingleWaiterObject(&request.done)) {
+        WriteErrorMessage("IoUringAsyncFile: cannot create waiter\n");
+        soft_exit(1);
+    }
+}
+
+    bool
+IoUringAsyncFile::Reader::close()
+{
+    bool worked = waitForCompletion();
+    DestroySingleWaiterObject(&request.done);
+    return worked;
+}
+
+    bool
+IoUringAsyncFile::Reader::beginRead(
+    void* buffer,
+    size_t length,
+    size_t offset,
+    size_t* bytesRead)
+{
+    if (!waitForCompletion()) {
+        return false;
+    }
+
+    result = bytesRead;
+    return file->begin(&request, (char*)buffer, length, offset, false);
+}
+
+    bool
+IoUringAsyncFile::Reader::waitForCompletion()
+{
+    bool wasInFlight = request.inFlight;
+    bool worked = file->wait(&request);
+
+    if (wasInFlight && result != NULL) {
+        *result = request.transferred;
+    }
+
+    return worked;
+}
+
+#endif // SNAP_IO_URING
+
 #else
 
 // todo: make this actually async!
@@ -2778,3 +3604,25 @@ AsyncFile* AsyncFile::open(const char* filename, bool write)
 #endif
 #endif
 }
+
+AsyncFile* AsyncFile::openIoUring(const char* filename, bool write, bool directIo)
+{
+    if (!strcmp("-", filename)) {
+        return open(filename, write);
+    }
+#ifdef SNAP_IO_URING
+    bool ringFailed;
+    AsyncFile* file = IoUringAsyncFile::open(filename, write, directIo, &ringFailed);
+    if (file != NULL || !ringFailed) {
+        return file;    // A file that can't be opened has already been reported, and the fallback wouldn't do any better
+    }
+    WriteErrorMessage("Falling back to regular async IO for '%s'\n", filename);
+#else
+    static bool warned = false;
+    if (!warned) {
+        warned = true;
+        WriteErrorMessage("This build of SNAP doesn't include io_uring support; using regular async IO\n");
+    }
+#endif
+    return open(filename, write);
+}
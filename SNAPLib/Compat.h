@@ -356,6 +356,16 @@ void SleepForMillis(unsigned millis);
 
 unsigned GetNumberOfProcessors();
 
+//
+// NUMA topology.  Without NUMA support (or with one socket) everything is on node 0.  InterleaveMemoryAcrossNumaNodes
+// spreads a range's pages round robin over the nodes, moving ones that are already there; it returns false when the
+// platform can't do it.
+//
+int GetNumberOfNumaNodes();
+int GetNumaNodeOfProcessor(unsigned processorNumber);
+int GetCurrentNumaNode();
+bool InterleaveMemoryAcrossNumaNodes(void *memory, size_t bytes);
+
 _int64 QueryFileSize(const char *fileName);
 
 // returns true on success
@@ -389,6 +399,9 @@ void CloseMemoryMappedFile(MemoryMappedFile* mappedFile);
 //
 void AdviseMemoryMappedFilePrefetch(const MemoryMappedFile *mappedFile);
 
+// ask the OS to start reading the first length bytes of a file into its cache.  Only an optimization; failure is silent.
+void AdviseFilePrefetch(const char *fileName, _int64 length);
+
 class AsyncFile
 {
 public:
@@ -396,11 +409,23 @@ public:
     // open a new file for reading and/or writing
     static AsyncFile* open(const char* filename, bool write);
 
+    // open a file whose IO goes through io_uring (Linux only; elsewhere, or if the kernel refuses, this is just open()).
+    // with directIo, requests whose buffer, offset and length are all sector aligned bypass the page cache
+    static AsyncFile* openIoUring(const char* filename, bool write, bool directIo);
+
     // free resources; must have destroyed all readers & writers first
     virtual bool close() = 0;
 
     virtual _int64 getSize() = 0;
 
+    // tell the kernel up front about the memory that will be used for IO, if the implementation can use that
+    // returns false if it didn't, which is harmless
+    virtual bool registerBuffers(void* buffer, size_t length) { return false; }
+
+    // implementations that queue beginRead/beginWrite requests hand everything queued to the OS here;
+    // waitForCompletion also does this, so it's only needed to get IO started sooner
+    virtual void submitPending() {}
+
     // abstract class for asynchronous writes
     class Writer
     {
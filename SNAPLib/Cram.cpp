@@ -0,0 +1,2432 @@
+/*++
+
+Module Name:
+
+    Cram.cpp
+
+Abstract:
+
+    Encoding of CRAM 3.0 containers from BAM records, and decoding them back.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "Cram.h"
+#include "Bam.h"
+#include "ReadSupplierQueue.h"
+#include "exit.h"
+#include "Error.h"
+
+using std::min;
+using std::max;
+
+// block content types
+static const _uint8 CramFileHeader = 0;
+static const _uint8 CramCompressionHeader = 1;
+static const _uint8 CramSliceHeader = 2;
+static const _uint8 CramExternalData = 4;
+static const _uint8 CramCoreData = 5;
+
+// block compression methods
+static const _uint8 CramRaw = 0;
+static const _uint8 CramGzip = 1;
+static const _uint8 CramBzip2 = 2;
+static const _uint8 CramLzma = 3;
+static const _uint8 CramRans = 4;
+
+// encodings
+static const _int32 CramEncodingNull = 0;
+static const _int32 CramEncodingExternal = 1;
+static const _int32 CramEncodingHuffman = 3;
+static const _int32 CramEncodingByteArrayLen = 4;
+static const _int32 CramEncodingByteArrayStop = 5;
+static const _int32 CramEncodingBeta = 6;
+static const _int32 CramEncodingSubexp = 7;
+static const _int32 CramEncodingGamma = 9;
+
+// CRAM record flags (CF)
+static const _int32 CramQualityArray = 0x1;
+static const _int32 CramDetached = 0x2;
+static const _int32 CramMateDownstream = 0x4;
+static const _int32 CramUnknownBases = 0x8;
+
+// mate flags (MF)
+static const _int32 CramMateReversed = 0x1;
+static const _int32 CramMateUnmapped = 0x2;
+
+static const char* SeriesNames = "BFCFRIRLAPRGRNMFNSNPTSTLFNFCFPBSINDLRSPDHCSCBAQSMQ";
+
+const _uint8 CramContainerEncoder::EofContainer[38] = {
+    0x0f, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x0f, 0xe0, 0x45, 0x4f, 0x46, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
+    0x05, 0xbd, 0xd9, 0x4f, 0x00, 0x01, 0x00, 0x06, 0x06, 0x01, 0x00, 0x01, 0x00, 0x01, 0x00, 0xee, 0x63, 0x01, 0x4b
+};
+
+    void
+CramBuffer::reserve(
+    size_t bytes)
+{
+    if (bytes <= capacity) {
+        return;
+    }
+    size_t newCapacity = max(bytes, max(capacity * 2, (size_t)4096));
+    char* newBuffer = (char*)realloc(buffer, newCapacity);
+    if (newBuffer == NULL) {
+        WriteErrorMessage("CramBuffer: unable to allocate %lld bytes\n", (_int64)newCapacity);
+        soft_exit(1);
+    }
+    buffer = newBuffer;
+    capacity = newCapacity;
+}
+
+    void
+CramBuffer::putInt32(
+    _int32 value)
+{
+    _uint8 bytes[4];
+    for (int i = 0; i < 4; i++) {
+        bytes[i] = (_uint8)((_uint32)value >> (8 * i));
+    }
+    put(bytes, 4);
+}
+
+    void
+CramBuffer::putITF8(
+    _int32 value)
+{
+    _uint32 u = (_uint32)value;
+    if ((u & ~0x7fU) == 0) {
+        putByte((_uint8)u);
+    } else if ((u & ~0x3fffU) == 0) {
+        putByte((_uint8)(0x80 | (u >> 8)));
+        putByte((_uint8)u);
+    } else if ((u & ~0x1fffffU) == 0) {
+        putByte((_uint8)(0xc0 | (u >> 16)));
+        putByte((_uint8)(u >> 8));
+        putByte((_uint8)u);
+    } else if ((u & ~0xfffffffU) == 0) {
+        putByte((_uint8)(0xe0 | (u >> 24)));
+        putByte((_uint8)(u >> 16));
+        putByte((_uint8)(u >> 8));
+        putByte((_uint8)u);
+    } else {
+        // The last byte only has the low 4 bits
+        putByte((_uint8)(0xf0 | (u >> 28)));
+        putByte((_uint8)(u >> 20));
+        putByte((_uint8)(u >> 12));
+        putByte((_uint8)(u >> 4));
+        putByte((_uint8)(u & 0xf));
+    }
+}
+
+    int
+CramBuffer::itf8Size(
+    _int32 value)
+{
+    _uint32 u = (_uint32)value;
+    return (u & ~0x7fU) == 0 ? 1 : (u & ~0x3fffU) == 0 ? 2 : (u & ~0x1fffffU) == 0 ? 3 : (u & ~0xfffffffU) == 0 ? 4 : 5;
+}
+
+    void
+CramBuffer::putLTF8(
+    _int64 value)
+{
+    _uint64 u = (_uint64)value;
+    //
+    // The count of leading one bits in the first byte is the number of bytes that follow, and whatever bits are left in
+    // it are the high bits of the value.
+    //
+    int extraBytes;
+    if (u < ((_uint64)1 << 7)) {
+        extraBytes = 0;
+    } else if (u < ((_uint64)1 << 14)) {
+        extraBytes = 1;
+    } else if (u < ((_uint64)1 << 21)) {
+        extraBytes = 2;
+    } else if (u < ((_uint64)1 << 28)) {
+        extraBytes = 3;
+    } else if (u < ((_uint64)1 << 35)) {
+        extraBytes = 4;
+    } else if (u < ((_uint64)1 << 42)) {
+        extraBytes = 5;
+    } else if (u < ((_uint64)1 << 49)) {
+        extraBytes = 6;
+    } else if (u < ((_uint64)1 << 56)) {
+        extraBytes = 7;
+    } else {
+        extraBytes = 8;
+    }
+    _uint8 first = (_uint8)(0xff00 >> extraBytes);
+    if (extraBytes < 7) {
+        first |= (_uint8)(u >> (8 * extraBytes));
+    }
+    putByte(first);
+    for (int i = extraBytes - 1; i >= 0; i--) {
+        putByte((_uint8)(u >> (8 * i)));
+    }
+}
+
+//
+// MD5, following RFC 1321.
+//
+
+static const _uint32 Md5Sines[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const int Md5Shifts[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+CramMD5::CramMD5() : bytes(0)
+{
+    state[0] = 0x67452301;
+    state[1] = 0xefcdab89;
+    state[2] = 0x98badcfe;
+    state[3] = 0x10325476;
+}
+
+    void
+CramMD5::transform(
+    const _uint8* block)
+{
+    _uint32 m[16];
+    for (int i = 0; i < 16; i++) {
+        m[i] = block[4 * i] | (block[4 * i + 1] << 8) | (block[4 * i + 2] << 16) | ((_uint32)block[4 * i + 3] << 24);
+    }
+    _uint32 a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int i = 0; i < 64; i++) {
+        _uint32 f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        _uint32 rotated = a + f + Md5Sines[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (rotated << Md5Shifts[i]) | (rotated >> (32 - Md5Shifts[i]));
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+    void
+CramMD5::update(
+    const void* data,
+    size_t n)
+{
+    const _uint8* p = (const _uint8*)data;
+    size_t have = (size_t)(bytes % 64);
+    bytes += n;
+    if (have > 0) {
+        size_t take = min(n, 64 - have);
+        memcpy(pending + have, p, take);
+        p += take;
+        n -= take;
+        if (have + take < 64) {
+            return;
+        }
+        transform(pending);
+    }
+    for (; n >= 64; p += 64, n -= 64) {
+        transform(p);
+    }
+    memcpy(pending, p, n);
+}
+
+    void
+CramMD5::final(
+    _uint8 digest[16])
+{
+    _uint64 bits = bytes * 8;
+    _uint8 padding[72];
+    size_t padBytes = 64 - (size_t)((bytes + 8) % 64);     // At least one, for the 0x80
+    memset(padding, 0, sizeof(padding));
+    padding[0] = 0x80;
+    for (int i = 0; i < 8; i++) {
+        padding[padBytes + i] = (_uint8)(bits >> (8 * i));
+    }
+    update(padding, padBytes + 8);
+    for (int i = 0; i < 16; i++) {
+        digest[i] = (_uint8)(state[i / 4] >> (8 * (i % 4)));
+    }
+}
+
+CramContainerEncoder::CramContainerEncoder(
+    const Genome* i_genome,
+    int i_compressionLevel)
+    : genome(i_genome), compressionLevel(i_compressionLevel), readBases(NULL), readBasesSize(0)
+{
+    memset(&zstream, 0, sizeof(zstream));
+    // 16 over the window size asks for a gzip header and trailer, which is what CRAM's method 1 is
+    int status = deflateInit2(&zstream, compressionLevel < 0 ? Z_DEFAULT_COMPRESSION : compressionLevel, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
+    if (status != Z_OK) {
+        WriteErrorMessage("CramContainerEncoder: deflateInit2 failed with %d\n", status);
+        soft_exit(1);
+    }
+}
+
+CramContainerEncoder::~CramContainerEncoder()
+{
+    deflateEnd(&zstream);
+    for (VariableSizeVector<TagBlock>::iterator i = tags.begin(); i != tags.end(); i++) {
+        delete i->data;
+    }
+    delete[] readBases;
+}
+
+    CramBuffer*
+CramContainerEncoder::tagBlock(
+    _int32 key)
+{
+    for (VariableSizeVector<TagBlock>::iterator i = tags.begin(); i != tags.end(); i++) {
+        if (i->key == key) {
+            return i->data;
+        }
+    }
+    TagBlock block;
+    block.key = key;
+    block.data = new CramBuffer();
+    tags.push_back(block);
+    return block.data;
+}
+
+    int
+CramContainerEncoder::tagLine(
+    BAMAlignment* bam)
+{
+    //
+    // Write the tag values to their blocks, and build this record's line of the tag dictionary at the end of tagLines
+    // so it can be compared with the ones already there.
+    //
+    size_t lineStart = tagLines.size();
+    for (BAMAlignAux* aux = bam->firstAux(); aux < bam->endAux(); aux = aux->next()) {
+        tagLines.put(aux->tag, 2);
+        tagLines.putByte(aux->val_type);
+        size_t valueBytes = aux->size() - 3;
+        CramBuffer* block = tagBlock((aux->tag[0] << 16) | (aux->tag[1] << 8) | (_uint8)aux->val_type);
+        block->putITF8((_int32)valueBytes);
+        block->put(aux->value(), valueBytes);
+    }
+    tagLines.putByte(0);
+
+    size_t lineBytes = tagLines.size() - lineStart;
+    for (int i = 0; i < tagLineStarts.size(); i++) {
+        size_t start = tagLineStarts[i];
+        size_t bytes = (i + 1 < tagLineStarts.size() ? (size_t)tagLineStarts[i + 1] : lineStart) - start;
+        if (bytes == lineBytes && memcmp(tagLines.data() + start, tagLines.data() + lineStart, lineBytes) == 0) {
+            tagLines.truncate(lineStart);
+            return i;
+        }
+    }
+    tagLineStarts.push_back((int)lineStart);
+    return (int)tagLineStarts.size() - 1;
+}
+
+//
+// The code for a substitution of readBase for refBase, which is its index among ACGTN leaving out refBase (that's the
+// substitution matrix in the compression header), or -1 if either one isn't in ACGTN.
+//
+    static int
+SubstitutionCode(
+    char refBase,
+    char readBase)
+{
+    static const char* bases = "ACGTN";
+    const char* ref = refBase == 0 ? NULL : strchr(bases, refBase);
+    const char* read = readBase == 0 ? NULL : strchr(bases, readBase);
+    if (ref == NULL || read == NULL || ref == read) {
+        return -1;
+    }
+    return read < ref ? (int)(read - bases) : (int)(read - bases) - 1;
+}
+
+// The bases of the reference an alignment covers (which, unlike BAMAlignment::l_ref, leaves out clipping).
+    static int
+ReferenceSpan(
+    BAMAlignment* bam)
+{
+    if (bam->FLAG & SAM_UNMAPPED) {
+        return 0;
+    }
+    int span = 0;
+    _uint32* cigar = bam->cigar();
+    for (int i = 0; i < bam->n_cigar_op; i++) {
+        int op = BAMAlignment::GetCigarOpCode(cigar[i]);
+        if (op == 0 || op == 2 || op == 3 || op == 7 || op == 8) {     // M, D, N, = and X
+            span += BAMAlignment::GetCigarOpCount(cigar[i]);
+        }
+    }
+    return span;
+}
+
+    static void
+PutExternalEncoding(
+    CramBuffer* buffer,
+    _int32 contentId)
+{
+    buffer->putITF8(CramEncodingExternal);
+    buffer->putITF8(CramBuffer::itf8Size(contentId));
+    buffer->putITF8(contentId);
+}
+
+    void
+CramContainerEncoder::decodeBases(
+    BAMAlignment* bam)
+{
+    if (bam->l_seq > readBasesSize) {
+        delete[] readBases;
+        readBasesSize = max(bam->l_seq, 2 * readBasesSize);
+        readBases = new char[readBasesSize + 1];    // decodeSeq writes pairs of bases
+    }
+    BAMAlignment::decodeSeq(readBases, bam->seq(), bam->l_seq);
+}
+
+    void
+CramContainerEncoder::addFeature(
+    char code,
+    int readPos,
+    int* io_lastPos,
+    int* io_nFeatures)
+{
+    series[FC].putByte(code);
+    series[FP].putITF8(readPos - *io_lastPos);
+    *io_lastPos = readPos;
+    (*io_nFeatures)++;
+}
+
+    void
+CramContainerEncoder::encodeFeatures(
+    BAMAlignment* bam)
+{
+    int length = bam->l_seq;
+    decodeBases(bam);
+    const char* quality = bam->qual();
+    bool hasQuality = length > 0 && (_uint8)quality[0] != 0xff;
+
+    //
+    // The reader fills in the bases between features from the reference, so it has to be there for the whole alignment.
+    // If it isn't, every aligned base is written as a base and quality feature, which doesn't need it.
+    //
+    int refSpan = ReferenceSpan(bam);
+    const char* reference = NULL;
+    if (bam->refID >= 0 && bam->refID < genome->getNumContigs() && bam->pos >= 0) {
+        const Genome::Contig* contig = genome->getContigByOriginalContigNumber(bam->refID);
+        if (bam->pos + refSpan <= contig->length - genome->getChromosomePadding()) {
+            reference = genome->getSubstring(contig->beginningLocation + bam->pos, refSpan);
+        }
+    }
+
+    // Feature positions are 1-based in the read, and each one is written as the distance from the one before
+    int nFeatures = 0, lastPos = 0;
+    int readPos = 0, refPos = 0;
+    _uint32* cigar = bam->cigar();
+    for (int i = 0; i < bam->n_cigar_op; i++) {
+        int count = BAMAlignment::GetCigarOpCount(cigar[i]);
+        switch (BAMAlignment::GetCigarOpCode(cigar[i])) {
+        case 0: // M
+        case 7: // =
+        case 8: // X
+            for (int j = 0; j < count && readPos < length; j++, readPos++, refPos++) {
+                char readBase = readBases[readPos];
+                char refBase = reference != NULL ? reference[refPos] : 0;
+                if (readBase == refBase) {
+                    continue;
+                }
+                int code = SubstitutionCode(refBase, readBase);
+                if (code >= 0) {
+                    addFeature('X', readPos + 1, &lastPos, &nFeatures);
+                    series[BS].putByte((_uint8)code);
+                } else {
+                    addFeature('B', readPos + 1, &lastPos, &nFeatures);
+                    series[BA].putByte(readBase);
+                    series[QS].putByte(hasQuality ? quality[readPos] : 0xff);
+                }
+            }
+            break;
+
+        case 1: // I
+            count = min(count, length - readPos);
+            addFeature('I', readPos + 1, &lastPos, &nFeatures);
+            series[IN].put(readBases + readPos, count);
+            series[IN].putByte(0);
+            readPos += count;
+            break;
+
+        case 2: // D
+            addFeature('D', readPos + 1, &lastPos, &nFeatures);
+            series[DL].putITF8(count);
+            refPos += count;
+            break;
+
+        case 3: // N
+            addFeature('N', readPos + 1, &lastPos, &nFeatures);
+            series[RS].putITF8(count);
+            refPos += count;
+            break;
+
+        case 4: // S
+            count = min(count, length - readPos);
+            addFeature('S', readPos + 1, &lastPos, &nFeatures);
+            series[SC].put(readBases + readPos, count);
+            series[SC].putByte(0);
+            readPos += count;
+            break;
+
+        case 5: // H
+            addFeature('H', readPos + 1, &lastPos, &nFeatures);
+            series[HC].putITF8(count);
+            break;
+
+        case 6: // P
+            addFeature('P', readPos + 1, &lastPos, &nFeatures);
+            series[PD].putITF8(count);
+            break;
+        }
+    }
+    series[FN].putITF8(nFeatures);
+}
+
+    void
+CramContainerEncoder::encodeRecord(
+    BAMAlignment* bam,
+    int sliceRefID,
+    bool apDelta,
+    _int32* io_lastAP)
+{
+    int flags = bam->FLAG;
+    int length = bam->l_seq;
+    bool hasQuality = length > 0 && (_uint8)bam->qual()[0] != 0xff;
+
+    series[BF].putITF8(flags);
+    series[CF].putITF8(CramDetached | (hasQuality ? CramQualityArray : 0) | (length == 0 ? CramUnknownBases : 0));
+    if (sliceRefID == -2) {
+        series[RI].putITF8(bam->refID);
+    }
+    series[RL].putITF8(length);
+    _int32 ap = bam->pos + 1;
+    series[AP].putITF8(apDelta ? ap - *io_lastAP : ap);
+    *io_lastAP = ap;
+    series[RG].putITF8(-1);     // Any read group stays in its RG tag
+    series[RN].put(bam->read_name(), bam->l_read_name > 0 ? bam->l_read_name - 1 : 0);
+    series[RN].putByte(0);
+
+    series[MF].putITF8(((flags & SAM_NEXT_REVERSED) ? 1 : 0) | ((flags & SAM_NEXT_UNMAPPED) ? 2 : 0));
+    series[NS].putITF8(bam->next_refID);
+    series[NP].putITF8(bam->next_pos + 1);
+    series[TS].putITF8(bam->tlen);
+
+    series[TL].putITF8(tagLine(bam));
+
+    if (!(flags & SAM_UNMAPPED)) {
+        encodeFeatures(bam);
+        series[MQ].putITF8(bam->MAPQ);
+    } else if (length > 0) {
+        decodeBases(bam);
+        series[BA].put(readBases, length);
+    }
+    if (hasQuality) {
+        series[QS].put(bam->qual(), length);
+    }
+}
+
+    void
+CramContainerEncoder::putBlock(
+    CramBuffer* output,
+    _uint8 method,
+    _uint8 contentType,
+    _int32 contentId,
+    const char* data,
+    size_t bytes,
+    size_t rawBytes)
+{
+    size_t blockStart = output->size();
+    output->putByte(method);
+    output->putByte(contentType);
+    output->putITF8(contentId);
+    output->putITF8((_int32)bytes);
+    output->putITF8((_int32)rawBytes);
+    if (bytes > 0) {
+        output->put(data, bytes);
+    }
+    output->putInt32((_int32)crc32(0, (const Bytef*)output->data() + blockStart, (uInt)(output->size() - blockStart)));
+}
+
+    void
+CramContainerEncoder::writeBlock(
+    CramBuffer* output,
+    _uint8 contentType,
+    _int32 contentId,
+    const char* data,
+    size_t bytes,
+    bool compress)
+{
+    if (compress && compressionLevel != 0 && bytes > 0) {
+        deflateReset(&zstream);
+        size_t bound = deflateBound(&zstream, (uLong)bytes);
+        compressed.clear();
+        compressed.reserve(bound);
+        zstream.next_in = (Bytef*)data;
+        zstream.avail_in = (uInt)bytes;
+        zstream.next_out = (Bytef*)compressed.data();
+        zstream.avail_out = (uInt)bound;
+        int status = deflate(&zstream, Z_FINISH);
+        if (status != Z_STREAM_END) {
+            WriteErrorMessage("CramContainerEncoder: deflate failed with %d\n", status);
+            soft_exit(1);
+        }
+        size_t compressedBytes = bound - zstream.avail_out;
+        if (compressedBytes < bytes) {
+            putBlock(output, CramGzip, contentType, contentId, compressed.data(), compressedBytes, bytes);
+            return;
+        }
+    }
+    putBlock(output, CramRaw, contentType, contentId, data, bytes, bytes);
+}
+
+    void
+CramContainerEncoder::writeCompressionHeader(
+    CramBuffer* header,
+    bool apDelta)
+{
+    header->clear();
+
+    // Preservation map
+    scratch.clear();
+    scratch.putITF8(5);
+    scratch.put("RN", 2);
+    scratch.putByte(1);                 // Read names are kept
+    scratch.put("AP", 2);
+    scratch.putByte(apDelta ? 1 : 0);   // Positions are deltas from the previous record's
+    scratch.put("RR", 2);
+    scratch.putByte(1);                 // The reference is needed to decode
+    scratch.put("SM", 2);
+    for (int i = 0; i < 5; i++) {
+        scratch.putByte(0x1b);          // For each reference base, codes 0-3 are the other bases in ACGTN order
+    }
+    scratch.put("TD", 2);
+    scratch.putITF8((_int32)tagLines.size());
+    scratch.put(tagLines.data(), tagLines.size());
+    header->putITF8((_int32)scratch.size());
+    header->put(scratch.data(), scratch.size());
+
+    // Data series encodings
+    scratch.clear();
+    scratch.putITF8(NumSeries);
+    for (int s = 0; s < NumSeries; s++) {
+        scratch.put(SeriesNames + 2 * s, 2);
+        if (s == RN || s == IN || s == SC) {
+            scratch.putITF8(CramEncodingByteArrayStop);
+            scratch.putITF8(1 + CramBuffer::itf8Size(s + 1));
+            scratch.putByte(0);
+            scratch.putITF8(s + 1);
+        } else {
+            PutExternalEncoding(&scratch, s + 1);
+        }
+    }
+    header->putITF8((_int32)scratch.size());
+    header->put(scratch.data(), scratch.size());
+
+    // Tag encodings: a length and then the BAM form of the value, both in the tag's own block
+    scratch.clear();
+    int nTags = 0;
+    for (VariableSizeVector<TagBlock>::iterator i = tags.begin(); i != tags.end(); i++) {
+        nTags += i->data->size() > 0;
+    }
+    scratch.putITF8(nTags);
+    for (VariableSizeVector<TagBlock>::iterator i = tags.begin(); i != tags.end(); i++) {
+        if (i->data->size() > 0) {
+            scratch.putITF8(i->key);
+            scratch.putITF8(CramEncodingByteArrayLen);
+            scratch.putITF8(2 * (2 + CramBuffer::itf8Size(i->key)));
+            PutExternalEncoding(&scratch, i->key);
+            PutExternalEncoding(&scratch, i->key);
+        }
+    }
+    header->putITF8((_int32)scratch.size());
+    header->put(scratch.data(), scratch.size());
+}
+
+    void
+CramContainerEncoder::encode(
+    char* records,
+    size_t bytes,
+    int nRecords,
+    _int64 recordCounter,
+    CramBuffer* output)
+{
+    //
+    // Work out what the slice covers: one contig (the usual case for sorted output, where the positions can then be
+    // written as deltas), only unplaced reads (-1), or a mix (-2), in which case each record has its contig.
+    //
+    int sliceRefID = 0;
+    _int32 start = INT32_MAX, end = 0, lastPos = -1;
+    bool apDelta = true;
+    _int64 bases = 0;
+    size_t offset = 0;
+    for (int i = 0; i < nRecords; i++) {
+        BAMAlignment* bam = (BAMAlignment*)(records + offset);
+        offset += bam->size();
+        _ASSERT(offset <= bytes);
+        if (i == 0) {
+            sliceRefID = bam->refID;
+        } else if (bam->refID != sliceRefID) {
+            sliceRefID = -2;
+        }
+        apDelta &= bam->pos >= lastPos;
+        lastPos = bam->pos;
+        bases += bam->l_seq;
+        if (bam->refID >= 0 && bam->pos >= 0) {
+            start = min(start, bam->pos + 1);
+            end = max(end, bam->pos + max(1, ReferenceSpan(bam)));
+        }
+    }
+    _int32 span = 0;
+    _uint8 md5[16];
+    memset(md5, 0, sizeof(md5));
+    if (sliceRefID >= 0 && start <= end) {
+        const Genome::Contig* contig = genome->getContigByOriginalContigNumber(sliceRefID);
+        span = (_int32)min((GenomeDistance)(end - start + 1), contig->length - genome->getChromosomePadding() - (start - 1));
+        const char* reference = genome->getSubstring(contig->beginningLocation + start - 1, span);
+        if (reference != NULL) {
+            CramMD5 hash;
+            hash.update(reference, span);
+            hash.final(md5);
+        }
+    } else {
+        apDelta = false;
+        start = 0;
+    }
+
+    for (int s = 0; s < NumSeries; s++) {
+        series[s].clear();
+    }
+    for (VariableSizeVector<TagBlock>::iterator i = tags.begin(); i != tags.end(); i++) {
+        i->data->clear();
+    }
+    tagLines.clear();
+    tagLineStarts.clear();
+
+    _int32 lastAP = start;
+    offset = 0;
+    for (int i = 0; i < nRecords; i++) {
+        BAMAlignment* bam = (BAMAlignment*)(records + offset);
+        offset += bam->size();
+        encodeRecord(bam, sliceRefID, apDelta, &lastAP);
+    }
+
+    writeCompressionHeader(&compressionHeader, apDelta);
+
+    // Slice header
+    int nExternal = 0;
+    for (int s = 0; s < NumSeries; s++) {
+        nExternal += series[s].size() > 0;
+    }
+    for (VariableSizeVector<TagBlock>::iterator i = tags.begin(); i != tags.end(); i++) {
+        nExternal += i->data->size() > 0;
+    }
+    sliceHeader.clear();
+    sliceHeader.putITF8(sliceRefID);
+    sliceHeader.putITF8(start);
+    sliceHeader.putITF8(span);
+    sliceHeader.putITF8(nRecords);
+    sliceHeader.putLTF8(recordCounter);
+    sliceHeader.putITF8(1 + nExternal);     // The core block and the external ones
+    sliceHeader.putITF8(nExternal);
+    for (int s = 0; s < NumSeries; s++) {
+        if (series[s].size() > 0) {
+            sliceHeader.putITF8(s + 1);
+        }
+    }
+    for (VariableSizeVector<TagBlock>::iterator i = tags.begin(); i != tags.end(); i++) {
+        if (i->data->size() > 0) {
+            sliceHeader.putITF8(i->key);
+        }
+    }
+    sliceHeader.putITF8(-1);                // No embedded reference
+    sliceHeader.put(md5, sizeof(md5));
+
+    blocks.clear();
+    writeBlock(&blocks, CramCompressionHeader, 0, compressionHeader.data(), compressionHeader.size(), false);
+    _int32 sliceOffset = (_int32)blocks.size();
+    writeBlock(&blocks, CramSliceHeader, 0, sliceHeader.data(), sliceHeader.size(), false);
+    writeBlock(&blocks, CramCoreData, 0, NULL, 0, false);  // Everything is in external blocks, so this is empty
+    for (int s = 0; s < NumSeries; s++) {
+        if (series[s].size() > 0) {
+            writeBlock(&blocks, CramExternalData, s + 1, series[s].data(), series[s].size(), true);
+        }
+    }
+    for (VariableSizeVector<TagBlock>::iterator i = tags.begin(); i != tags.end(); i++) {
+        if (i->data->size() > 0) {
+            writeBlock(&blocks, CramExternalData, i->key, i->data->data(), i->data->size(), true);
+        }
+    }
+
+    containerHeader.clear();
+    containerHeader.putInt32((_int32)blocks.size());
+    containerHeader.putITF8(sliceRefID);
+    containerHeader.putITF8(start);
+    containerHeader.putITF8(span);
+    containerHeader.putITF8(nRecords);
+    containerHeader.putLTF8(recordCounter);
+    containerHeader.putLTF8(bases);
+    containerHeader.putITF8(3 + nExternal);
+    containerHeader.putITF8(1);             // One slice, and where it starts
+    containerHeader.putITF8(sliceOffset);
+    containerHeader.putInt32((_int32)crc32(0, (const Bytef*)containerHeader.data(), (uInt)containerHeader.size()));
+
+    output->put(containerHeader.data(), containerHeader.size());
+    output->put(blocks.data(), blocks.size());
+}
+
+    bool
+CramContainerEncoder::encodeHeader(
+    const Genome* genome,
+    const char* bamHeader,
+    size_t bytes,
+    const char* fileName,
+    size_t* o_headerBytes,
+    CramBuffer* output)
+{
+    BAMHeader* header = (BAMHeader*)bamHeader;
+    if (bytes < BAMHeader::size(0) || header->magic != BAMHeader::BAM_MAGIC || header->l_text < 0 || BAMHeader::size(header->l_text) > bytes) {
+        return false;
+    }
+    size_t headerBytes = header->size();
+    BAMHeaderRefSeq* refSeq = header->firstRefSeq();
+    for (int i = 0; i < header->n_ref(); i++) {
+        if (headerBytes + sizeof(_int32) > bytes || headerBytes + BAMHeaderRefSeq::size(refSeq->l_name) > bytes) {
+            return false;
+        }
+        headerBytes += BAMHeaderRefSeq::size(refSeq->l_name);
+        refSeq = refSeq->next();
+    }
+    *o_headerBytes = headerBytes;
+
+    //
+    // Copy the SAM header text, adding the MD5 of each contig to its @SQ line so that readers can check they have the
+    // right reference.
+    //
+    CramBuffer text;
+    const char* line = header->text();
+    const char* textEnd = line + header->l_text;
+    char* upper = new char[65536];
+    while (line < textEnd) {
+        const char* lineEnd = (const char*)memchr(line, '\n', textEnd - line);
+        if (lineEnd == NULL) {
+            lineEnd = textEnd;
+        }
+        text.put(line, lineEnd - line);
+        if (lineEnd - line > 4 && memcmp(line, "@SQ\t", 4) == 0) {
+            const char* name = NULL;
+            bool hasMD5 = false;
+            for (const char* field = line; field != NULL && field < lineEnd; field = (const char*)memchr(field + 1, '\t', lineEnd - field - 1)) {
+                if (lineEnd - field > 4 && memcmp(field, "\tSN:", 4) == 0) {
+                    name = field + 4;
+                } else if (lineEnd - field > 4 && memcmp(field, "\tM5:", 4) == 0) {
+                    hasMD5 = true;
+                }
+            }
+            GenomeLocation location;
+            InternalContigNum contigNum;
+            if (name != NULL && !hasMD5 && genome != NULL) {
+                const char* nameEnd = (const char*)memchr(name, '\t', lineEnd - name);
+                std::string contigName(name, nameEnd == NULL ? lineEnd - name : nameEnd - name);
+                if (genome->getLocationOfContig(contigName.c_str(), &location, &contigNum)) {
+                    const Genome::Contig* contig = genome->getContigByInternalNumber(contigNum);
+                    GenomeDistance length = contig->length - genome->getChromosomePadding();
+                    const char* bases = genome->getSubstring(contig->beginningLocation, length);
+                    if (bases != NULL) {
+                        CramMD5 hash;
+                        for (GenomeDistance done = 0; done < length; done += 65536) {
+                            size_t chunk = (size_t)min((GenomeDistance)65536, length - done);
+                            for (size_t i = 0; i < chunk; i++) {
+                                upper[i] = toupper(bases[done + i]);
+                            }
+                            hash.update(upper, chunk);
+                        }
+                        _uint8 md5[16];
+                        hash.final(md5);
+                        char hex[37];
+                        strcpy(hex, "\tM5:");
+                        for (int i = 0; i < 16; i++) {
+                            sprintf(hex + 4 + 2 * i, "%02x", md5[i]);
+                        }
+                        text.put(hex, 36);
+                    }
+                }
+            }
+        }
+        if (lineEnd < textEnd) {
+            text.putByte('\n');
+        }
+        line = lineEnd + 1;
+    }
+    delete[] upper;
+
+    // File definition: magic, version 3.0 and a 20 byte file id, which is the file's name
+    output->put("CRAM", 4);
+    output->putByte(3);
+    output->putByte(0);
+    char fileId[20];
+    memset(fileId, 0, sizeof(fileId));
+    if (fileName != NULL) {
+        const char* baseName = strrchr(fileName, '/');
+        baseName = baseName == NULL ? fileName : baseName + 1;
+        memcpy(fileId, baseName, min(strlen(baseName), sizeof(fileId)));
+    }
+    output->put(fileId, sizeof(fileId));
+
+    // The header container, with one raw block of the text's length and the text
+    CramBuffer content, block, containerHeader;
+    content.putInt32((_int32)text.size());
+    content.put(text.data(), text.size());
+    putBlock(&block, CramRaw, CramFileHeader, 0, content.data(), content.size(), content.size());
+    containerHeader.putInt32((_int32)block.size());
+    containerHeader.putITF8(0);     // reference
+    containerHeader.putITF8(0);     // start
+    containerHeader.putITF8(0);     // span
+    containerHeader.putITF8(0);     // records
+    containerHeader.putLTF8(0);     // record counter
+    containerHeader.putLTF8(0);     // bases
+    containerHeader.putITF8(1);     // blocks
+    containerHeader.putITF8(0);     // landmarks
+    containerHeader.putInt32((_int32)crc32(0, (const Bytef*)containerHeader.data(), (uInt)containerHeader.size()));
+    output->put(containerHeader.data(), containerHeader.size());
+    output->put(block.data(), block.size());
+
+    return true;
+}
+
+//
+// Decoding
+//
+
+static const char* DecoderSeriesNames = "BFCFRIRLAPRGRNMFNSNPTSNFTLFNFCFPBSINDLRSPDHCSCBAQSMQBBQQ";
+
+    const char*
+CramCursor::get(
+    size_t bytes)
+{
+    if (bytes > (size_t)(end - p)) {
+        overrun = true;
+        p = end;
+        return NULL;
+    }
+    const char* result = p;
+    p += bytes;
+    return result;
+}
+
+    _int32
+CramCursor::getInt32()
+{
+    const char* bytes = get(4);
+    if (bytes == NULL) {
+        return 0;
+    }
+    _uint32 value = 0;
+    for (int i = 3; i >= 0; i--) {
+        value = (value << 8) | (_uint8)bytes[i];
+    }
+    return (_int32)value;
+}
+
+    _int32
+CramCursor::getITF8()
+{
+    _uint32 value = getByte();
+    if (value < 0x80) {
+        return value;
+    }
+    int extraBytes = value < 0xc0 ? 1 : value < 0xe0 ? 2 : value < 0xf0 ? 3 : 4;
+    value &= extraBytes == 4 ? 0x0f : 0xff >> (extraBytes + 1);
+    for (int i = 0; i < extraBytes; i++) {
+        if (i == 3) {
+            // The last byte only has the low 4 bits
+            value = (value << 4) | (getByte() & 0xf);
+        } else {
+            value = (value << 8) | getByte();
+        }
+    }
+    return (_int32)value;
+}
+
+    _int64
+CramCursor::getLTF8()
+{
+    _uint8 first = getByte();
+    int extraBytes = 0;
+    while (extraBytes < 8 && (first & (0x80 >> extraBytes))) {
+        extraBytes++;
+    }
+    _uint64 value = extraBytes == 8 ? 0 : first & (0xff >> (extraBytes + 1));
+    for (int i = 0; i < extraBytes; i++) {
+        value = (value << 8) | getByte();
+    }
+    return (_int64)value;
+}
+
+    bool
+CramContainerHeader::parse(
+    const char* data,
+    size_t bytes)
+{
+    CramCursor cursor(data, bytes);
+    length = cursor.getInt32();
+    refID = cursor.getITF8();
+    start = cursor.getITF8();
+    span = cursor.getITF8();
+    nRecords = cursor.getITF8();
+    recordCounter = cursor.getLTF8();
+    this->bases = cursor.getLTF8();
+    nBlocks = cursor.getITF8();
+    _int32 nLandmarks = cursor.getITF8();
+    landmarks.clear();
+    for (int i = 0; i < nLandmarks && !cursor.overrun; i++) {
+        landmarks.push_back(cursor.getITF8());
+    }
+    _uint32 crc = (_uint32)cursor.getInt32();
+    if (cursor.overrun) {
+        return false;
+    }
+    headerBytes = cursor.position() - data;
+    if (length < 0 || nLandmarks < 0 || crc != (_uint32)crc32(0, (const Bytef*)data, (uInt)(headerBytes - 4))) {
+        WriteErrorMessage("CRAM file is corrupt: bad container header\n");
+        soft_exit(1);
+    }
+    return true;
+}
+
+CramHeader::~CramHeader()
+{
+    for (int i = 0; i < nRefs; i++) {
+        delete[] refNames[i];
+    }
+    delete[] refNames;
+    delete[] refBases;
+    delete[] refLengths;
+}
+
+// The value of a field in a SAM header line (which starts at a tab), or NULL if it isn't there.
+    static const char*
+HeaderField(
+    const char* line,
+    const char* lineEnd,
+    const char* tag,
+    size_t* o_length)
+{
+    for (const char* field = (const char*)memchr(line, '\t', lineEnd - line); field != NULL; field = (const char*)memchr(field + 1, '\t', lineEnd - field - 1)) {
+        if (lineEnd - field > 4 && field[1] == tag[0] && field[2] == tag[1] && field[3] == ':') {
+            const char* value = field + 4;
+            const char* valueEnd = (const char*)memchr(value, '\t', lineEnd - value);
+            *o_length = (valueEnd == NULL ? lineEnd : valueEnd) - value;
+            return value;
+        }
+    }
+    return NULL;
+}
+
+    void
+CramHeader::addReference(
+    const char* name,
+    size_t nameLength,
+    _int32 length,
+    const char* fileName)
+{
+    char* copy = new char[nameLength + 1];
+    memcpy(copy, name, nameLength);
+    copy[nameLength] = 0;
+    refNames[nRefs] = copy;
+    refLengths[nRefs] = length;
+    refBases[nRefs] = NULL;
+
+    GenomeLocation location;
+    InternalContigNum contigNum;
+    if (genome != NULL && genome->getLocationOfContig(copy, &location, &contigNum)) {
+        const Genome::Contig* contig = genome->getContigByInternalNumber(contigNum);
+        GenomeDistance contigLength = contig->length - genome->getChromosomePadding();
+        if (contigLength != length) {
+            WriteErrorMessage("Contig %s is %d bases long in CRAM file %s, but %lld in the index, so the file wasn't written against this reference\n",
+                copy, length, fileName, (_int64)contigLength);
+            soft_exit(1);
+        }
+        refBases[nRefs] = genome->getSubstring(contig->beginningLocation, contigLength);
+    }
+    nRefs++;
+
+    bam.putInt32((_int32)nameLength + 1);
+    bam.put(copy, nameLength + 1);
+    bam.putInt32(length);
+}
+
+    bool
+CramHeader::decode(
+    const char* data,
+    size_t bytes,
+    const char* fileName,
+    size_t* o_bytes)
+{
+    if (bytes < 26) {
+        return false;
+    }
+    if (memcmp(data, "CRAM", 4) != 0) {
+        WriteErrorMessage("%s isn't a CRAM file\n", fileName);
+        soft_exit(1);
+    }
+    if (data[4] != 3) {
+        WriteErrorMessage("%s is CRAM version %d.%d; only version 3 can be read\n", fileName, data[4], data[5]);
+        soft_exit(1);
+    }
+    CramContainerHeader containerHeader;
+    if (!containerHeader.parse(data + 26, bytes - 26) || bytes - 26 - containerHeader.headerBytes < (size_t)containerHeader.length) {
+        return false;
+    }
+    *o_bytes = 26 + containerHeader.headerBytes + containerHeader.length;
+
+    CramContainerDecoder decoder(this);
+    CramCursor cursor(data + 26 + containerHeader.headerBytes, containerHeader.length);
+    CramContainerDecoder::Block block;
+    decoder.readBlock(&cursor, &block);
+    CramCursor content(block.data, block.bytes);
+    _int32 textLength = content.getInt32();
+    const char* text = content.get(textLength);
+    if (block.contentType != CramFileHeader || text == NULL) {
+        WriteErrorMessage("CRAM file %s is corrupt: bad header container\n", fileName);
+        soft_exit(1);
+    }
+    // Writers may pad the text with NULs
+    const char* textEnd = (const char*)memchr(text, 0, textLength);
+    if (textEnd == NULL) {
+        textEnd = text + textLength;
+    }
+
+    int nSQ = 0;
+    for (const char* line = text; line < textEnd; line++) {
+        nSQ += textEnd - line > 4 && memcmp(line, "@SQ\t", 4) == 0 && (line == text || line[-1] == '\n');
+    }
+    refNames = new char*[nSQ];
+    refBases = new const char*[nSQ];
+    refLengths = new _int32[nSQ];
+
+    bam.clear();
+    bam.putInt32(BAMHeader::BAM_MAGIC);
+    bam.putInt32((_int32)(textEnd - text));
+    bam.put(text, textEnd - text);
+    size_t nRefOffset = bam.size();
+    bam.putInt32(0);
+
+    for (const char* line = text; line < textEnd; ) {
+        const char* lineEnd = (const char*)memchr(line, '\n', textEnd - line);
+        if (lineEnd == NULL) {
+            lineEnd = textEnd;
+        }
+        size_t length;
+        if (lineEnd - line > 4 && memcmp(line, "@SQ\t", 4) == 0) {
+            const char* name = HeaderField(line, lineEnd, "SN", &length);
+            size_t lengthLength;
+            const char* refLength = HeaderField(line, lineEnd, "LN", &lengthLength);
+            if (name == NULL || refLength == NULL) {
+                WriteErrorMessage("CRAM file %s has an @SQ line without SN or LN\n", fileName);
+                soft_exit(1);
+            }
+            addReference(name, length, atoi(refLength), fileName);
+        } else if (lineEnd - line > 4 && memcmp(line, "@RG\t", 4) == 0) {
+            const char* id = HeaderField(line, lineEnd, "ID", &length);
+            readGroupStarts.push_back((int)readGroups.size());
+            if (id != NULL) {
+                readGroups.put(id, length);
+            }
+            readGroups.putByte(0);
+        }
+        line = lineEnd + 1;
+    }
+    *(_int32*)(bam.data() + nRefOffset) = nRefs;
+    return true;
+}
+
+//
+// How a data series or tag is stored.
+//
+struct CramContainerDecoder::Encoding
+{
+    Encoding() : codec(CramEncodingNull), contentId(0), block(NULL), stop(0), offset(0), bits(0),
+        nSymbols(0), symbols(NULL), lengths(NULL), codes(NULL), lengthEncoding(NULL), valueEncoding(NULL) {}
+
+    ~Encoding()
+    {
+        delete[] symbols;
+        delete[] lengths;
+        delete[] codes;
+    }
+
+    _int32      codec;
+    _int32      contentId;      // EXTERNAL and BYTE_ARRAY_STOP
+    CramCursor* block;          // The slice's block for contentId
+    _uint8      stop;           // BYTE_ARRAY_STOP
+    _int32      offset;         // BETA, GAMMA and SUBEXP
+    int         bits;           // BETA's bits and SUBEXP's k
+
+    // HUFFMAN, as a canonical code: the symbols in order of code length and then value, and their codes
+    int         nSymbols;
+    _int32*     symbols;
+    int*        lengths;
+    _uint32*    codes;
+
+    Encoding*   lengthEncoding; // BYTE_ARRAY_LEN
+    Encoding*   valueEncoding;
+};
+
+CramContainerDecoder::CramContainerDecoder(
+    const CramHeader* i_header)
+    : header(i_header), blocksUsed(0), coreBit(0), coreByte(0), reference(NULL), referenceStart(1), referenceLength(0),
+    referenceID(-1), embeddedReference(false)
+{
+    memset(&zstream, 0, sizeof(zstream));
+    int status = inflateInit2(&zstream, 15 + 32);   // zlib or gzip
+    if (status != Z_OK) {
+        WriteErrorMessage("CramContainerDecoder: inflateInit2 failed with %d\n", status);
+        soft_exit(1);
+    }
+    for (int s = 0; s < NumSeries; s++) {
+        series[s] = NULL;
+    }
+}
+
+CramContainerDecoder::~CramContainerDecoder()
+{
+    inflateEnd(&zstream);
+    for (VariableSizeVector<Encoding*>::iterator i = encodings.begin(); i != encodings.end(); i++) {
+        delete *i;
+    }
+    for (VariableSizeVector<CramBuffer*>::iterator i = blockBuffers.begin(); i != blockBuffers.end(); i++) {
+        delete *i;
+    }
+}
+
+    void
+CramContainerDecoder::corrupt(
+    const char* what)
+{
+    WriteErrorMessage("CRAM file is corrupt or uses features SNAP can't read: %s\n", what);
+    soft_exit(1);
+}
+
+    void
+CramContainerDecoder::readBlock(
+    CramCursor* cursor,
+    Block* o_block)
+{
+    const char* blockStart = cursor->position();
+    _uint8 method = cursor->getByte();
+    o_block->contentType = cursor->getByte();
+    o_block->contentId = cursor->getITF8();
+    _int32 size = cursor->getITF8();
+    _int32 rawSize = cursor->getITF8();
+    const char* data = size < 0 ? NULL : cursor->get(size);
+    if (data == NULL || rawSize < 0) {
+        corrupt("truncated block");
+    }
+    _uint32 crc = (_uint32)crc32(0, (const Bytef*)blockStart, (uInt)(cursor->position() - blockStart));
+    if ((_uint32)cursor->getInt32() != crc || cursor->overrun) {
+        corrupt("bad block CRC");
+    }
+
+    if (method == CramRaw) {
+        o_block->data = data;
+        o_block->bytes = size;
+        return;
+    }
+
+    if (blocksUsed == blockBuffers.size()) {
+        blockBuffers.push_back(new CramBuffer());
+    }
+    CramBuffer* buffer = blockBuffers[blocksUsed++];
+    buffer->clear();
+    if (method == CramGzip) {
+        char* output = buffer->append(rawSize);
+        zstream.next_in = (Bytef*)data;
+        zstream.avail_in = size;
+        zstream.next_out = (Bytef*)output;
+        zstream.avail_out = rawSize;
+        int status;
+        do {
+            // Allow for more than one gzip member
+            inflateReset(&zstream);
+            status = inflate(&zstream, Z_FINISH);
+        } while (status == Z_STREAM_END && zstream.avail_in > 0 && zstream.avail_out > 0);
+        if (status != Z_STREAM_END || zstream.avail_out != 0) {
+            corrupt("bad gzip block");
+        }
+    } else if (method == CramRans) {
+        if (!uncompressRans(data, size, buffer) || buffer->size() != (size_t)rawSize) {
+            corrupt("bad rANS block");
+        }
+    } else if (method == CramBzip2 || method == CramLzma) {
+        WriteErrorMessage("CRAM file has blocks compressed with %s, which SNAP can't read.  Convert it with samtools (which uses gzip and rANS by default) first.\n",
+            method == CramBzip2 ? "bzip2" : "lzma");
+        soft_exit(1);
+    } else {
+        WriteErrorMessage("CRAM file has blocks compressed with method %d (one of the CRAM 3.1 codecs?), which SNAP can't read.  Convert it to CRAM 3.0 with samtools first.\n", method);
+        soft_exit(1);
+    }
+    o_block->data = buffer->data();
+    o_block->bytes = buffer->size();
+}
+
+    CramContainerDecoder::Encoding*
+CramContainerDecoder::parseEncoding(
+    CramCursor* cursor)
+{
+    Encoding* encoding = new Encoding();
+    encodings.push_back(encoding);
+    encoding->codec = cursor->getITF8();
+    _int32 paramBytes = cursor->getITF8();
+    const char* params = paramBytes < 0 ? NULL : cursor->get(paramBytes);
+    if (params == NULL) {
+        corrupt("truncated encoding");
+    }
+    CramCursor p(params, paramBytes);
+    switch (encoding->codec) {
+    case CramEncodingNull:
+        break;
+
+    case CramEncodingExternal:
+        encoding->contentId = p.getITF8();
+        break;
+
+    case CramEncodingHuffman: {
+        int n = p.getITF8();
+        if (n <= 0 || n > paramBytes) {
+            corrupt("bad Huffman alphabet");
+        }
+        encoding->nSymbols = n;
+        encoding->symbols = new _int32[n];
+        encoding->lengths = new int[n];
+        encoding->codes = new _uint32[n];
+        for (int i = 0; i < n; i++) {
+            encoding->symbols[i] = p.getITF8();
+        }
+        if (p.getITF8() != n) {
+            corrupt("bad Huffman code lengths");
+        }
+        for (int i = 0; i < n; i++) {
+            encoding->lengths[i] = p.getITF8();
+            if (encoding->lengths[i] < 0 || encoding->lengths[i] > 31) {
+                corrupt("bad Huffman code length");
+            }
+        }
+        // Sort by length and then symbol (insertion sort: alphabets are small), and assign codes in that order
+        for (int i = 1; i < n; i++) {
+            _int32 symbol = encoding->symbols[i];
+            int length = encoding->lengths[i];
+            int j = i;
+            for (; j > 0 && (encoding->lengths[j - 1] > length || (encoding->lengths[j - 1] == length && encoding->symbols[j - 1] > symbol)); j--) {
+                encoding->symbols[j] = encoding->symbols[j - 1];
+                encoding->lengths[j] = encoding->lengths[j - 1];
+            }
+            encoding->symbols[j] = symbol;
+            encoding->lengths[j] = length;
+        }
+        _uint32 code = 0;
+        for (int i = 0; i < n; i++) {
+            if (i > 0) {
+                code = (code + 1) << (encoding->lengths[i] - encoding->lengths[i - 1]);
+            }
+            encoding->codes[i] = code;
+        }
+        break;
+    }
+
+    case CramEncodingByteArrayLen:
+        encoding->lengthEncoding = parseEncoding(&p);
+        encoding->valueEncoding = parseEncoding(&p);
+        break;
+
+    case CramEncodingByteArrayStop:
+        encoding->stop = p.getByte();
+        encoding->contentId = p.getITF8();
+        break;
+
+    case CramEncodingBeta:
+        encoding->offset = p.getITF8();
+        encoding->bits = p.getITF8();
+        break;
+
+    case CramEncodingSubexp:
+        encoding->offset = p.getITF8();
+        encoding->bits = p.getITF8();
+        break;
+
+    case CramEncodingGamma:
+        encoding->offset = p.getITF8();
+        break;
+
+    default:
+        // Only an error if something is actually stored with it
+        break;
+    }
+    if (p.overrun || encoding->bits < 0 || encoding->bits > 32) {
+        corrupt("bad encoding parameters");
+    }
+    return encoding;
+}
+
+    void
+CramContainerDecoder::readCompressionHeader(
+    const Block& block)
+{
+    CramCursor cursor(block.data, block.bytes);
+    for (VariableSizeVector<Encoding*>::iterator i = encodings.begin(); i != encodings.end(); i++) {
+        delete *i;
+    }
+    encodings.clear();
+
+    // Preservation map, where anything not given has its default
+    readNamesIncluded = true;
+    apDelta = true;
+    referenceRequired = true;
+    _uint8 matrix[5] = {0x1b, 0x1b, 0x1b, 0x1b, 0x1b};
+    tagDictionary.clear();
+    tagLineStarts.clear();
+    bool sawTagDictionary = false;
+    cursor.getITF8();
+    int n = cursor.getITF8();
+    for (int i = 0; i < n && !cursor.overrun; i++) {
+        const char* key = cursor.get(2);
+        if (key == NULL) {
+            break;
+        }
+        if (memcmp(key, "RN", 2) == 0) {
+            readNamesIncluded = cursor.getByte() != 0;
+        } else if (memcmp(key, "AP", 2) == 0) {
+            apDelta = cursor.getByte() != 0;
+        } else if (memcmp(key, "RR", 2) == 0) {
+            referenceRequired = cursor.getByte() != 0;
+        } else if (memcmp(key, "SM", 2) == 0) {
+            for (int b = 0; b < 5; b++) {
+                matrix[b] = cursor.getByte();
+            }
+        } else if (memcmp(key, "TD", 2) == 0) {
+            _int32 length = cursor.getITF8();
+            const char* dictionary = length < 0 ? NULL : cursor.get(length);
+            if (dictionary == NULL) {
+                corrupt("truncated tag dictionary");
+            }
+            tagDictionary.put(dictionary, length);
+            sawTagDictionary = true;
+        } else {
+            corrupt("unknown preservation map key");
+        }
+    }
+    if (!sawTagDictionary) {
+        tagDictionary.putByte(0);   // One empty line
+    }
+    for (size_t start = 0; start < tagDictionary.size(); ) {
+        tagLineStarts.push_back((int)start);
+        const char* end = (const char*)memchr(tagDictionary.data() + start, 0, tagDictionary.size() - start);
+        if (end == NULL || (end - tagDictionary.data() - start) % 3 != 0) {
+            corrupt("bad tag dictionary");
+        }
+        start = end - tagDictionary.data() + 1;
+    }
+
+    //
+    // Each byte of the substitution matrix has 2 bit codes for the other four bases in ACGTN order, highest bits first.
+    //
+    static const char* bases = "ACGTN";
+    for (int ref = 0; ref < 5; ref++) {
+        for (int code = 0; code < 4; code++) {
+            substitutions[ref][code] = 'N';
+        }
+        for (int alt = 0, j = 0; alt < 5; alt++) {
+            if (alt != ref) {
+                substitutions[ref][(matrix[ref] >> (6 - 2 * j)) & 3] = bases[alt];
+                j++;
+            }
+        }
+    }
+
+    // Data series encodings
+    for (int s = 0; s < NumSeries; s++) {
+        series[s] = NULL;
+    }
+    cursor.getITF8();
+    n = cursor.getITF8();
+    for (int i = 0; i < n && !cursor.overrun; i++) {
+        const char* key = cursor.get(2);
+        if (key == NULL) {
+            break;
+        }
+        Encoding* encoding = parseEncoding(&cursor);
+        for (int s = 0; s < NumSeries; s++) {
+            if (memcmp(DecoderSeriesNames + 2 * s, key, 2) == 0) {
+                series[s] = encoding;
+            }
+        }
+    }
+
+    // Tag encodings
+    tagKeys.clear();
+    tagEncodings.clear();
+    cursor.getITF8();
+    n = cursor.getITF8();
+    for (int i = 0; i < n && !cursor.overrun; i++) {
+        tagKeys.push_back(cursor.getITF8());
+        tagEncodings.push_back(parseEncoding(&cursor));
+    }
+    if (cursor.overrun) {
+        corrupt("truncated compression header");
+    }
+}
+
+    CramCursor*
+CramContainerDecoder::externalBlock(
+    _int32 contentId)
+{
+    for (int i = 0; i < contentIds.size(); i++) {
+        if (contentIds[i] == contentId) {
+            return &externals[i];
+        }
+    }
+    return &missing;
+}
+
+    CramContainerDecoder::Encoding*
+CramContainerDecoder::seriesEncoding(
+    Series s)
+{
+    if (series[s] == NULL) {
+        char message[40];
+        sprintf(message, "no encoding for data series %.2s", DecoderSeriesNames + 2 * s);
+        corrupt(message);
+    }
+    return series[s];
+}
+
+    int
+CramContainerDecoder::readBit()
+{
+    if (coreBit == 0) {
+        coreByte = core.getByte();
+        if (core.overrun) {
+            corrupt("core block too short");
+        }
+        coreBit = 8;
+    }
+    coreBit--;
+    return (coreByte >> coreBit) & 1;
+}
+
+    _uint32
+CramContainerDecoder::readBits(
+    int count)
+{
+    _uint32 value = 0;
+    for (int i = 0; i < count; i++) {
+        value = (value << 1) | readBit();
+    }
+    return value;
+}
+
+    _int32
+CramContainerDecoder::decodeValue(
+    Encoding* encoding)
+{
+    switch (encoding->codec) {
+    case CramEncodingExternal: {
+        _int32 value = encoding->block->getITF8();
+        if (encoding->block->overrun) {
+            corrupt("external block too short");
+        }
+        return value;
+    }
+
+    case CramEncodingHuffman: {
+        _uint32 code = 0;
+        int length = 0;
+        for (int i = 0; i < encoding->nSymbols; ) {
+            while (length < encoding->lengths[i]) {
+                code = (code << 1) | readBit();
+                length++;
+            }
+            // The codes of one length are consecutive
+            int j = i;
+            while (j < encoding->nSymbols && encoding->lengths[j] == length) {
+                j++;
+            }
+            if (code >= encoding->codes[i] && code - encoding->codes[i] < (_uint32)(j - i)) {
+                return encoding->symbols[i + (code - encoding->codes[i])];
+            }
+            i = j;
+        }
+        corrupt("bad Huffman code");
+        return 0;
+    }
+
+    case CramEncodingBeta:
+        return (_int32)readBits(encoding->bits) - encoding->offset;
+
+    case CramEncodingGamma: {
+        int zeros = 0;
+        while (readBit() == 0) {
+            if (++zeros > 31) {
+                corrupt("bad gamma code");
+            }
+        }
+        return (_int32)(((_uint32)1 << zeros) | readBits(zeros)) - encoding->offset;
+    }
+
+    case CramEncodingSubexp: {
+        int ones = 0;
+        while (readBit() == 1) {
+            if (++ones > 31) {
+                corrupt("bad subexponential code");
+            }
+        }
+        if (ones == 0) {
+            return (_int32)readBits(encoding->bits) - encoding->offset;
+        }
+        int bits = ones + encoding->bits - 1;
+        return (_int32)(((_uint32)1 << bits) | readBits(bits)) - encoding->offset;
+    }
+
+    default: {
+        char message[60];
+        sprintf(message, "unsupported encoding %d", encoding->codec);
+        corrupt(message);
+        return 0;
+    }
+    }
+}
+
+    _int32
+CramContainerDecoder::decodeInt(
+    Series s)
+{
+    return decodeValue(seriesEncoding(s));
+}
+
+    _uint8
+CramContainerDecoder::decodeByte(
+    Series s)
+{
+    Encoding* encoding = seriesEncoding(s);
+    if (encoding->codec == CramEncodingExternal) {
+        _uint8 value = encoding->block->getByte();
+        if (encoding->block->overrun) {
+            corrupt("external block too short");
+        }
+        return value;
+    }
+    return (_uint8)decodeValue(encoding);
+}
+
+    void
+CramContainerDecoder::decodeBytes(
+    Series s,
+    int count,
+    char* output)
+{
+    Encoding* encoding = seriesEncoding(s);
+    if (encoding->codec == CramEncodingExternal) {
+        const char* data = encoding->block->get(count);
+        if (data == NULL) {
+            corrupt("external block too short");
+        }
+        memcpy(output, data, count);
+    } else {
+        for (int i = 0; i < count; i++) {
+            output[i] = (char)decodeValue(encoding);
+        }
+    }
+}
+
+    void
+CramContainerDecoder::decodeByteArray(
+    Encoding* encoding,
+    CramBuffer* output)
+{
+    if (encoding->codec == CramEncodingByteArrayLen) {
+        _int32 length = decodeValue(encoding->lengthEncoding);
+        if (length < 0) {
+            corrupt("negative array length");
+        }
+        Encoding* value = encoding->valueEncoding;
+        if (value->codec == CramEncodingExternal) {
+            const char* data = value->block->get(length);
+            if (data == NULL) {
+                corrupt("external block too short");
+            }
+            output->put(data, length);
+        } else {
+            for (int i = 0; i < length; i++) {
+                output->putByte((_uint8)decodeValue(value));
+            }
+        }
+    } else if (encoding->codec == CramEncodingByteArrayStop) {
+        CramCursor* block = encoding->block;
+        const char* stop = (const char*)memchr(block->position(), encoding->stop, block->remaining());
+        if (stop == NULL) {
+            corrupt("unterminated array");
+        }
+        size_t length = stop - block->position();
+        output->put(block->get(length + 1), length);
+    } else {
+        corrupt("unsupported encoding for an array");
+    }
+}
+
+    void
+CramContainerDecoder::setReference(
+    int refID)
+{
+    referenceID = refID;
+    reference = header->getRefBases(refID);
+    referenceStart = 1;
+    referenceLength = header->getRefLength(refID);
+    if (reference == NULL && referenceRequired && refID >= 0) {
+        WriteErrorMessage("CRAM file has reads aligned to contig %s, which isn't in the index, so their bases can't be decoded\n", header->getRefName(refID));
+        soft_exit(1);
+    }
+}
+
+    void
+CramContainerDecoder::copyReference(
+    char* output,
+    _int64 pos,
+    int length)
+{
+    _int64 offset = pos - (referenceStart - 1);
+    for (int i = 0; i < length; i++, offset++) {
+        output[i] = reference != NULL && offset >= 0 && offset < referenceLength ? reference[offset] : 'N';
+    }
+}
+
+// Appends a CIGAR operation, merging it with the last one if they're the same (which they are for adjacent features).
+    static void
+AddCigar(
+    VariableSizeVector<_uint32>* cigar,
+    int op,
+    _int32 count)
+{
+    if (count <= 0) {
+        return;
+    }
+    if (cigar->size() > 0 && BAMAlignment::GetCigarOpCode((*cigar)[cigar->size() - 1]) == op) {
+        (*cigar)[cigar->size() - 1] += count << 4;
+    } else {
+        cigar->push_back((count << 4) | op);
+    }
+}
+
+// The size of a BAM tag value of a given type, or 0 for the variable length ones.
+    static int
+TagValueSize(
+    char type)
+{
+    switch (type) {
+    case 'A': case 'c': case 'C': return 1;
+    case 's': case 'S': return 2;
+    case 'i': case 'I': case 'f': return 4;
+    default: return 0;
+    }
+}
+
+    void
+CramContainerDecoder::decodeRecord(
+    int index,
+    int sliceRefID,
+    _int32* io_lastAP,
+    CramBuffer* output)
+{
+    RecordInfo* info = &records[index];
+    info->offset = output->size();
+
+    _int32 flags = decodeInt(BF);
+    _int32 cramFlags = decodeInt(CF);
+    _int32 refID = sliceRefID == -2 ? decodeInt(RI) : sliceRefID;
+    _int32 readLength = decodeInt(RL);
+    _int32 ap = decodeInt(AP);
+    if (apDelta) {
+        ap += *io_lastAP;
+        *io_lastAP = ap;
+    }
+    _int32 readGroup = decodeInt(RG);
+    name.clear();
+    if (readNamesIncluded) {
+        decodeByteArray(seriesEncoding(RN), &name);
+    }
+    if (readLength < 0) {
+        corrupt("negative read length");
+    }
+
+    _int32 nextRefID = -1, nextPos = -1, tlen = 0;
+    if (cramFlags & CramDetached) {
+        _int32 mateFlags = decodeInt(MF);
+        if (!readNamesIncluded) {
+            decodeByteArray(seriesEncoding(RN), &name);
+        }
+        nextRefID = decodeInt(NS);
+        nextPos = decodeInt(NP) - 1;
+        tlen = decodeInt(TS);
+        flags |= (mateFlags & CramMateReversed) ? SAM_NEXT_REVERSED : 0;
+        flags |= (mateFlags & CramMateUnmapped) ? SAM_NEXT_UNMAPPED : 0;
+    } else if (cramFlags & CramMateDownstream) {
+        int mate = index + 1 + decodeInt(NF);
+        if (mate <= index || mate >= records.size()) {
+            corrupt("mate outside the slice");
+        }
+        info->mate = mate;
+        records[mate].hasUpstream = true;
+        records[mate].nameNumber = info->nameNumber;
+    }
+    if (name.size() == 0) {
+        // Names weren't kept, so make one up that the other segments of the template share
+        char generated[24];
+        sprintf(generated, "%lld", info->nameNumber + 1);
+        name.put(generated, strlen(generated));
+    }
+
+    // Tags
+    _int32 tagLine = decodeInt(TL);
+    if (tagLine < 0 || tagLine >= tagLineStarts.size()) {
+        corrupt("bad tag line");
+    }
+    aux.clear();
+    bool sawRG = false;
+    for (const char* tag = tagDictionary.data() + tagLineStarts[tagLine]; *tag != 0; tag += 3) {
+        _int32 key = ((_uint8)tag[0] << 16) | ((_uint8)tag[1] << 8) | (_uint8)tag[2];
+        Encoding* encoding = NULL;
+        for (int i = 0; i < tagKeys.size(); i++) {
+            if (tagKeys[i] == key) {
+                encoding = tagEncodings[i];
+                break;
+            }
+        }
+        if (encoding == NULL) {
+            corrupt("no encoding for a tag");
+        }
+        sawRG |= tag[0] == 'R' && tag[1] == 'G';
+        aux.put(tag, 3);
+        char type = tag[2];
+        if (encoding->codec == CramEncodingExternal) {
+            //
+            // The value as it is in BAM, with nothing to say how long it is, so that has to come from the type.
+            //
+            CramCursor* block = encoding->block;
+            size_t size = TagValueSize(type);
+            if (type == 'Z' || type == 'H') {
+                const char* end = (const char*)memchr(block->position(), 0, block->remaining());
+                size = end == NULL ? block->remaining() + 1 : end - block->position() + 1;
+            } else if (type == 'B' && block->remaining() >= 5) {
+                size = 5 + TagValueSize(block->position()[0]) * (size_t)*(_uint32*)(block->position() + 1);
+            }
+            const char* value = block->get(size);
+            if (value == NULL || size == 0) {
+                corrupt("bad tag value");
+            }
+            aux.put(value, size);
+        } else {
+            size_t start = aux.size();
+            decodeByteArray(encoding, &aux);
+            if ((type == 'Z' || type == 'H') && (aux.size() == start || aux.data()[aux.size() - 1] != 0)) {
+                aux.putByte(0);     // Stored without its terminator
+            }
+        }
+    }
+    if (readGroup >= 0 && !sawRG) {
+        const char* id = header->getReadGroup(readGroup);
+        if (id != NULL) {
+            aux.put("RGZ", 3);
+            aux.put(id, strlen(id) + 1);
+        }
+    }
+
+    readBases.clear();
+    char* seq = readBases.append(readLength + 1);
+    readQualities.clear();
+    char* qual = readQualities.append(readLength + 1);
+    memset(qual, 0xff, readLength);
+    cigar.clear();
+    _int32 mapq = 0;
+    _int32 refSpan = 0;
+
+    if (!(flags & SAM_UNMAPPED)) {
+        if (!embeddedReference && refID != referenceID) {
+            setReference(refID);
+        }
+        int nFeatures = decodeInt(FN);
+        int readPos = 0;                // Bases of the read done so far
+        _int64 refPos = ap - 1;         // 0-based, the next one to match
+        int featurePos = 0;             // 1-based
+        for (int f = 0; f < nFeatures; f++) {
+            char code = decodeByte(FC);
+            featurePos += decodeInt(FP);
+            if (featurePos < 1 || featurePos > readLength + 1) {
+                corrupt("feature outside the read");
+            }
+            if (code == 'Q') {
+                qual[featurePos - 1] = decodeByte(QS);
+                continue;
+            } else if (code == 'q') {
+                arrayValue.clear();
+                decodeByteArray(seriesEncoding(QQ), &arrayValue);
+                if (featurePos - 1 + arrayValue.size() > (size_t)readLength) {
+                    corrupt("qualities past the end of the read");
+                }
+                memcpy(qual + featurePos - 1, arrayValue.data(), arrayValue.size());
+                continue;
+            }
+
+            // The bases up to the feature match the reference
+            int match = featurePos - 1 - readPos;
+            if (match < 0) {
+                corrupt("features out of order");
+            }
+            copyReference(seq + readPos, refPos, match);
+            AddCigar(&cigar, 0, match);
+            readPos += match;
+            refPos += match;
+
+            int length;
+            switch (code) {
+            case 'X': {
+                _uint8 substitution = decodeByte(BS);
+                char refBase = 'N';
+                copyReference(&refBase, refPos, 1);
+                const char* refIndex = strchr("ACGT", toupper(refBase));
+                seq[readPos] = substitutions[refIndex == NULL || refBase == 0 ? 4 : refIndex - "ACGT"][substitution & 3];
+                length = 1;
+                AddCigar(&cigar, 0, 1);
+                refPos++;
+                break;
+            }
+            case 'B':
+                seq[readPos] = decodeByte(BA);
+                qual[readPos] = decodeByte(QS);
+                length = 1;
+                AddCigar(&cigar, 0, 1);
+                refPos++;
+                break;
+            case 'b':
+            case 'I':
+            case 'S':
+                arrayValue.clear();
+                decodeByteArray(seriesEncoding(code == 'b' ? BB : code == 'I' ? IN : SC), &arrayValue);
+                length = (int)arrayValue.size();
+                if (readPos + length > readLength) {
+                    corrupt("bases past the end of the read");
+                }
+                memcpy(seq + readPos, arrayValue.data(), length);
+                AddCigar(&cigar, code == 'b' ? 0 : code == 'I' ? 1 : 4, length);
+                if (code == 'b') {
+                    refPos += length;
+                }
+                break;
+            case 'i':
+                seq[readPos] = decodeByte(BA);
+                length = 1;
+                AddCigar(&cigar, 1, 1);
+                break;
+            case 'D':
+            case 'N':
+                length = decodeInt(code == 'D' ? DL : RS);
+                AddCigar(&cigar, code == 'D' ? 2 : 3, length);
+                refPos += length;
+                length = 0;
+                break;
+            case 'P':
+            case 'H':
+                AddCigar(&cigar, code == 'P' ? 6 : 5, decodeInt(code == 'P' ? PD : HC));
+                length = 0;
+                break;
+            default:
+                corrupt("unknown read feature");
+                length = 0;
+            }
+            readPos += length;
+            if (readPos > readLength) {
+                corrupt("read features past the end of the read");
+            }
+        }
+        copyReference(seq + readPos, refPos, readLength - readPos);
+        AddCigar(&cigar, 0, readLength - readPos);
+        refPos += readLength - readPos;
+        refSpan = (_int32)(refPos - (ap - 1));
+
+        mapq = decodeInt(MQ);
+        if (cramFlags & CramQualityArray) {
+            decodeBytes(QS, readLength, qual);
+        }
+    } else {
+        if (!(cramFlags & CramUnknownBases)) {
+            decodeBytes(BA, readLength, seq);
+        }
+        if (cramFlags & CramQualityArray) {
+            decodeBytes(QS, readLength, qual);
+        }
+    }
+
+    //
+    // Now that its size is known, build the BAM record.
+    //
+    int nameLength = (int)min(name.size(), (size_t)254);
+    int seqLength = (cramFlags & CramUnknownBases) ? 0 : readLength;
+    size_t size = BAMAlignment::size(nameLength + 1, (unsigned)cigar.size(), seqLength, (unsigned)aux.size());
+    BAMAlignment* bam = (BAMAlignment*)output->append(size);
+    bam->block_size = (_int32)(size - sizeof(bam->block_size));
+    bam->refID = refID;
+    bam->pos = ap - 1;
+    bam->l_read_name = (_uint8)(nameLength + 1);
+    bam->MAPQ = (_uint8)mapq;
+    bam->bin = (_uint16)BAMAlignment::reg2bin(bam->pos, bam->pos + max(refSpan, 1));
+    bam->n_cigar_op = (_uint16)cigar.size();
+    bam->FLAG = (_uint16)flags;
+    bam->l_seq = seqLength;
+    bam->next_refID = nextRefID;
+    bam->next_pos = nextPos;
+    bam->tlen = tlen;
+    memcpy(bam->read_name(), name.data(), nameLength);
+    bam->read_name()[nameLength] = 0;
+    for (int i = 0; i < cigar.size(); i++) {
+        bam->cigar()[i] = cigar[i];
+    }
+    BAMAlignment::encodeSeq(bam->seq(), seq, seqLength);
+    memcpy(bam->qual(), qual, seqLength);
+    memcpy(bam->firstAux(), aux.data(), aux.size());
+    info->end = bam->pos + refSpan;
+}
+
+    void
+CramContainerDecoder::fixMates(
+    int nRecords,
+    CramBuffer* output)
+{
+    //
+    // Records linked to a later one in the slice don't store anything about their mates; it all comes from the
+    // other records in the template, which form a chain from the first.  Each points at the next, and the last at the first.
+    //
+    for (int first = 0; first < nRecords; first++) {
+        if (records[first].mate < 0 || records[first].hasUpstream) {
+            continue;
+        }
+        chain.clear();
+        for (int i = first; i >= 0; i = records[i].mate) {
+            chain.push_back(i);
+        }
+
+        bool sameRef = true;
+        _int32 left = 0, right = 0;
+        int leftmost = -1;
+        for (int i = 0; i < chain.size(); i++) {
+            BAMAlignment* bam = (BAMAlignment*)(output->data() + records[chain[i]].offset);
+            BAMAlignment* firstBam = (BAMAlignment*)(output->data() + records[first].offset);
+            sameRef &= !(bam->FLAG & SAM_UNMAPPED) && bam->refID == firstBam->refID;
+            if (leftmost == -1 || bam->pos < left) {
+                left = bam->pos;
+                leftmost = chain[i];
+            }
+            right = max(right, records[chain[i]].end);
+        }
+
+        for (int i = 0; i < chain.size(); i++) {
+            BAMAlignment* bam = (BAMAlignment*)(output->data() + records[chain[i]].offset);
+            BAMAlignment* next = (BAMAlignment*)(output->data() + records[chain[(i + 1) % chain.size()]].offset);
+            bam->next_refID = next->refID;
+            bam->next_pos = next->pos;
+            bam->FLAG |= (next->FLAG & SAM_REVERSE_COMPLEMENT) ? SAM_NEXT_REVERSED : 0;
+            bam->FLAG |= (next->FLAG & SAM_UNMAPPED) ? SAM_NEXT_UNMAPPED : 0;
+            bam->tlen = !sameRef ? 0 : chain[i] == leftmost ? right - left : left - right;
+        }
+    }
+}
+
+    void
+CramContainerDecoder::decodeSlice(
+    CramCursor* cursor,
+    CramBuffer* output)
+{
+    Block block;
+    readBlock(cursor, &block);
+    if (block.contentType != CramSliceHeader) {
+        corrupt("no slice header");
+    }
+    CramCursor sliceHeader(block.data, block.bytes);
+    _int32 sliceRefID = sliceHeader.getITF8();
+    _int32 start = sliceHeader.getITF8();
+    sliceHeader.getITF8();                  // span
+    _int32 nRecords = sliceHeader.getITF8();
+    _int64 recordCounter = sliceHeader.getLTF8();
+    _int32 nBlocks = sliceHeader.getITF8();
+    _int32 nContentIds = sliceHeader.getITF8();
+    for (int i = 0; i < nContentIds && !sliceHeader.overrun; i++) {
+        sliceHeader.getITF8();
+    }
+    _int32 embeddedRefID = sliceHeader.getITF8();
+    if (sliceHeader.overrun || nRecords < 0 || nBlocks < 0) {
+        corrupt("bad slice header");
+    }
+
+    contentIds.clear();
+    externals.clear();
+    core = CramCursor();
+    coreBit = 0;
+    for (int i = 0; i < nBlocks; i++) {
+        readBlock(cursor, &block);
+        if (block.contentType == CramCoreData) {
+            core = CramCursor(block.data, block.bytes);
+        } else if (block.contentType == CramExternalData) {
+            contentIds.push_back(block.contentId);
+            externals.push_back(CramCursor(block.data, block.bytes));
+        }
+    }
+    missing = CramCursor();
+    for (VariableSizeVector<Encoding*>::iterator i = encodings.begin(); i != encodings.end(); i++) {
+        (*i)->block = externalBlock((*i)->contentId);
+    }
+
+    embeddedReference = embeddedRefID >= 0;
+    if (embeddedReference) {
+        CramCursor* embedded = externalBlock(embeddedRefID);
+        reference = embedded->position();
+        referenceStart = start;
+        referenceLength = embedded->remaining();
+        referenceID = sliceRefID;
+    } else {
+        setReference(sliceRefID);
+    }
+
+    records.clear();
+    records.extend(nRecords);
+    for (int i = 0; i < nRecords; i++) {
+        records[i].mate = -1;
+        records[i].nameNumber = recordCounter + i;
+    }
+    _int32 lastAP = start;
+    for (int i = 0; i < nRecords; i++) {
+        decodeRecord(i, sliceRefID, &lastAP, output);
+    }
+    fixMates(nRecords, output);
+}
+
+    void
+CramContainerDecoder::decode(
+    const char* container,
+    size_t bytes,
+    CramBuffer* output)
+{
+    CramContainerHeader containerHeader;
+    if (!containerHeader.parse(container, bytes) || bytes < containerHeader.headerBytes + containerHeader.length) {
+        corrupt("truncated container");
+    }
+    if (containerHeader.landmarks.size() == 0) {
+        return;     // Nothing in it, like the EOF container
+    }
+    const char* blocks = container + containerHeader.headerBytes;
+    CramCursor cursor(blocks, containerHeader.length);
+    blocksUsed = 0;
+    Block block;
+    readBlock(&cursor, &block);
+    if (block.contentType != CramCompressionHeader) {
+        corrupt("no compression header");
+    }
+    readCompressionHeader(block);
+
+    for (int i = 0; i < containerHeader.landmarks.size(); i++) {
+        _int32 landmark = containerHeader.landmarks[i];
+        if (landmark < 0 || landmark >= containerHeader.length) {
+            corrupt("bad slice offset");
+        }
+        CramCursor slice(blocks + landmark, containerHeader.length - landmark);
+        blocksUsed = 0;
+        decodeSlice(&slice, output);
+    }
+}
+
+//
+// rANS with 4 interleaved states and byte-wise renormalization (the CRAM 3.0 "rANS 4x8" codec).  Frequencies are
+// scaled to a total of 4096.
+//
+static const int RansFrequencyBits = 12;
+static const _uint32 RansTotal = 1 << RansFrequencyBits;
+static const _uint32 RansLow = 1 << 23;
+
+//
+// A symbol table: the frequency and cumulative frequency of each symbol, and the symbol for each slot in [0, 4096).
+//
+struct RansTable
+{
+    _uint16     frequency[256];
+    _uint16     start[256];
+    _uint8      symbol[RansTotal];
+};
+
+//
+// Reads a frequency table, which lists symbols with their frequencies, with a run length after two consecutive ones
+// and a 0 at the end.  The same form lists the contexts for order 1, so it's used for both.
+//
+    static bool
+ReadRansSymbols(
+    const _uint8** io_p,
+    const _uint8* end,
+    int* io_symbol,
+    int* io_run)
+{
+    const _uint8* p = *io_p;
+    if (p >= end) {
+        return false;
+    }
+    if (*io_run > 0) {
+        (*io_run)--;
+        (*io_symbol)++;
+        if (*io_symbol > 255) {
+            return false;
+        }
+    } else if (*p == *io_symbol + 1) {
+        *io_symbol = *p++;
+        if (p >= end) {
+            return false;
+        }
+        *io_run = *p++;
+    } else {
+        *io_symbol = *p++;
+    }
+    *io_p = p;
+    return true;
+}
+
+    static bool
+ReadRansTable(
+    const _uint8** io_p,
+    const _uint8* end,
+    RansTable* table)
+{
+    memset(table->frequency, 0, sizeof(table->frequency));
+    memset(table->symbol, 0, sizeof(table->symbol));
+    const _uint8* p = *io_p;
+    if (p >= end) {
+        return false;
+    }
+    int symbol = *p++;
+    int run = 0;
+    _uint32 total = 0;
+    do {
+        if (p >= end) {
+            return false;
+        }
+        _uint32 frequency = *p++;
+        if (frequency >= 128) {
+            if (p >= end) {
+                return false;
+            }
+            frequency = ((frequency & 0x7f) << 8) | *p++;
+        }
+        if (total + frequency > RansTotal) {
+            return false;
+        }
+        table->frequency[symbol] = (_uint16)frequency;
+        table->start[symbol] = (_uint16)total;
+        memset(table->symbol + total, symbol, frequency);
+        total += frequency;
+        if (!ReadRansSymbols(&p, end, &symbol, &run)) {
+            return false;
+        }
+    } while (symbol != 0);
+    *io_p = p;
+    return true;
+}
+
+    static inline _uint8
+RansDecodeSymbol(
+    const RansTable* table,
+    _uint32* io_state,
+    const _uint8** io_p,
+    const _uint8* end)
+{
+    _uint32 slot = *io_state & (RansTotal - 1);
+    _uint8 symbol = table->symbol[slot];
+    _uint32 state = table->frequency[symbol] * (*io_state >> RansFrequencyBits) + slot - table->start[symbol];
+    while (state < RansLow && *io_p < end) {
+        state = (state << 8) | *(*io_p)++;
+    }
+    *io_state = state;
+    return symbol;
+}
+
+    static _uint32
+GetLittleEndian32(
+    const _uint8* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((_uint32)p[3] << 24);
+}
+
+    bool
+CramContainerDecoder::uncompressRans(
+    const char* data,
+    size_t bytes,
+    CramBuffer* output)
+{
+    const _uint8* p = (const _uint8*)data;
+    if (bytes < 9) {
+        return false;
+    }
+    int order = p[0];
+    _uint32 compressedBytes = GetLittleEndian32(p + 1);
+    _uint32 rawBytes = GetLittleEndian32(p + 5);
+    if (compressedBytes > bytes - 9) {
+        return false;
+    }
+    const _uint8* end = p + 9 + compressedBytes;
+    p += 9;
+    _uint8* out = (_uint8*)output->append(rawBytes);
+    if (rawBytes == 0) {
+        return true;
+    }
+
+    _uint32 state[4];
+    if (order == 0) {
+        RansTable* table = new RansTable;
+        bool ok = ReadRansTable(&p, end, table) && end - p >= 16;
+        if (ok) {
+            for (int i = 0; i < 4; i++, p += 4) {
+                state[i] = GetLittleEndian32(p);
+            }
+            // Each state does every fourth symbol
+            _uint32 whole = rawBytes & ~3;
+            for (_uint32 i = 0; i < whole; i += 4) {
+                for (int j = 0; j < 4; j++) {
+                    out[i + j] = RansDecodeSymbol(table, &state[j], &p, end);
+                }
+            }
+            for (_uint32 i = whole; i < rawBytes; i++) {
+                out[i] = table->symbol[state[i - whole] & (RansTotal - 1)];
+            }
+        }
+        delete table;
+        return ok;
+    } else if (order == 1) {
+        //
+        // A table for each preceding symbol, which only exists for those that occur.
+        //
+        RansTable* tables[256];
+        memset(tables, 0, sizeof(tables));
+        bool ok = p < end;
+        int context = ok ? *p++ : 0;
+        int run = 0;
+        while (ok) {
+            if (tables[context] == NULL) {
+                tables[context] = new RansTable;
+            }
+            ok = ReadRansTable(&p, end, tables[context]) && ReadRansSymbols(&p, end, &context, &run);
+            if (context == 0) {
+                break;
+            }
+        }
+        ok &= end - p >= 16;
+        if (ok) {
+            for (int i = 0; i < 4; i++, p += 4) {
+                state[i] = GetLittleEndian32(p);
+            }
+            // Each state does a quarter of the output, with the last one doing the remainder too
+            _uint32 quarter = rawBytes >> 2;
+            int previous[4] = {0, 0, 0, 0};
+            for (_uint32 i = 0; ok && i < rawBytes - 3 * quarter; i++) {
+                for (int j = 0; j < 4; j++) {
+                    if (j < 3 && i >= quarter) {
+                        continue;
+                    }
+                    RansTable* table = tables[previous[j]];
+                    if (table == NULL) {
+                        ok = false;
+                        break;
+                    }
+                    previous[j] = out[j * quarter + i] = RansDecodeSymbol(table, &state[j], &p, end);
+                }
+            }
+        }
+        for (int i = 0; i < 256; i++) {
+            delete tables[i];
+        }
+        return ok;
+    }
+    return false;
+}
+
+    CRAMReader*
+CRAMReader::create(
+    const char *fileName,
+    int bufferCount,
+    _int64 startingOffset,
+    _int64 amountOfFileToProcess,
+    const ReaderContext& context)
+{
+    CRAMReader* reader = new CRAMReader(context);
+    reader->init(fileName, bufferCount, startingOffset, amountOfFileToProcess);
+    return reader;
+}
+
+    DataReader*
+CRAMReader::createDataReader(
+    const char* fileName,
+    int bufferCount)
+{
+    DataSupplier* supplier = DataSupplier::Cram(strcmp("-", fileName) ? DataSupplier::Input(context.useIoUring, context.directIo) : DataSupplier::Stdio, context.genome);
+    DataReader* reader = supplier->getDataReader(bufferCount, MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor, 0);
+    delete supplier;
+    return reader;
+}
+
+    ReadSupplierGenerator *
+CRAMReader::createReadSupplierGenerator(
+    const char *fileName,
+    int numThreads,
+    const ReaderContext& context)
+{
+    CRAMReader* reader = create(fileName, ReadSupplierQueue::BufferCount(numThreads), 0, 0, context);
+    ReadSupplierQueue* queue = new ReadSupplierQueue((ReadReader*)reader);
+    queue->startReaders();
+    return queue;
+}
+
+    PairedReadSupplierGenerator *
+CRAMReader::createPairedReadSupplierGenerator(
+    const char *fileName,
+    int numThreads,
+    bool quicklyDropUnmatchedReads,
+    const ReaderContext& context,
+    int matchBufferSize)
+{
+    CRAMReader* reader = create(fileName,
+        ReadSupplierQueue::BufferCount(numThreads) + PairedReadReader::MatchBuffers, 0, 0, context);
+    PairedReadReader* matcher = PairedReadReader::PairMatcher(reader, quicklyDropUnmatchedReads);
+    ReadSupplierQueue* queue = new ReadSupplierQueue(matcher);
+    queue->startReaders();
+    return queue;
+}
@@ -0,0 +1,481 @@
+/*++
+
+Module Name:
+
+    Cram.h
+
+Abstract:
+
+    Headers for encoding and decoding CRAM 3.0 containers, which store reads as differences from the reference (here, the
+    genome in the index).
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Genome.h"
+#include "BigAlloc.h"
+#include "VariableSizeVector.h"
+#include "zlib.h"
+#include "Bam.h"
+
+struct BAMAlignment;
+
+//
+// A byte buffer that grows as it's written, with the integer encodings CRAM uses: ITF8 (1-5 bytes for 32 bits) and
+// LTF8 (1-9 bytes for 64 bits), which put the count of extra bytes in the high bits of the first, and little-endian
+// fixed size ints.
+//
+class CramBuffer
+{
+public:
+    CramBuffer() : buffer(NULL), used(0), capacity(0) {}
+
+    ~CramBuffer()
+    { free(buffer); }
+
+    char* data()
+    { return buffer; }
+
+    const char* data() const
+    { return buffer; }
+
+    size_t size() const
+    { return used; }
+
+    void clear()
+    { used = 0; }
+
+    void truncate(size_t bytes)
+    { _ASSERT(bytes <= used); used = bytes; }
+
+    void reserve(size_t bytes);
+
+    void putByte(_uint8 value)
+    {
+        if (used == capacity) {
+            reserve(used + 1);
+        }
+        buffer[used++] = (char)value;
+    }
+
+    // Makes room for bytes more at the end and returns where they go.
+    char* append(size_t bytes)
+    {
+        if (used + bytes > capacity) {
+            reserve(used + bytes);
+        }
+        used += bytes;
+        return buffer + used - bytes;
+    }
+
+    void put(const void* data, size_t bytes)
+    {
+        if (used + bytes > capacity) {
+            reserve(used + bytes);
+        }
+        memcpy(buffer + used, data, bytes);
+        used += bytes;
+    }
+
+    void putInt32(_int32 value);
+
+    void putITF8(_int32 value);
+
+    void putLTF8(_int64 value);
+
+    // The number of bytes putITF8 would write.
+    static int itf8Size(_int32 value);
+
+private:
+    char*       buffer;
+    size_t      used;
+    size_t      capacity;
+};
+
+//
+// MD5 (RFC 1321), which CRAM uses to tie slices and @SQ lines to the reference they were encoded against.
+//
+class CramMD5
+{
+public:
+    CramMD5();
+
+    void update(const void* data, size_t bytes);
+
+    void final(_uint8 digest[16]);
+
+private:
+    void transform(const _uint8* block);
+
+    _uint32     state[4];
+    _uint64     bytes;
+    _uint8      pending[64];
+};
+
+//
+// Turns BAM records (as SNAP writes them) into CRAM containers.  Each container has one slice, with every data series
+// in an external block of its own compressed with gzip, which is what any CRAM 3.0 reader has to support.  Mapped reads
+// are stored as their differences from the genome (substitutions, indels and clipping), so the genome the file was
+// aligned against is needed to read it back.  Mates are always stored explicitly ("detached") rather than as
+// links within the slice, so a container can be written without seeing the rest of the file.
+//
+// One per thread; it keeps its block buffers from one container to the next.
+//
+class CramContainerEncoder
+{
+public:
+    CramContainerEncoder(const Genome* i_genome, int i_compressionLevel);
+
+    ~CramContainerEncoder();
+
+    //
+    // Appends a container with the nRecords BAM records (which are the first bytes of records) to output.
+    // recordCounter is how many records came before these in the file.
+    //
+    void encode(char* records, size_t bytes, int nRecords, _int64 recordCounter, CramBuffer* output);
+
+    //
+    // Appends the CRAM file definition and the container with the SAM header for a BAM header (magic, text and
+    // reference list), adding an M5 tag to each @SQ line that doesn't have one.  Returns false if bytes doesn't hold
+    // the whole BAM header; otherwise sets o_headerBytes to how many of them it used.
+    //
+    static bool encodeHeader(const Genome* genome, const char* bamHeader, size_t bytes, const char* fileName, size_t* o_headerBytes, CramBuffer* output);
+
+    // The empty container that ends a CRAM 3.0 file.
+    static const _uint8 EofContainer[38];
+
+    // Records per container, and so per slice (the same as samtools).
+    static const int MaxRecordsPerContainer = 10000;
+
+    // Data series, each of which goes into the external block with content id (series + 1).
+    enum Series {
+        BF, CF, RI, RL, AP, RG, RN, MF, NS, NP, TS, TL, FN, FC, FP, BS, IN, DL, RS, PD, HC, SC, BA, QS, MQ, NumSeries
+    };
+
+private:
+
+    struct TagBlock {
+        _int32          key;            // (tag[0] << 16) | (tag[1] << 8) | type, which is also its content id
+        CramBuffer*     data;
+    };
+
+    CramBuffer* tagBlock(_int32 key);
+
+    void encodeRecord(BAMAlignment* bam, int sliceRefID, bool apDelta, _int32* io_lastAP);
+
+    void decodeBases(BAMAlignment* bam);
+
+    void encodeFeatures(BAMAlignment* bam);
+
+    void addFeature(char code, int readPos, int* io_lastPos, int* io_nFeatures);
+
+    int tagLine(BAMAlignment* bam);
+
+    // Writes a block, with gzip if compress is set and it helps.
+    void writeBlock(CramBuffer* output, _uint8 contentType, _int32 contentId, const char* data, size_t bytes, bool compress);
+
+    static void putBlock(CramBuffer* output, _uint8 method, _uint8 contentType, _int32 contentId, const char* data, size_t bytes, size_t rawBytes);
+
+    void writeCompressionHeader(CramBuffer* header, bool apDelta);
+
+    const Genome*       genome;
+    const int           compressionLevel;
+    z_stream            zstream;
+    CramBuffer          compressed;
+
+    CramBuffer          series[NumSeries];
+    VariableSizeVector<TagBlock> tags;
+    VariableSizeVector<int> tagLineStarts;  // Offsets in tagLines of each distinct line of tags, which is 3 bytes per tag and a NUL
+    CramBuffer          tagLines;
+    char*               readBases;          // The current record's bases as characters
+    int                 readBasesSize;
+
+    CramBuffer          scratch;
+    CramBuffer          compressionHeader;
+    CramBuffer          sliceHeader;
+    CramBuffer          blocks;
+    CramBuffer          containerHeader;
+};
+
+//
+// A read cursor over a buffer, for the CRAM integer encodings.  Reading past the end returns zeros and sets overrun,
+// so callers can check once after a run of reads rather than after each one.
+//
+class CramCursor
+{
+public:
+    CramCursor() : p(NULL), end(NULL), overrun(false) {}
+
+    CramCursor(const char* data, size_t bytes) : p(data), end(data + bytes), overrun(false) {}
+
+    _uint8 getByte()
+    {
+        if (p >= end) {
+            overrun = true;
+            return 0;
+        }
+        return (_uint8)*p++;
+    }
+
+    // Returns the next bytes and skips over them, or NULL if there aren't that many.
+    const char* get(size_t bytes);
+
+    _int32 getInt32();
+
+    _int32 getITF8();
+
+    _int64 getLTF8();
+
+    const char* position() const
+    { return p; }
+
+    size_t remaining() const
+    { return end - p; }
+
+    bool        overrun;
+
+private:
+    const char* p;
+    const char* end;
+};
+
+//
+// The fixed part of a container: where it is and how big.
+//
+struct CramContainerHeader
+{
+    _int32      length;             // Bytes of blocks after the header
+    _int32      refID;
+    _int32      start;
+    _int32      span;
+    _int32      nRecords;
+    _int64      recordCounter;
+    _int64      bases;
+    _int32      nBlocks;
+    VariableSizeVector<_int32> landmarks;   // Where each slice starts, relative to the end of the header
+    size_t      headerBytes;
+
+    //
+    // Returns false if bytes doesn't hold the whole header.  Exits if it's corrupt.
+    //
+    bool parse(const char* data, size_t bytes);
+};
+
+//
+// What a CRAM file's header says: the SAM header text (as a BAM header, which is what the rest of SNAP reads), and
+// for each reference the bases in the genome that its reads are stored against.
+//
+class CramHeader
+{
+public:
+    CramHeader(const Genome* i_genome) : genome(i_genome), nRefs(0), refBases(NULL), refLengths(NULL), refNames(NULL) {}
+
+    ~CramHeader();
+
+    //
+    // Decodes the file definition and the header container at the start of a file.  Returns false if bytes doesn't hold
+    // them both; otherwise sets o_bytes to how many they took.  Exits if this isn't CRAM 3.0 or a reference in it doesn't
+    // match the genome.
+    //
+    bool decode(const char* data, size_t bytes, const char* fileName, size_t* o_bytes);
+
+    // The header as BAM: magic, text and the reference list.
+    const char* bamHeader() const
+    { return bam.data(); }
+
+    size_t bamHeaderBytes() const
+    { return bam.size(); }
+
+    int getNumRefs() const
+    { return nRefs; }
+
+    // NULL if the reference isn't in the genome
+    const char* getRefBases(int refID) const
+    { return refID >= 0 && refID < nRefs ? refBases[refID] : NULL; }
+
+    _int32 getRefLength(int refID) const
+    { return refID >= 0 && refID < nRefs ? refLengths[refID] : 0; }
+
+    const char* getRefName(int refID) const
+    { return refID >= 0 && refID < nRefs ? refNames[refID] : "*"; }
+
+    // The ID of the index'th @RG line, which is what the RG data series holds; NULL if there isn't one.
+    const char* getReadGroup(int index) const
+    { return index >= 0 && index < readGroupStarts.size() ? readGroups.data() + readGroupStarts[index] : NULL; }
+
+private:
+    void addReference(const char* name, size_t nameLength, _int32 length, const char* fileName);
+
+    const Genome*       genome;
+    CramBuffer          bam;
+    int                 nRefs;
+    const char**        refBases;
+    _int32*             refLengths;
+    char**              refNames;
+    CramBuffer          readGroups;             // NUL terminated IDs
+    VariableSizeVector<int> readGroupStarts;
+};
+
+//
+// Turns a CRAM container back into BAM records, getting the bases of mapped reads from the genome.  It handles what
+// CRAM 3.0 writers produce: blocks that are raw, gzip or rANS compressed (but not bzip2 or lzma), all of the encodings
+// for data series, mates stored either explicitly or as links to a later record in the slice, and references embedded
+// in a slice.  MD and NM aren't regenerated; whatever tags were stored come back as they were.
+//
+// Not thread safe; use one per thread.
+//
+class CramContainerDecoder
+{
+public:
+    CramContainerDecoder(const CramHeader* i_header);
+
+    ~CramContainerDecoder();
+
+    //
+    // Appends the BAM records in a container (the header and all of its blocks) to output.
+    //
+    void decode(const char* container, size_t bytes, CramBuffer* output);
+
+    //
+    // Uncompresses a block compressed with rANS (the 4x8 order 0 and order 1 forms), appending to output.  Returns false
+    // if it's corrupt.
+    //
+    static bool uncompressRans(const char* data, size_t bytes, CramBuffer* output);
+
+    // Data series, including the ones that only readers see
+    enum Series {
+        BF, CF, RI, RL, AP, RG, RN, MF, NS, NP, TS, NF, TL, FN, FC, FP, BS, IN, DL, RS, PD, HC, SC, BA, QS, MQ, BB, QQ, NumSeries
+    };
+
+    struct Block {
+        _uint8      contentType;
+        _int32      contentId;
+        const char* data;       // uncompressed
+        size_t      bytes;
+    };
+
+    //
+    // Reads the next block, uncompressing it into a buffer of the decoder's if needed, where it stays until the next
+    // slice.
+    //
+    void readBlock(CramCursor* cursor, Block* o_block);
+
+    struct Encoding;
+
+private:
+
+    Encoding* parseEncoding(CramCursor* cursor);
+
+    void readCompressionHeader(const Block& block);
+
+    void decodeSlice(CramCursor* cursor, CramBuffer* output);
+
+    void decodeRecord(int index, int sliceRefID, _int32* io_lastAP, CramBuffer* output);
+
+    void fixMates(int nRecords, CramBuffer* output);
+
+    void setReference(int refID);
+
+    // Bases of the reference from a 0-based position, with Ns past its end.
+    void copyReference(char* output, _int64 pos, int length);
+
+    _int32 decodeValue(Encoding* encoding);
+
+    _int32 decodeInt(Series series);
+
+    _uint8 decodeByte(Series series);
+
+    void decodeBytes(Series series, int count, char* output);
+
+    void decodeByteArray(Encoding* encoding, CramBuffer* output);
+
+    _uint32 readBits(int count);
+
+    int readBit();
+
+    CramCursor* externalBlock(_int32 contentId);
+
+    Encoding* seriesEncoding(Series series);
+
+    void corrupt(const char* what);
+
+    const CramHeader*   header;
+    z_stream            zstream;
+
+    // From the compression header
+    bool                readNamesIncluded;
+    bool                apDelta;
+    bool                referenceRequired;
+    char                substitutions[5][4];    // Read base for each reference base (ACGTN) and code
+    CramBuffer          tagDictionary;
+    VariableSizeVector<int> tagLineStarts;
+    Encoding*           series[NumSeries];
+    VariableSizeVector<Encoding*> encodings;        // All of them, to delete
+    VariableSizeVector<_int32> tagKeys;
+    VariableSizeVector<Encoding*> tagEncodings;
+
+    // The current slice's blocks
+    VariableSizeVector<CramBuffer*> blockBuffers;
+    int                 blocksUsed;
+    VariableSizeVector<_int32> contentIds;
+    VariableSizeVector<CramCursor> externals;
+    CramCursor          missing;                // For encodings whose block isn't in the slice
+    CramCursor          core;
+    int                 coreBit;                // Bits left in the current core byte
+    _uint8              coreByte;
+    const char*         reference;              // Bases for the slice's reference, or one embedded in it
+    _int64              referenceStart;         // 1-based position of reference[0]
+    _int64              referenceLength;
+    int                 referenceID;
+    bool                embeddedReference;
+
+    // Per record in the slice, for linking mates
+    struct RecordInfo {
+        size_t      offset;                     // in the output
+        int         mate;                       // record index of the next segment, or -1
+        bool        hasUpstream;                // another record links to this one
+        _int64      nameNumber;                 // for generated names
+        _int32      end;                        // 0-based, exclusive end of the alignment on the reference
+    };
+    VariableSizeVector<RecordInfo> records;
+    VariableSizeVector<int> chain;
+
+    // Scratch for one record
+    CramBuffer          readBases;
+    CramBuffer          readQualities;
+    VariableSizeVector<_uint32> cigar;
+    CramBuffer          name;
+    CramBuffer          aux;
+    CramBuffer          arrayValue;
+};
+
+//
+// Reads CRAM files by turning them back into BAM records, in a DataReader that decodes containers on the decompression
+// pool, and then reading those as BAMReader does.
+//
+class CRAMReader : public BAMReader
+{
+public:
+    CRAMReader(const ReaderContext& i_context) : BAMReader(i_context) {}
+
+    static CRAMReader* create(const char *fileName, int bufferCount,
+        _int64 startingOffset, _int64 amountOfFileToProcess,
+        const ReaderContext& context);
+
+    static ReadSupplierGenerator *createReadSupplierGenerator(const char *fileName, int numThreads, const ReaderContext& context);
+
+    static PairedReadSupplierGenerator *createPairedReadSupplierGenerator(const char *fileName, int numThreads, bool quicklyDropUnmatchedReads,
+        const ReaderContext& context, int matchBufferSize = 5000);
+
+protected:
+    virtual DataReader* createDataReader(const char* fileName, int bufferCount);
+};
@@ -0,0 +1,334 @@
+/*++
+
+Module Name:
+
+    CramDataWriter.cpp
+
+Abstract:
+
+    Filter and encoder that write BAM output as CRAM.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "CramDataWriter.h"
+#include "Cram.h"
+#include "Bam.h"
+#include "ParallelTask.h"
+#include "VariableSizeVector.h"
+#include "exit.h"
+#include "Error.h"
+
+using std::min;
+
+//
+// Splits a batch of BAM records into containers and has the workers encode them, each into its own buffer, and then
+// copies the containers back over the batch.
+//
+class CramEncodeWorkerManager : public ParallelWorkerManager
+{
+public:
+    CramEncodeWorkerManager(CramWriterFilterSupplier* i_filterSupplier)
+        : filterSupplier(i_filterSupplier)
+    {}
+
+    virtual ~CramEncodeWorkerManager();
+
+    virtual void initialize(void* i_encoder);
+
+    virtual ParallelWorker* createWorker();
+
+    virtual void beginStep();
+
+    virtual void finishStep();
+
+private:
+    struct Container {
+        size_t      offset;     // in the batch
+        size_t      bytes;
+        int         nRecords;
+        _int64      recordCounter;
+    };
+
+    CramWriterFilterSupplier* filterSupplier;
+    FileEncoder* encoder;
+    char* input;
+    size_t inputSize;
+    size_t inputUsed;
+    CramBuffer header;      // File definition and header container, if the batch starts with the BAM header
+    VariableSizeVector<Container> containers;
+    VariableSizeVector<CramBuffer*> outputs;
+
+    friend class CramEncodeWorker;
+};
+
+class CramEncodeWorker : public ParallelWorker
+{
+public:
+    CramEncodeWorker() : encoder(NULL) {}
+
+    virtual ~CramEncodeWorker() { delete encoder; }
+
+    virtual void step();
+
+private:
+    CramContainerEncoder* encoder;
+};
+
+// used for case where each thread encodes by itself
+
+class CramWriterFilter : public DataWriter::Filter
+{
+public:
+    CramWriterFilter(CramWriterFilterSupplier* i_supplier)
+        : DataWriter::Filter(DataWriter::ResizeFilter), supplier(i_supplier), manager(NULL), worker(NULL), encoder(NULL)
+    {}
+
+    ~CramWriterFilter();
+
+    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, GenomeDistance bytes, GenomeLocation location) {}
+
+    virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes, bool lastBatch = false, bool* needMoreBuffer = NULL, size_t* fromBufferUsed = NULL);
+
+private:
+
+    CramWriterFilterSupplier* supplier;
+    // if encoding inline, filled in with minimally initialized objects
+    CramEncodeWorkerManager* manager;
+    ParallelWorker* worker;
+    FileEncoder* encoder;
+};
+
+CramEncodeWorkerManager::~CramEncodeWorkerManager()
+{
+    for (VariableSizeVector<CramBuffer*>::iterator i = outputs.begin(); i != outputs.end(); i++) {
+        delete *i;
+    }
+}
+
+    void
+CramEncodeWorkerManager::initialize(
+    void* i_encoder)
+{
+    encoder = (FileEncoder*) i_encoder;
+}
+
+    ParallelWorker*
+CramEncodeWorkerManager::createWorker()
+{
+    return new CramEncodeWorker();
+}
+
+    void
+CramEncodeWorkerManager::beginStep()
+{
+    containers.clear();
+    header.clear();
+    if (filterSupplier->closing) {
+        return;
+    }
+    encoder->getEncodeBatch(&input, &inputSize, &inputUsed);
+
+    size_t offset = 0;
+    if (inputUsed >= sizeof(_uint32) && *(_uint32*)input == BAMHeader::BAM_MAGIC) {
+        if (!CramContainerEncoder::encodeHeader(filterSupplier->genome, input, inputUsed, filterSupplier->fileName, &offset, &header)) {
+            WriteErrorMessage("The BAM header doesn't fit in one write buffer, so it can't be written as CRAM.  Try a larger -wbs.\n");
+            soft_exit(1);
+        }
+    }
+
+    //
+    // Batches of sorted output get a container per contig (up to the record limit), which lets readers skip to a
+    // region.  Anything else just goes in containers of the most records, which cover whatever contigs they cover.
+    //
+    bool sorted = true;
+    int lastRefID = 0, lastPos = 0, nRecords = 0;
+    for (size_t recordOffset = offset; recordOffset < inputUsed; nRecords++) {
+        BAMAlignment* bam = (BAMAlignment*)(input + recordOffset);
+        if (recordOffset + sizeof(_int32) > inputUsed || recordOffset + bam->size() > inputUsed) {
+            WriteErrorMessage("CRAM encoding: batch ends in the middle of a BAM record\n");
+            soft_exit(1);
+        }
+        _uint32 refID = (_uint32)bam->refID;    // So unplaced reads (-1) come last
+        if (nRecords > 0 && (refID < (_uint32)lastRefID || (refID == (_uint32)lastRefID && bam->pos < lastPos))) {
+            sorted = false;
+        }
+        lastRefID = bam->refID;
+        lastPos = bam->pos;
+        recordOffset += bam->size();
+    }
+    _int64 recordCounter = InterlockedAdd64AndReturnNewValue(&filterSupplier->recordCounter, nRecords) - nRecords;
+
+    Container container;
+    container.offset = offset;
+    container.bytes = 0;
+    container.nRecords = 0;
+    container.recordCounter = recordCounter;
+    int containerRefID = 0;
+    for (size_t recordOffset = offset; recordOffset < inputUsed; ) {
+        BAMAlignment* bam = (BAMAlignment*)(input + recordOffset);
+        if (container.nRecords == CramContainerEncoder::MaxRecordsPerContainer || (sorted && container.nRecords > 0 && bam->refID != containerRefID)) {
+            containers.push_back(container);
+            container.offset = recordOffset;
+            container.bytes = 0;
+            container.recordCounter += container.nRecords;
+            container.nRecords = 0;
+        }
+        containerRefID = bam->refID;
+        container.bytes += bam->size();
+        container.nRecords++;
+        recordOffset += bam->size();
+    }
+    if (container.nRecords > 0) {
+        containers.push_back(container);
+    }
+
+    while (outputs.size() < containers.size()) {
+        outputs.push_back(new CramBuffer());
+    }
+}
+
+    void
+CramEncodeWorkerManager::finishStep()
+{
+    if (filterSupplier->closing) {
+        return;
+    }
+    size_t toUsed = header.size();
+    for (int i = 0; i < containers.size(); i++) {
+        toUsed += outputs[i]->size();
+    }
+    if (toUsed > inputSize) {
+        WriteErrorMessage("CRAM encoding: the containers for a batch of %lld bytes took %lld, which is more than the write buffer.  Try a larger -wbs.\n",
+            (_int64)inputUsed, (_int64)toUsed);
+        soft_exit(1);
+    }
+
+    toUsed = 0;
+    if (header.size() > 0) {
+        memcpy(input, header.data(), header.size());
+        toUsed += header.size();
+    }
+    for (int i = 0; i < containers.size(); i++) {
+        memcpy(input + toUsed, outputs[i]->data(), outputs[i]->size());
+        toUsed += outputs[i]->size();
+    }
+    encoder->setEncodedBatchSize(toUsed);
+}
+
+    void
+CramEncodeWorker::step()
+{
+    CramEncodeWorkerManager* manager = (CramEncodeWorkerManager*) getManager();
+    if (encoder == NULL) {
+        encoder = new CramContainerEncoder(manager->filterSupplier->genome, DataWriterSupplier::BgzfCompressionLevel);
+    }
+    int nContainers = (int)manager->containers.size();
+    int begin = (getThreadNum() * nContainers) / getNumThreads();
+    int end = ((1 + getThreadNum()) * nContainers) / getNumThreads();
+    for (int i = begin; i < end; i++) {
+        CramEncodeWorkerManager::Container* container = &manager->containers[i];
+        manager->outputs[i]->clear();
+        encoder->encode(manager->input + container->offset, container->bytes, container->nRecords, container->recordCounter, manager->outputs[i]);
+    }
+}
+
+CramWriterFilter::~CramWriterFilter()
+{
+    delete worker;
+    delete encoder;     // which deletes the manager
+}
+
+    size_t
+CramWriterFilter::onNextBatch(
+    DataWriter* writer,
+    size_t offset,
+    size_t bytes,
+    bool lastBatch,
+    bool* needMoreBuffer,
+    size_t* fromBufferUsed)
+{
+    //
+    // Nothing to write
+    //
+    if (bytes == 0 || *needMoreBuffer) {
+        return 0;
+    }
+
+    char* fromBuffer;
+    size_t fromSize, fromUsed, physicalOffset, logicalOffset;
+    writer->getBatch(-1, &fromBuffer, &fromSize, &fromUsed, &physicalOffset, NULL, &logicalOffset);
+    if (fromUsed == 0 || supplier->multiThreaded || supplier->closing) {
+        if (fromBufferUsed != NULL) {
+            *fromBufferUsed = min<long long>(fromUsed, bytes);
+        }
+        return min<long long>(fromUsed, bytes);
+    }
+
+    // encode buffer synchronously in-place
+    if (manager == NULL) {
+        manager = new CramEncodeWorkerManager(supplier);
+        worker = manager->createWorker();
+        encoder = new FileEncoder(0, false, manager);
+        encoder->initialize((AsyncDataWriter*) writer);
+        manager->initialize(encoder);
+        manager->configure(worker, 0, 1);
+    }
+
+    encoder->setupEncode(-1);
+    manager->beginStep();
+    worker->step();
+    manager->finishStep();
+    writer->getBatch(-1, &fromBuffer, &fromSize, &fromUsed, &physicalOffset, NULL, &logicalOffset);
+    if (fromBufferUsed != NULL) {
+        *fromBufferUsed = fromUsed;
+    }
+
+    return fromUsed;
+}
+
+    DataWriter::Filter*
+CramWriterFilterSupplier::getFilter()
+{
+    return new CramWriterFilter(this);
+}
+
+    void
+CramWriterFilterSupplier::onClosing(
+    DataWriterSupplier* supplier)
+{
+    closing = true;
+    DataWriter* writer = supplier->getWriter();
+    char* buffer;
+    size_t bytes;
+    if (! (writer->getBuffer(&buffer, &bytes) && bytes >= sizeof(CramContainerEncoder::EofContainer))) {
+        WriteErrorMessage("no space to write CRAM EOF container\n");
+        soft_exit(1);
+    }
+    memcpy(buffer, CramContainerEncoder::EofContainer, sizeof(CramContainerEncoder::EofContainer));
+    writer->advance(sizeof(CramContainerEncoder::EofContainer));
+    writer->close();
+    delete writer;
+}
+
+    CramWriterFilterSupplier*
+DataWriterSupplier::cram(
+    const Genome* genome,
+    const char* fileName,
+    bool multiThreaded)
+{
+    return new CramWriterFilterSupplier(genome, fileName, multiThreaded);
+}
+
+    FileEncoder*
+FileEncoder::cram(
+    CramWriterFilterSupplier* filterSupplier,
+    int numThreads,
+    bool bindToProcessor)
+{
+    return new FileEncoder(numThreads, bindToProcessor, new CramEncodeWorkerManager(filterSupplier));
+}
@@ -0,0 +1,64 @@
+/*++
+
+Module Name:
+
+    CramDataWriter.h
+
+Abstract:
+
+    Headers for the filter that turns BAM output into CRAM as it's written.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "DataWriter.h"
+#include "Genome.h"
+
+//
+// The last filter for CRAM output.  SNAP writes the file as BAM records, so that sorting and duplicate marking work the
+// same way, and this replaces each batch of them with CRAM containers before it goes to the file (where the BAM output
+// would have BGZF compression).  Like GzipWriterFilterSupplier, it encodes in each writer's thread for unsorted output,
+// and in the FileEncoder's threads for sorted output, where multiThreaded is set.
+//
+class CramWriterFilterSupplier : public DataWriter::FilterSupplier
+{
+public:
+    CramWriterFilterSupplier(const Genome* i_genome, const char* i_fileName, bool i_multiThreaded)
+    :
+        FilterSupplier(DataWriter::ResizeFilter),
+        genome(i_genome),
+        fileName(i_fileName),
+        multiThreaded(i_multiThreaded),
+        closing(false),
+        recordCounter(0)
+    {}
+
+    virtual ~CramWriterFilterSupplier() {}
+
+    const bool multiThreaded;
+
+    virtual DataWriter::Filter* getFilter();
+
+    virtual void onClosing(DataWriterSupplier* supplier);
+    virtual void onClosed(DataWriterSupplier* supplier) {}
+
+private:
+    friend class CramWriterFilter;
+    friend class CramEncodeWorkerManager;
+    friend class CramEncodeWorker;
+
+    const Genome* genome;
+    const char* fileName;
+    bool closing;
+    volatile _int64 recordCounter;      // Records given to containers so far, across all of the writers (so with more than one writer,
+                                        // containers' counters are in the order they were encoded rather than written; readers only
+                                        // use them to make up names, and we always store names)
+};
@@ -24,6 +24,7 @@ Environment:
 #include "ParallelTask.h"
 #include "DataReader.h"
 #include "Bam.h"
+#include "Cram.h"
 #include "zlib.h"
 #include "exit.h"
 #include "Error.h"
@@ -90,6 +91,21 @@ protected:
 
     // must hold the lock to call
     virtual void addBuffer();
+
+    //
+    // Adaptive buffering.  Subclasses that do real asynchronous IO can turn this on, and then rather than reading bufferSize into
+    // every free buffer, they read ioSize bytes into at most readAheadLimit buffers beyond the one that the consumer is working on.
+    // nextBatch() watches how long the consumer waits for reads to complete, and grows the read-ahead (adding buffers as needed) and
+    // then the read size when it's waiting too much, and backs off when the read-ahead is sitting there full.  All of the adaptive
+    // readers in the process share DataSupplier::AdaptiveBufferMemoryLimit.
+    //
+    void enableAdaptiveBuffering();
+
+    // must hold the lock to call
+    bool readAheadAllowsAnotherRead();
+
+    // must hold the lock to call.  waitForBuffer() on behalf of the consumer, charging the time to the read-ahead policy.
+    void consumerWaitForBuffer(unsigned bufferNumber);
   
     static const unsigned BUFFER_SIZE = 4 * 1024 * 1024 - 4096;
 
@@ -147,10 +163,30 @@ protected:
 
 	ExclusiveLock       lock;
 
+    bool                adaptive;
+    size_t              ioSize;             // How much to read into a buffer.  Always bufferSize if we're not adaptive.
+    unsigned            readAheadLimit;     // Max buffers that may be Reading or Full ahead of the consumer
+
 private:
 
 	virtual bool getDataInternal(char** o_buffer, _int64* o_validBytes, _int64* o_startBytes = NULL);
 
+    // must hold the lock to call
+    void adaptBuffering();
+    void accountAdaptiveMemory();
+
+    _int64              adaptiveBytesAccounted;     // Our contribution to AdaptiveBytesInUse
+    _int64              windowStart;                // Start time of the current measurement window
+    _int64              stallNanos;                 // Time the consumer spent waiting for reads in this window
+    unsigned            windowBatches;
+    unsigned            quietWindows;               // Consecutive windows with (almost) no waiting
+    size_t              minIoSize;
+
+    static volatile _int64 AdaptiveBytesInUse;
+
+    static const _int64 AdaptWindowNanos = 100 * 1000 * 1000;
+    static const unsigned MinReadAhead = 2;
+
 	//
 	// Stuff for handling the header read.  We allow arbitrarily large header reads, and service them by copying data from the underlying
 	// data reader into a local buffer.  We might wind up reading more than the actual header, so we serve reads out of the header buffer
@@ -187,7 +223,8 @@ ReadBasedDataReader::ReadBasedDataReader(
     bufferSize(i_bufferSpace > 0 ? i_bufferSpace / ((_int64)i_nBuffers * 2) : BUFFER_SIZE),
 	headerBuffer(NULL), headerBufferSize(0), amountAdvancedThroughUnderlyingStoreByUs(0), 
 	headerExtra(NULL), headerExtraSize(0), startedReadingHeader(false), headerBuffersOutstanding(0), nHeaderBuffersAllocated(0),
-	hitEOFReadingHeader(false)
+	hitEOFReadingHeader(false), adaptive(false), readAheadLimit(0), adaptiveBytesAccounted(0), windowStart(0), stallNanos(0),
+    windowBatches(0), quietWindows(0), minIoSize(0)
 {
     //
     // Initialize the buffer info struct.
@@ -205,6 +242,9 @@ ReadBasedDataReader::ReadBasedDataReader(
         soft_exit(1);
     }
 
+    ioSize = bufferSize;
+    readAheadLimit = maxBuffers;
+
     char* allocated = (char*) BigReserve(maxBuffers * (bufferSize + extraBytes + overflowBytes));
     BigCommit(allocated, nBuffers * (bufferSize + extraBytes + overflowBytes));
     if (NULL == allocated) {
@@ -241,6 +281,10 @@ ReadBasedDataReader::ReadBasedDataReader(
 
 ReadBasedDataReader::~ReadBasedDataReader()
 {
+    if (adaptiveBytesAccounted != 0) {
+        InterlockedAdd64AndReturnNewValue(&AdaptiveBytesInUse, -adaptiveBytesAccounted);
+    }
+
     BigDealloc(bufferInfo[0].buffer);
     for (unsigned i = 0; i < nBuffers; i++) {
         bufferInfo[i].buffer = bufferInfo[i].extra = NULL;
@@ -524,7 +568,7 @@ ReadBasedDataReader::getDataInternal(
     if (info->state != Full) {
         _ASSERT(info->state != InUse);
         AcquireExclusiveLock(&lock);
-        waitForBuffer(nextBufferForConsumer);
+        consumerWaitForBuffer(nextBufferForConsumer);
         ReleaseExclusiveLock(&lock);
     }
 
@@ -592,11 +636,15 @@ ReadBasedDataReader::nextBatch()
     }
 
     if (bufferInfo[nextBufferForConsumer].state != Full) {
-        waitForBuffer(nextBufferForConsumer);
+        consumerWaitForBuffer(nextBufferForConsumer);
     }
 
     bufferInfo[nextBufferForConsumer].offset = overflow;
     bufferInfo[nextBufferForConsumer].holds = 0;
+
+    if (adaptive) {
+        adaptBuffering();
+    }
     //fprintf(stderr,"emitting buffer starting at 0x%llx\n", info->fileOffset);
     //if (nextStart != 0) fprintf(stderr, "checking NextStart 0x%llx\n", nextStart);  
     _ASSERT(nextStart == 0 || nextStart == bufferInfo[nextBufferForConsumer].fileOffset || bufferInfo[nextBufferForConsumer].isEOF);
@@ -780,6 +828,131 @@ ReadBasedDataReader::addBuffer()
     }
 }
 
+    void
+ReadBasedDataReader::enableAdaptiveBuffering()
+{
+    //
+    // Start with half-sized reads and half of the buffers reading ahead, and let adaptBuffering() work it out from there.
+    // The smallest read we'll do has to leave plenty of room past the overflow, or we'd spend all our time re-reading it.
+    //
+    minIoSize = __max(bufferSize / 4, (size_t)(4 * overflowBytes));
+    if (minIoSize >= bufferSize) {
+        minIoSize = bufferSize;     // Records are too big to play with the read size; we can still vary the read-ahead
+    }
+
+    adaptive = true;
+    ioSize = __max(minIoSize, bufferSize / 2);
+    readAheadLimit = __max(MinReadAhead, nBuffers / 2);
+    windowStart = timeInNanos();
+
+    accountAdaptiveMemory();
+}
+
+    void
+ReadBasedDataReader::accountAdaptiveMemory()
+{
+    _int64 bytes = (_int64)readAheadLimit * ((_int64)ioSize + overflowBytes + extraBytes);
+    InterlockedAdd64AndReturnNewValue(&AdaptiveBytesInUse, bytes - adaptiveBytesAccounted);
+    adaptiveBytesAccounted = bytes;
+}
+
+    bool
+ReadBasedDataReader::readAheadAllowsAnotherRead()
+{
+    AssertExclusiveLockHeld(&lock);
+
+    if (!adaptive) {
+        return true;
+    }
+
+    unsigned ahead = 0;
+    for (int i = nextBufferForConsumer; i != -1; i = bufferInfo[i].next) {
+        if (i != nextBufferForConsumer && !bufferInfo[i].headerBuffer && (bufferInfo[i].state == Reading || bufferInfo[i].state == Full)) {
+            ahead++;
+        }
+    }
+
+    return ahead < readAheadLimit;
+}
+
+    void
+ReadBasedDataReader::consumerWaitForBuffer(
+    unsigned bufferNumber)
+{
+    AssertExclusiveLockHeld(&lock);
+
+    if (!adaptive) {
+        waitForBuffer(bufferNumber);
+        return;
+    }
+
+    _int64 start = timeInNanos();
+    waitForBuffer(bufferNumber);
+    stallNanos += timeInNanos() - start;
+}
+
+    void
+ReadBasedDataReader::adaptBuffering()
+{
+    AssertExclusiveLockHeld(&lock);
+
+    windowBatches++;
+    _int64 now = timeInNanos();
+    _int64 windowLength = now - windowStart;
+    if (windowLength < AdaptWindowNanos || windowBatches < 4) {
+        return;
+    }
+
+    double stallFraction = (double)stallNanos / (double)windowLength;
+    _int64 bufferBytes = (_int64)ioSize + overflowBytes + extraBytes;
+    bool overLimit = AdaptiveBytesInUse > DataSupplier::AdaptiveBufferMemoryLimit;
+
+    if (overLimit) {
+        //
+        // Someone (maybe us) grew past the limit.  Give back read size first, since that doesn't cost the consumer any latency.
+        //
+        if (ioSize > minIoSize) {
+            ioSize = __max(minIoSize, ioSize / 2);
+        } else if (readAheadLimit > MinReadAhead) {
+            readAheadLimit--;
+        }
+        quietWindows = 0;
+    } else if (stallFraction > 0.02) {
+        //
+        // The consumer is waiting on IO.  Read further ahead if we can, and once that's not helping (or we're out of buffers), read
+        // bigger chunks.
+        //
+        quietWindows = 0;
+        if (readAheadLimit < maxBuffers - 1 && AdaptiveBytesInUse + bufferBytes <= DataSupplier::AdaptiveBufferMemoryLimit && (readAheadLimit < 8 || ioSize == bufferSize)) {
+            readAheadLimit += __max(1u, readAheadLimit / 4);
+            readAheadLimit = __min(readAheadLimit, maxBuffers - 1);
+            if (nextBufferForReader == -1) {
+                addBuffer();
+            }
+        } else if (ioSize < bufferSize && AdaptiveBytesInUse + (_int64)readAheadLimit * ioSize <= DataSupplier::AdaptiveBufferMemoryLimit) {
+            ioSize = __min(bufferSize, ioSize * 2);
+        }
+    } else if (stallFraction < 0.002) {
+        //
+        // IO is keeping up.  If that's been true for a while and the read-ahead is full, we have more of it than we need.
+        //
+        quietWindows++;
+        if (quietWindows >= 8) {
+            quietWindows = 0;
+            if (readAheadLimit > MinReadAhead && !readAheadAllowsAnotherRead()) {
+                readAheadLimit--;
+            }
+        }
+    }
+
+    accountAdaptiveMemory();
+    startIo();  // In case we just raised the read-ahead
+
+    windowStart = now;
+    windowBatches = 0;
+    stallNanos = 0;
+}
+
 class StdioDataReader : public ReadBasedDataReader 
 {
 public:
@@ -1391,6 +1564,10 @@ AsyncFileDataReader::AsyncFileDataReader(unsigned i_nBuffers, _int64 i_overflowB
     ReadBasedDataReader(i_nBuffers, i_overflowBytes, extraFactor, bufferSpace), fileName(NULL), asyncFile(NULL), endingOffset(0)
 {
     readOffset = 0;
+    if (bufferSpace == 0 && i_nBuffers > 1 && DataSupplier::AdaptiveBuffering) {
+        enableAdaptiveBuffering();  // Callers that asked for a specific amount of buffer space get exactly that
+    }
+
     bufferReaders = (AsyncFile::Reader**)malloc(sizeof(AsyncFile::Reader*) * maxBuffers);
 
     if (NULL == bufferReaders) {
@@ -1495,7 +1672,7 @@ AsyncFileDataReader::startIo()
     //
     AssertExclusiveLockHeld(&lock);
 
-    while (nextBufferForReader != -1) {
+    while (nextBufferForReader != -1 && readAheadAllowsAnotherRead()) {
         // remove from free list
         BufferInfo* info = &bufferInfo[nextBufferForReader];
         AsyncFile::Reader* reader = bufferReaders[nextBufferForReader];
@@ -1532,10 +1709,10 @@ AsyncFileDataReader::startIo()
         unsigned amountToRead;
         _int64 finalOffset = __min(fileSize, endingOffset + overflowBytes);
         _int64 finalStartOffset = __min(fileSize, endingOffset);
-        amountToRead = (unsigned)__min(finalOffset - readOffset, (_int64)bufferSize);   // Cast OK because can't be longer than unsigned bufferSize
+        amountToRead = (unsigned)__min(finalOffset - readOffset, (_int64)ioSize);   // Cast OK because can't be longer than unsigned bufferSize
         info->isEOF = readOffset + amountToRead == finalOffset;
         info->nBytesThatMayBeginARead = info->isEOF && finalStartOffset == fileSize ? amountToRead
-            : (unsigned)__min((_int64)bufferSize - overflowBytes, finalStartOffset - readOffset);
+            : (unsigned)__min((_int64)ioSize - overflowBytes, finalStartOffset - readOffset);
 
         _ASSERT(amountToRead >= info->nBytesThatMayBeginARead && (!info->isEOF || finalOffset == readOffset + amountToRead));
         info->fileOffset = readOffset;
@@ -1599,10 +1776,12 @@ AsyncFileDataReader::waitForBuffer(
         startIo();
     }
 
+    _int64 start = timeInNanos();
     if (!reader->waitForCompletion()) {
         WriteErrorMessage("AsyncFileDataReader::waitForBuffer: reader->waitForCompletion() failed\n");
         soft_exit(1);
     }
+    InterlockedAdd64AndReturnNewValue(&ReadWaitTime, timeInNanos() - start);
 
     info->state = Full;
     info->buffer[info->validBytes] = 0;
@@ -1640,6 +1819,78 @@ public:
 
 DataSupplier* DataSupplier::AsyncFile = new AsyncFileDataSupplier();
 
+//
+// An AsyncFileDataReader that goes through io_uring.  The initial buffers are registered with the ring so reads into them
+// use the fixed-buffer opcodes, and all of the reads started in one startIo() call go to the kernel in a single submission.
+//
+
+class IoUringDataReader : public AsyncFileDataReader
+{
+public:
+
+    IoUringDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, size_t bufferSpace, bool i_directIo) :
+        AsyncFileDataReader(i_nBuffers, i_overflowBytes, extraFactor, bufferSpace), directIo(i_directIo) {}
+
+    virtual bool init(const char* i_fileName);
+
+protected:
+
+    // must hold the lock to call
+    virtual void startIo();
+
+private:
+
+    bool                directIo;
+};
+
+    bool
+IoUringDataReader::init(const char* i_fileName)
+{
+    fileName = i_fileName;
+    asyncFile = AsyncFile::openIoUring(fileName, false, directIo);
+    if (NULL == asyncFile) {
+        return false;   // openIoUring() has printed why
+    }
+
+    fileSize = asyncFile->getSize();
+    if (fileSize < 0) {
+        return false;   // There's aleady an error message printed
+    }
+
+    //
+    // Only the buffers we start with are registered; any that addBuffer() brings in later just use the regular opcodes.
+    // Failure (usually the locked memory limit) is harmless.
+    //
+    asyncFile->registerBuffers(bufferInfo[0].buffer, nBuffers * (bufferSize + extraBytes + overflowBytes));
+
+    return true;
+} // IoUringDataReader::init
+
+    void
+IoUringDataReader::startIo()
+{
+    AsyncFileDataReader::startIo();
+    asyncFile->submitPending();
+} // IoUringDataReader::startIo
+
+class IoUringDataSupplier : public DataSupplier
+{
+public:
+    IoUringDataSupplier(bool i_directIo) : DataSupplier(), directIo(i_directIo) {}
+    virtual DataReader* getDataReader(int bufferCount, _int64 overflowBytes, double extraFactor, size_t bufferSpace)
+    {
+        // add some buffers for read-ahead
+        return new IoUringDataReader(bufferCount + (bufferCount > 1 ? 4 : 0), overflowBytes, extraFactor, bufferSpace, directIo);
+    }
+
+private:
+    bool directIo;
+};
+
+DataSupplier* DataSupplier::IoUring = new IoUringDataSupplier(false);
+
+DataSupplier* DataSupplier::IoUringDirect = new IoUringDataSupplier(true);
+
 //
 // Decompress
 //
@@ -1650,6 +1901,8 @@ static const int ENABLE_ZLIB_GZIP = 32;
 static const double MIN_FACTOR = 1.2;
 static const double MAX_FACTOR = 10.0;
 
+typedef VariableSizeVector<_int64> OffsetVector;
+
 class DecompressDataReader : public DataReader
 {
 public:
@@ -1693,15 +1946,13 @@ public:
     // debugging
     char* findPointer(void* p);
 
-private:
-
+protected:
 
     static void decompressThread(void *context);
 
     static void decompressThreadContinuous(void *context);
 
-    friend class DecompressManager;
-    friend class DecompressWorker;
+    friend class DecompressPool;
 
     enum EntryState
     {
@@ -1726,8 +1977,35 @@ private:
         _int64 fileOffset;  // This is just for debugging
         bool allocated; // if decompressed has been allocated specially, not from inner extra data
         void ensureSize(_int64 newSize, _int64 newTotal, _int64 copyOld);
+
+        // for BGZF, while its blocks are being decompressed by the pool (all but blocksLeft are protected by the pool's lock)
+        OffsetVector inputs; // offset of each block in compressed, plus the end
+        OffsetVector outputs; // offset each block decompresses to in decompressed, plus the end
+        int nBlocks;
+        int nextBlock; // next one to be claimed by a pool thread
+        volatile int blocksLeft; // not finished decompressing
+        Entry* nextPending; // next entry this reader submitted to the pool
     };
 
+    //
+    // The parts of reading a compressed format that the background thread and the decompression pool call, so that
+    // other block formats (CRAM) can use the same machinery.  readEntry fills in the next entry from the inner reader,
+    // with the offsets of each block in it, and returns false if it's the empty entry that marks the end.  The pool calls
+    // decompressBlock for each block (on any of its threads), and finishEntry once all of an entry's blocks are done.
+    //
+    virtual bool readEntry(Entry* entry);
+
+    virtual void decompressBlock(Entry* entry, int block, z_stream* zstream, ThreadHeap* heap);
+
+    virtual void finishEntry(Entry* entry) {}
+
+    // Makes entry the empty one after the last batch.
+    void setEOFEntry(Entry* entry);
+
+    // Stops the background thread once the pool is done with its entries.  Subclasses call it before freeing anything
+    // that readEntry or decompressBlock use.
+    void stopThread();
+
     // use only these routines to manipulate the linked  lists
     Entry* peekReady(); // from first, block if none
     void popReady(); // from first
@@ -1755,6 +2033,13 @@ private:
     Entry* available; // first non-ready buffer (head of freelist), NULL if none
     EventObject availableEvent; // signalled by main thread when available goes NULL->non-NULL
     ExclusiveLock lock; // lock on linked list pointers in this object and in Entry
+    volatile int readyCount; // entries on the ready list, which the pool uses to decide who needs data most
+
+    // entries submitted to the decompression pool, in order; protected by the pool's lock
+    Entry* pendingFirst; // oldest, which is the next one to become ready
+    Entry* pendingLast;
+    Entry* unclaimed; // first with blocks that no pool thread has taken yet, NULL if none
+    EventObject pendingEmpty; // signalled when there are no pending entries
 };
 
 void DecompressDataReader::Entry::ensureSize(_int64 newSize, _int64 extra, _int64 copyOld)
@@ -1783,7 +2068,8 @@ DecompressDataReader::DecompressDataReader(
     int i_chunkSize)
     : DataReader(), inner(i_inner), count(i_count), offset(i_overflowBytes),
     totalExtra(i_totalExtra), extraBytes(i_extraBytes), overflowBytes(i_overflowBytes),
-    chunkSize(i_chunkSize), threadStarted(false), eof(false), stopping(false)
+    chunkSize(i_chunkSize), threadStarted(false), eof(false), stopping(false), readyCount(0),
+    pendingFirst(NULL), pendingLast(NULL), unclaimed(NULL)
 {
     entries = new Entry[count];
     for (int i = 0; i < count; i++) {
@@ -1803,16 +2089,14 @@ DecompressDataReader::DecompressDataReader(
     AllowEventWaitersToProceed(&availableEvent);
     CreateEventObject(&decompressThreadDone);
     PreventEventWaitersFromProceeding(&decompressThreadDone);
+    CreateEventObject(&pendingEmpty);
+    AllowEventWaitersToProceed(&pendingEmpty);
     InitializeExclusiveLock(&lock);
 }
 
 DecompressDataReader::~DecompressDataReader()
 {
-    if (threadStarted) {
-        stopping = true;
-        AllowEventWaitersToProceed(&availableEvent);
-        WaitForEvent(&decompressThreadDone);
-    }
+    stopThread();
     for (int i = 0;  i < count; i++) {
         if (entries[i].allocated) {
             BigDealloc(entries[i].decompressed);
@@ -1822,6 +2106,17 @@ DecompressDataReader::~DecompressDataReader()
     delete inner;
 }
 
+    void
+DecompressDataReader::stopThread()
+{
+    if (threadStarted) {
+        stopping = true;
+        AllowEventWaitersToProceed(&availableEvent);
+        WaitForEvent(&decompressThreadDone);
+        threadStarted = false;
+    }
+}
+
     bool
 DecompressDataReader::init(
     const char* fileName)
@@ -2117,68 +2412,216 @@ DecompressDataReader::findPointer(
     return result;
 }
 
-typedef VariableSizeVector<_int64> OffsetVector;
-
-class DecompressWorker : public ParallelWorker
+//
+// A process-wide pool of threads that inflate BGZF blocks for every DecompressDataReader.  Each reader used to have its own
+// set of up to eight threads, so reading several BAM files at once (or a BAM file while something else is decompressing)
+// ran many more threads than there are cores, all fighting over the caches.  Now each reader's thread just reads its
+// batches and finds the block boundaries, then submits each batch here and goes on to the next.  The pool has one thread
+// per core (DataSupplier::ThreadCount) no matter how many readers there are.
+//
+// Each reader has its own queue of submitted batches, which become ready in the order in which they were submitted.  The
+// pool threads take one block at a time, from the reader with the fewest batches ready for its consumer, so that the reader
+// that's closest to making its consumer wait gets priority.
+//
+class DecompressPool
 {
 public:
-    DecompressWorker();
+    static DecompressPool* getPool();
+
+    // The entry's inputs and outputs must be filled in.  An entry with no blocks (the EOF marker) is ready as soon as those before it are.
+    void submit(DecompressDataReader* reader, DecompressDataReader::Entry* entry);
 
-    virtual void step();
+    // Waits until everything the reader submitted is ready and no pool thread is still using the reader, so it can be deleted.
+    void drain(DecompressDataReader* reader);
 
 private:
-    z_stream zstream;
-    ThreadHeap heap;
-};
-    
-class DecompressManager: public ParallelWorkerManager
+    DecompressPool();
+
+    static void WorkerThreadMain(void* param);
+    void workerThread();
+
+    // must hold the lock to call
+    void makeReady(DecompressDataReader* reader);
+    void removeReader(int index);
+
+    ExclusiveLock lock;
+    EventObject workAvailable; // set while any reader has unclaimed blocks
+    VariableSizeVector<DecompressDataReader*> readers; // those with unclaimed blocks
+    int nextReader; // where to start looking among readers with the same priority, so they take turns
+    int nThreads;
+    bool threadsStarted;
+
+    static DecompressPool* volatile pool;
+}; // DecompressPool
+
+DecompressPool* volatile DecompressPool::pool = NULL;
+
+DecompressPool::DecompressPool()
+    : nextReader(0), nThreads(0), threadsStarted(false)
 {
-public:
-    DecompressManager(OffsetVector* i_inputs, OffsetVector* i_outputs)
-        : inputs(i_inputs), outputs(i_outputs)
-    {}
+    InitializeExclusiveLock(&lock);
+    CreateEventObject(&workAvailable);
+    PreventEventWaitersFromProceeding(&workAvailable);
+}
 
-    virtual ParallelWorker* createWorker()
-    { return new DecompressWorker(); }
+    DecompressPool*
+DecompressPool::getPool()
+{
+    if (pool == NULL) {
+        DecompressPool* newPool = new DecompressPool();
+        if (InterlockedCompareExchangePointerAndReturnOldValue((void* volatile*)&pool, newPool, NULL) != NULL) {
+            delete newPool; // someone else got there first
+        }
+    }
+    return pool;
+}
 
-    OffsetVector* inputs;
-    OffsetVector* outputs;
-    DecompressDataReader::Entry* entry;
+    void
+DecompressPool::submit(
+    DecompressDataReader* reader,
+    DecompressDataReader::Entry* entry)
+{
+    entry->nBlocks = (int)entry->inputs.size() - 1;
+    entry->nextBlock = 0;
+    entry->blocksLeft = entry->nBlocks;
+    entry->nextPending = NULL;
+
+    AcquireExclusiveLock(&lock);
+    if (!threadsStarted) {
+        //
+        // The pool lasts for the life of the process, so its threads start with the first BGZF reader (after the thread count is set).
+        //
+        threadsStarted = true;
+        nThreads = max(1, DataSupplier::ThreadCount);
+        for (int i = 0; i < nThreads; i++) {
+            if (!StartNewThread(WorkerThreadMain, this)) {
+                WriteErrorMessage("DecompressPool: unable to start decompression thread\n");
+                soft_exit(1);
+            }
+        }
+    }
 
-    friend class DecompressWorker;
-}; // DecompressManager
+    if (reader->pendingLast == NULL) {
+        reader->pendingFirst = entry;
+        PreventEventWaitersFromProceeding(&reader->pendingEmpty);
+    } else {
+        reader->pendingLast->nextPending = entry;
+    }
+    reader->pendingLast = entry;
 
-DecompressWorker::DecompressWorker()
-    : heap(BAM_BLOCK)
+    if (entry->nBlocks == 0) {
+        makeReady(reader);
+    } else if (reader->unclaimed == NULL) {
+        reader->unclaimed = entry;
+        readers.push_back(reader);
+        AllowEventWaitersToProceed(&workAvailable);
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+DecompressPool::drain(
+    DecompressDataReader* reader)
 {
-    zstream.zalloc = zalloc;
-    zstream.zfree = zfree;
-    zstream.opaque = &heap;
+    WaitForEvent(&reader->pendingEmpty);
+
+    //
+    // The thread that set pendingEmpty did it in makeReady(), holding the lock, and may not have got all the way out of
+    // setting the event yet.  Once we have the lock it has, and nothing in the pool refers to this reader any more.
+    //
+    AcquireExclusiveLock(&lock);
+    _ASSERT(reader->pendingFirst == NULL && reader->unclaimed == NULL);
+    ReleaseExclusiveLock(&lock);
 }
 
     void
-DecompressWorker::step()
-{
-    DecompressManager* manager = (DecompressManager*) getManager();
-    for (int i = getThreadNum(); i < manager->inputs->size() - 1; i += getNumThreads()) {
-        _int64 inputUsed, outputUsed;
-        bool ok = DecompressDataReader::decompress(&zstream,
-            &heap,
-            manager->entry->compressed + (*manager->inputs)[i],
-            (*manager->inputs)[i + 1] - (*manager->inputs)[i],
-            &inputUsed,
-            manager->entry->decompressed + (*manager->outputs)[i],
-            (*manager->outputs)[i + 1] - (*manager->outputs)[i],
-            &outputUsed,
-            DecompressDataReader::SingleBlock);
+DecompressPool::WorkerThreadMain(
+    void* param)
+{
+    ((DecompressPool*)param)->workerThread();
+}
 
-        if (!ok) {
-            WriteErrorMessage("DecompressWorker::step(): DecompressDataReader::decompress() failed.  File offset 0x%llx\n", manager->entry->fileOffset);
-            soft_exit(1);
+    void
+DecompressPool::workerThread()
+{
+    z_stream zstream;
+    ThreadHeap heap(BAM_BLOCK);
+
+    while (true) {
+        WaitForEvent(&workAvailable);
+
+        AcquireExclusiveLock(&lock);
+        if (readers.size() == 0) {
+            ReleaseExclusiveLock(&lock);
+            continue;
+        }
+
+        int chosen = -1;
+        for (int i = 0; i < readers.size(); i++) {
+            int index = (nextReader + i) % readers.size();
+            if (chosen == -1 || readers[index]->readyCount < readers[chosen]->readyCount) {
+                chosen = index;
+            }
         }
+        nextReader = chosen + 1;
 
-        _ASSERT(inputUsed == (*manager->inputs)[i + 1] - (*manager->inputs)[i] &&
-            outputUsed == (*manager->outputs)[i + 1] - (*manager->outputs)[i]);
+        DecompressDataReader* reader = readers[chosen];
+        DecompressDataReader::Entry* entry = reader->unclaimed;
+        int block = entry->nextBlock++;
+        if (entry->nextBlock == entry->nBlocks) {
+            //
+            // That's the last block of this entry, so move on to the next one that has any.
+            //
+            do {
+                reader->unclaimed = reader->unclaimed->nextPending;
+            } while (reader->unclaimed != NULL && reader->unclaimed->nBlocks == 0);
+            if (reader->unclaimed == NULL) {
+                removeReader(chosen);
+            }
+        }
+        ReleaseExclusiveLock(&lock);
+
+        reader->decompressBlock(entry, block, &zstream, &heap);
+
+        if (InterlockedDecrementAndReturnNewValue(&entry->blocksLeft) == 0) {
+            reader->finishEntry(entry);
+            AcquireExclusiveLock(&lock);
+            makeReady(reader);
+            ReleaseExclusiveLock(&lock);
+        }
+    }
+}
+
+    void
+DecompressPool::makeReady(
+    DecompressDataReader* reader)
+{
+    //
+    // Entries can finish out of order, but they have to go to the consumer in order.  This holds the pool lock while
+    // it puts them on the ready list, so two threads can't reorder them.
+    //
+    AssertExclusiveLockHeld(&lock);
+    while (reader->pendingFirst != NULL && reader->pendingFirst->blocksLeft == 0) {
+        DecompressDataReader::Entry* entry = reader->pendingFirst;
+        reader->pendingFirst = entry->nextPending;
+        if (reader->pendingFirst == NULL) {
+            reader->pendingLast = NULL;
+        }
+        reader->enqueueReady(entry);
+    }
+    if (reader->pendingFirst == NULL) {
+        AllowEventWaitersToProceed(&reader->pendingEmpty);
+    }
+}
+
+    void
+DecompressPool::removeReader(
+    int index)
+{
+    readers[index] = readers[readers.size() - 1];
+    readers.erase(readers.size() - 1);
+    if (readers.size() == 0) {
+        PreventEventWaitersFromProceeding(&workAvailable);
     }
 }
 
@@ -2199,92 +2642,132 @@ calculateDecompressedSize(char* compressed, _int64 compressedStart, _int64 compr
     return output;
 }
 
+    void
+DecompressDataReader::setEOFEntry(
+    Entry* entry)
+{
+    DataBatch b = inner->getBatch();
+    entry->batch = DataBatch(b.batchID + 1, b.fileID);
+    // decompressed buffer is same as next-to-last batch, need to allocate own buffer
+    entry->decompressed = (char*) BigAlloc(totalExtra);
+    entry->decompressedSize = extraBytes;
+    entry->decompressedValid = entry->decompressedStart = overflowBytes;
+    entry->allocated = true;
+    entry->inputs.clear();
+    entry->outputs.clear();
+    entry->inputs.push_back(0);
+    entry->outputs.push_back(0);
+}
+
+    bool
+DecompressDataReader::readEntry(
+    Entry* entry)
+{
+    // always starts with a fresh batch - advances after reading it all
+    bool ok = inner->getData(&entry->compressed, &entry->compressedValid, &entry->compressedStart);
+    if (! ok) {
+        //fprintf(stderr, "decompressThread #%d %d:%d eof\n", (int)(entry - entries), inner->getBatch().fileID, inner->getBatch().batchID);
+        if (! inner->isEOF()) {
+            WriteErrorMessage("error reading file at offset %lld\n", getFileOffset());
+            soft_exit(1);
+        }
+        // mark as eof - no data
+        setEOFEntry(entry);
+        return false;
+    }
+
+    if (!entry->allocated) {
+        _int64 extraSize;
+        inner->getExtra(&entry->decompressed, &extraSize);
+        entry->decompressedSize = extraBytes;
+        _ASSERT(extraSize >= extraBytes && extraSize >= overflowBytes);
+    }
+    // figure out offsets and advance inner data
+    OffsetVector& inputs = entry->inputs;
+    OffsetVector& outputs = entry->outputs;
+    inputs.clear();
+    outputs.clear();
+    _int64 input = 0;
+    _int64 output = overflowBytes;
+
+    _int64 tempOutput = calculateDecompressedSize(entry->compressed, entry->compressedStart, entry->compressedValid, input, output, getFileOffset() - input);
+    entry->ensureSize(tempOutput, totalExtra - extraBytes, overflowBytes);
+
+    do {
+        inputs.push_back(input);
+        outputs.push_back(output);
+        BgzfHeader* zip = (BgzfHeader*) (entry->compressed + input);
+        input += zip->BSIZE() + 1;
+        output += zip->ISIZE();
+
+        if (output > entry->decompressedSize) {
+            fprintf(stderr, "Bug in DecompressDataReader::decompressThread(); don't have enough decompress buffer when we thought we'd assured it.  Existing size %lld, needed (at least) %lld, entry @0x%p\n", entry->decompressedSize, output, entry);
+            soft_exit(1);
+        }
+        if (input > entry->compressedValid || zip->BSIZE() >= BAM_BLOCK || zip->ISIZE() > BAM_BLOCK) {
+            fprintf(stderr, "error reading BAM file at offset %lld\n", getFileOffset());
+            soft_exit(1);
+        }
+    } while (input < entry->compressedStart);
+    // append final offsets
+    inputs.push_back(input);
+    outputs.push_back(output);
+    //fprintf(stderr, "decompressThread read #%d %lld->%lld\n", (int)(entry - entries), input, output);
+    inner->advance(input);
+    entry->decompressedValid = output;
+    entry->decompressedStart = output - overflowBytes;
+    entry->batch = inner->getBatch();
+    holdBatch(entry->batch); // hold batch while decompressing
+    inner->nextBatch(); // start reading next batch
+    return true;
+}
+
+    void
+DecompressDataReader::decompressBlock(
+    Entry* entry,
+    int block,
+    z_stream* zstream,
+    ThreadHeap* heap)
+{
+    _int64 inputUsed, outputUsed;
+    bool ok = decompress(zstream,
+        heap,
+        entry->compressed + entry->inputs[block],
+        entry->inputs[block + 1] - entry->inputs[block],
+        &inputUsed,
+        entry->decompressed + entry->outputs[block],
+        entry->outputs[block + 1] - entry->outputs[block],
+        &outputUsed,
+        SingleBlock);
+
+    if (!ok) {
+        WriteErrorMessage("DecompressPool: DecompressDataReader::decompress() failed.  File offset 0x%llx\n", entry->fileOffset);
+        soft_exit(1);
+    }
+
+    _ASSERT(inputUsed == entry->inputs[block + 1] - entry->inputs[block] &&
+        outputUsed == entry->outputs[block + 1] - entry->outputs[block]);
+}
+
     void
 DecompressDataReader::decompressThread(
     void* context)
 {
     DecompressDataReader* reader = (DecompressDataReader*) context;
-    OffsetVector inputs, outputs;
-    DecompressManager manager(&inputs, &outputs);
-    ParallelCoworker coworker(min(8, DataSupplier::ThreadCount), false, &manager);
-    coworker.start();
-    // keep reading & decompressing entries until stopped
+    DecompressPool* pool = DecompressPool::getPool();
+    // keep reading entries & handing them to the pool until stopped
     bool stop = false;
     while (! stop) {
         Entry* entry = reader->dequeueAvailable();
-        entry->fileOffset = reader->getFileOffset();
         if (reader->stopping) {
             break;
         }
-        // always starts with a fresh batch - advances after reading it all
-        bool ok = reader->inner->getData(&entry->compressed, &entry->compressedValid, &entry->compressedStart);
-        int index = (int) (entry - reader->entries);
-        if (! ok) {
-            //fprintf(stderr, "decompressThread #%d %d:%d eof\n", index, reader->inner->getBatch().fileID, reader->inner->getBatch().batchID);
-            if (! reader->inner->isEOF()) {
-                WriteErrorMessage("error reading file at offset %lld\n", reader->getFileOffset());
-                soft_exit(1);
-            }
-            // mark as eof - no data
-            DataBatch b = reader->inner->getBatch();
-            entry->batch = DataBatch(b.batchID + 1, b.fileID);
-            // decompressed buffer is same as next-to-last batch, need to allocate own buffer
-            entry->decompressed = (char*) BigAlloc(reader->totalExtra);
-            entry->decompressedSize = reader->extraBytes;
-            entry->decompressedValid = entry->decompressedStart = reader->overflowBytes;
-            entry->allocated = true;
-            stop = true;
-        } else {
-            if (!entry->allocated) {
-                _int64 extraSize;
-                reader->inner->getExtra(&entry->decompressed, &extraSize);
-                entry->decompressedSize = reader->extraBytes;
-                _ASSERT(extraSize >= reader->extraBytes && extraSize >= reader->overflowBytes);
-            }
-            // figure out offsets and advance inner data
-            inputs.clear();
-            outputs.clear();
-            _int64 input = 0;
-            _int64 output = reader->overflowBytes;
-
-            _int64 tempOutput = calculateDecompressedSize(entry->compressed, entry->compressedStart, entry->compressedValid, input, output, reader->getFileOffset() - input);
-            entry->ensureSize(tempOutput, reader->totalExtra - reader->extraBytes, reader->overflowBytes);
-
-            do {
-                inputs.push_back(input);
-                outputs.push_back(output);
-                BgzfHeader* zip = (BgzfHeader*) (entry->compressed + input);
-                input += zip->BSIZE() + 1;
-                output += zip->ISIZE();
-
-                if (output > entry->decompressedSize) {
-                    fprintf(stderr, "Bug in DecompressDataReader::decompressThread(); don't have enough decompress buffer when we thought we'd assured it.  Existing size %lld, needed (at least) %lld, entry @0x%p\n", entry->decompressedSize, output, entry);
-                    soft_exit(1);
-                }
-                if (input > entry->compressedValid || zip->BSIZE() >= BAM_BLOCK || zip->ISIZE() > BAM_BLOCK) {
-                    fprintf(stderr, "error reading BAM file at offset %lld\n", reader->getFileOffset());
-                    soft_exit(1);
-                }
-            } while (input < entry->compressedStart);
-            // append final offsets
-            inputs.push_back(input);
-            outputs.push_back(output);
-            //fprintf(stderr, "decompressThread read #%d %lld->%lld\n", index, input, output);
-            reader->inner->advance(input);
-            entry->decompressedValid = output;
-            entry->decompressedStart = output - reader->overflowBytes;
-            entry->batch = reader->inner->getBatch();
-			reader->holdBatch(entry->batch); // hold batch while decompressing
-            reader->inner->nextBatch(); // start reading next batch
-            // decompress all chunks synchronously on multiple threads
-            manager.entry = entry;
-            coworker.step();
-        }
-        // make buffer available for clients & go on to next
-        //fprintf(stderr, "decompressThread #%d %d:%d ready\n", index, entry->batch.fileID, entry->batch.batchID);
-        reader->enqueueReady(entry);
+        entry->fileOffset = reader->getFileOffset();
+        stop = !reader->readEntry(entry);
+        // the pool makes it available for clients when all of its blocks (and those of the entries before it) are decompressed
+        pool->submit(reader, entry);
     }
-    coworker.stop();
+    pool->drain(reader);
     AllowEventWaitersToProceed(&reader->decompressThreadDone);
 }
 
@@ -2370,6 +2853,7 @@ DecompressDataReader::popReady()
             _ASSERT(first->state == EntryReady);
             //fprintf(stderr, "popReady %d:%d #%d -> held\n", first->batch.fileID, first->batch.batchID, first - entries);
             first->state = EntryHeld;
+            readyCount--;
             if (first->next == NULL) {
                 _ASSERT(last == first);
                 last = NULL;
@@ -2392,6 +2876,7 @@ DecompressDataReader::enqueueReady(Entry* entry)
     _ASSERT(entry->state == EntryReading);
     entry->next = NULL;
     entry->state = EntryReady;
+    readyCount++;
     if (last == NULL) {
         first = last = entry;
         AllowEventWaitersToProceed(&readyEvent);
@@ -2440,6 +2925,236 @@ DecompressDataReader::enqueueAvailable(Entry* entry)
     }
 }
 
+//
+// Reads CRAM as the uncompressed BAM stream that BAMReader expects: the BAM header, and then the records of each
+// container in order.  The reading thread copies whole containers out of the inner reader's batches (a container can
+// span any number of them), and the decompression pool decodes each container on whatever thread is free, so decoding
+// scales with the pool just as BGZF inflation does.
+//
+class CramDataReader : public DecompressDataReader
+{
+public:
+    CramDataReader(DataReader* i_inner, int i_count, _int64 totalExtra, _int64 i_extraBytes, _int64 i_overflowBytes, const Genome* genome);
+
+    virtual ~CramDataReader();
+
+    virtual char* readHeader(_int64* io_headerSize);
+
+    virtual void getExtra(char** o_extra, _int64* o_length);
+
+protected:
+    virtual bool readEntry(Entry* entry);
+
+    virtual void decompressBlock(Entry* entry, int block, z_stream* zstream, ThreadHeap* heap);
+
+    virtual void finishEntry(Entry* entry);
+
+private:
+    struct CramEntry
+    {
+        CramEntry() : headerContainer(-1), extraSize(0) {}
+
+        ~CramEntry()
+        {
+            for (VariableSizeVector<CramBuffer*>::iterator i = outputs.begin(); i != outputs.end(); i++) {
+                delete *i;
+            }
+        }
+
+        CramBuffer  input; // whole containers; the entry's inputs are where each starts, plus the end
+        VariableSizeVector<CramBuffer*> outputs; // BAM records from each container
+        int         headerContainer; // which one is the header container, if any
+        _int64      extraSize; // extra data after the decompressed data
+    };
+
+    CramHeader      header;
+    bool            headerDecoded;
+    _int64          fileDefinitionLeft; // bytes of the file definition that the reading thread has yet to skip
+    bool            sawHeaderContainer;
+    CramBuffer      pending; // the start of a container that the last batch ended in the middle of
+    CramEntry*      cramEntries; // one for each entry
+};
+
+// The file definition is the magic number, version and a 20 byte file ID.
+static const _int64 CramFileDefinitionBytes = 26;
+
+CramDataReader::CramDataReader(
+    DataReader* i_inner,
+    int i_count,
+    _int64 i_totalExtra,
+    _int64 i_extraBytes,
+    _int64 i_overflowBytes,
+    const Genome* genome)
+    : DecompressDataReader(i_inner, i_count, i_totalExtra, i_extraBytes, i_overflowBytes, BAM_BLOCK),
+    header(genome), headerDecoded(false), fileDefinitionLeft(CramFileDefinitionBytes), sawHeaderContainer(false)
+{
+    cramEntries = new CramEntry[count];
+}
+
+CramDataReader::~CramDataReader()
+{
+    stopThread();
+    delete[] cramEntries;
+}
+
+    char*
+CramDataReader::readHeader(
+    _int64* io_headerSize)
+{
+    if (!headerDecoded) {
+        //
+        // Read more of the start of the file until it holds the whole header container.
+        //
+        _int64 bytes = max(*io_headerSize, (_int64)1024 * 1024);
+        while (true) {
+            _int64 got = bytes;
+            char* data = inner->readHeader(&got);
+            size_t used;
+            if (header.decode(data, (size_t)got, getFilename(), &used)) {
+                break;
+            }
+            if (got < bytes) {
+                WriteErrorMessage("CRAM file %s ends in its header\n", getFilename());
+                soft_exit(1);
+            }
+            bytes *= 2;
+        }
+        headerDecoded = true;
+    }
+    *io_headerSize = (_int64)header.bamHeaderBytes();
+    return (char*)header.bamHeader();
+}
+
+    void
+CramDataReader::getExtra(
+    char** o_extra,
+    _int64* o_length)
+{
+    Entry* entry = peekReady();
+    *o_extra = entry->decompressed + entry->decompressedSize;
+    *o_length = cramEntries[entry - entries].extraSize;
+}
+
+    bool
+CramDataReader::readEntry(
+    Entry* entry)
+{
+    CramEntry* cram = &cramEntries[entry - entries];
+    cram->input.clear();
+    cram->input.put(pending.data(), pending.size());
+    pending.clear();
+    cram->headerContainer = -1;
+    OffsetVector& inputs = entry->inputs;
+    inputs.clear();
+    inputs.push_back(0);
+    size_t parsed = 0;
+
+    while (true) {
+        char* data;
+        _int64 valid;
+        if (! inner->getData(&data, &valid)) {
+            if (! inner->isEOF()) {
+                WriteErrorMessage("error reading file at offset %lld\n", getFileOffset());
+                soft_exit(1);
+            }
+            if (cram->input.size() > 0 || fileDefinitionLeft > 0) {
+                WriteErrorMessage("CRAM file %s is truncated: it ends in the middle of a container\n", getFilename());
+                soft_exit(1);
+            }
+            setEOFEntry(entry);
+            cram->extraSize = totalExtra - extraBytes;
+            return false;
+        }
+        _int64 skip = min(valid, fileDefinitionLeft);
+        fileDefinitionLeft -= skip;
+        cram->input.put(data + skip, valid - skip);
+        inner->advance(valid);
+
+        CramContainerHeader containerHeader;
+        while (containerHeader.parse(cram->input.data() + parsed, cram->input.size() - parsed) &&
+                cram->input.size() - parsed >= containerHeader.headerBytes + containerHeader.length) {
+            if (! sawHeaderContainer) {
+                // The first container is the SAM header, which readHeader has already decoded
+                _ASSERT(headerDecoded);
+                sawHeaderContainer = true;
+                cram->headerContainer = (int)inputs.size() - 1;
+            }
+            parsed += containerHeader.headerBytes + containerHeader.length;
+            inputs.push_back(parsed);
+        }
+
+        if (inputs.size() > 1) {
+            break;
+        }
+        // Not even one whole container yet, so this batch isn't needed any more
+        inner->nextBatch();
+    }
+
+    pending.put(cram->input.data() + parsed, cram->input.size() - parsed);
+    cram->input.truncate(parsed);
+    while (cram->outputs.size() < inputs.size() - 1) {
+        cram->outputs.push_back(new CramBuffer());
+    }
+
+    if (!entry->allocated) {
+        _int64 extraSize;
+        inner->getExtra(&entry->decompressed, &extraSize);
+        entry->decompressedSize = extraBytes;
+        cram->extraSize = totalExtra - extraBytes;
+        _ASSERT(extraSize >= totalExtra);
+    }
+    entry->batch = inner->getBatch();
+    holdBatch(entry->batch); // hold batch while decoding, since the output may go in its extra data
+    inner->nextBatch();
+    return true;
+}
+
+    void
+CramDataReader::decompressBlock(
+    Entry* entry,
+    int block,
+    z_stream* zstream,
+    ThreadHeap* heap)
+{
+    CramEntry* cram = &cramEntries[entry - entries];
+    CramBuffer* output = cram->outputs[block];
+    output->clear();
+    if (block == cram->headerContainer) {
+        output->put(header.bamHeader(), header.bamHeaderBytes());
+    } else {
+        CramContainerDecoder decoder(&header);
+        decoder.decode(cram->input.data() + entry->inputs[block], entry->inputs[block + 1] - entry->inputs[block], output);
+    }
+}
+
+    void
+CramDataReader::finishEntry(
+    Entry* entry)
+{
+    CramEntry* cram = &cramEntries[entry - entries];
+    int nContainers = (int)entry->inputs.size() - 1;
+    _int64 total = 0;
+    for (int i = 0; i < nContainers; i++) {
+        total += cram->outputs[i]->size();
+    }
+    if (overflowBytes + total > entry->decompressedSize) {
+        //
+        // CRAM compresses better than BGZF, so this can happen.  Keep the extra data in proportion, since BAMReader uses
+        // it for the decoded bases and qualities.
+        //
+        _int64 extra = (_int64)((double)(overflowBytes + total) * (totalExtra - extraBytes) / extraBytes);
+        entry->ensureSize(overflowBytes + total, extra, 0);
+        cram->extraSize = extra;
+    }
+    char* p = entry->decompressed + overflowBytes;
+    for (int i = 0; i < nContainers; i++) {
+        memcpy(p, cram->outputs[i]->data(), cram->outputs[i]->size());
+        p += cram->outputs[i]->size();
+    }
+    entry->decompressedValid = overflowBytes + total;
+    entry->decompressedStart = total;
+}
+
 class DecompressDataReaderSupplier : public DataSupplier
 {
 public:
@@ -2490,6 +3205,47 @@ DataSupplier::Gzip(
 {
     return new DecompressDataReaderSupplier(inner, 0);
 }
+
+class CramDataReaderSupplier : public DataSupplier
+{
+public:
+    CramDataReaderSupplier(DataSupplier* i_inner, const Genome* i_genome)
+        : DataSupplier(), inner(i_inner), genome(i_genome)
+    {}
+
+    virtual DataReader* getDataReader(int bufferCount, _int64 overflowBytes, double extraFactor, size_t bufferSpace);
+
+private:
+    DataSupplier* inner;
+    const Genome* genome;
+};
+
+    DataReader*
+CramDataReaderSupplier::getDataReader(
+    int bufferCount,
+    _int64 overflowBytes,
+    double extraFactor,
+    size_t bufferSpace)
+{
+    // the same as for BGZF; the reader makes more space if a batch decodes to more than this
+    double expand = MAX_FACTOR * DataSupplier::ExpansionFactor;
+    double totalFactor = expand * (1.0 + extraFactor);
+    // containers are copied out of the inner reader's batches, so it needs no overflow
+    DataReader* data = inner->getDataReader(bufferCount + 2, 0, totalFactor, bufferSpace);
+    char* p;
+    _int64 totalExtra;
+    data->getExtra(&p, &totalExtra);
+    _int64 mine = (_int64)(totalExtra * expand / totalFactor);
+    return new CramDataReader(data, bufferCount, totalExtra, mine, overflowBytes, genome);
+}
+
+    DataSupplier*
+DataSupplier::Cram(
+    DataSupplier* inner,
+    const Genome* genome)
+{
+    return new CramDataReaderSupplier(inner, genome);
+}
     DataSupplier* 
 DataSupplier::StdioSupplier()
 {
@@ -2985,10 +3741,56 @@ DataSupplier* DataSupplier::GzipStdio = DataSupplier::Gzip(DataSupplier::Stdio);
 
 DataSupplier* DataSupplier::GzipBamStdio = DataSupplier::GzipBam(DataSupplier::Stdio);
 
+    DataSupplier*
+DataSupplier::Input(bool useIoUring, bool directIo)
+{
+    if (!useIoUring) {
+        return Default;
+    }
+    return directIo ? IoUringDirect : IoUring;
+}
+
+    DataSupplier*
+DataSupplier::GzipInput(bool useIoUring, bool directIo)
+{
+    static DataSupplier* gzipIoUring[2] = {NULL, NULL};
+
+    if (!useIoUring) {
+        return GzipDefault;
+    }
+    int which = directIo ? 1 : 0;
+    if (gzipIoUring[which] == NULL) {
+        gzipIoUring[which] = Gzip(Input(true, directIo));
+    }
+    return gzipIoUring[which];
+}
+
+    DataSupplier*
+DataSupplier::GzipBamInput(bool useIoUring, bool directIo)
+{
+    static DataSupplier* gzipBamIoUring[2] = {NULL, NULL};
+
+    if (!useIoUring) {
+        return GzipBamDefault;
+    }
+    int which = directIo ? 1 : 0;
+    if (gzipBamIoUring[which] == NULL) {
+        gzipBamIoUring[which] = GzipBam(Input(true, directIo));
+    }
+    return gzipBamIoUring[which];
+}
+
 
 int DataSupplier::ThreadCount = 1;
 
 double DataSupplier::ExpansionFactor = 1.0;
 
+bool DataSupplier::AdaptiveBuffering = true;
+bool DataSupplier::ParallelStdinParsing = true;
+
+_int64 DataSupplier::AdaptiveBufferMemoryLimit = (_int64)1024 * 1024 * 1024;
+
+volatile _int64 ReadBasedDataReader::AdaptiveBytesInUse = 0;
+
 volatile _int64 DataReader::ReadWaitTime = 0;
 volatile _int64 DataReader::ReleaseWaitTime = 0;
@@ -24,6 +24,9 @@ Revision History:
 
 #include "Compat.h"
 #include "VariableSizeMap.h"
+
+class Genome;
+
 //
 // This defines a family of composable classes for efficiently reading data with flow control.
 //
@@ -170,6 +173,9 @@ public:
     static DataSupplier* Gzip(DataSupplier* inner);
     static DataSupplier* StdioSupplier();
 
+    // CRAM, decoded into the uncompressed BAM stream against the genome the reads were stored relative to
+    static DataSupplier* Cram(DataSupplier* inner, const Genome* genome);
+
     // memmap works on both platforms (but better on Linux)
     static DataSupplier* MemMap;
 
@@ -180,6 +186,11 @@ public:
 
     static DataSupplier* AsyncFile;
 
+    // AsyncFile over io_uring (falls back to plain AsyncFile where that's not available);
+    // the Direct variant also uses O_DIRECT for suitably aligned reads
+    static DataSupplier* IoUring;
+    static DataSupplier* IoUringDirect;
+
     // default raw data supplier for platform
     static DataSupplier* Default;
     static DataSupplier* GzipDefault;
@@ -194,6 +205,19 @@ public:
 
     // hack: global for additional expansion factor
     static double ExpansionFactor;
+
+    // hack: globals to let file readers tune their own read size and read-ahead, and how much memory all of them together may use
+    static bool AdaptiveBuffering;
+    static _int64 AdaptiveBufferMemoryLimit;
+
+    // hack: global to let uncompressed text on stdin be cut into chunks that all of the aligner threads parse
+    static bool ParallelStdinParsing;
+
+    // suppliers for the aligner's input files: Default, GzipDefault and GzipBamDefault, or their io_uring equivalents
+    // for -iou and -iod.  Everything else (the sort spill file, the index) stays on Default.
+    static DataSupplier* Input(bool useIoUring, bool directIo);
+    static DataSupplier* GzipInput(bool useIoUring, bool directIo);
+    static DataSupplier* GzipBamInput(bool useIoUring, bool directIo);
 };
 
 // manages lifetime tracking for batches of reads
@@ -30,6 +30,12 @@ using std::max;
 
 //#define VALIDATE_WRITE 1
 
+bool DataWriterSupplier::CompressSortIntermediate = true;
+bool DataWriterSupplier::SortBackgroundMerge = false;
+bool DataWriterSupplier::SortInMemory = false;
+bool DataWriterSupplier::UseFastDeflate = false;
+int DataWriterSupplier::BgzfCompressionLevel = -1;
+
 char *
 DataWriterSupplier::generateSortIntermediateFilePathName(AlignerOptions *options)
 {
@@ -65,7 +71,7 @@ class AsyncDataWriterSupplier : public DataWriterSupplier
 {
 public:
     AsyncDataWriterSupplier(const char* i_filename, DataWriter::FilterSupplier* i_filterSupplier,
-        FileEncoder* i_encoder, int i_bufferCount, size_t i_bufferSize);
+        FileEncoder* i_encoder, int i_bufferCount, size_t i_bufferSize, bool i_useIoUring, bool i_directIo);
 
     ~AsyncDataWriterSupplier()
     {
@@ -133,6 +139,11 @@ private:
     void releaseLock()
     { if (encoder != NULL) { ReleaseExclusiveLock(&lock); } }
 
+    struct Batch;
+
+    // waits for any write of the batch to finish and tells the filter about it; returns false if the write failed
+    bool waitForWrite(Batch* batch);
+
     struct Batch
     {
         char* buffer;
@@ -143,6 +154,7 @@ private:
         size_t fileOffset;
         size_t logicalUsed;
         size_t logicalOffset;
+        bool writePending;  // written since the last waitForWrite
         EventObject encoded;
     };
     Batch* batches;
@@ -357,6 +369,7 @@ AsyncDataWriter::AsyncDataWriter(
         batches[i].fileOffset = 0;
         batches[i].logicalUsed = 0;
         batches[i].logicalOffset = 0;
+        batches[i].writePending = false;
         if (encoder != NULL) {
             CreateEventObject(&batches[i].encoded);
             AllowEventWaitersToProceed(&batches[i].encoded); // initialize so empty bufs are available
@@ -450,7 +463,7 @@ AsyncDataWriter::nextBatch(bool lastBatch)
     Batch* write = &batches[written];
     write->logicalUsed = write->used;
     current = (current + 1) % count;
-    if (!batches[current].file->waitForCompletion()) {
+    if (!waitForWrite(&batches[current])) {
         WriteErrorMessage("error: file write failed\n");
         soft_exit(1);
     }
@@ -476,9 +489,9 @@ AsyncDataWriter::nextBatch(bool lastBatch)
         size_t n = filter->onNextBatch(this, write->fileOffset, write->used, lastBatch, &needMoreBuffer, &bytesRead);
         if (n == UINT64_MAX) // The filter's hacky way of telling us it's squirreled away the data and we shouldn't write it to the file.
         {
-            _ASSERT(!newSize);
-            _ASSERT(lastBatch); // Is this really necessary?  You could imagine filters that save more than the last batch.
+            _ASSERT(filter->filterType == CopyFilter || filter->filterType == TransformFilter);   // The sort filter keeps the last batch, or all of them when sorting in memory
             suppressWrite = true;
+            n = 0;  // So that a TransformFilter doesn't take up any space in the file
         }
         if (newSize) {
             if (filter->filterType == DupMarkFilter) {
@@ -529,6 +542,7 @@ AsyncDataWriter::nextBatch(bool lastBatch)
             fprintf(stderr, "batch:%d, used:%lld, logicalUsed:%lld, batchSize:%lld, filterType:%d\n", written, write->used, write->logicalUsed, write->bufferSize, filter->filterType);
 #endif
             supplier->advance(encoder == NULL ? write->used : 0, write->logicalUsed, &write->fileOffset, &write->logicalOffset);
+            filter->onBatchPlaced(write->fileOffset, write->used);
         }
         if (newBuffer) {
             // current has used>0, written has logicalUsed>0, for compressed & uncompressed data respectively
@@ -541,7 +555,7 @@ AsyncDataWriter::nextBatch(bool lastBatch)
             write = &batches[written];
             current = (current + 1) % count;
 
-            if (!batches[current].file->waitForCompletion()) {
+            if (!waitForWrite(&batches[current])) {
                 WriteErrorMessage("error: file write failed\n");
                 soft_exit(1);
             }
@@ -560,6 +574,7 @@ AsyncDataWriter::nextBatch(bool lastBatch)
                 WriteErrorMessage("error: file write %lld bytes at offset %lld failed\n", write->used, write->fileOffset);
                 soft_exit(1);
             }
+            write->writePending = true;
         }
     } else {
         PreventEventWaitersFromProceeding(&write->encoded);
@@ -571,6 +586,22 @@ AsyncDataWriter::nextBatch(bool lastBatch)
     return true;
 }
 
+    bool
+AsyncDataWriter::waitForWrite(
+    Batch* batch)
+{
+    if (!batch->file->waitForCompletion()) {
+        return false;
+    }
+    if (batch->writePending) {
+        batch->writePending = false;
+        if (filter != NULL) {
+            filter->onBatchWritten(batch->fileOffset, batch->used);
+        }
+    }
+    return true;
+}
+
     void
 AsyncDataWriter::close()
 {
@@ -591,7 +622,9 @@ AsyncDataWriterSupplier::AsyncDataWriterSupplier(
     DataWriter::FilterSupplier* i_filterSupplier,
     FileEncoder* i_encoder,
     int i_bufferCount,
-    size_t i_bufferSize)
+    size_t i_bufferSize,
+    bool i_useIoUring,
+    bool i_directIo)
     :
     filename(i_filename),
     filterSupplier(i_filterSupplier),
@@ -602,7 +635,11 @@ AsyncDataWriterSupplier::AsyncDataWriterSupplier(
     sharedLogical(0),
     closing(false)
 {
-    file = AsyncFile::open(filename, true);
+    if (i_useIoUring) {
+        file = AsyncFile::openIoUring(filename, true, i_directIo);
+    } else {
+        file = AsyncFile::open(filename, true);
+    }
     if (file == NULL) {
         WriteErrorMessage("failed to open %s for write\n", filename);
         soft_exit(1);
@@ -657,9 +694,11 @@ DataWriterSupplier::create(
     char *internalScoreTag,
     DataWriter::FilterSupplier* filterSupplier,
     FileEncoder* encoder,
-    int count)
+    int count,
+    bool useIoUring,
+    bool directIo)
 {
-    return new AsyncDataWriterSupplier(filename, filterSupplier, encoder, count, bufferSize);
+    return new AsyncDataWriterSupplier(filename, filterSupplier, encoder, count, bufferSize, useIoUring, directIo);
 }
 
 class ComposeFilter : public DataWriter::Filter
@@ -690,6 +729,18 @@ public:
         return sb;
     }
 
+    virtual void onBatchPlaced(size_t fileOffset, size_t bytes)
+    {
+        a->onBatchPlaced(fileOffset, bytes);
+        b->onBatchPlaced(fileOffset, bytes);
+    }
+
+    virtual void onBatchWritten(size_t fileOffset, size_t bytes)
+    {
+        a->onBatchWritten(fileOffset, bytes);
+        b->onBatchWritten(fileOffset, bytes);
+    }
+
 private:
     DataWriter::Filter* a;
     DataWriter::Filter* b;
@@ -732,6 +783,7 @@ DataWriter::FilterSupplier::compose(
 }
 
 volatile _int64 DataWriter::WaitTime = 0;
+volatile _int64 DataWriter::SortSpillBytes = 0;
 volatile _int64 DataWriter::FilterTime = 0;
 
 
@@ -68,6 +68,13 @@ public:
         // TransformFilters return #byte of transformed data in current buffer, so we need to advance again
         // TransformFilters should call getBatch(0) to ensure current buffer has been written before they write into it
         virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes, bool lastBatch = false, bool* needMoreBuffer = NULL, size_t* fromBufferUsed = NULL) = 0;
+
+        // called for TransformFilters once the data from onNextBatch has been given its place in the file,
+        // since the offset passed to onNextBatch is only advisory for them
+        virtual void onBatchPlaced(size_t fileOffset, size_t bytes) {}
+
+        // called once a batch's write to the file has finished, so its data can be read back
+        virtual void onBatchWritten(size_t fileOffset, size_t bytes) {}
     };
     
     // factory for per-thread filters
@@ -118,6 +125,9 @@ public:
     static volatile _int64 FilterTime;
     static volatile _int64 WaitTime;
 
+    // bytes of sorted runs written to the sort intermediate file (as stored, so after compression)
+    static volatile _int64 SortSpillBytes;
+
 protected:
     Filter* filter;
 };
@@ -125,7 +135,9 @@ protected:
 class FileFormat;
 class Genome;
 class GzipWriterFilterSupplier;
+class CramWriterFilterSupplier;
 class FileEncoder;
+class SegmentedOutputSupplier;
 
 // creates writers for multiple threads
 class DataWriterSupplier
@@ -138,6 +150,8 @@ public:
     // call when all threads are done, all filters destroyed
     virtual void close() = 0;
     
+    // useIoUring writes the file through io_uring, and directIo also bypasses the page cache for aligned writes; they're
+    // for the output file (-iou and -iod), not for intermediate files
     static DataWriterSupplier* create(
         const char* filename,
         size_t bufferSize,
@@ -145,7 +159,9 @@ public:
         char *internalScoreTag,
         DataWriter::FilterSupplier* filterSupplier = NULL,
         FileEncoder* encoder = NULL,
-        int count = 4);
+        int count = 4,
+        bool useIoUring = false,
+        bool directIo = false);
     
     static DataWriterSupplier* sorted(
         const FileFormat* format,
@@ -158,7 +174,10 @@ public:
         size_t maxBufferSize,
         bool emitInternalScore,
         char *internalScoreTag,
-        FileEncoder* encoder = NULL);
+        bool useIoUring,                // for sortedFileName, as for create()
+        bool directIo,
+        FileEncoder* encoder = NULL,
+        SegmentedOutputSupplier* segmentedOutput = NULL);
 
     static char *generateSortIntermediateFilePathName(AlignerOptions *options);
 
@@ -169,7 +188,51 @@ public:
 
     static DataWriter::FilterSupplier* bamMarkDuplicates(const Genome* genome);
 
-    static DataWriter::FilterSupplier* bamIndex(const char* indexFileName, const Genome* genome, GzipWriterFilterSupplier* gzipSupplier);
+    // marks duplicates in unsorted BAM output from the reads' signatures, patching fileName once it's written
+    static DataWriter::FilterSupplier* bamMarkUnsortedDuplicates(const Genome* genome, const char* fileName);
+
+    // turns BAM records into CRAM containers encoded against the genome; multiThreaded as for gzip
+    static CramWriterFilterSupplier* cram(const Genome* genome, const char* fileName, bool multiThreaded);
+
+    // writes a BAI index, or a CSI index with the given minimum shift and depth if csiMinShift isn't 0
+    static DataWriter::FilterSupplier* bamIndex(const char* indexFileName, const Genome* genome, GzipWriterFilterSupplier* gzipSupplier,
+        int csiMinShift = 0, int csiDepth = 0);
+
+    // lets a sorted BAM merge write ranges of the genome in parallel; indexFileName may be NULL for no index, and the index is as
+    // for bamIndex.  With markDuplicates each range marks its own duplicates, and pairs with mates in different ranges are made
+    // consistent when they're put together.
+    static SegmentedOutputSupplier* bamSegments(const char* indexFileName, int csiMinShift, int csiDepth, const Genome* genome, int numThreads,
+        bool bindToProcessors, bool emitInternalScore, char* internalScoreTag, bool markDuplicates);
+
+    // hack: global to have sorted output compress its intermediate file
+    static bool CompressSortIntermediate;
+
+    // hack: global to have sorted output merge its runs in the background during alignment
+    static bool SortBackgroundMerge;
+
+    // hack: global to have sorted output keep its sorted batches in memory instead of the intermediate file while they fit
+    static bool SortInMemory;
+
+    // hack: globals for how BAM output is compressed: with SNAP's own deflate encoder rather than zlib, and at what level (-1 for zlib's default)
+    static bool UseFastDeflate;
+    static int BgzfCompressionLevel;
+};
+
+//
+// Lets the merge phase of a sort split the genome into ranges and write each one into its own segment at the same time,
+// which a format can offer when its output can be put back together from pieces (BAM, whose BGZF blocks and index chunks
+// can be concatenated).  Segment 0 is the output file itself and gets the header.
+//
+class SegmentedOutputSupplier
+{
+public:
+    virtual ~SegmentedOutputSupplier() {}
+
+    // Returns a writer supplier, with its own filters and encoder, for one segment of nSegments.
+    virtual DataWriterSupplier* createSegment(int segment, int nSegments, const char* fileName, size_t bufferSize) = 0;
+
+    // Called once all of the segments' suppliers are closed; appends segments 1..nSegments-1 to the output file and finishes it.
+    virtual void finish(const char* outputFileName, int nSegments, char** segmentFileNames) = 0;
 };
 
 class AsyncDataWriter;
@@ -193,6 +256,8 @@ public:
 
     static FileEncoder* gzip(GzipWriterFilterSupplier* filterSupplier, int numThreads, bool bindToProcessor, size_t chunkSize = 65536, bool bam = true);
 
+    static FileEncoder* cram(CramWriterFilterSupplier* filterSupplier, int numThreads, bool bindToProcessor);
+
     // post-construction initialization
     void initialize(AsyncDataWriter* i_writer);
 
@@ -33,6 +33,7 @@ Revision History:
 #include "Util.h"
 #include "exit.h"
 #include "Error.h"
+#include "PipeReadSupplier.h"
 
 using std::min;
 using util::strnchr;
@@ -581,9 +582,9 @@ PairedFASTQReader::createPairedReadSupplierGenerator(
             } else {
                 fileSize[i] = QueryFileSize(fileNames[i]);
                 if (gzip) {
-                    dataSupplier[i] = DataSupplier::GzipDefault;
+                    dataSupplier[i] = DataSupplier::GzipInput(context.useIoUring, context.directIo);
                 } else {
-                    dataSupplier[i] = DataSupplier::Default;
+                    dataSupplier[i] = DataSupplier::Input(context.useIoUring, context.directIo);
                 }
             }
         }
@@ -619,6 +620,11 @@ FASTQReader::createReadSupplierGenerator(
         // Single ended uncompressed FASTQ files can be handled by a range splitter.
         //
         return new RangeSplittingReadSupplierGenerator(fileName, false, numThreads, context);
+    } else if (isStdin && !gzip && DataSupplier::ParallelStdinParsing) {
+        //
+        // Uncompressed stdin gets cut into chunks of whole records that all of the threads parse.
+        //
+        return new PipeReadSupplierGenerator(false, numThreads, context);
     } else {
         ReadReader* fastq;
         //
@@ -631,7 +637,7 @@ FASTQReader::createReadSupplierGenerator(
                 fastq = FASTQReader::create(DataSupplier::Stdio, fileName, ReadSupplierQueue::BufferCount(numThreads), 0, 0, context);
             }
         } else {
-            fastq = FASTQReader::create(DataSupplier::GzipDefault, fileName, ReadSupplierQueue::BufferCount(numThreads), 0, QueryFileSize(fileName), context);
+            fastq = FASTQReader::create(DataSupplier::GzipInput(context.useIoUring, context.directIo), fileName, ReadSupplierQueue::BufferCount(numThreads), 0, QueryFileSize(fileName), context);
         }
         if (fastq == NULL) {
             delete fastq;
@@ -651,6 +657,13 @@ PairedInterleavedFASTQReader::createPairedReadSupplierGenerator(
     bool gzip)
 {
      bool isStdin = !strcmp(fileName,"-");
+
+     if (isStdin && !gzip && DataSupplier::ParallelStdinParsing) {
+        //
+        // The pipe reader cuts its chunks on pair boundaries, so each thread can parse its own.
+        //
+        return new PipePairedReadSupplierGenerator(numThreads, context);
+     }
  
      if (gzip || isStdin || true /* always use queue for PairedInterleavedFASTQ because otherwise we need to know the read ID format to seek into the middle of the file, but that's nonstandard. */) {
         DataSupplier *dataSupplier;
@@ -663,9 +676,9 @@ PairedInterleavedFASTQReader::createPairedReadSupplierGenerator(
             }
         } else {
             if (gzip) {
-                dataSupplier = DataSupplier::GzipDefault;
+                dataSupplier = DataSupplier::GzipInput(context.useIoUring, context.directIo);
             } else {
-                dataSupplier = DataSupplier::Default;
+                dataSupplier = DataSupplier::Input(context.useIoUring, context.directIo);
             }
         }
         
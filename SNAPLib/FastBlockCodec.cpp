@@ -0,0 +1,209 @@
+/*++
+
+Module Name:
+
+    FastBlockCodec.cpp
+
+Abstract:
+
+    A fast, light-weight block compressor used for SNAP's own temporary files.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+
+--*/
+
+#include "stdafx.h"
+#include "FastBlockCodec.h"
+
+    static inline _uint32
+Read32(const char *p)
+{
+    _uint32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+    static inline void
+WriteExtendedLength(size_t length, char *&output)
+{
+    while (length >= 255) {
+        *output++ = (char)255;
+        length -= 255;
+    }
+    *output++ = (char)length;
+}
+
+    static inline bool
+ReadExtendedLength(const _uint8 *&input, const _uint8 *inputEnd, size_t *io_length)
+{
+    _uint8 byte;
+    do {
+        if (input >= inputEnd) {
+            return false;
+        }
+        byte = *input++;
+        *io_length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+//
+// Writes one sequence: the literals from the last match (or the start) to this one, followed by the match.  A
+// matchLength of 0 means that this is the last sequence, which is only literals.  Returns false if it doesn't fit.
+//
+    static inline bool
+WriteSequence(const char *literals, size_t literalLength, size_t offset, size_t matchLength, char *&output, char *outputEnd)
+{
+    const size_t minMatch = 4;
+    size_t extraMatchLength = matchLength > 0 ? matchLength - minMatch : 0;
+
+    size_t worstCaseSize = 1 + literalLength / 255 + 1 + literalLength + (matchLength > 0 ? 2 + extraMatchLength / 255 + 1 : 0);
+    if ((size_t)(outputEnd - output) < worstCaseSize) {
+        return false;
+    }
+
+    *output++ = (char)((__min(literalLength, (size_t)15) << 4) | __min(extraMatchLength, (size_t)15));
+    if (literalLength >= 15) {
+        WriteExtendedLength(literalLength - 15, output);
+    }
+    memcpy(output, literals, literalLength);
+    output += literalLength;
+
+    if (matchLength > 0) {
+        *output++ = (char)(offset & 0xff);
+        *output++ = (char)(offset >> 8);
+        if (extraMatchLength >= 15) {
+            WriteExtendedLength(extraMatchLength - 15, output);
+        }
+    }
+
+    return true;
+}
+
+    size_t
+FastBlockCodec::compress(const char *input, size_t inputSize, char *output, size_t outputSize)
+{
+    _ASSERT(inputSize <= MaxBlockSize);
+
+    //
+    // Positions fit in 16 bits because blocks are at most 64KB.  Stale entries are harmless, because every candidate is checked
+    // against the actual data before it's used.
+    //
+    _uint16 hashTable[1 << HashBits];
+    memset(hashTable, 0, sizeof(hashTable));
+
+    char *out = output;
+    char *outEnd = output + outputSize;
+    size_t anchor = 0;      // Start of the literals that haven't been written yet
+
+    if (inputSize > MatchFindLimit) {
+        const size_t matchFindLimit = inputSize - MatchFindLimit;
+        const size_t matchLimit = inputSize - LastLiterals;
+        size_t pos = 0;
+
+        while (pos < matchFindLimit) {
+            _uint32 sequence = Read32(input + pos);
+            unsigned hash = (sequence * 2654435761U) >> (32 - HashBits);
+            size_t candidate = hashTable[hash];
+            hashTable[hash] = (_uint16)pos;
+
+            if (candidate >= pos || Read32(input + candidate) != sequence) {
+                //
+                // Move faster the longer it's been since the last match, so that incompressible data doesn't cost much.
+                //
+                pos += 1 + ((pos - anchor) >> 6);
+                continue;
+            }
+
+            while (pos > anchor && candidate > 0 && input[pos - 1] == input[candidate - 1]) {
+                pos--;
+                candidate--;
+            }
+
+            size_t matchLength = MinMatch;
+            while (pos + matchLength < matchLimit && input[pos + matchLength] == input[candidate + matchLength]) {
+                matchLength++;
+            }
+
+            if (!WriteSequence(input + anchor, pos - anchor, pos - candidate, matchLength, out, outEnd)) {
+                return 0;
+            }
+
+            pos += matchLength;
+            anchor = pos;
+        }
+    }
+
+    if (!WriteSequence(input + anchor, inputSize - anchor, 0, 0, out, outEnd)) {
+        return 0;
+    }
+
+    return out - output;
+}
+
+    bool
+FastBlockCodec::decompress(const char *input, size_t inputSize, char *output, size_t outputSize)
+{
+    const _uint8 *in = (const _uint8 *)input;
+    const _uint8 *inEnd = in + inputSize;
+    char *out = output;
+    char *outEnd = output + outputSize;
+
+    while (in < inEnd) {
+        unsigned token = *in++;
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !ReadExtendedLength(in, inEnd, &literalLength)) {
+            return false;
+        }
+        if ((size_t)(inEnd - in) < literalLength || (size_t)(outEnd - out) < literalLength) {
+            return false;
+        }
+        memcpy(out, in, literalLength);
+        in += literalLength;
+        out += literalLength;
+
+        if (in == inEnd) {
+            break;  // The last sequence is just literals
+        }
+
+        if (inEnd - in < 2) {
+            return false;
+        }
+        size_t offset = in[0] | ((size_t)in[1] << 8);
+        in += 2;
+        if (offset == 0 || offset > (size_t)(out - output)) {
+            return false;
+        }
+
+        size_t matchLength = token & 0xf;
+        if (matchLength == 15 && !ReadExtendedLength(in, inEnd, &matchLength)) {
+            return false;
+        }
+        matchLength += MinMatch;
+        if ((size_t)(outEnd - out) < matchLength) {
+            return false;
+        }
+
+        const char *match = out - offset;
+        if (offset >= matchLength) {
+            memcpy(out, match, matchLength);
+        } else {
+            //
+            // The match overlaps the data it's producing (i.e., it's a run), so it has to go a byte at a time.
+            //
+            for (size_t i = 0; i < matchLength; i++) {
+                out[i] = match[i];
+            }
+        }
+        out += matchLength;
+    }
+
+    return out == outEnd;
+}
@@ -0,0 +1,51 @@
+/*++
+
+Module Name:
+
+    FastBlockCodec.h
+
+Abstract:
+
+    Headers for a fast, light-weight block compressor used for SNAP's own temporary files.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+//
+// A greedy LZ77 compressor that writes the LZ4 block format (sequences of a literal/match length token, literals and
+// a two byte match offset).  It trades compression ratio for speed: it's several times faster than zlib at its fastest
+// setting on both ends, which matters for data that SNAP writes and reads back once, such as the sort intermediate file.
+// Blocks are independent and at most MaxBlockSize bytes, so that match offsets always fit in 16 bits.
+//
+class FastBlockCodec
+{
+public:
+    static const size_t MaxBlockSize = 64 * 1024;
+
+    //
+    // Compresses a block into output, returning the compressed size, or 0 if it wouldn't fit in outputSize bytes.  Callers
+    // generally pass inputSize - 1 as the output size so that they store incompressible blocks as is.
+    //
+    static size_t compress(const char *input, size_t inputSize, char *output, size_t outputSize);
+
+    //
+    // Decompresses a block that is known to expand to exactly outputSize bytes.  Returns false if the data is corrupt.
+    //
+    static bool decompress(const char *input, size_t inputSize, char *output, size_t outputSize);
+
+private:
+    static const int HashBits = 13;
+    static const size_t MinMatch = 4;
+    static const size_t LastLiterals = 5;   // The format requires that blocks end in at least this many literals
+    static const size_t MatchFindLimit = 12;// and that the last match start at least this far from the end
+};
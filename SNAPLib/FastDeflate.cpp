@@ -0,0 +1,570 @@
+/*++
+
+Module Name:
+
+    FastDeflate.cpp
+
+Abstract:
+
+    A single-shot deflate encoder for BGZF blocks.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+
+--*/
+
+#include "stdafx.h"
+#include "FastDeflate.h"
+#include "BigAlloc.h"
+#include "exit.h"
+#include "Error.h"
+
+using std::min;
+
+    static inline _uint32
+Read32(const _uint8 *p)
+{
+    _uint32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+    static inline _uint64
+Read64(const _uint8 *p)
+{
+    _uint64 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+//
+// The tables from RFC 1951 that map match lengths and distances to their codes and extra bits.
+//
+static const int LengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const int LengthExtraBits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const int DistanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+    6145, 8193, 12289, 16385, 24577};
+static const int DistanceExtraBits[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const int CodeLengthOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+//
+// Reverse lookups from a length or distance to its code, filled in at startup.
+//
+struct DeflateCodeTables {
+    _uint8 lengthCode[259];
+    _uint8 distanceCode[32769];
+
+    DeflateCodeTables() {
+        for (int code = 0; code < 29; code++) {
+            for (int length = LengthBase[code]; length < LengthBase[code] + (1 << LengthExtraBits[code]) && length <= 258; length++) {
+                lengthCode[length] = (_uint8)code;  // 258 gets its own code, which comes last
+            }
+        }
+        for (int code = 0; code < 30; code++) {
+            for (int distance = DistanceBase[code]; distance < DistanceBase[code] + (1 << DistanceExtraBits[code]); distance++) {
+                distanceCode[distance] = (_uint8)code;
+            }
+        }
+    }
+};
+
+static DeflateCodeTables CodeTables;
+
+//
+// Deflate packs bits starting from the least significant bit of each byte.
+//
+struct DeflateBitWriter {
+    _uint8     *out;
+    _uint8     *outEnd;
+    _uint64     bits;
+    int         count;
+    bool        overflow;
+
+    DeflateBitWriter(char *output, size_t outputSize)
+        : out((_uint8 *)output), outEnd((_uint8 *)output + outputSize), bits(0), count(0), overflow(false) {}
+
+    // At most 16 bits at a time
+    inline void put(_uint32 value, int nBits) {
+        bits |= (_uint64)value << count;
+        count += nBits;
+        if (count >= 32) {
+            if (outEnd - out >= 4) {
+                out[0] = (_uint8)bits;
+                out[1] = (_uint8)(bits >> 8);
+                out[2] = (_uint8)(bits >> 16);
+                out[3] = (_uint8)(bits >> 24);
+                out += 4;
+            } else {
+                overflow = true;
+            }
+            bits >>= 32;
+            count -= 32;
+        }
+    }
+
+    // Pads to a byte boundary
+    void flush() {
+        while (count > 0) {
+            if (out < outEnd) {
+                *out++ = (_uint8)bits;
+            } else {
+                overflow = true;
+            }
+            bits >>= 8;
+            count -= 8;
+        }
+        count = 0;
+        bits = 0;
+    }
+};
+
+//
+// Turns symbol frequencies sorted in increasing order into code lengths in place, using the algorithm from Moffat and
+// Katajainen, "In-Place Calculation of Minimum-Redundancy Codes" (1995).  A[0] ends up with the longest code.
+//
+    static void
+CalculateMinimumRedundancy(int *A, int n)
+{
+    A[0] += A[1];
+    int root = 0, leaf = 2;
+    for (int next = 1; next < n - 1; next++) {
+        if (leaf >= n || A[root] < A[leaf]) {
+            A[next] = A[root];
+            A[root++] = next;
+        } else {
+            A[next] = A[leaf++];
+        }
+        if (leaf >= n || (root < next && A[root] < A[leaf])) {
+            A[next] += A[root];
+            A[root++] = next;
+        } else {
+            A[next] += A[leaf++];
+        }
+    }
+
+    A[n - 2] = 0;
+    for (int next = n - 3; next >= 0; next--) {
+        A[next] = A[A[next]] + 1;
+    }
+
+    int available = 1, used = 0, depth = 0;
+    root = n - 2;
+    int next = n - 1;
+    while (available > 0) {
+        while (root >= 0 && A[root] == depth) {
+            used++;
+            root--;
+        }
+        while (available > used) {
+            A[next--] = depth;
+            available--;
+        }
+        available = 2 * used;
+        depth++;
+        used = 0;
+    }
+}
+
+//
+// Fills in Huffman code lengths of at most maxBits for the symbols with non-zero counts.  Deflate wants at least
+// two codes even when only one symbol (or none) is used, so it makes them up in that case.
+//
+    static void
+BuildCodeLengths(const _uint32 *counts, int nSymbols, int maxBits, _uint8 *lengths)
+{
+    _uint64 sorted[286];    // count in the high bits, symbol in the low 16
+    int A[286];
+    int nUsed = 0;
+
+    memset(lengths, 0, nSymbols);
+    for (int symbol = 0; symbol < nSymbols; symbol++) {
+        if (counts[symbol] != 0) {
+            sorted[nUsed++] = ((_uint64)counts[symbol] << 16) | symbol;
+        }
+    }
+
+    if (nUsed < 2) {
+        int symbol = nUsed == 0 ? 0 : (int)(sorted[0] & 0xffff);
+        lengths[symbol] = 1;
+        lengths[symbol == 0 ? 1 : 0] = 1;
+        return;
+    }
+
+    std::sort(sorted, sorted + nUsed);
+    for (int i = 0; i < nUsed; i++) {
+        A[i] = (int)(sorted[i] >> 16);
+    }
+    CalculateMinimumRedundancy(A, nUsed);
+
+    //
+    // Squeeze anything longer than maxBits down to maxBits, and then lengthen shorter codes until the lengths describe
+    // a complete prefix code again.
+    //
+    int nCodes[16];
+    memset(nCodes, 0, sizeof(nCodes));
+    for (int i = 0; i < nUsed; i++) {
+        nCodes[min(A[i], maxBits)]++;
+    }
+
+    _uint32 total = 0;
+    for (int bits = maxBits; bits > 0; bits--) {
+        total += (_uint32)nCodes[bits] << (maxBits - bits);
+    }
+    while (total != (1u << maxBits)) {
+        nCodes[maxBits]--;
+        for (int bits = maxBits - 1; bits > 0; bits--) {
+            if (nCodes[bits] != 0) {
+                nCodes[bits]--;
+                nCodes[bits + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    //
+    // The most frequent symbols get the shortest codes.
+    //
+    int next = nUsed;
+    for (int bits = 1; bits <= maxBits; bits++) {
+        for (int i = 0; i < nCodes[bits]; i++) {
+            lengths[sorted[--next] & 0xffff] = (_uint8)bits;
+        }
+    }
+}
+
+//
+// Assigns canonical codes for the lengths, bit reversed so that they can go straight to DeflateBitWriter::put.
+//
+    static void
+BuildCodes(const _uint8 *lengths, int nSymbols, _uint16 *codes)
+{
+    int lengthCounts[16];
+    int nextCode[16];
+    memset(lengthCounts, 0, sizeof(lengthCounts));
+    for (int symbol = 0; symbol < nSymbols; symbol++) {
+        lengthCounts[lengths[symbol]]++;
+    }
+    lengthCounts[0] = 0;
+
+    int code = 0;
+    for (int bits = 1; bits < 16; bits++) {
+        code = (code + lengthCounts[bits - 1]) << 1;
+        nextCode[bits] = code;
+    }
+
+    for (int symbol = 0; symbol < nSymbols; symbol++) {
+        int bits = lengths[symbol];
+        if (bits == 0) {
+            codes[symbol] = 0;
+            continue;
+        }
+        int forward = nextCode[bits]++;
+        int reversed = 0;
+        for (int i = 0; i < bits; i++) {
+            reversed = (reversed << 1) | ((forward >> i) & 1);
+        }
+        codes[symbol] = (_uint16)reversed;
+    }
+}
+
+FastDeflate::FastDeflate(int i_level) : level(__max(0, __min(9, i_level)))
+{
+    static const int chainForLevel[10] = {0, 1, 2, 4, 8, 16, 32, 64, 128, 256};
+    maxChain = chainForLevel[level];
+
+    head = (_int32 *)BigAlloc(sizeof(_int32) * (1 << HashBits));
+    prev = (_uint16 *)BigAlloc(sizeof(_uint16) * MaxBlockSize);
+    items = (Item *)BigAlloc(sizeof(Item) * MaxBlockSize);
+    if (head == NULL || prev == NULL || items == NULL) {
+        WriteErrorMessage("FastDeflate: unable to allocate match tables\n");
+        soft_exit(1);
+    }
+    nItems = 0;
+}
+
+FastDeflate::~FastDeflate()
+{
+    BigDealloc(head);
+    BigDealloc(prev);
+    BigDealloc(items);
+}
+
+    size_t
+FastDeflate::storedSize(size_t inputSize)
+{
+    return inputSize + 5 * __max((size_t)1, (inputSize + 65534) / 65535);
+}
+
+    size_t
+FastDeflate::compress(const char *input, size_t inputSize, char *output, size_t outputSize)
+{
+    _ASSERT(inputSize <= MaxBlockSize);
+
+    size_t storedBytes = storedSize(inputSize);
+    if (level > 0 && inputSize > 0) {
+        findMatches((const _uint8 *)input, inputSize);
+
+        //
+        // Anything that comes out larger than the stored form is useless, so don't let it write past that.
+        //
+        size_t compressedBytes = writeHuffmanBlock((const _uint8 *)input, inputSize, output, min(outputSize, storedBytes - 1));
+        if (compressedBytes > 0) {
+            return compressedBytes;
+        }
+    }
+
+    if (storedBytes > outputSize) {
+        return 0;
+    }
+    return writeStoredBlocks(input, inputSize, output, outputSize);
+}
+
+    void
+FastDeflate::findMatches(const _uint8 *input, size_t inputSize)
+{
+    nItems = 0;
+    memset(literalLengthCounts, 0, sizeof(literalLengthCounts));
+    memset(distanceCounts, 0, sizeof(distanceCounts));
+    memset(head, 0xff, sizeof(_int32) * (1 << HashBits));
+
+    //
+    // The lower levels only index the first position of each match, which is most of the speed difference between them.
+    //
+    const bool indexWithinMatches = level >= 4;
+    const bool useChains = maxChain > 1;
+
+    size_t pos = 0;
+    while (pos + MinMatch <= inputSize) {
+        _uint32 sequence = Read32(input + pos);
+        unsigned hash = (sequence * 2654435761U) >> (32 - HashBits);
+        _int32 candidate = head[hash];
+        head[hash] = (_int32)pos;
+        if (useChains) {
+            prev[pos] = candidate < 0 ? (_uint16)pos : (_uint16)candidate; // A position pointing to itself ends the chain
+        }
+
+        size_t bestLength = 0, bestDistance = 0;
+        const size_t maxLength = min(MaxMatch, inputSize - pos);
+        for (int chain = maxChain; candidate >= 0 && pos - candidate <= WindowSize; ) {
+            const _uint8 *match = input + candidate;
+            if (Read32(match) == sequence && match[bestLength] == input[pos + bestLength]) {
+                size_t length = MinMatch;
+                while (length + 8 <= maxLength && Read64(match + length) == Read64(input + pos + length)) {
+                    length += 8;
+                }
+                while (length < maxLength && match[length] == input[pos + length]) {
+                    length++;
+                }
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestDistance = pos - candidate;
+                    if (length == maxLength) {
+                        break;
+                    }
+                }
+            }
+
+            if (--chain <= 0 || !useChains || prev[candidate] == candidate) {
+                break;
+            }
+            candidate = prev[candidate];
+        }
+
+        if (bestLength < MinMatch) {
+            items[nItems].literalOrLength = input[pos];
+            items[nItems].distance = 0;
+            nItems++;
+            literalLengthCounts[input[pos]]++;
+            pos++;
+            continue;
+        }
+
+        items[nItems].literalOrLength = (_uint16)bestLength;
+        items[nItems].distance = (_uint16)bestDistance;
+        nItems++;
+        literalLengthCounts[257 + CodeTables.lengthCode[bestLength]]++;
+        distanceCounts[CodeTables.distanceCode[bestDistance]]++;
+
+        size_t matchEnd = pos + bestLength;
+        if (indexWithinMatches) {
+            for (pos++; pos < matchEnd && pos + MinMatch <= inputSize; pos++) {
+                hash = (Read32(input + pos) * 2654435761U) >> (32 - HashBits);
+                prev[pos] = head[hash] < 0 ? (_uint16)pos : (_uint16)head[hash];
+                head[hash] = (_int32)pos;
+            }
+        }
+        pos = matchEnd;
+    }
+
+    for (; pos < inputSize; pos++) {
+        items[nItems].literalOrLength = input[pos];
+        items[nItems].distance = 0;
+        nItems++;
+        literalLengthCounts[input[pos]]++;
+    }
+
+    literalLengthCounts[256] = 1;   // End of block
+}
+
+    size_t
+FastDeflate::writeHuffmanBlock(const _uint8 *input, size_t inputSize, char *output, size_t outputSize)
+{
+    _uint8 literalLengthLengths[NumLiteralLengthCodes];
+    _uint8 distanceLengths[NumDistanceCodes];
+    _uint16 literalLengthCodes[NumLiteralLengthCodes];
+    _uint16 distanceCodes[NumDistanceCodes];
+
+    BuildCodeLengths(literalLengthCounts, NumLiteralLengthCodes, 15, literalLengthLengths);
+    BuildCodeLengths(distanceCounts, NumDistanceCodes, 15, distanceLengths);
+    BuildCodes(literalLengthLengths, NumLiteralLengthCodes, literalLengthCodes);
+    BuildCodes(distanceLengths, NumDistanceCodes, distanceCodes);
+
+    int nLiteralLengths = NumLiteralLengthCodes;
+    while (nLiteralLengths > 257 && literalLengthLengths[nLiteralLengths - 1] == 0) {
+        nLiteralLengths--;
+    }
+    int nDistances = NumDistanceCodes;
+    while (nDistances > 1 && distanceLengths[nDistances - 1] == 0) {
+        nDistances--;
+    }
+
+    //
+    // The two sets of code lengths are sent as one sequence, run length encoded with symbols 16 (repeat the previous
+    // length 3-6 times), 17 (3-10 zeros) and 18 (11-138 zeros), which are themselves Huffman coded.
+    //
+    _uint8 allLengths[NumLiteralLengthCodes + NumDistanceCodes];
+    memcpy(allLengths, literalLengthLengths, nLiteralLengths);
+    memcpy(allLengths + nLiteralLengths, distanceLengths, nDistances);
+    const int nAllLengths = nLiteralLengths + nDistances;
+
+    _uint8 runSymbols[NumLiteralLengthCodes + NumDistanceCodes];
+    _uint8 runExtra[NumLiteralLengthCodes + NumDistanceCodes];
+    int nRunSymbols = 0;
+    _uint32 codeLengthCounts[NumCodeLengthCodes];
+    memset(codeLengthCounts, 0, sizeof(codeLengthCounts));
+
+    for (int i = 0; i < nAllLengths; ) {
+        _uint8 length = allLengths[i];
+        int run = 1;
+        while (i + run < nAllLengths && allLengths[i + run] == length) {
+            run++;
+        }
+        i += run;
+
+        if (length == 0) {
+            while (run >= 11) {
+                int count = min(run, 138);
+                runSymbols[nRunSymbols] = 18;
+                runExtra[nRunSymbols++] = (_uint8)(count - 11);
+                run -= count;
+            }
+            if (run >= 3) {
+                runSymbols[nRunSymbols] = 17;
+                runExtra[nRunSymbols++] = (_uint8)(run - 3);
+                run = 0;
+            }
+        } else {
+            runSymbols[nRunSymbols] = length;
+            runExtra[nRunSymbols++] = 0;
+            run--;
+            while (run >= 3) {
+                int count = min(run, 6);
+                runSymbols[nRunSymbols] = 16;
+                runExtra[nRunSymbols++] = (_uint8)(count - 3);
+                run -= count;
+            }
+        }
+        while (run > 0) {
+            runSymbols[nRunSymbols] = length;
+            runExtra[nRunSymbols++] = 0;
+            run--;
+        }
+    }
+
+    for (int i = 0; i < nRunSymbols; i++) {
+        codeLengthCounts[runSymbols[i]]++;
+    }
+
+    _uint8 codeLengthLengths[NumCodeLengthCodes];
+    _uint16 codeLengthCodes[NumCodeLengthCodes];
+    BuildCodeLengths(codeLengthCounts, NumCodeLengthCodes, 7, codeLengthLengths);
+    BuildCodes(codeLengthLengths, NumCodeLengthCodes, codeLengthCodes);
+
+    int nCodeLengths = NumCodeLengthCodes;
+    while (nCodeLengths > 4 && codeLengthLengths[CodeLengthOrder[nCodeLengths - 1]] == 0) {
+        nCodeLengths--;
+    }
+
+    DeflateBitWriter writer(output, outputSize);
+    writer.put(1, 1);   // Final block
+    writer.put(2, 2);   // Dynamic Huffman codes
+    writer.put(nLiteralLengths - 257, 5);
+    writer.put(nDistances - 1, 5);
+    writer.put(nCodeLengths - 4, 4);
+    for (int i = 0; i < nCodeLengths; i++) {
+        writer.put(codeLengthLengths[CodeLengthOrder[i]], 3);
+    }
+
+    static const int runExtraBits[3] = {2, 3, 7};
+    for (int i = 0; i < nRunSymbols; i++) {
+        writer.put(codeLengthCodes[runSymbols[i]], codeLengthLengths[runSymbols[i]]);
+        if (runSymbols[i] >= 16) {
+            writer.put(runExtra[i], runExtraBits[runSymbols[i] - 16]);
+        }
+    }
+
+    for (size_t i = 0; i < nItems && !writer.overflow; i++) {
+        const Item& item = items[i];
+        if (item.distance == 0) {
+            writer.put(literalLengthCodes[item.literalOrLength], literalLengthLengths[item.literalOrLength]);
+            continue;
+        }
+
+        int lengthCode = CodeTables.lengthCode[item.literalOrLength];
+        writer.put(literalLengthCodes[257 + lengthCode], literalLengthLengths[257 + lengthCode]);
+        if (LengthExtraBits[lengthCode] != 0) {
+            writer.put(item.literalOrLength - LengthBase[lengthCode], LengthExtraBits[lengthCode]);
+        }
+
+        int distanceCode = CodeTables.distanceCode[item.distance];
+        writer.put(distanceCodes[distanceCode], distanceLengths[distanceCode]);
+        if (DistanceExtraBits[distanceCode] != 0) {
+            writer.put(item.distance - DistanceBase[distanceCode], DistanceExtraBits[distanceCode]);
+        }
+    }
+    writer.put(literalLengthCodes[256], literalLengthLengths[256]);
+    writer.flush();
+
+    if (writer.overflow) {
+        return 0;
+    }
+    return (char *)writer.out - output;
+}
+
+    size_t
+FastDeflate::writeStoredBlocks(const char *input, size_t inputSize, char *output, size_t outputSize)
+{
+    _ASSERT(storedSize(inputSize) <= outputSize);
+
+    char *out = output;
+    size_t pos = 0;
+    do {
+        size_t bytes = min(inputSize - pos, (size_t)65535);
+        bool last = pos + bytes == inputSize;
+        out[0] = last ? 1 : 0;  // BFINAL, and BTYPE 0 (stored)
+        out[1] = (char)(bytes & 0xff);
+        out[2] = (char)(bytes >> 8);
+        out[3] = (char)(~bytes & 0xff);
+        out[4] = (char)((~bytes >> 8) & 0xff);
+        memcpy(out + 5, input + pos, bytes);
+        out += 5 + bytes;
+        pos += bytes;
+    } while (pos < inputSize);
+
+    return out - output;
+}
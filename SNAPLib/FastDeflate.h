@@ -0,0 +1,80 @@
+/*++
+
+Module Name:
+
+    FastDeflate.h
+
+Abstract:
+
+    Headers for a single-shot deflate encoder for BGZF blocks.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+//
+// Compresses a whole block (at most MaxBlockSize bytes, which is what BGZF allows) into a raw deflate stream in one
+// call.  zlib is built for streams of any length, so it keeps a sliding window, checks for more input and flushes
+// partial blocks; none of that is needed when the entire input is in memory and small.  This does greedy LZ77 matching
+// over the block with a hash chain whose depth depends on the level, and then writes one block with Huffman codes built
+// for exactly that data (or a stored block if that's smaller).  The output is standard deflate, readable by any inflater.
+//
+// Each instance has its own tables, so use one per thread.
+//
+class FastDeflate
+{
+public:
+    static const size_t MaxBlockSize = 64 * 1024;
+
+    // Level 0 stores the data uncompressed; 1 is the fastest and 9 the most thorough, as with zlib.
+    FastDeflate(int i_level);
+    ~FastDeflate();
+
+    //
+    // Returns the size of the deflate stream written to output, or 0 if it doesn't fit in outputSize bytes.
+    //
+    size_t compress(const char *input, size_t inputSize, char *output, size_t outputSize);
+
+    // The largest a stored (i.e., uncompressed) encoding of inputSize bytes can be.
+    static size_t storedSize(size_t inputSize);
+
+private:
+
+    struct Item {
+        _uint16         literalOrLength;    // The byte if distance is 0, otherwise the match length
+        _uint16         distance;
+    };
+
+    void findMatches(const _uint8 *input, size_t inputSize);
+    size_t writeHuffmanBlock(const _uint8 *input, size_t inputSize, char *output, size_t outputSize);
+    static size_t writeStoredBlocks(const char *input, size_t inputSize, char *output, size_t outputSize);
+
+    static const int HashBits = 15;
+    static const size_t MinMatch = 4;
+    static const size_t MaxMatch = 258;
+    static const size_t WindowSize = 32768;
+
+    static const int NumLiteralLengthCodes = 286;
+    static const int NumDistanceCodes = 30;
+    static const int NumCodeLengthCodes = 19;
+
+    const int       level;
+    int             maxChain;           // How many earlier positions with the same hash to try
+
+    _int32         *head;               // Most recent position for each hash
+    _uint16        *prev;               // Previous position with the same hash, for each position
+
+    Item           *items;
+    size_t          nItems;
+    _uint32         literalLengthCounts[NumLiteralLengthCodes];
+    _uint32         distanceCounts[NumDistanceCodes];
+};
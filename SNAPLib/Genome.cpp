@@ -33,7 +33,7 @@ Revision History:
 #include "Util.h"
 
 Genome::Genome(GenomeDistance i_maxBases, GenomeDistance nBasesStored, unsigned i_chromosomePadding, unsigned i_maxContigs)
-: maxBases(i_maxBases), minLocation(0), maxLocation(i_maxBases), chromosomePadding(i_chromosomePadding), maxContigs(i_maxContigs), mappedFile(NULL)
+: maxBases(i_maxBases), minLocation(0), maxLocation(i_maxBases), chromosomePadding(i_chromosomePadding), maxContigs(i_maxContigs), mappedFile(NULL), replicaOf(NULL)
 {
     bases = ((char *) BigAlloc(nBasesStored + 2 * N_PADDING)) + N_PADDING;
     if (NULL == bases) {
@@ -51,6 +51,8 @@ Genome::Genome(GenomeDistance i_maxBases, GenomeDistance nBasesStored, unsigned
     contigs = (Contig *)BigAlloc(sizeof(Contig) * maxContigs);
     contigNumberByOriginalOrder = (InternalContigNum *)BigAlloc(sizeof(InternalContigNum) * maxContigs);
     contigsByName = NULL;
+    contigByBucket = NULL;
+    nContigBuckets = 0;
 }
 
     void
@@ -166,6 +168,11 @@ Genome::markContigLiftover(
 
 Genome::~Genome()
 {
+    if (NULL != replicaOf) {
+        BigDealloc(bases - N_PADDING);
+        return;
+    }
+
     for (int i = 0; i < nContigs; i++) {
         delete [] contigs[i].name;
         contigs[i].name = NULL;
@@ -177,6 +184,10 @@ Genome::~Genome()
 
     BigDealloc(contigs);
     BigDealloc(contigNumberByOriginalOrder);
+    if (contigByBucket != NULL) {
+        BigDealloc(contigByBucket);
+        contigByBucket = NULL;
+    }
 
     if (contigsByName) {
         delete [] contigsByName;
@@ -192,6 +203,28 @@ Genome::~Genome()
     }
 }
 
+    const Genome *
+Genome::replicate() const
+{
+    Genome *replica = new Genome(*this);
+    replica->replicaOf = this;
+    replica->mappedFile = NULL;
+
+    GenomeDistance nBasesStored = maxLocation - minLocation;
+    replica->bases = ((char *)BigAlloc(nBasesStored + 2 * N_PADDING)) + N_PADDING;
+    memset(replica->bases - N_PADDING, 'n', N_PADDING);
+    memcpy(replica->bases, bases, nBasesStored);
+    memset(replica->bases + nBasesStored, 'n', N_PADDING);
+
+    return replica;
+}
+
+    bool
+Genome::interleaveAcrossNumaNodes() const
+{
+    return InterleaveMemoryAcrossNumaNodes(bases, maxLocation - minLocation);
+}
+
 // Flags for the options field in the header
 #define	GENOME_FLAG_ALT_CONTIGS_MARKED		            0x1 // This should always be true now, we dropped support for indices that don't mark ALTs in 1.0.4.  (That doesn't mean that they have to have alts marked, it's just the format.)
 
@@ -579,6 +612,11 @@ Genome::getContigAtLocation(GenomeLocation location) const
     _ASSERT(location < nBases);
     int low = 0;
     int high = nContigs - 1;
+    _int64 bucket = GenomeLocationAsInt64(location) >> ContigBucketShift;
+    if (bucket < nContigBuckets) {
+        low = contigByBucket[bucket];
+        high = contigByBucket[bucket + 1];
+    }
     while (low <= high) {
         int mid = (low + high) / 2;
         if (contigs[mid].beginningLocation <= location &&
@@ -729,6 +767,20 @@ void Genome::fillInContigLengths()
     }
 
     contigs[nContigs-1].length = nBases - GenomeLocationAsInt64(contigs[nContigs-1].beginningLocation);
+
+    if (contigByBucket != NULL) {
+        BigDealloc(contigByBucket);
+    }
+    nContigBuckets = (GenomeLocationAsInt64(nBases) >> ContigBucketShift) + 1;
+    contigByBucket = (int *)BigAlloc(sizeof(int) * (nContigBuckets + 1));
+    int contig = 0;
+    for (_int64 bucket = 0; bucket <= nContigBuckets; bucket++) {
+        GenomeLocation bucketStart = GenomeLocation(bucket << ContigBucketShift);
+        while (contig < nContigs - 1 && contigs[contig + 1].beginningLocation <= bucketStart) {
+            contig++;
+        }
+        contigByBucket[bucket] = contig;
+    }
 }
 
 const Genome::Contig *Genome::getContigForRead(GenomeLocation location, unsigned readLength, GenomeDistance *extraBasesClippedBefore) const 
@@ -333,6 +333,14 @@ public:
 
         bool saveToFile(const char *fileName) const;
 
+        //
+        // For NUMA machines.  replicate() copies the bases into memory first touched by the calling thread, and so on
+        // its node; the contig tables are shared with the original, which has to outlive the replica.
+        // interleaveAcrossNumaNodes() spreads the bases' pages evenly over the nodes instead.
+        //
+        const Genome *replicate() const;
+        bool interleaveAcrossNumaNodes() const;
+
         //
         // Methods to read the genome.
         //
@@ -463,6 +471,14 @@ private:
 
         Contig      *contigs;    // This is always in order (it's not possible to express it otherwise in FASTA).
 
+        //
+        // For each 64Kbase bucket of the genome, the index of the contig that contains its first base (plus one more for the end),
+        // so that getContigAtLocation only has to search the few contigs that overlap the location's bucket.  It's filled in
+        // with the contig lengths; until then getContigAtLocation searches all of them.
+        //
+        static const int ContigBucketShift = 16;
+        int         *contigByBucket;
+        _int64       nContigBuckets;
 
         Contig              *contigsByName;
         InternalContigNum   *contigNumberByOriginalOrder;
@@ -474,6 +490,8 @@ private:
 		GenericFile_map *mappedFile;
 
         GenomeLocation  genomeLocationOfFirstALTContig;
+
+        const Genome    *replicaOf;     // NULL unless this is a NUMA replica, which owns only its bases
 };
 
 //
@@ -642,6 +660,11 @@ public:
     inline OriginalContigNum getContig() { return originalContigNum; }
     inline int getPos() { return pos; }
 
+    // An unsigned key that sorts the same way, for radix sorting
+    inline _uint64 getSortKey() const {
+        return ((_uint64)(unsigned)OriginalContigNumToInt(originalContigNum) << 32) | ((unsigned)pos ^ 0x80000000);
+    }
+
 private:
     OriginalContigNum originalContigNum;
     int pos;
@@ -1155,6 +1155,112 @@ GenomeIndex::~GenomeIndex()
 	delete genome;
 	genome = NULL;
 
+}
+
+    GenomeIndex *
+GenomeIndex::replicate() const
+{
+    GenomeIndex *replica = new GenomeIndex();
+
+    replica->seedLen = seedLen;
+    replica->hashTableKeySize = hashTableKeySize;
+    replica->nHashTables = nHashTables;
+    replica->majorVersion = majorVersion;
+    replica->minorVersion = minorVersion;
+    replica->largeHashTable = largeHashTable;
+    replica->locationSize = locationSize;
+    replica->overflowTableSize = overflowTableSize;
+
+    //
+    // The tables go into one blob, like an index that's read rather than mapped.
+    //
+    size_t tablesBlobSize = 0;
+    for (unsigned i = 0; i < nHashTables; i++) {
+        tablesBlobSize += (hashTables[i]->GetTableBytes() + 15) & ~(size_t)15;
+    }
+
+    replica->tablesBlob = BigAlloc(tablesBlobSize);
+    replica->hashTables = new SNAPHashTable*[nHashTables];
+    char *nextTable = (char *)replica->tablesBlob;
+    for (unsigned i = 0; i < nHashTables; i++) {
+        replica->hashTables[i] = hashTables[i]->replicateInto(nextTable);
+        nextTable += (hashTables[i]->GetTableBytes() + 15) & ~(size_t)15;
+    }
+
+    if (NULL != overflowTable64) {
+        replica->overflowTable64 = (_int64 *)BigAlloc((size_t)overflowTableSize * sizeof(*overflowTable64));
+        memcpy(replica->overflowTable64, overflowTable64, (size_t)overflowTableSize * sizeof(*overflowTable64));
+    } else {
+        replica->overflowTable32 = (unsigned *)BigAlloc((size_t)overflowTableSize * sizeof(*overflowTable32));
+        memcpy(replica->overflowTable32, overflowTable32, (size_t)overflowTableSize * sizeof(*overflowTable32));
+    }
+
+    replica->genome = genome->replicate();
+
+    return replica;
+}
+
+    bool
+GenomeIndex::interleaveAcrossNumaNodes()
+{
+    bool worked = genome->interleaveAcrossNumaNodes();
+
+    for (unsigned i = 0; i < nHashTables; i++) {
+        worked &= InterleaveMemoryAcrossNumaNodes(hashTables[i]->GetTableMemory(), hashTables[i]->GetTableBytes());
+    }
+
+    if (NULL != overflowTable64) {
+        worked &= InterleaveMemoryAcrossNumaNodes(overflowTable64, (size_t)overflowTableSize * sizeof(*overflowTable64));
+    } else {
+        worked &= InterleaveMemoryAcrossNumaNodes(overflowTable32, (size_t)overflowTableSize * sizeof(*overflowTable32));
+    }
+
+    return worked;
+}
+
+NumaIndexReplicas::NumaIndexReplicas(GenomeIndex *i_primary) : primary(i_primary)
+{
+    nNodes = GetNumberOfNumaNodes();
+    replicas = new GenomeIndex*[nNodes];
+    locks = new ExclusiveLock[nNodes];
+
+    int homeNode = GetCurrentNumaNode();
+    for (int i = 0; i < nNodes; i++) {
+        replicas[i] = (i == homeNode) ? primary : NULL;
+        InitializeExclusiveLock(&locks[i]);
+    }
+}
+
+NumaIndexReplicas::~NumaIndexReplicas()
+{
+    for (int i = 0; i < nNodes; i++) {
+        if (replicas[i] != primary) {
+            delete replicas[i];
+        }
+        DestroyExclusiveLock(&locks[i]);
+    }
+
+    delete[] replicas;
+    delete[] locks;
+}
+
+    GenomeIndex *
+NumaIndexReplicas::getReplicaForNode(int node)
+{
+    if (node < 0 || node >= nNodes) {
+        return primary;
+    }
+
+    AcquireExclusiveLock(&locks[node]);
+    if (NULL == replicas[node]) {
+        _int64 start = timeInMillis();
+        replicas[node] = primary->replicate();
+        WriteStatusMessage("Replicated the index onto NUMA node %d in %llds.\n", node, (timeInMillis() - start + 500) / 1000);
+    }
+    GenomeIndex *replica = replicas[node];
+    ReleaseExclusiveLock(&locks[node]);
+
+    return replica;
 }
 
     void
@@ -82,6 +82,14 @@ public:
 	int getMajorVersion();
 	int getMinorVersion();
 
+    //
+    // NUMA support (-numa).  replicate() copies the hash tables, overflow table and genome bases into memory first touched
+    // by the calling thread, and so onto its node; the replica shares the genome's contig tables and has to be deleted
+    // before this index.  interleaveAcrossNumaNodes() spreads this index's pages evenly over the nodes instead.
+    //
+    GenomeIndex *replicate() const;
+    bool interleaveAcrossNumaNodes();
+
 protected:
 
     int seedLen;
@@ -305,3 +313,24 @@ protected:
 };
 
 extern Genome::Contig ContigForInvalidGenomeLocation;
+
+//
+// The per-node copies of an index for -numa replicate.  Each node's copy is made by the first aligner thread that runs
+// there, so that the pages it touches while copying land on that node; the node the index was loaded on uses the
+// original.  Nodes are replicated in parallel, with a lock per node.
+//
+class NumaIndexReplicas {
+public:
+    NumaIndexReplicas(GenomeIndex *i_primary);
+    ~NumaIndexReplicas();
+
+    GenomeIndex *getReplicaForNode(int node);
+
+    int getNumberOfNodes() const {return nNodes;}
+
+private:
+    GenomeIndex     *primary;
+    int              nNodes;
+    GenomeIndex    **replicas;
+    ExclusiveLock   *locks;
+};
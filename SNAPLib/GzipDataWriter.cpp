@@ -23,6 +23,7 @@ Environment:
 #include "ParallelTask.h"
 #include "RangeSplitter.h"
 #include "Bam.h"
+#include "FastDeflate.h"
 #include "zlib.h"
 #include "exit.h"
 #include "Error.h"
@@ -72,17 +73,47 @@ private:
 class GzipCompressWorker : public ParallelWorker
 {
 public:
-    GzipCompressWorker() : heap(NULL) {}
+    GzipCompressWorker() : backend(NULL) {}
 
-    virtual ~GzipCompressWorker() { delete heap; }
+    virtual ~GzipCompressWorker() { delete backend; }
 
     virtual void step();
 
-    static size_t compressChunk(z_stream& zstream, bool bamFormat, char* toBuffer, size_t toSize, char* fromBuffer, size_t fromUsed);
+private:
+    DeflateBackend* backend;
+};
+
+class ZlibDeflateBackend : public DeflateBackend
+{
+public:
+    ZlibDeflateBackend(size_t chunkSize, int i_level)
+        : heap(chunkSize * 8), level(i_level) // appears to use 4*chunkSize per run
+    {
+        zstream.zalloc = zalloc;
+        zstream.zfree = zfree;
+        zstream.opaque = &heap;
+    }
+
+    virtual size_t compressChunk(bool bamFormat, char* toBuffer, size_t toSize, char* fromBuffer, size_t fromUsed);
 
 private:
     z_stream zstream;
-    ThreadHeap* heap;
+    ThreadHeap heap;
+    const int level;
+};
+
+//
+// Uses FastDeflate for the compressed data, and writes the gzip header and trailer itself.
+//
+class FastDeflateBackend : public DeflateBackend
+{
+public:
+    FastDeflateBackend(int level) : deflater(level) {}
+
+    virtual size_t compressChunk(bool bamFormat, char* toBuffer, size_t toSize, char* fromBuffer, size_t fromUsed);
+
+private:
+    FastDeflate deflater;
 };
 
 // used for case where each thread compresses by itself
@@ -218,11 +249,8 @@ GzipCompressWorkerManager::finishStep()
 GzipCompressWorker::step()
 {
     GzipCompressWorkerManager* supplier = (GzipCompressWorkerManager*) getManager();
-    if (heap == NULL) {
-        heap = new ThreadHeap(supplier->chunkSize * 8); // appears to use 4*chunkSize per run
-        zstream.zalloc = zalloc;
-        zstream.zfree = zfree;
-        zstream.opaque = heap;
+    if (backend == NULL) {
+        backend = DeflateBackend::create(supplier->chunkSize);
     }
     //fprintf(stderr, "zip task thread %d begin. nChunks %d\n", GetCurrentThreadId(), supplier->nChunks);
     _int64 start = timeInMillis();
@@ -230,17 +258,25 @@ GzipCompressWorker::step()
     int end = ((1 + getThreadNum()) * supplier->nChunks) / getNumThreads();
     for (int i = begin; i < end; i++) {
         size_t bytes = min(supplier->chunkSize, supplier->inputUsed - i * supplier->chunkSize);
-        supplier->sizes[i] = compressChunk(zstream, supplier->bam,
+        supplier->sizes[i] = backend->compressChunk(supplier->bam,
             supplier->buffer + i * supplier->chunkSize, supplier->chunkSize,
             supplier->input + i * supplier->chunkSize, bytes);
         _ASSERT(supplier->sizes[i] <= supplier->chunkSize); // can't grow!
     }
 }
 
+    DeflateBackend*
+DeflateBackend::create(
+    size_t chunkSize)
+{
+    if (DataWriterSupplier::UseFastDeflate) {
+        return new FastDeflateBackend(DataWriterSupplier::BgzfCompressionLevel < 0 ? 6 : DataWriterSupplier::BgzfCompressionLevel);
+    }
+    return new ZlibDeflateBackend(chunkSize, DataWriterSupplier::BgzfCompressionLevel < 0 ? Z_DEFAULT_COMPRESSION : DataWriterSupplier::BgzfCompressionLevel);
+}
 
     size_t
-GzipCompressWorker::compressChunk(
-    z_stream& zstream,
+ZlibDeflateBackend::compressChunk(
     bool bamFormat,
     char* toBuffer,
     size_t toSize,
@@ -251,9 +287,7 @@ GzipCompressWorker::compressChunk(
         WriteErrorMessage("exceeded BAM chunk size\n");
         soft_exit(1);
     }
-    if (zstream.opaque != NULL) {
-        ((ThreadHeap*)zstream.opaque)->reset();
-    }
+    heap.reset();
     // set up BAM header structure
     gz_header header;
     _uint8 bamExtraData[6];
@@ -294,7 +328,7 @@ GzipCompressWorker::compressChunk(
     uInt oldAvail;
     int status;
 
-    status = deflateInit2(&zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits | GZIP_ENCODING, 8, Z_DEFAULT_STRATEGY);
+    status = deflateInit2(&zstream, level, Z_DEFLATED, windowBits | GZIP_ENCODING, 8, Z_DEFAULT_STRATEGY);
     if (status < 0) {
         WriteErrorMessage("GzipWriterFilter: deflateInit2 failed with %d\n", status);
         soft_exit(1);
@@ -341,6 +375,71 @@ GzipCompressWorker::compressChunk(
     return toUsed;
 }
 
+    size_t
+FastDeflateBackend::compressChunk(
+    bool bamFormat,
+    char* toBuffer,
+    size_t toSize,
+    char* fromBuffer,
+    size_t fromUsed)
+{
+    if (bamFormat && fromUsed > BAM_BLOCK) {
+        WriteErrorMessage("exceeded BAM chunk size\n");
+        soft_exit(1);
+    }
+
+    //
+    // The same header zlib writes for the BGZF block: no time or name, and the extra field with the block size (BSIZE),
+    // which is backpatched below.
+    //
+    const size_t headerSize = bamFormat ? 18 : 10;
+    const size_t trailerSize = 8;
+    if (toSize < headerSize + trailerSize) {
+        WriteErrorMessage("GzipWriterFilter: output buffer too small\n");
+        soft_exit(1);
+    }
+    _uint8* header = (_uint8*)toBuffer;
+    header[0] = 0x1f;
+    header[1] = 0x8b;
+    header[2] = 8;                      // deflate
+    header[3] = bamFormat ? 4 : 0;      // FEXTRA
+    memset(header + 4, 0, 4);           // MTIME
+    header[8] = 0;                      // XFL
+    header[9] = 0;                      // OS
+    if (bamFormat) {
+        header[10] = 6;                 // XLEN
+        header[11] = 0;
+        header[12] = 'B';
+        header[13] = 'C';
+        header[14] = 2;
+        header[15] = 0;
+    }
+
+    size_t compressedBytes = deflater.compress(fromBuffer, fromUsed, toBuffer + headerSize, toSize - headerSize - trailerSize);
+    if (compressedBytes == 0) {
+        WriteErrorMessage("GzipWriterFilter: compressed data doesn't fit in the output chunk\n");
+        soft_exit(1);
+    }
+
+    _uint8* trailer = header + headerSize + compressedBytes;
+    _uint32 crc = (_uint32)crc32(crc32(0, NULL, 0), (const Bytef*)fromBuffer, (uInt)fromUsed);
+    for (int i = 0; i < 4; i++) {
+        trailer[i] = (_uint8)(crc >> (8 * i));
+        trailer[4 + i] = (_uint8)(fromUsed >> (8 * i));
+    }
+
+    size_t toUsed = headerSize + compressedBytes + trailerSize;
+    if (bamFormat) {
+        if (toUsed >= BAM_BLOCK) {
+            WriteErrorMessage("exceeded BAM chunk size\n");
+            soft_exit(1);
+        }
+        * (_uint16*) (toBuffer + 16) = (_uint16) (toUsed - 1);
+    }
+
+    return toUsed;
+}
+
 GzipWriterFilter::GzipWriterFilter(GzipWriterFilterSupplier* i_supplier)
     : DataWriter::Filter(DataWriter::ResizeFilter), supplier(i_supplier), manager(NULL), worker(NULL)
 {}
@@ -443,18 +542,16 @@ GzipWriterFilterSupplier::onClosing(
         closing = true;
         DataWriter* writer = supplier->getWriter();
         // write empty block as BAM end of file marker
-        static _uint8 eof[] = {
-            0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
-            0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-        };
-        char* buffer;
-        size_t bytes;
-        if (! (writer->getBuffer(&buffer, &bytes) && bytes >= sizeof(eof))) {
-            WriteErrorMessage("no space to write eof marker\n");
-            soft_exit(1);
+        if (writeEofMarker) {
+            char* buffer;
+            size_t bytes;
+            if (! (writer->getBuffer(&buffer, &bytes) && bytes >= sizeof(BamEofMarker))) {
+                WriteErrorMessage("no space to write eof marker\n");
+                soft_exit(1);
+            }
+            memcpy(buffer, BamEofMarker, sizeof(BamEofMarker));
+            writer->advance(sizeof(BamEofMarker));
         }
-        memcpy(buffer, eof, sizeof(eof));
-        writer->advance(sizeof(eof));
 
         // add final translation for last empty block
         writer->nextBatch();
@@ -473,6 +570,11 @@ GzipWriterFilterSupplier::onClosing(
     std::sort(translation.begin(), translation.end(), translationComparator);
 }
 
+const _uint8 GzipWriterFilterSupplier::BamEofMarker[28] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+    0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
     void
 GzipWriterFilterSupplier::addTranslations(
     VariableSizeVector< pair<_uint64,_uint64> >* moreTranslations)
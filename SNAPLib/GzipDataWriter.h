@@ -33,6 +33,23 @@ Revision History:
 
 using std::pair;
 
+//
+// Compresses one chunk at a time into a complete gzip member, which is a BGZF block when bamFormat is set.  Each
+// compression thread has its own.  Which implementation is used is only a speed/size trade-off: they all produce
+// the same container, so nothing reading the output can tell them apart.
+//
+class DeflateBackend
+{
+public:
+    virtual ~DeflateBackend() {}
+
+    // Returns the size of the gzip member written to toBuffer.
+    virtual size_t compressChunk(bool bamFormat, char* toBuffer, size_t toSize, char* fromBuffer, size_t fromUsed) = 0;
+
+    // Makes the backend selected by DataWriterSupplier::UseFastDeflate at DataWriterSupplier::BgzfCompressionLevel.
+    static DeflateBackend* create(size_t chunkSize);
+};
+
 class GzipWriterFilterSupplier : public DataWriter::FilterSupplier
 {
 public:
@@ -44,7 +61,8 @@ public:
         numThreads(i_numThreads),
         bindToProcessors(i_bindToProcessors),
         multiThreaded(i_multiThreaded),
-        closing(false)
+        closing(false),
+        writeEofMarker(true)
     {
         InitializeExclusiveLock(&lock);
     }
@@ -62,6 +80,13 @@ public:
     virtual void onClosed(DataWriterSupplier* supplier) {}
 
     void addTranslations(VariableSizeVector< pair<_uint64,_uint64> >* translation);
+
+    // for output that's written in pieces and concatenated, all but the whole file leave off the BAM EOF marker
+    void omitEofMarker()
+    { writeEofMarker = false; }
+
+    // the empty BGZF block that ends a BAM file
+    static const _uint8 BamEofMarker[28];
     
     bool translate(_uint64 logical, _uint64* o_physical, _uint64* delta);
 
@@ -98,4 +123,5 @@ private:
     ExclusiveLock lock;
     VariableSizeVector< pair<_uint64,_uint64> > translation;
     bool closing;
+    bool writeEofMarker;
 };
@@ -181,6 +181,17 @@ SNAPHashTable::~SNAPHashTable()
     }
 }
 
+    SNAPHashTable *
+SNAPHashTable::replicateInto(void *memory) const
+{
+    SNAPHashTable *replica = new SNAPHashTable(*this);
+    replica->Table = memory;
+    replica->ownsMemoryForTable = false;
+    memcpy(memory, Table, GetTableBytes());
+
+    return replica;
+}
+
     bool
 SNAPHashTable::saveToFile(const char *saveFileName, size_t *bytesWritten)
 {
@@ -63,6 +63,14 @@ class SNAPHashTable {
         unsigned GetValueSizeInBytes() const {return valueSizeInBytes;}
         unsigned GetValueCount() const {return valueCount;}
 
+        //
+        // The table's entries, and a copy of the table whose entries live at memory (which has to hold GetTableBytes()).
+        // The copy doesn't own that memory.  These are for putting replicas of the index on each NUMA node.
+        //
+        void *GetTableMemory() const {return Table;}
+        size_t GetTableBytes() const {return tableSize * elementSize;}
+        SNAPHashTable *replicateInto(void *memory) const;
+
 		void *getEntryValues(_uint64 whichEntry) 
 		{
 			_ASSERT(whichEntry < GetTableSize());
@@ -63,7 +63,7 @@ IntersectingPairedEndAligner::IntersectingPairedEndAligner(
     extraSearchDepth(extraSearchDepth_), nLocationsScoredLandauVishkin(0), nLocationsScoredAffineGap(0), disabledOptimizations(disabledOptimizations_),
     useAffineGap(useAffineGap_), maxSecondaryAlignmentsPerContig(maxSecondaryAlignmentsPerContig_), alignmentAdjuster(index->getGenome()), ignoreAlignmentAdjustmentsForOm(ignoreAlignmentAdjustmentsForOm_), altAwareness(altAwareness_),
     maxScoreGapToPreferNonAltAlignment(maxScoreGapToPreferNonAltAlignment_), matchReward(matchReward_), subPenalty(subPenalty_), gapOpenPenalty(gapOpenPenalty_), gapExtendPenalty(gapExtendPenalty_), useSoftClip(useSoftClip_),
-    stopOnFirstHit(false)
+    stopOnFirstHit(false), perfCounters(NULL)
 {
     doesGenomeIndexHave64BitLocations = index->doesGenomeIndexHave64BitLocations();
 
@@ -405,101 +405,108 @@ IntersectingPairedEndAligner::alignLandauVishkin(
     //
     // Phase 1: do the hash table lookups for each of the seeds for each of the reads and add them to the hit sets.
     //
+    {
+        //
+        // All of phase 1 counts as seed lookup, rather than each lookupSeed() call, which would cost -perf two system
+        // calls per seed.
+        //
+        PerfPhaseScope seedLookupScope(perfCounters, PerfPhaseSeedLookup);
 
-    for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
-        int nextSeedToTest = 0;
-        unsigned wrapCount = 0;
-        int nPossibleSeeds = (int)readLen[whichRead] - seedLen + 1;
-        memset(seedUsed, 0, (__max(readLen[0], readLen[1]) + 7) / 8);
-        bool beginsDisjointHitSet[NUM_DIRECTIONS] = { true, true };
-
-        while (countOfHashTableLookups[whichRead] < nPossibleSeeds && countOfHashTableLookups[whichRead] < maxSeeds) {
-            if (nextSeedToTest >= nPossibleSeeds) {
-                wrapCount++;
-                beginsDisjointHitSet[FORWARD] = beginsDisjointHitSet[RC] = true;
-                if (wrapCount >= seedLen) {
+        for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+            int nextSeedToTest = 0;
+            unsigned wrapCount = 0;
+            int nPossibleSeeds = (int)readLen[whichRead] - seedLen + 1;
+            memset(seedUsed, 0, (__max(readLen[0], readLen[1]) + 7) / 8);
+            bool beginsDisjointHitSet[NUM_DIRECTIONS] = { true, true };
+
+            while (countOfHashTableLookups[whichRead] < nPossibleSeeds && countOfHashTableLookups[whichRead] < maxSeeds) {
+                if (nextSeedToTest >= nPossibleSeeds) {
+                    wrapCount++;
+                    beginsDisjointHitSet[FORWARD] = beginsDisjointHitSet[RC] = true;
+                    if (wrapCount >= seedLen) {
+                        //
+                        // There aren't enough valid seeds in this read to reach our target.
+                        //
+                        break;
+                    }
+                    nextSeedToTest = GetWrappedNextSeedToTest(seedLen, wrapCount);
+                }
+
+
+                while (nextSeedToTest < nPossibleSeeds && IsSeedUsed(nextSeedToTest)) {
                     //
-                    // There aren't enough valid seeds in this read to reach our target.
+                    // This seed is already used.  Try the next one.
                     //
-                    break;
+                    nextSeedToTest++;
                 }
-                nextSeedToTest = GetWrappedNextSeedToTest(seedLen, wrapCount);
-            }
 
+                if (nextSeedToTest >= nPossibleSeeds) {
+                    //
+                    // Unusable seeds have pushed us past the end of the read.  Go back around the outer loop so we wrap properly.
+                    //
+                    continue;
+                }
 
-            while (nextSeedToTest < nPossibleSeeds && IsSeedUsed(nextSeedToTest)) {
-                //
-                // This seed is already used.  Try the next one.
-                //
-                nextSeedToTest++;
-            }
+                SetSeedUsed(nextSeedToTest);
 
-            if (nextSeedToTest >= nPossibleSeeds) {
-                //
-                // Unusable seeds have pushed us past the end of the read.  Go back around the outer loop so we wrap properly.
-                //
-                continue;
-            }
-
-            SetSeedUsed(nextSeedToTest);
+                if (!Seed::DoesTextRepresentASeed(reads[whichRead][FORWARD]->getData() + nextSeedToTest, seedLen)) {
+                    //
+                    // It's got Ns in it, so just skip it.
+                    //
+                    nextSeedToTest++;
+                    continue;
+                }
 
-            if (!Seed::DoesTextRepresentASeed(reads[whichRead][FORWARD]->getData() + nextSeedToTest, seedLen)) {
+                Seed seed(reads[whichRead][FORWARD]->getData() + nextSeedToTest, seedLen);
                 //
-                // It's got Ns in it, so just skip it.
+                // Find all instances of this seed in the genome.
                 //
-                nextSeedToTest++;
-                continue;
-            }
+                _int64 nHits[NUM_DIRECTIONS];
+                const GenomeLocation* hits[NUM_DIRECTIONS];
+                const unsigned* hits32[NUM_DIRECTIONS];
 
-            Seed seed(reads[whichRead][FORWARD]->getData() + nextSeedToTest, seedLen);
-            //
-            // Find all instances of this seed in the genome.
-            //
-            _int64 nHits[NUM_DIRECTIONS];
-            const GenomeLocation* hits[NUM_DIRECTIONS];
-            const unsigned* hits32[NUM_DIRECTIONS];
-
-            if (doesGenomeIndexHave64BitLocations) {
-                index->lookupSeed(seed, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC],
-                    hashTableHitSets[whichRead][FORWARD]->getNextSingletonLocation(), hashTableHitSets[whichRead][RC]->getNextSingletonLocation());
-            } else {
-                index->lookupSeed32(seed, &nHits[FORWARD], &hits32[FORWARD], &nHits[RC], &hits32[RC]);
-            }
-
-            countOfHashTableLookups[whichRead]++;
-            for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
-                int offset;
-                if (dir == FORWARD) {
-                    offset = nextSeedToTest;
+                if (doesGenomeIndexHave64BitLocations) {
+                    index->lookupSeed(seed, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC],
+                        hashTableHitSets[whichRead][FORWARD]->getNextSingletonLocation(), hashTableHitSets[whichRead][RC]->getNextSingletonLocation());
                 } else {
-                    offset = readLen[whichRead] - seedLen - nextSeedToTest;
+                    index->lookupSeed32(seed, &nHits[FORWARD], &hits32[FORWARD], &nHits[RC], &hits32[RC]);
                 }
 
-                if (nHits[dir] < maxBigHits) {
-                    totalHashTableHits[whichRead][dir] += nHits[dir];
-                    if (doesGenomeIndexHave64BitLocations) {
-                        hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir], hits[dir], beginsDisjointHitSet[dir]);
+                countOfHashTableLookups[whichRead]++;
+                for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
+                    int offset;
+                    if (dir == FORWARD) {
+                        offset = nextSeedToTest;
+                    } else {
+                        offset = readLen[whichRead] - seedLen - nextSeedToTest;
+                    }
+
+                    if (nHits[dir] < maxBigHits) {
+                        totalHashTableHits[whichRead][dir] += nHits[dir];
+                        if (doesGenomeIndexHave64BitLocations) {
+                            hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir], hits[dir], beginsDisjointHitSet[dir]);
+                        } else {
+                            hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir], hits32[dir], beginsDisjointHitSet[dir]);
+                        }
+                        beginsDisjointHitSet[dir] = false;
                     } else {
-                        hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir], hits32[dir], beginsDisjointHitSet[dir]);
+                        popularSeedsSkipped[whichRead]++;
                     }
-                    beginsDisjointHitSet[dir] = false;
+                } // for each direction
+
+                //
+                // If we don't have enough seeds left to reach the end of the read, space out the seeds more-or-less evenly.
+                //
+                if ((maxSeeds - countOfHashTableLookups[whichRead] + 1) * (int)seedLen + nextSeedToTest < nPossibleSeeds) {
+                    _ASSERT((nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1) >= (int)seedLen);
+                    nextSeedToTest += (nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1);
+                    _ASSERT(nextSeedToTest < nPossibleSeeds);   // We haven't run off the end of the read.
                 } else {
-                    popularSeedsSkipped[whichRead]++;
+                    nextSeedToTest += seedLen;
                 }
-            } // for each direction
-
-            //
-            // If we don't have enough seeds left to reach the end of the read, space out the seeds more-or-less evenly.
-            //
-            if ((maxSeeds - countOfHashTableLookups[whichRead] + 1) * (int)seedLen + nextSeedToTest < nPossibleSeeds) {
-                _ASSERT((nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1) >= (int)seedLen);
-                nextSeedToTest += (nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1);
-                _ASSERT(nextSeedToTest < nPossibleSeeds);   // We haven't run off the end of the read.
-            } else {
-                nextSeedToTest += seedLen;
-            }
-        } // while we need to lookup seeds for this read
-    } // for each read
+            } // while we need to lookup seeds for this read
+        } // for each read
+    } // phase 1
 
 #if INSTRUMENTATION_FOR_PAPER
     int hashTableHits[NUM_READS_PER_PAIR] = { hashTableHitSets[0][FORWARD]->getNumDistinctHitLocations(0) + hashTableHitSets[0][RC]->getNumDistinctHitLocations(0),
@@ -1583,101 +1590,108 @@ IntersectingPairedEndAligner::alignHamming(
     //
     // Phase 1: do the hash table lookups for each of the seeds for each of the reads and add them to the hit sets.
     //
+    {
+        //
+        // All of phase 1 counts as seed lookup, rather than each lookupSeed() call, which would cost -perf two system
+        // calls per seed.
+        //
+        PerfPhaseScope seedLookupScope(perfCounters, PerfPhaseSeedLookup);
 
-    for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
-        int nextSeedToTest = 0;
-        unsigned wrapCount = 0;
-        int nPossibleSeeds = (int)readLen[whichRead] - seedLen + 1;
-        memset(seedUsed, 0, (__max(readLen[0], readLen[1]) + 7) / 8);
-        bool beginsDisjointHitSet[NUM_DIRECTIONS] = { true, true };
-
-        while (countOfHashTableLookups[whichRead] < nPossibleSeeds && countOfHashTableLookups[whichRead] < maxSeeds) {
-            if (nextSeedToTest >= nPossibleSeeds) {
-                wrapCount++;
-                beginsDisjointHitSet[FORWARD] = beginsDisjointHitSet[RC] = true;
-                if (wrapCount >= seedLen) {
+        for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+            int nextSeedToTest = 0;
+            unsigned wrapCount = 0;
+            int nPossibleSeeds = (int)readLen[whichRead] - seedLen + 1;
+            memset(seedUsed, 0, (__max(readLen[0], readLen[1]) + 7) / 8);
+            bool beginsDisjointHitSet[NUM_DIRECTIONS] = { true, true };
+
+            while (countOfHashTableLookups[whichRead] < nPossibleSeeds && countOfHashTableLookups[whichRead] < maxSeeds) {
+                if (nextSeedToTest >= nPossibleSeeds) {
+                    wrapCount++;
+                    beginsDisjointHitSet[FORWARD] = beginsDisjointHitSet[RC] = true;
+                    if (wrapCount >= seedLen) {
+                        //
+                        // There aren't enough valid seeds in this read to reach our target.
+                        //
+                        break;
+                    }
+                    nextSeedToTest = GetWrappedNextSeedToTest(seedLen, wrapCount);
+                }
+
+
+                while (nextSeedToTest < nPossibleSeeds && IsSeedUsed(nextSeedToTest)) {
                     //
-                    // There aren't enough valid seeds in this read to reach our target.
+                    // This seed is already used.  Try the next one.
                     //
-                    break;
+                    nextSeedToTest++;
                 }
-                nextSeedToTest = GetWrappedNextSeedToTest(seedLen, wrapCount);
-            }
-
 
-            while (nextSeedToTest < nPossibleSeeds && IsSeedUsed(nextSeedToTest)) {
-                //
-                // This seed is already used.  Try the next one.
-                //
-                nextSeedToTest++;
-            }
+                if (nextSeedToTest >= nPossibleSeeds) {
+                    //
+                    // Unusable seeds have pushed us past the end of the read.  Go back around the outer loop so we wrap properly.
+                    //
+                    continue;
+                }
 
-            if (nextSeedToTest >= nPossibleSeeds) {
-                //
-                // Unusable seeds have pushed us past the end of the read.  Go back around the outer loop so we wrap properly.
-                //
-                continue;
-            }
+                SetSeedUsed(nextSeedToTest);
 
-            SetSeedUsed(nextSeedToTest);
+                if (!Seed::DoesTextRepresentASeed(reads[whichRead][FORWARD]->getData() + nextSeedToTest, seedLen)) {
+                    //
+                    // It's got Ns in it, so just skip it.
+                    //
+                    nextSeedToTest++;
+                    continue;
+                }
 
-            if (!Seed::DoesTextRepresentASeed(reads[whichRead][FORWARD]->getData() + nextSeedToTest, seedLen)) {
+                Seed seed(reads[whichRead][FORWARD]->getData() + nextSeedToTest, seedLen);
                 //
-                // It's got Ns in it, so just skip it.
+                // Find all instances of this seed in the genome.
                 //
-                nextSeedToTest++;
-                continue;
-            }
-
-            Seed seed(reads[whichRead][FORWARD]->getData() + nextSeedToTest, seedLen);
-            //
-            // Find all instances of this seed in the genome.
-            //
-            _int64 nHits[NUM_DIRECTIONS];
-            const GenomeLocation* hits[NUM_DIRECTIONS];
-            const unsigned* hits32[NUM_DIRECTIONS];
+                _int64 nHits[NUM_DIRECTIONS];
+                const GenomeLocation* hits[NUM_DIRECTIONS];
+                const unsigned* hits32[NUM_DIRECTIONS];
 
-            if (doesGenomeIndexHave64BitLocations) {
-                index->lookupSeed(seed, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC],
-                    hashTableHitSets[whichRead][FORWARD]->getNextSingletonLocation(), hashTableHitSets[whichRead][RC]->getNextSingletonLocation());
-            } else {
-                index->lookupSeed32(seed, &nHits[FORWARD], &hits32[FORWARD], &nHits[RC], &hits32[RC]);
-            }
-
-            countOfHashTableLookups[whichRead]++;
-            for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
-                int offset;
-                if (dir == FORWARD) {
-                    offset = nextSeedToTest;
+                if (doesGenomeIndexHave64BitLocations) {
+                    index->lookupSeed(seed, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC],
+                        hashTableHitSets[whichRead][FORWARD]->getNextSingletonLocation(), hashTableHitSets[whichRead][RC]->getNextSingletonLocation());
                 } else {
-                    offset = readLen[whichRead] - seedLen - nextSeedToTest;
+                    index->lookupSeed32(seed, &nHits[FORWARD], &hits32[FORWARD], &nHits[RC], &hits32[RC]);
                 }
 
-                if (nHits[dir] < maxBigHits) {
-                    totalHashTableHits[whichRead][dir] += nHits[dir];
-                    if (doesGenomeIndexHave64BitLocations) {
-                        hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir], hits[dir], beginsDisjointHitSet[dir]);
+                countOfHashTableLookups[whichRead]++;
+                for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
+                    int offset;
+                    if (dir == FORWARD) {
+                        offset = nextSeedToTest;
                     } else {
-                        hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir], hits32[dir], beginsDisjointHitSet[dir]);
+                        offset = readLen[whichRead] - seedLen - nextSeedToTest;
                     }
-                    beginsDisjointHitSet[dir] = false;
+
+                    if (nHits[dir] < maxBigHits) {
+                        totalHashTableHits[whichRead][dir] += nHits[dir];
+                        if (doesGenomeIndexHave64BitLocations) {
+                            hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir], hits[dir], beginsDisjointHitSet[dir]);
+                        } else {
+                            hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir], hits32[dir], beginsDisjointHitSet[dir]);
+                        }
+                        beginsDisjointHitSet[dir] = false;
+                    } else {
+                        popularSeedsSkipped[whichRead]++;
+                    }
+                } // for each direction
+
+                //
+                // If we don't have enough seeds left to reach the end of the read, space out the seeds more-or-less evenly.
+                //
+                if ((maxSeeds - countOfHashTableLookups[whichRead] + 1) * (int)seedLen + nextSeedToTest < nPossibleSeeds) {
+                    _ASSERT((nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1) >= (int)seedLen);
+                    nextSeedToTest += (nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1);
+                    _ASSERT(nextSeedToTest < nPossibleSeeds);   // We haven't run off the end of the read.
                 } else {
-                    popularSeedsSkipped[whichRead]++;
+                    nextSeedToTest += seedLen;
                 }
-            } // for each direction
-
-            //
-            // If we don't have enough seeds left to reach the end of the read, space out the seeds more-or-less evenly.
-            //
-            if ((maxSeeds - countOfHashTableLookups[whichRead] + 1) * (int)seedLen + nextSeedToTest < nPossibleSeeds) {
-                _ASSERT((nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1) >= (int)seedLen);
-                nextSeedToTest += (nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1);
-                _ASSERT(nextSeedToTest < nPossibleSeeds);   // We haven't run off the end of the read.
-            } else {
-                nextSeedToTest += seedLen;
-            }
-        } // while we need to lookup seeds for this read
-    } // for each read
+            } // while we need to lookup seeds for this read
+        } // for each read
+    } // phase 1
 
     readWithMoreHits = totalHashTableHits[0][FORWARD] + totalHashTableHits[0][RC] > totalHashTableHits[1][FORWARD] + totalHashTableHits[1][RC] ? 0 : 1;
     readWithFewerHits = 1 - readWithMoreHits;
@@ -2984,6 +2998,8 @@ IntersectingPairedEndAligner::scoreLocationWithAffineGapLiftover(
     bool                 useAltLiftover
 	)
 {
+    PerfPhaseScope affineGapScope(perfCounters, PerfPhaseAffineGap);
+
     Read *readToScore = reads[whichRead][direction];
     unsigned readDataLength = readToScore->getDataLength();
     GenomeDistance genomeDataLength = readDataLength + MAX_K; // Leave extra space in case the read has deletions
@@ -3132,6 +3148,8 @@ IntersectingPairedEndAligner::scoreLocationWithAffineGap(
     bool                 useAltLiftover
 	)
 {
+    PerfPhaseScope affineGapScope(perfCounters, PerfPhaseAffineGap);
+
     Read *readToScore = reads[whichRead][direction];
     unsigned readDataLength = readToScore->getDataLength();
     GenomeDistance genomeDataLength = readDataLength + MAX_K; // Leave extra space in case the read has deletions
@@ -3297,6 +3315,8 @@ IntersectingPairedEndAligner::scoreLocation(
     bool                *usedGaplessClipping,
     int                 *genomeSpan)
 {
+    PerfPhaseScope scoringScope(perfCounters, PerfPhaseScoring);
+
     if (disabledOptimizations.noUkkonen) {
         scoreLimit = maxK + extraSearchDepth;
     }
@@ -3402,6 +3422,7 @@ IntersectingPairedEndAligner::scoreLocationWithHammingDistance(
     bool*                usedGaplessClipping,
     int*                 scoreGapless)
 {
+    PerfPhaseScope scoringScope(perfCounters, PerfPhaseScoring);
 
     if (disabledOptimizations.noUkkonen) {
         scoreLimit = maxK + extraSearchDepth;
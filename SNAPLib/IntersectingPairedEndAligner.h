@@ -82,6 +82,11 @@ public:
          reverseAffineGap = reverseAffineGap_;
      }
 
+     void setPerfCounters(PerfCounters *perfCounters_)
+     {
+         perfCounters = perfCounters_;
+     }
+
     virtual ~IntersectingPairedEndAligner();
     
     virtual bool align(
@@ -421,6 +426,8 @@ private:
     AffineGapVectorized<> *affineGap;
     AffineGapVectorized<-1> *reverseAffineGap;
 
+    PerfCounters *perfCounters;     // Per-phase hardware counters, or NULL if we're not collecting them
+
     char rcTranslationTable[256];
     unsigned nTable[256];
 
@@ -0,0 +1,275 @@
+/*++
+
+Module Name:
+
+    MetricsEmitter.cpp
+
+Abstract:
+
+    Periodic progress reports while aligning (-metrics), for schedulers that want to spot stragglers and I/O starvation.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+
+--*/
+
+#include "stdafx.h"
+#include "MetricsEmitter.h"
+#include "DataReader.h"
+#include "DataWriter.h"
+#include "ReadSupplierQueue.h"
+#include "Error.h"
+
+#ifndef _MSC_VER
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif // _MSC_VER
+
+    MetricsEmitter *
+MetricsEmitter::open(const char *target, int intervalInSeconds)
+{
+    const char *socketPrefix = "unix:";
+    if (strncmp(target, socketPrefix, strlen(socketPrefix)) != 0) {
+        FILE *file = fopen(target, "a");
+        if (NULL == file) {
+            WriteErrorMessage("Unable to open metrics file '%s'\n", target);
+            return NULL;
+        }
+
+        return new MetricsEmitter(file, -1, intervalInSeconds);
+    }
+
+#ifdef _MSC_VER
+    WriteErrorMessage("-metrics unix:<path> isn't supported on Windows; use a file instead.\n");
+    return NULL;
+#else   // _MSC_VER
+    const char *path = target + strlen(socketPrefix);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        WriteErrorMessage("Metrics socket path '%s' is too long\n", path);
+        return NULL;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || ::connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        WriteErrorMessage("Unable to connect to metrics socket '%s', errno %d.  Something has to be listening on it before SNAP starts.\n", path, errno);
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    return new MetricsEmitter(NULL, fd, intervalInSeconds);
+#endif  // _MSC_VER
+}
+
+MetricsEmitter::MetricsEmitter(FILE *i_file, int i_socketFd, int intervalInSeconds) :
+    file(i_file), socketFd(i_socketFd), broken(false), intervalInMillis((_int64)intervalInSeconds * 1000)
+{
+    InitializeExclusiveLock(&lock);
+    CreateEventObject(&stopRequested);
+    PreventEventWaitersFromProceeding(&stopRequested);
+    CreateSingleWaiterObject(&reporterDone);
+
+    for (int i = 0; i < MaxThreads; i++) {
+        threadStats[i] = NULL;
+    }
+    memset(lastThreadSnapshot, 0, sizeof(lastThreadSnapshot));
+
+    startTime = lastReportTime = timeInMillis();
+    lastReads = lastBases = 0;
+    lastReadWaitTime = DataReader::ReadWaitTime;
+    lastWriteWaitTime = DataWriter::WaitTime;
+    memset(lastMapqHistogram, 0, sizeof(lastMapqHistogram));
+}
+
+MetricsEmitter::~MetricsEmitter()
+{
+    if (NULL != file) {
+        fclose(file);
+    }
+#ifndef _MSC_VER
+    if (socketFd != -1) {
+        close(socketFd);
+    }
+#endif // _MSC_VER
+
+    DestroyExclusiveLock(&lock);
+    DestroyEventObject(&stopRequested);
+    DestroySingleWaiterObject(&reporterDone);
+}
+
+    void
+MetricsEmitter::start()
+{
+    if (!StartNewThread(ReporterThreadMain, this)) {
+        WriteErrorMessage("Unable to start the metrics reporting thread\n");
+        soft_exit(1);
+    }
+}
+
+    void
+MetricsEmitter::stop()
+{
+    AllowEventWaitersToProceed(&stopRequested);
+    WaitForSingleWaiterObject(&reporterDone);
+}
+
+    void
+MetricsEmitter::ReporterThreadMain(void *param)
+{
+    MetricsEmitter *emitter = (MetricsEmitter *)param;
+
+    while (!WaitForEventWithTimeout(&emitter->stopRequested, emitter->intervalInMillis)) {
+        emitter->report(false);
+    }
+
+    emitter->report(true);
+    SignalSingleWaiterObject(&emitter->reporterDone);
+}
+
+    void
+MetricsEmitter::registerThread(AlignerStats *stats)
+{
+    AcquireExclusiveLock(&lock);
+    for (int i = 0; i < MaxThreads; i++) {
+        if (NULL == threadStats[i]) {
+            threadStats[i] = stats;
+            memset(&lastThreadSnapshot[i], 0, sizeof(lastThreadSnapshot[i]));
+            break;
+        }
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+MetricsEmitter::unregisterThread(AlignerStats *stats)
+{
+    AcquireExclusiveLock(&lock);
+    for (int i = 0; i < MaxThreads; i++) {
+        if (stats == threadStats[i]) {
+            retired.add(stats);
+            threadStats[i] = NULL;
+            break;
+        }
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+MetricsEmitter::report(bool final)
+{
+    if (broken) {
+        return;
+    }
+
+    const size_t bufferSize = 4096 + MaxThreads * 128;
+    char *buffer = new char[bufferSize];
+    size_t used = 0;
+
+#define APPEND(...) used += snprintf(buffer + used, bufferSize - used, __VA_ARGS__)
+
+    _int64 now = timeInMillis();
+    _int64 intervalMillis = __max(now - lastReportTime, (_int64)1);
+    double intervalSeconds = intervalMillis / 1000.0;
+
+    AcquireExclusiveLock(&lock);
+
+    _int64 reads = retired.totalReads;
+    _int64 bases = retired.totalBases;
+    unsigned mapqHistogram[AlignerStats::maxMapq + 1];
+    for (int i = 0; i <= AlignerStats::maxMapq; i++) {
+        mapqHistogram[i] = retired.mapqHistogram[i];
+    }
+
+    for (int i = 0; i < MaxThreads; i++) {
+        if (NULL != threadStats[i]) {
+            reads += threadStats[i]->totalReads;
+            bases += threadStats[i]->totalBases;
+            for (int j = 0; j <= AlignerStats::maxMapq; j++) {
+                mapqHistogram[j] += threadStats[i]->mapqHistogram[j];
+            }
+        }
+    }
+
+    _int64 readWaitTime = DataReader::ReadWaitTime;
+    _int64 writeWaitTime = DataWriter::WaitTime;
+
+    APPEND("{\"elapsed_s\":%.1f,\"interval_s\":%.1f,\"final\":%s,\"reads\":%lld,\"reads_per_s\":%.0f,\"bases_per_s\":%.0f,"
+        "\"input_wait_ms\":%lld,\"output_wait_ms\":%lld,\"ready_batches\":%lld,\"sort_spill_bytes\":%lld,\"threads\":[",
+        (now - startTime) / 1000.0, intervalSeconds, final ? "true" : "false", reads, (reads - lastReads) / intervalSeconds, (bases - lastBases) / intervalSeconds,
+        (readWaitTime - lastReadWaitTime) / 1000000, (writeWaitTime - lastWriteWaitTime) / 1000000, ReadSupplierQueue::ReadyElements, DataWriter::SortSpillBytes);
+
+    //
+    // Per-thread numbers are over the interval.  reading_ms is time spent waiting for the next read, writing_ms
+    // includes waiting for an output buffer, so a thread whose aligning_ms is well below the interval is starved.
+    //
+    bool first = true;
+    for (int i = 0; i < MaxThreads; i++) {
+        if (NULL == threadStats[i]) {
+            continue;
+        }
+
+        ThreadSnapshot current;
+        current.reads = threadStats[i]->totalReads;
+        current.millisReading = threadStats[i]->millisReading;
+        current.millisAligning = threadStats[i]->millisAligning;
+        current.millisWriting = threadStats[i]->millisWriting;
+
+        APPEND("%s{\"thread\":%d,\"reads_per_s\":%.0f,\"reading_ms\":%lld,\"aligning_ms\":%lld,\"writing_ms\":%lld}", first ? "" : ",", i,
+            (current.reads - lastThreadSnapshot[i].reads) / intervalSeconds, current.millisReading - lastThreadSnapshot[i].millisReading,
+            current.millisAligning - lastThreadSnapshot[i].millisAligning, current.millisWriting - lastThreadSnapshot[i].millisWriting);
+
+        lastThreadSnapshot[i] = current;
+        first = false;
+    }
+    ReleaseExclusiveLock(&lock);
+
+    APPEND("],\"mapq_delta\":[");
+    for (int i = 0; i <= AlignerStats::maxMapq; i++) {
+        APPEND("%s%u", i == 0 ? "" : ",", mapqHistogram[i] - lastMapqHistogram[i]);
+        lastMapqHistogram[i] = mapqHistogram[i];
+    }
+    APPEND("]}\n");
+
+#undef APPEND
+
+    lastReportTime = now;
+    lastReads = reads;
+    lastBases = bases;
+    lastReadWaitTime = readWaitTime;
+    lastWriteWaitTime = writeWaitTime;
+
+    write(buffer, __min(used, bufferSize - 1));
+    delete[] buffer;
+}
+
+    void
+MetricsEmitter::write(const char *buffer, size_t length)
+{
+    if (NULL != file) {
+        fwrite(buffer, 1, length, file);
+        fflush(file);
+        return;
+    }
+
+#ifndef _MSC_VER
+    while (length > 0) {
+        ssize_t sent = send(socketFd, buffer, length, MSG_NOSIGNAL);   // Don't take SIGPIPE if the listener has gone away
+        if (sent <= 0) {
+            WriteErrorMessage("WARNING: lost the metrics socket (errno %d); no more metrics will be reported for this run.\n", errno);
+            broken = true;
+            return;
+        }
+        buffer += sent;
+        length -= sent;
+    }
+#endif // _MSC_VER
+}
@@ -0,0 +1,90 @@
+/*++
+
+Module Name:
+
+    MetricsEmitter.h
+
+Abstract:
+
+    Periodic progress reports while aligning (-metrics), for schedulers that want to spot stragglers and I/O starvation.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "AlignerStats.h"
+
+//
+// A thread that wakes up every interval and writes one line of JSON describing the last interval to a file or a Unix
+// domain socket.  The aligner threads register their AlignerStats with it, and it reads them while they're being updated;
+// the fields are all naturally aligned 64 bit values, so a report may be a read or two behind but is never torn.  When
+// a thread finishes, its stats are folded into a retired total so the cumulative counts don't go backwards.
+//
+class MetricsEmitter
+{
+public:
+    //
+    // target is a file name to append to or unix:<path> for a socket that's already listening.  Returns NULL after
+    // printing an error if it can't be opened.
+    //
+    static MetricsEmitter *open(const char *target, int intervalInSeconds);
+
+    ~MetricsEmitter();
+
+    void start();
+
+    //
+    // Writes a final report (with "final":true) and waits for the reporting thread to exit.
+    //
+    void stop();
+
+    void registerThread(AlignerStats *threadStats);
+    void unregisterThread(AlignerStats *threadStats);
+
+private:
+    MetricsEmitter(FILE *i_file, int i_socketFd, int intervalInSeconds);
+
+    static void ReporterThreadMain(void *param);
+    void report(bool final);
+    void write(const char *buffer, size_t length);
+
+    FILE                *file;
+    int                  socketFd;      // -1 unless we're writing to a socket
+    bool                 broken;        // The socket went away; stop reporting but keep aligning
+    _int64               intervalInMillis;
+
+    struct ThreadSnapshot {
+        _int64  reads;
+        _int64  millisReading;
+        _int64  millisAligning;
+        _int64  millisWriting;
+    };
+
+    ExclusiveLock        lock;          // Protects threadStats, lastThreadSnapshot and retired
+    static const int     MaxThreads = 1024;
+    AlignerStats        *threadStats[MaxThreads];
+    ThreadSnapshot       lastThreadSnapshot[MaxThreads];
+    AlignerStats         retired;
+
+    EventObject          stopRequested;
+    SingleWaiterObject   reporterDone;
+
+    //
+    // Values at the previous report, to compute the deltas.
+    //
+    _int64               startTime;
+    _int64               lastReportTime;
+    _int64               lastReads;
+    _int64               lastBases;
+    _int64               lastReadWaitTime;
+    _int64               lastWriteWaitTime;
+    unsigned             lastMapqHistogram[AlignerStats::maxMapq + 1];
+};
@@ -25,18 +25,235 @@ Revision History:
 #include "Read.h"
 #include "Compat.h"
 #include "MultiInputReadSupplier.h"
+#include "Error.h"
+#include "exit.h"
+#include "Util.h"
+
+
+//
+// How much of each input to ask the OS to read ahead when we open it.
+//
+static const _int64 InputPrefetchBytes = 64 * 1024 * 1024;
+
+//
+// The per-thread suppliers usually go to whichever of their active inputs has been delivering reads with the least
+// waiting, but every this many batches they go strictly round robin so that no input is left sitting.
+//
+static const int RoundRobinInterval = 4;
+
+InputScheduler::InputScheduler(
+    int i_nInputs,
+    SNAPFile *i_inputs,
+    int i_numThreads,
+    bool i_paired,
+    bool i_quicklyDropUnpairedReads,
+    const ReaderContext& context,
+    int i_activeInputs,
+    int i_inputsToWarm) :
+    nInputs(i_nInputs), inputs(i_inputs), numThreads(i_numThreads), paired(i_paired), quicklyDropUnpairedReads(i_quicklyDropUnpairedReads),
+    activeInputs(__max(1, __min(i_activeInputs, i_nInputs))), inputsToWarm(__max(0, i_inputsToWarm)), shuttingDown(false)
+{
+    contexts = new ReaderContext[nInputs];
+    generators = new ReadSupplierGenerator *[nInputs];
+    pairedGenerators = new PairedReadSupplierGenerator *[nInputs];
+    opened = new EventObject[nInputs];
+    stats = new InputStats[nInputs];
+
+    for (int i = 0; i < nInputs; i++) {
+        contexts[i] = context;  // use separate context for each supplier, initialized from common
+        generators[i] = NULL;
+        pairedGenerators[i] = NULL;
+        CreateEventObject(&opened[i]);
+        memset(&stats[i], 0, sizeof(stats[i]));
+    }
 
+    //
+    // Every thread starts on the first activeInputs inputs right away.
+    //
+    furthestInputStarted = activeInputs - 1;
 
-MultiInputReadSupplier::MultiInputReadSupplier(int i_nReadSuppliers, ReadSupplier **i_readSuppliers)
+    InitializeExclusiveLock(&lock);
+    if (!CreateSingleWaiterObject(&openerWakeup) || !CreateSingleWaiterObject(&openerFinished)) {
+        WriteErrorMessage("InputScheduler: unable to create waiter\n");
+        soft_exit(1);
+    }
+
+    if (!StartNewThread(OpenerThreadMain, this)) {
+        WriteErrorMessage("InputScheduler: unable to start opener thread\n");
+        soft_exit(1);
+    }
+}
+
+InputScheduler::~InputScheduler()
 {
-    readSuppliers = i_readSuppliers;    // We get to own the array
-    nRemainingReadSuppliers = nReadSuppliers = i_nReadSuppliers;
-    nextReadSupplier = 0;
-    activeReadSuppliers = new ActiveRead[nReadSuppliers];
+    AcquireExclusiveLock(&lock);
+    shuttingDown = true;
+    ReleaseExclusiveLock(&lock);
+    SignalSingleWaiterObject(&openerWakeup);
+    WaitForSingleWaiterObject(&openerFinished);
+
+    for (int i = 0; i < nInputs; i++) {
+        delete generators[i];
+        delete pairedGenerators[i];
+        DestroyEventObject(&opened[i]);
+    }
+
+    delete [] contexts;
+    delete [] generators;
+    delete [] pairedGenerators;
+    delete [] opened;
+    delete [] stats;
+
+    DestroySingleWaiterObject(&openerWakeup);
+    DestroySingleWaiterObject(&openerFinished);
+    DestroyExclusiveLock(&lock);
+}
+
+    void
+InputScheduler::OpenerThreadMain(void *param)
+{
+    ((InputScheduler *)param)->openerThread();
+}
+
+    void
+InputScheduler::openerThread()
+{
+    for (int input = 0; input < nInputs; input++) {
+        AcquireExclusiveLock(&lock);
+        while (!shuttingDown && input > furthestInputStarted + inputsToWarm) {
+            ReleaseExclusiveLock(&lock);
+            WaitForSingleWaiterObject(&openerWakeup);
+            ResetSingleWaiterObject(&openerWakeup);
+            AcquireExclusiveLock(&lock);
+        }
+        bool stop = shuttingDown;
+        ReleaseExclusiveLock(&lock);
+
+        if (stop) {
+            //
+            // Nothing will ask for the rest, but don't leave anyone stuck waiting for them.
+            //
+            for (; input < nInputs; input++) {
+                AllowEventWaitersToProceed(&opened[input]);
+            }
+            break;
+        }
+
+        _int64 start = timeInNanos();
+        if (paired) {
+            pairedGenerators[input] = inputs[input].createPairedReadSupplierGenerator(numThreads, quicklyDropUnpairedReads, contexts[input]);
+        } else {
+            generators[input] = inputs[input].createReadSupplierGenerator(numThreads, contexts[input]);
+        }
+        stats[input].openNanos = timeInNanos() - start;
+
+        if (!inputs[input].isStdio) {
+            AdviseFilePrefetch(inputs[input].fileName, InputPrefetchBytes);
+            if (NULL != inputs[input].secondFileName) {
+                AdviseFilePrefetch(inputs[input].secondFileName, InputPrefetchBytes);
+            }
+        }
+
+        AllowEventWaitersToProceed(&opened[input]);
+    }
+
+    SignalSingleWaiterObject(&openerFinished);
+}
+
+    void
+InputScheduler::waitForInput(int input)
+{
+    _ASSERT(input >= 0 && input < nInputs);
+
+    AcquireExclusiveLock(&lock);
+    bool wakeOpener = input > furthestInputStarted;
+    if (wakeOpener) {
+        furthestInputStarted = input;
+    }
+    ReleaseExclusiveLock(&lock);
+
+    if (wakeOpener) {
+        SignalSingleWaiterObject(&openerWakeup);
+    }
+
+    WaitForEvent(&opened[input]);
+}
+
+    ReadSupplierGenerator *
+InputScheduler::getGenerator(int input)
+{
+    _ASSERT(!paired);
+    waitForInput(input);
+    return generators[input];
+}
+
+    PairedReadSupplierGenerator *
+InputScheduler::getPairedGenerator(int input)
+{
+    _ASSERT(paired);
+    waitForInput(input);
+    return pairedGenerators[input];
+}
+
+    ReaderContext *
+InputScheduler::getContext()
+{
+    WaitForEvent(&opened[0]);
+    if (paired) {
+        return pairedGenerators[0]->getContext();
+    } else {
+        return generators[0]->getContext();
+    }
+}
+
+    void
+InputScheduler::noteReads(int input, _int64 reads, _int64 nanosWaiting)
+{
+    InputStats *inputStats = &stats[input];
+    _int64 now = timeInNanos();
+
+    InterlockedAdd64AndReturnNewValue(&inputStats->reads, reads);
+    InterlockedAdd64AndReturnNewValue(&inputStats->nanosWaiting, nanosWaiting);
+    InterlockedCompareExchange64AndReturnOldValue((volatile _uint64 *)&inputStats->firstReadTime, now, 0);
+    if (now > inputStats->lastReadTime) {
+        inputStats->lastReadTime = now;     // Racy, but it only has to be about right
+    }
+}
+
+    void
+InputScheduler::printStats()
+{
+    const size_t strBufLen = 50;
+    char readsBuffer[strBufLen];
+    char rateBuffer[strBufLen];
+
+    WriteStatusMessage("\nInput  Reads            Reads/s      Open (ms)  Wait (s)  File\n");
+    for (int i = 0; i < nInputs; i++) {
+        _int64 elapsed = stats[i].lastReadTime - stats[i].firstReadTime;
+        WriteStatusMessage("%-6d %-16s %-12s %-10lld %-9.1f %s%s%s\n", i,
+            FormatUIntWithCommas(stats[i].reads, readsBuffer, strBufLen),
+            FormatUIntWithCommas(elapsed > 0 ? (_uint64)(stats[i].reads * 1000000000.0 / elapsed) : 0, rateBuffer, strBufLen),
+            stats[i].openNanos / 1000000, stats[i].nanosWaiting / 1e9,
+            inputs[i].fileName, NULL != inputs[i].secondFileName ? " " : "", NULL != inputs[i].secondFileName ? inputs[i].secondFileName : "");
+    }
+}
+
+MultiInputReadSupplier::MultiInputReadSupplier(InputScheduler *i_scheduler) : scheduler(i_scheduler)
+{
+    nReadSuppliers = scheduler->getInputCount();
+    readSuppliers = new ReadSupplier *[nReadSuppliers];
     for (int i = 0; i < nReadSuppliers; i++) {
-        activeReadSuppliers[i].index = i;
-        activeReadSuppliers[i].lastBatch = DataBatch();
-        activeReadSuppliers[i].firstReadInNextBatch = NULL;
+        readSuppliers[i] = NULL;
+    }
+
+    nextInput = 0;
+    nextReadSupplier = 0;
+    batchesSincePick = 0;
+    activeReadSuppliers = new ActiveRead[scheduler->getActiveInputCount()];
+    for (nRemainingReadSuppliers = 0; nRemainingReadSuppliers < scheduler->getActiveInputCount(); nRemainingReadSuppliers++) {
+        if (!startNextInput(&activeReadSuppliers[nRemainingReadSuppliers])) {
+            break;
+        }
     }
 }
 
@@ -50,6 +267,62 @@ MultiInputReadSupplier::~MultiInputReadSupplier()
     delete [] activeReadSuppliers;
 }
 
+    bool
+MultiInputReadSupplier::startNextInput(ActiveRead *active)
+{
+    while (nextInput < nReadSuppliers) {
+        int input = nextInput++;
+        ReadSupplierGenerator *generator = scheduler->getGenerator(input);
+        if (NULL == generator) {
+            continue;
+        }
+
+        //
+        // This is NULL if the other threads have already taken all of the input.
+        //
+        readSuppliers[input] = generator->generateNewReadSupplier();
+        if (NULL != readSuppliers[input]) {
+            active->index = input;
+            active->lastBatch = DataBatch();
+            active->firstReadInNextBatch = NULL;
+            active->reads = 0;
+            active->nanosWaiting = 0;
+            active->nanosPerRead = 0;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+    void
+MultiInputReadSupplier::reportStats(ActiveRead *active)
+{
+    if (active->reads > 0) {
+        double nanosPerRead = (double)active->nanosWaiting / active->reads;
+        active->nanosPerRead = active->nanosPerRead == 0 ? nanosPerRead : (active->nanosPerRead + nanosPerRead) / 2;
+    }
+    scheduler->noteReads(active->index, active->reads, active->nanosWaiting);
+    active->reads = 0;
+    active->nanosWaiting = 0;
+}
+
+    void
+MultiInputReadSupplier::pickNextActive()
+{
+    if (++batchesSincePick >= RoundRobinInterval) {
+        batchesSincePick = 0;
+        nextReadSupplier = (nextReadSupplier + 1) % nRemainingReadSuppliers;
+        return;
+    }
+
+    for (int i = 0; i < nRemainingReadSuppliers; i++) {
+        if (activeReadSuppliers[i].nanosPerRead < activeReadSuppliers[nextReadSupplier].nanosPerRead) {
+            nextReadSupplier = i;
+        }
+    }
+}
+
     Read *
 MultiInputReadSupplier::getNextRead()
 {
@@ -70,27 +343,34 @@ MultiInputReadSupplier::getNextRead()
             return read;
         }
 
+        _int64 start = timeInNanos();
         read = readSuppliers[active->index]->getNextRead();
+        active->nanosWaiting += timeInNanos() - start;
+
         if (read != NULL) {
+            active->reads++;
             read->setBatch(DataBatch(read->getBatch().batchID,
                 read->getBatch().fileID * nReadSuppliers + active->index));
             active->lastBatch = read->getBatch();
             if (read->getBatch() == last || last == DataBatch()) {
                 return read;
             }
-            // end of batch from current supplier, round-robin through suppliers
+            // end of batch from current supplier, move on to the next one
             active->firstReadInNextBatch = read;
-            nextReadSupplier = (nextReadSupplier + 1) % nRemainingReadSuppliers;
+            reportStats(active);
+            pickNextActive();
         } else {
+            reportStats(active);
             //
-            // This supplier is done.  Update our array to pull the
-            // last live read supplier into the slot that we just vacated (this will result
-            // in violating a strict round robin, but we don't promise any such thing
-            // anyway). Can't delete because it might be retaining read data in use downstream.
+            // This supplier is done.  Start this thread on the next input in its place, or if there aren't any left, pull
+            // the last live read supplier into the slot that we just vacated (this will result in violating a strict round robin,
+            // but we don't promise any such thing anyway). Can't delete because it might be retaining read data in use downstream.
             //
-            nRemainingReadSuppliers--;
-            activeReadSuppliers[nextReadSupplier] = activeReadSuppliers[nRemainingReadSuppliers];
-            nextReadSupplier = 0;   // (Bluntly) handles the case where nextReadSupplier is the last one.
+            if (!startNextInput(active)) {
+                nRemainingReadSuppliers--;
+                activeReadSuppliers[nextReadSupplier] = activeReadSuppliers[nRemainingReadSuppliers];
+                nextReadSupplier = 0;   // (Bluntly) handles the case where nextReadSupplier is the last one.
+            }
         }
     }
 }
@@ -100,7 +380,7 @@ MultiInputReadSupplier::holdBatch(
     DataBatch batch)
 {
     int index = batch.fileID % nReadSuppliers;
-    _ASSERT(index >= 0 && index < nReadSuppliers);
+    _ASSERT(index >= 0 && index < nReadSuppliers && readSuppliers[index] != NULL);
     readSuppliers[index]->holdBatch(DataBatch(batch.batchID, batch.fileID / nReadSuppliers));
 }
     
@@ -109,20 +389,26 @@ MultiInputReadSupplier::releaseBatch(
     DataBatch batch)
 {
     int index = batch.fileID % nReadSuppliers;
-    _ASSERT(index >= 0 && index < nReadSuppliers);
+    _ASSERT(index >= 0 && index < nReadSuppliers && readSuppliers[index] != NULL);
     return readSuppliers[index]->releaseBatch(DataBatch(batch.batchID, batch.fileID / nReadSuppliers));
 }
 
-MultiInputPairedReadSupplier::MultiInputPairedReadSupplier(int i_nReadSuppliers, PairedReadSupplier **i_pairedReadSuppliers)
+MultiInputPairedReadSupplier::MultiInputPairedReadSupplier(InputScheduler *i_scheduler) : scheduler(i_scheduler)
 {
-    pairedReadSuppliers = i_pairedReadSuppliers;    // We get to own the array
-    nRemainingReadSuppliers = nReadSuppliers = i_nReadSuppliers;
-    nextReadSupplier = 0;
-    activeReadSuppliers = new ActiveRead[nReadSuppliers];
+    nReadSuppliers = scheduler->getInputCount();
+    pairedReadSuppliers = new PairedReadSupplier *[nReadSuppliers];
     for (int i = 0; i < nReadSuppliers; i++) {
-        activeReadSuppliers[i].index = i;
-        activeReadSuppliers[i].lastBatch[0] = activeReadSuppliers[i].lastBatch[1] = DataBatch();
-        activeReadSuppliers[i].firstReadInNextBatch[0] = activeReadSuppliers[i].firstReadInNextBatch[1] = NULL;
+        pairedReadSuppliers[i] = NULL;
+    }
+
+    nextInput = 0;
+    nextReadSupplier = 0;
+    batchesSincePick = 0;
+    activeReadSuppliers = new ActiveRead[scheduler->getActiveInputCount()];
+    for (nRemainingReadSuppliers = 0; nRemainingReadSuppliers < scheduler->getActiveInputCount(); nRemainingReadSuppliers++) {
+        if (!startNextInput(&activeReadSuppliers[nRemainingReadSuppliers])) {
+            break;
+        }
     }
 }
  
@@ -137,27 +423,83 @@ MultiInputPairedReadSupplier::~MultiInputPairedReadSupplier()
     delete [] activeReadSuppliers;
 }
 
+    bool
+MultiInputPairedReadSupplier::startNextInput(ActiveRead *active)
+{
+    while (nextInput < nReadSuppliers) {
+        int input = nextInput++;
+        PairedReadSupplierGenerator *generator = scheduler->getPairedGenerator(input);
+        if (NULL == generator) {
+            continue;
+        }
+
+        pairedReadSuppliers[input] = generator->generateNewPairedReadSupplier();
+        if (NULL != pairedReadSuppliers[input]) {
+            active->index = input;
+            active->lastBatch[0] = active->lastBatch[1] = DataBatch();
+            active->firstReadInNextBatch[0] = active->firstReadInNextBatch[1] = NULL;
+            active->reads = 0;
+            active->nanosWaiting = 0;
+            active->nanosPerRead = 0;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+    void
+MultiInputPairedReadSupplier::reportStats(ActiveRead *active)
+{
+    if (active->reads > 0) {
+        double nanosPerRead = (double)active->nanosWaiting / active->reads;
+        active->nanosPerRead = active->nanosPerRead == 0 ? nanosPerRead : (active->nanosPerRead + nanosPerRead) / 2;
+    }
+    scheduler->noteReads(active->index, active->reads, active->nanosWaiting);
+    active->reads = 0;
+    active->nanosWaiting = 0;
+}
+
+    void
+MultiInputPairedReadSupplier::pickNextActive()
+{
+    if (++batchesSincePick >= RoundRobinInterval) {
+        batchesSincePick = 0;
+        nextReadSupplier = (nextReadSupplier + 1) % nRemainingReadSuppliers;
+        return;
+    }
+
+    for (int i = 0; i < nRemainingReadSuppliers; i++) {
+        if (activeReadSuppliers[i].nanosPerRead < activeReadSuppliers[nextReadSupplier].nanosPerRead) {
+            nextReadSupplier = i;
+        }
+    }
+}
+
     bool 
 MultiInputPairedReadSupplier::getNextReadPair(Read **read0, Read **read1)
 {
     if (0 == nRemainingReadSuppliers) {
-        return NULL;
+        return false;
     }
 
     _ASSERT(nextReadSupplier < nRemainingReadSuppliers);
 
     ActiveRead* active = &activeReadSuppliers[nextReadSupplier];
+    _int64 start = timeInNanos();
     bool hasReads = pairedReadSuppliers[active->index]->getNextReadPair(read0, read1);
+    active->nanosWaiting += timeInNanos() - start;
     bool nextBatch = hasReads && ((*read0)->getBatch() != active->lastBatch[0] || (*read1)->getBatch() != active->lastBatch[1]);
     if (nextBatch) {
         active->firstReadInNextBatch[0] = *read0;
         active->firstReadInNextBatch[1] = *read1;
     }
     if (nextBatch || ! hasReads) {
+        reportStats(active);
         while (true) {
-            // end of batch from current supplier, round-robin through suppliers
+            // end of batch from current supplier, move on to the next one
             if (nextBatch) {
-                nextReadSupplier = (nextReadSupplier + 1) % nRemainingReadSuppliers;
+                pickNextActive();
                 nextBatch = false;
             }
             active = &activeReadSuppliers[nextReadSupplier];
@@ -168,27 +510,34 @@ MultiInputPairedReadSupplier::getNextReadPair(Read **read0, Read **read1)
                 active->firstReadInNextBatch[0] = active->firstReadInNextBatch[1] = NULL;
                 break;
             }
-            if (pairedReadSuppliers[active->index]->getNextReadPair(read0, read1)) {
+            start = timeInNanos();
+            bool gotPair = pairedReadSuppliers[active->index]->getNextReadPair(read0, read1);
+            active->nanosWaiting += timeInNanos() - start;
+            if (gotPair) {
                 break;
             }
+            reportStats(active);
+            //
+            // This supplier is done.  Start this thread on the next input in its place, or if there aren't any left, pull
+            // the last live read supplier into the slot that we just vacated (this will result in violating a strict round robin,
+            // but we don't promise any such thing anyway). Can't delete because it might be retaining read data in use downstream.
+            //
+            if (startNextInput(active)) {
+                continue;
+            }
             nRemainingReadSuppliers--;
             if (0 == nRemainingReadSuppliers) {
                 return false;
             }
-            //
-            // This supplier is done.  Update our array to pull the
-            // last live read supplier into the slot that we just vacated (this will result
-            // in violating a strict round robin, but we don't promise any such thing
-            // anyway). Can't delete because it might be retaining read data in use downstream.
-            //
             activeReadSuppliers[nextReadSupplier] = activeReadSuppliers[nRemainingReadSuppliers];
             nextReadSupplier = 0;   // (Bluntly) handles the case where nextReadSupplier is the last one.
         }
     }
+    active->reads += 2;
     active->lastBatch[0] = (*read0)->getBatch();
-    (*read0)->setBatch(DataBatch(active->lastBatch[0].fileID * nReadSuppliers + active->index, active->lastBatch[0].batchID));
+    (*read0)->setBatch(DataBatch(active->lastBatch[0].batchID, active->lastBatch[0].fileID * nReadSuppliers + active->index));
     active->lastBatch[1] = (*read1)->getBatch();
-    (*read1)->setBatch(DataBatch(active->lastBatch[1].fileID * nReadSuppliers + active->index, active->lastBatch[1].batchID));
+    (*read1)->setBatch(DataBatch(active->lastBatch[1].batchID, active->lastBatch[1].fileID * nReadSuppliers + active->index));
 
     return true;
 }
@@ -198,7 +547,7 @@ MultiInputPairedReadSupplier::holdBatch(
     DataBatch batch)
 {
     int index = batch.fileID % nReadSuppliers;
-    _ASSERT(index >= 0 && index < nReadSuppliers);
+    _ASSERT(index >= 0 && index < nReadSuppliers && pairedReadSuppliers[index] != NULL);
     pairedReadSuppliers[index]->holdBatch(DataBatch(batch.batchID, batch.fileID / nReadSuppliers));
 }
     
@@ -207,92 +556,53 @@ MultiInputPairedReadSupplier::releaseBatch(
     DataBatch batch)
 {
     int index = batch.fileID % nReadSuppliers;
-    _ASSERT(index >= 0 && index < nReadSuppliers);
+    _ASSERT(index >= 0 && index < nReadSuppliers && pairedReadSuppliers[index] != NULL);
     return pairedReadSuppliers[index]->releaseBatch(DataBatch(batch.batchID, batch.fileID / nReadSuppliers));
 }
 
 
-MultiInputReadSupplierGenerator::MultiInputReadSupplierGenerator(int i_nReadSuppliers, ReadSupplierGenerator **i_readSupplierGenerators)
+MultiInputReadSupplierGenerator::MultiInputReadSupplierGenerator(InputScheduler *i_scheduler) : scheduler(i_scheduler)
 {
-    nReadSuppliers = i_nReadSuppliers;
-    readSupplierGenerators = i_readSupplierGenerators;  // We take ownership of the array
 }
 
 MultiInputReadSupplierGenerator::~MultiInputReadSupplierGenerator()
 {
-    for (int i = 0; i < nReadSuppliers; i++) {
-        delete readSupplierGenerators[i];
-    }
-    delete [] readSupplierGenerators;
-    readSupplierGenerators = NULL;
+    delete scheduler;   // We own it
+    scheduler = NULL;
 }
 
     ReadSupplier *
 MultiInputReadSupplierGenerator::generateNewReadSupplier()
 {
-    ReadSupplier **readSuppliers = new ReadSupplier *[nReadSuppliers];
-    for (int i = 0; i < nReadSuppliers; ) {
-        readSuppliers[i] = readSupplierGenerators[i]->generateNewReadSupplier();
-		if (NULL == readSuppliers[i]) {
-			nReadSuppliers--;
-		} else {
-			i++;
-		}
-    }
-
-	if (0 == nReadSuppliers) {
-		delete [] readSuppliers;
-		return NULL;
-	}
-
-    return new MultiInputReadSupplier(nReadSuppliers,readSuppliers);    // The Supplier owns the array and suppliers we created
+    return new MultiInputReadSupplier(scheduler);
 }
 
     
     ReaderContext*
 MultiInputReadSupplierGenerator::getContext()
 {
-    return readSupplierGenerators[0]->getContext();
+    return scheduler->getContext();
 }
 
 
-MultiInputPairedReadSupplierGenerator::MultiInputPairedReadSupplierGenerator(int i_nReadSuppliers, PairedReadSupplierGenerator **i_readSupplierGenerators)
+MultiInputPairedReadSupplierGenerator::MultiInputPairedReadSupplierGenerator(InputScheduler *i_scheduler) : scheduler(i_scheduler)
 {
-    nReadSuppliers = i_nReadSuppliers;
-    readSupplierGenerators = i_readSupplierGenerators;  // We own the array and the generators.
 }
 
 MultiInputPairedReadSupplierGenerator::~MultiInputPairedReadSupplierGenerator()
 {
-    for (int i = 0; i < nReadSuppliers; i++) {
-        delete readSupplierGenerators[i];
-        readSupplierGenerators[i] = NULL;
-    }
-    delete [] readSupplierGenerators;
-    readSupplierGenerators = NULL;
+    delete scheduler;   // We own it
+    scheduler = NULL;
 }
 
     PairedReadSupplier *
 MultiInputPairedReadSupplierGenerator::generateNewPairedReadSupplier()
 {
-    PairedReadSupplier **readSuppliers = new PairedReadSupplier *[nReadSuppliers];
-    for (int i = 0; i < nReadSuppliers; ) {
-        readSuppliers[i] = readSupplierGenerators[i]->generateNewPairedReadSupplier();
-		if (NULL == readSuppliers[i]) {
-			nReadSuppliers--;
-		} else {
-			i++;
-		}
-    }
-	if (0 == nReadSuppliers) {
-		delete [] readSuppliers;
-		return NULL;
-	}
-    return new MultiInputPairedReadSupplier(nReadSuppliers,readSuppliers);
+    return new MultiInputPairedReadSupplier(scheduler);
 }
 
     ReaderContext*
 MultiInputPairedReadSupplierGenerator::getContext()
 {
-    return readSupplierGenerators[0]->getContext();
+    return scheduler->getContext();
 }
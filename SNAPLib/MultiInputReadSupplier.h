@@ -24,10 +24,77 @@ Revision History:
 #pragma once
 #include "Read.h"
 #include "Compat.h"
+#include "AlignerOptions.h"
+
+//
+// Decides when each of several input files gets opened, and keeps track of how fast each one is consumed.
+//
+// Opening an input means creating its read supplier generator, which reads the header and (for formats that go
+// through a ReadSupplierQueue) starts the reader threads, so it's both slow and the thing that gets the data flowing.
+// Rather than doing that for every input up front, a background thread opens them in order, staying inputsToWarm
+// past the furthest input that any aligner thread has started on, and asks the OS to start reading the files it opens.
+// That way the open and first reads of the next file overlap with the aligner threads draining the current ones.
+//
+class InputScheduler {
+public:
+    InputScheduler(int i_nInputs, SNAPFile *i_inputs, int i_numThreads, bool i_paired, bool i_quicklyDropUnpairedReads, const ReaderContext& context,
+        int i_activeInputs, int i_inputsToWarm);
+    ~InputScheduler();
+
+    int getInputCount() { return nInputs; }
+
+    // How many inputs each aligner thread reads from at once
+    int getActiveInputCount() { return activeInputs; }
+
+    // These wait for the input to be opened.  They return NULL if it couldn't be.
+    ReadSupplierGenerator *getGenerator(int input);
+    PairedReadSupplierGenerator *getPairedGenerator(int input);
+
+    ReaderContext *getContext();
+
+    // Called by the per-thread suppliers
+    void noteReads(int input, _int64 reads, _int64 nanosWaiting);
+
+    void printStats();
+
+private:
+
+    static void OpenerThreadMain(void *param);
+    void openerThread();
+    void waitForInput(int input);
+
+    struct InputStats {
+        volatile _int64     reads;
+        volatile _int64     nanosWaiting;       // Time aligner threads spent in calls to get reads from this input
+        volatile _int64     firstReadTime;
+        volatile _int64     lastReadTime;
+        _int64              openNanos;          // How long it took to create the generator
+    };
+
+    int                             nInputs;
+    SNAPFile                        *inputs;
+    int                             numThreads;
+    bool                            paired;
+    bool                            quicklyDropUnpairedReads;
+    int                             activeInputs;
+    int                             inputsToWarm;
+
+    ReaderContext                   *contexts;          // One per input, since the generators hold onto them
+    ReadSupplierGenerator           **generators;
+    PairedReadSupplierGenerator     **pairedGenerators;
+    EventObject                     *opened;            // Set once the corresponding generator is filled in
+    InputStats                      *stats;
+
+    ExclusiveLock                   lock;
+    int                             furthestInputStarted;
+    bool                            shuttingDown;
+    SingleWaiterObject              openerWakeup;
+    SingleWaiterObject              openerFinished;
+};
 
 class MultiInputReadSupplier: public ReadSupplier {
 public:
-    MultiInputReadSupplier(int nReadSuppliers, ReadSupplier **i_readSuppliers);
+    MultiInputReadSupplier(InputScheduler *i_scheduler);
     virtual ~MultiInputReadSupplier();
 
     virtual Read *getNextRead();
@@ -43,18 +110,28 @@ private:
         int         index; // index in readSuppliers array
         DataBatch   lastBatch; // last batch read from this supplier
         Read*       firstReadInNextBatch;
+        _int64      reads;          // Reads from this supplier since we last reported stats
+        _int64      nanosWaiting;   // Time spent getting them
+        double      nanosPerRead;   // Smoothed waiting time per read, for choosing the next input to read from
     };
 
+    bool startNextInput(ActiveRead *active);    // Fills in active with the next input for this thread, returns false if there are none
+    void pickNextActive();
+    void reportStats(ActiveRead *active);
+
+    InputScheduler      *scheduler;
     int                 nRemainingReadSuppliers;
     int                 nReadSuppliers;
     int                 nextReadSupplier;
-    ReadSupplier        **readSuppliers;
+    int                 nextInput;          // The next input this thread hasn't started
+    int                 batchesSincePick;
+    ReadSupplier        **readSuppliers;    // Indexed by input, NULL until we start on it
     ActiveRead          *activeReadSuppliers;
 };
 
 class MultiInputPairedReadSupplier: public PairedReadSupplier {
 public:
-    MultiInputPairedReadSupplier(int nReadSuppliers, PairedReadSupplier **i_pairedReadSuppliers);
+    MultiInputPairedReadSupplier(InputScheduler *i_scheduler);
     virtual ~MultiInputPairedReadSupplier();
 
     virtual bool getNextReadPair(Read **read0, Read **read1);
@@ -71,11 +148,21 @@ private:
         int         index; // index in readSuppliers array
         DataBatch   lastBatch[2]; // last batch read from this supplier
         Read*       firstReadInNextBatch[2];
+        _int64      reads;
+        _int64      nanosWaiting;
+        double      nanosPerRead;
     };
 
+    bool startNextInput(ActiveRead *active);
+    void pickNextActive();
+    void reportStats(ActiveRead *active);
+
+    InputScheduler      *scheduler;
     int                 nRemainingReadSuppliers;
     int                 nReadSuppliers;
     int                 nextReadSupplier;
+    int                 nextInput;
+    int                 batchesSincePick;
     PairedReadSupplier  **pairedReadSuppliers;
     ActiveRead          *activeReadSuppliers;
 };
@@ -83,7 +170,7 @@ private:
 class MultiInputReadSupplierGenerator: public ReadSupplierGenerator
 {
 public:
-    MultiInputReadSupplierGenerator(int i_nReadSuppliers, ReadSupplierGenerator **i_readSupplierGenerators);
+    MultiInputReadSupplierGenerator(InputScheduler *i_scheduler);
     virtual ~MultiInputReadSupplierGenerator();
 
     virtual ReadSupplier *generateNewReadSupplier();
@@ -91,14 +178,13 @@ public:
 
 private:
 
-    int nReadSuppliers;
-    ReadSupplierGenerator **readSupplierGenerators;
+    InputScheduler *scheduler;
 };
 
 class MultiInputPairedReadSupplierGenerator: public PairedReadSupplierGenerator
 {
 public:
-    MultiInputPairedReadSupplierGenerator(int i_nReadSuppliers, PairedReadSupplierGenerator **i_readSupplierGenerators);
+    MultiInputPairedReadSupplierGenerator(InputScheduler *i_scheduler);
     virtual ~MultiInputPairedReadSupplierGenerator();
 
     virtual PairedReadSupplier *generateNewPairedReadSupplier();
@@ -106,6 +192,5 @@ public:
 
 private:
 
-    int nReadSuppliers;
-    PairedReadSupplierGenerator **readSupplierGenerators;
+    InputScheduler *scheduler;
 };
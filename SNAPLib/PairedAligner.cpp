@@ -524,6 +524,7 @@ void PairedAlignerContext::runIterationThreadImpl(Read **reads)
                 soft_exit(1);
             }
             stats->totalReads += 2;
+            stats->totalBases += reads[0]->getDataLength() + reads[1]->getDataLength();
 
             bool pass0 = options->passFilter(reads[0], result.status[0], reads[0]->getDataLength() >= minReadLength && (int)reads[0]->countOfNs() <= maxDist, false);
             bool pass1 = options->passFilter(reads[1], result.status[1], reads[1]->getDataLength() >= minReadLength && (int)reads[1]->countOfNs() <= maxDist, false);
@@ -561,27 +562,28 @@ void PairedAlignerContext::runIterationThreadImpl(Read **reads)
         maxSingleSecondaryHits = 0;
     } else {
         //
-        // Since we reallocate these if they overflow, just pick a value that doesn't waste too much memory.
+        // These come from the result arena, which only commits what's touched, so give them a whole slab.
         //
-        maxPairedSecondaryHits = 32;
-        maxSingleSecondaryHits = 32;
+        maxPairedSecondaryHits = ResultBufferSlabSize / sizeof(PairedAlignmentResult) - 1;
+        maxSingleSecondaryHits = ResultBufferSlabSize / sizeof(SingleAlignmentResult);
     }
 
     if (useAffineGap) {
-        maxPairedCandidatesForAffineGap = 4096;
-        maxSingleCandidatesForAffineGap = 4096;
+        maxPairedCandidatesForAffineGap = __max((_int64)4096, (_int64)(ResultBufferSlabSize / sizeof(PairedAlignmentResult)));
+        maxSingleCandidatesForAffineGap = __max((_int64)4096, (_int64)(ResultBufferSlabSize / sizeof(SingleAlignmentResult)));
     }
     else {
         maxPairedCandidatesForAffineGap = 0;
         maxSingleCandidatesForAffineGap = 0;
     }
 
-    bool reallocatedSingleSecondaryBuffer = false;
-    bool reallocatedPairedSecondaryBuffer = false;
-    bool reallocatedPairedCandidatesForAffineGapBuffer = false;
-    bool reallocatedSingleCandidatesForAffineGapBuffer = false;
+    const _int64 initialPairedSecondaryHits = maxPairedSecondaryHits;
+    const _int64 initialSingleSecondaryHits = maxSingleSecondaryHits;
+    const _int64 initialPairedCandidatesForAffineGap = maxPairedCandidatesForAffineGap;
+    const _int64 initialSingleCandidatesForAffineGap = maxSingleCandidatesForAffineGap;
 
-    memoryPoolSize += (1 + maxPairedSecondaryHits + maxPairedCandidatesForAffineGap) * sizeof(PairedAlignmentResult) + (maxSingleSecondaryHits + maxSingleCandidatesForAffineGap) * sizeof(SingleAlignmentResult);
+    ArenaAllocator *arena = new ArenaAllocator(ResultArenaReservation);
+    DataBatch arenaBatch;
 
     BigAllocator *allocator = new BigAllocator(memoryPoolSize, 16); // FIXME: Used larger allocation granularity for __m128i that needs to be aligned at 16 byte boundaries
     
@@ -624,19 +626,15 @@ void PairedAlignerContext::runIterationThreadImpl(Read **reads)
         enableHammingScoringBaseAligner,
         allocator);
 
-    allocator->checkCanaries();
+    aligner->setPerfCounters(perfCounters);
 
-    PairedAlignmentResult *results = (PairedAlignmentResult *)allocator->allocate((1 + maxPairedSecondaryHits) * sizeof(*results)); // 1 + is for the primary result
-    SingleAlignmentResult *singleSecondaryResults = (SingleAlignmentResult *)allocator->allocate(maxSingleSecondaryHits * sizeof(*singleSecondaryResults));
+    allocator->checkCanaries();
 
+    PairedAlignmentResult *results = NULL;
+    SingleAlignmentResult *singleSecondaryResults = NULL;
     PairedAlignmentResult* pairedCandidatesForAffineGap = NULL;
     SingleAlignmentResult* singleCandidatesForAffineGap = NULL;
 
-    if (useAffineGap) {
-        pairedCandidatesForAffineGap = (PairedAlignmentResult*)allocator->allocate(maxPairedCandidatesForAffineGap * sizeof(*pairedCandidatesForAffineGap));
-        singleCandidatesForAffineGap = (SingleAlignmentResult*)allocator->allocate(maxSingleCandidatesForAffineGap * sizeof(*singleCandidatesForAffineGap));
-    }
-
     ReadWriter *readWriter = this->readWriter;
 
 #ifdef  _MSC_VER
@@ -657,7 +655,7 @@ void PairedAlignerContext::runIterationThreadImpl(Read **reads)
     _int64 startTime = timeInMillis();
     while (supplier->getNextReadPair(&reads[0], &reads[1])) {
             _int64 readFinishedTime;
-            if (options->profile) {
+            if (timeStages) {
                 readFinishedTime = timeInMillis();
                 stats->millisReading += (readFinishedTime - startTime);
             }
@@ -668,6 +666,27 @@ void PairedAlignerContext::runIterationThreadImpl(Read **reads)
             }
 
             stats->totalReads += 2;
+            stats->totalBases += reads[0]->getDataLength() + reads[1]->getDataLength();
+
+            if (NULL == results || reads[0]->getBatch() != arenaBatch) {
+                //
+                // New batch: drop whatever the last one overflowed into and carve the buffers again at their slab sizes.
+                //
+                arenaBatch = reads[0]->getBatch();
+                arena->reset();
+
+                maxPairedSecondaryHits = initialPairedSecondaryHits;
+                maxSingleSecondaryHits = initialSingleSecondaryHits;
+                maxPairedCandidatesForAffineGap = initialPairedCandidatesForAffineGap;
+                maxSingleCandidatesForAffineGap = initialSingleCandidatesForAffineGap;
+
+                results = (PairedAlignmentResult *)arena->allocate((1 + maxPairedSecondaryHits) * sizeof(*results)); // 1 + is for the primary result
+                singleSecondaryResults = (SingleAlignmentResult *)arena->allocate(maxSingleSecondaryHits * sizeof(*singleSecondaryResults));
+                if (useAffineGap) {
+                    pairedCandidatesForAffineGap = (PairedAlignmentResult*)arena->allocate(maxPairedCandidatesForAffineGap * sizeof(*pairedCandidatesForAffineGap));
+                    singleCandidatesForAffineGap = (SingleAlignmentResult*)arena->allocate(maxSingleCandidatesForAffineGap * sizeof(*singleCandidatesForAffineGap));
+                }
+            }
 
             if (AlignerOptions::useHadoopErrorMessages && stats->totalReads % 10000 == 0 && timeInMillis() - lastReportTime > 10000) {
                 fprintf(stderr, "reporter:counter:SNAP,readsAligned,%llu\n", stats->totalReads - readsWhenLastReported);
@@ -701,6 +720,7 @@ void PairedAlignerContext::runIterationThreadImpl(Read **reads)
 
                 if (pass) {
                     if (NULL != readWriter) {
+                        PerfPhaseScope outputScope(perfCounters, PerfPhaseOutput);
                         readWriter->writePairs(readerContext, reads, &result, 1, NULL, nSingleResults, true, useAffineGap);
                     }
                     stats->uselessReads += 2;
@@ -713,9 +733,9 @@ void PairedAlignerContext::runIterationThreadImpl(Read **reads)
             }
 
 
-            _int64 startTime;
+            _int64 alignStartTimeInNanos;
             if (TIME_HISTOGRAM || options->attachAlignmentTimes) {
-                startTime = timeInNanos();
+                alignStartTimeInNanos = timeInNanos();
             }
 
             _int64 nSecondaryResults;
@@ -724,6 +744,14 @@ void PairedAlignerContext::runIterationThreadImpl(Read **reads)
             _int64 nSingleCandidatesForAffineGap[2];
             PairedAlignmentResult firstALTResult;
 
+            if (numaReplicas != NULL) {
+                if (GetCurrentNumaNode() == numaNode) {
+                    stats->numaLocalAlignments++;
+                } else {
+                    stats->numaRemoteAlignments++;
+                }
+            }
+
             while (!aligner->align(reads[0], reads[1], results, &firstALTResult, maxSecondaryAlignmentAdditionalEditDistance, maxPairedSecondaryHits, &nSecondaryResults, results + 1,
                 maxSingleSecondaryHits, maxSecondaryAlignments, &nSingleSecondaryResults[0], &nSingleSecondaryResults[1], singleSecondaryResults,
                 maxPairedCandidatesForAffineGap, &nPairedCandidatesForAffineGap, pairedCandidatesForAffineGap,
@@ -732,62 +760,43 @@ void PairedAlignerContext::runIterationThreadImpl(Read **reads)
                 _ASSERT(nSecondaryResults > maxPairedSecondaryHits || nSingleSecondaryResults[0] > maxSingleSecondaryHits ||
                     nPairedCandidatesForAffineGap > maxPairedCandidatesForAffineGap || nSingleCandidatesForAffineGap[0] > maxSingleCandidatesForAffineGap);
 
-                if (nSecondaryResults > maxPairedSecondaryHits) {
-                    if (reallocatedPairedSecondaryBuffer) {
-                        BigDealloc(results);
-                        results = NULL;
-                    }
+                //
+                // Overflowed even a whole slab.  Grow whichever buffer it was and realign.
+                //
+                stats->alignmentsRerun++;
 
+                if (nSecondaryResults > maxPairedSecondaryHits) {
+                    results = (PairedAlignmentResult*)arena->grow(results, (maxPairedSecondaryHits + 1) * sizeof(PairedAlignmentResult), (2 * maxPairedSecondaryHits + 1) * sizeof(PairedAlignmentResult));
                     maxPairedSecondaryHits *= 2;
-                    results = (PairedAlignmentResult*)BigAlloc((maxPairedSecondaryHits + 1) * sizeof(PairedAlignmentResult));
-                    reallocatedPairedSecondaryBuffer = true;
                 }
 
                 if (nSingleSecondaryResults[0] > maxSingleSecondaryHits) {
-                    if (reallocatedSingleSecondaryBuffer) {
-                        BigDealloc(singleSecondaryResults);
-                        singleSecondaryResults = NULL;
-                    }
-
+                    singleSecondaryResults = (SingleAlignmentResult*)arena->grow(singleSecondaryResults, maxSingleSecondaryHits * sizeof(SingleAlignmentResult), 2 * maxSingleSecondaryHits * sizeof(SingleAlignmentResult));
                     maxSingleSecondaryHits *= 2;
-                    singleSecondaryResults = (SingleAlignmentResult*)BigAlloc(maxSingleSecondaryHits * sizeof(SingleAlignmentResult));
-                    reallocatedSingleSecondaryBuffer = true;
                 }
 
                 if (nPairedCandidatesForAffineGap > maxPairedCandidatesForAffineGap) {
                     _ASSERT(useAffineGap);
-                    if (reallocatedPairedCandidatesForAffineGapBuffer) {
-                        BigDealloc(pairedCandidatesForAffineGap);
-                        pairedCandidatesForAffineGap = NULL;
-                    }
-
+                    pairedCandidatesForAffineGap = (PairedAlignmentResult*)arena->grow(pairedCandidatesForAffineGap, maxPairedCandidatesForAffineGap * sizeof(PairedAlignmentResult), 2 * maxPairedCandidatesForAffineGap * sizeof(PairedAlignmentResult));
                     maxPairedCandidatesForAffineGap *= 2;
-                    pairedCandidatesForAffineGap = (PairedAlignmentResult*)BigAlloc((maxPairedCandidatesForAffineGap) * sizeof(PairedAlignmentResult));
-                    reallocatedPairedCandidatesForAffineGapBuffer = true;
                 }
 
                 if (nSingleCandidatesForAffineGap[0] > maxSingleCandidatesForAffineGap) {
                     _ASSERT(useAffineGap);
-                    if (reallocatedSingleCandidatesForAffineGapBuffer) {
-                        BigDealloc(singleCandidatesForAffineGap);
-                        singleCandidatesForAffineGap = NULL;
-                    }
-
+                    singleCandidatesForAffineGap = (SingleAlignmentResult*)arena->grow(singleCandidatesForAffineGap, maxSingleCandidatesForAffineGap * sizeof(SingleAlignmentResult), 2 * maxSingleCandidatesForAffineGap * sizeof(SingleAlignmentResult));
                     maxSingleCandidatesForAffineGap *= 2;
-                    singleCandidatesForAffineGap = (SingleAlignmentResult*)BigAlloc(maxSingleCandidatesForAffineGap * sizeof(SingleAlignmentResult));
-                    reallocatedSingleCandidatesForAffineGapBuffer = true;
                 }
             }
 
             _int64 alignFinishedTime;
-            if (options->profile) {
+            if (timeStages) {
                 alignFinishedTime = timeInMillis();
                 stats->millisAligning += (alignFinishedTime - readFinishedTime);
             }
 
             _int64 runTime;
             if (TIME_HISTOGRAM || options->attachAlignmentTimes) {
-                runTime = timeInNanos() - startTime;
+                runTime = timeInNanos() - alignStartTimeInNanos;
 
                 if (options->attachAlignmentTimes) {
                     if (runTime > 0) {
@@ -872,6 +881,7 @@ void PairedAlignerContext::runIterationThreadImpl(Read **reads)
             }
 
             if (NULL != readWriter) {
+                PerfPhaseScope outputScope(perfCounters, PerfPhaseOutput);
                 readWriter->writePairs(readerContext, reads, results, nSecondaryResults + 1, singleResults, nSingleSecondaryResults, firstIsPrimary, useAffineGap);
 
                 if (emitALTAlignments && (firstALTResult.status[0] != NotFound || firstALTResult.status[1] != NotFound)) {
@@ -879,7 +889,7 @@ void PairedAlignerContext::runIterationThreadImpl(Read **reads)
                 }
             }
 
-            if (options->profile) {
+            if (timeStages) {
                 startTime = timeInMillis();
                 stats->millisWriting += (startTime - alignFinishedTime);
             }
@@ -931,25 +941,8 @@ void PairedAlignerContext::runIterationThreadImpl(Read **reads)
 
     allocator->checkCanaries();
 
-    if (reallocatedPairedSecondaryBuffer) {
-        BigDealloc(results);
-        results = NULL;
-    }
-
-    if (reallocatedSingleSecondaryBuffer) {
-        BigDealloc(singleSecondaryResults);
-        singleSecondaryResults = NULL;
-    }
-
-    if (reallocatedPairedCandidatesForAffineGapBuffer) {
-        BigDealloc(pairedCandidatesForAffineGap);
-        pairedCandidatesForAffineGap = NULL;
-    }
-
-    if (reallocatedSingleCandidatesForAffineGapBuffer) {
-        BigDealloc(singleCandidatesForAffineGap);
-        singleCandidatesForAffineGap = NULL;
-    }
+    recordArenaStats(arena);
+    delete arena;
 
     aligner->~ChimericPairedEndAligner();
     delete supplier;
@@ -1019,14 +1012,11 @@ PairedAlignerContext::typeSpecificBeginIteration()
     } else {
         //
         // We've got multiple inputs, so use a MultiInputReadSupplier to combine the individual inputs.
+        // The scheduler opens the inputs ahead of when they're needed and the per-thread suppliers spread their reading across them.
         //
-        PairedReadSupplierGenerator **generators = new PairedReadSupplierGenerator *[options->nInputs];
-        // use separate context for each supplier, initialized from common
-        for (int i = 0; i < options->nInputs; i++) {
-            ReaderContext context(readerContext);
-            generators[i] = options->inputs[i].createPairedReadSupplierGenerator(options->numThreads, quicklyDropUnpairedReads, context);
-        }
-        pairedReadSupplierGenerator = new MultiInputPairedReadSupplierGenerator(options->nInputs,generators);
+        inputScheduler = new InputScheduler(options->nInputs, options->inputs, options->numThreads, true, quicklyDropUnpairedReads, readerContext,
+            options->activeInputs, options->inputsToWarm);
+        pairedReadSupplierGenerator = new MultiInputPairedReadSupplierGenerator(inputScheduler);
     }
     ReaderContext* context = pairedReadSupplierGenerator->getContext();
     readerContext.header = context->header;
@@ -1054,5 +1044,6 @@ PairedAlignerContext::typeSpecificNextIteration()
         readerContext.rgLineOffsets = NULL;
     }
     delete pairedReadSupplierGenerator;
+    inputScheduler = NULL;
     pairedReadSupplierGenerator = NULL;
 }
@@ -28,6 +28,7 @@ Revision History:
 #include "AffineGap.h"
 #include "AffineGapVectorized.h"
 #include "Read.h"
+#include "PerfCounters.h"
 
 
 
@@ -77,6 +78,11 @@ public:
     {
     }
 
+    virtual void setPerfCounters(
+        PerfCounters            *perfCounters)
+    {
+    }
+
     virtual _int64 getLocationsScoredWithLandauVishkin() const = 0;   
     virtual _int64 getLocationsScoredWithAffineGap() const = 0;
 };
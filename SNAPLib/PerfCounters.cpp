@@ -0,0 +1,163 @@
+/*++
+
+Module Name:
+
+    PerfCounters.cpp
+
+Abstract:
+
+    Per-thread hardware performance counters, attributed to the phases of aligning a read.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+
+--*/
+
+#include "stdafx.h"
+#include "PerfCounters.h"
+#include "Error.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif // __linux__
+
+const char *PerfCounters::PhaseNames[NPerfPhases] = {"other", "seed lookup", "candidate scoring", "affine gap", "output"};
+const char *PerfCounters::EventNames[NPerfEvents] = {"task ms", "cycles", "LLC misses", "dTLB misses", "branch misses"};
+
+PerfCounters::PerfCounters() : groupFd(-1), nSlots(0), currentPhase(PerfPhaseOther)
+{
+    for (int event = 0; event < NPerfEvents; event++) {
+        eventFds[event] = -1;
+        slotOfEvent[event] = -1;
+        lastValues[event] = 0;
+    }
+
+    memset(counts, 0, sizeof(counts));
+}
+
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+    for (int event = 0; event < NPerfEvents; event++) {
+        if (eventFds[event] != -1) {
+            close(eventFds[event]);
+        }
+    }
+#endif // __linux__
+}
+
+#ifdef __linux__
+
+    bool
+PerfCounters::open()
+{
+    static const struct {
+        _uint32 type;
+        _uint64 config;
+    } events[NPerfEvents] = {
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    };
+
+    for (int event = 0; event < NPerfEvents; event++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[event].type;
+        attr.config = events[event].config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;    // Needed at the default perf_event_paranoid setting, and keeps our own read() calls out of the counts
+        attr.exclude_hv = 1;
+
+        //
+        // pid 0 and cpu -1 means this thread, on whatever processor it runs.
+        //
+        int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+        if (fd == -1) {
+            continue;
+        }
+
+        if (groupFd == -1) {
+            groupFd = fd;
+        }
+        eventFds[event] = fd;
+        slotOfEvent[event] = nSlots;
+        nSlots++;
+    }
+
+    if (groupFd == -1) {
+        return false;
+    }
+
+    //
+    // Start with a baseline so the first phase only gets what happens after this.
+    //
+    currentPhase = PerfPhaseOther;
+    charge();
+    memset(counts, 0, sizeof(counts));
+
+    return true;
+}
+
+    void
+PerfCounters::charge()
+{
+    if (groupFd == -1) {
+        return;
+    }
+
+    _uint64 buffer[1 + NPerfEvents];   // The number of events followed by their values, in the order they joined the group
+    if (read(groupFd, buffer, sizeof(buffer)) < (ssize_t)((1 + nSlots) * sizeof(_uint64))) {
+        return;
+    }
+
+    for (int event = 0; event < NPerfEvents; event++) {
+        int slot = slotOfEvent[event];
+        if (slot >= 0) {
+            counts[currentPhase][event] += buffer[1 + slot] - lastValues[slot];
+            lastValues[slot] = buffer[1 + slot];
+        }
+    }
+}
+
+#else   // __linux__
+
+    bool
+PerfCounters::open()
+{
+    return false;   // perf_event_open is Linux only
+}
+
+    void
+PerfCounters::charge()
+{
+}
+
+#endif  // __linux__
+
+    void
+PerfCounters::addTo(_int64 totals[NPerfPhases][NPerfEvents], _int64 threadsWithEvent[NPerfEvents])
+{
+    charge();
+
+    for (int event = 0; event < NPerfEvents; event++) {
+        if (!isEventAvailable((PerfEvent)event)) {
+            continue;
+        }
+
+        threadsWithEvent[event]++;
+        for (int phase = 0; phase < NPerfPhases; phase++) {
+            totals[phase][event] += counts[phase][event];
+        }
+    }
+
+    memset(counts, 0, sizeof(counts));
+}
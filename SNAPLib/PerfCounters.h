@@ -0,0 +1,122 @@
+/*++
+
+Module Name:
+
+    PerfCounters.h
+
+Abstract:
+
+    Per-thread hardware performance counters, attributed to the phases of aligning a read.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+//
+// The phases we attribute counts to.  Anything that happens while no phase is active (reading input, the aligners'
+// own bookkeeping) is charged to PerfPhaseOther.
+//
+enum PerfPhase {PerfPhaseOther, PerfPhaseSeedLookup, PerfPhaseScoring, PerfPhaseAffineGap, PerfPhaseOutput, NPerfPhases};
+
+//
+// What we count.  Task clock is a software event, so it works even where the hardware counters aren't exposed (most VMs
+// and containers); it also serves as the group leader so that the hardware events are read all at once.
+//
+enum PerfEvent {PerfEventTaskClock, PerfEventCycles, PerfEventLLCMisses, PerfEventDTLBMisses, PerfEventBranchMisses, NPerfEvents};
+
+//
+// A group of perf_event_open counters for the calling thread.  Rather than nesting timers, we keep a current phase and
+// charge everything counted since the last switch to it whenever the phase changes, so a phase that calls into another
+// (like candidate scoring that falls back to affine gap) only gets its own share.  Each switch costs one read() system
+// call, which is why this is opt-in (-perf).  Linux only; open() fails elsewhere.
+//
+class PerfCounters
+{
+public:
+    PerfCounters();
+    ~PerfCounters();
+
+    //
+    // Open the counters for the calling thread.  Returns false if none of them could be opened.  Events that aren't
+    // supported on this machine are left out individually; isEventAvailable() says which ones we got.
+    //
+    bool open();
+
+    bool isEventAvailable(PerfEvent event) const {
+        return slotOfEvent[event] >= 0;
+    }
+
+    //
+    // Make phase the current one and return the phase that was current before.
+    //
+    inline PerfPhase enterPhase(PerfPhase phase) {
+        PerfPhase previousPhase = currentPhase;
+        if (phase != currentPhase) {
+            charge();
+            currentPhase = phase;
+        }
+        return previousPhase;
+    }
+
+    //
+    // Add this thread's counts into the per-phase totals, and count this thread for each event it had.
+    //
+    void addTo(_int64 totals[NPerfPhases][NPerfEvents], _int64 threadsWithEvent[NPerfEvents]);
+
+    static const char *PhaseNames[NPerfPhases];
+    static const char *EventNames[NPerfEvents];
+
+private:
+
+    void charge();
+
+    int         groupFd;
+    int         eventFds[NPerfEvents];
+    int         slotOfEvent[NPerfEvents];   // Position in the group read, or -1 if we don't have the event
+    int         nSlots;
+    _uint64     lastValues[NPerfEvents];    // Indexed by slot
+    _int64      counts[NPerfPhases][NPerfEvents];
+    PerfPhase   currentPhase;
+};
+
+//
+// Runs the enclosing block in a phase, putting back the previous phase on the way out.  Does nothing when counters is NULL,
+// which is the case unless -perf was specified.  The one argument form doesn't switch until enter() is called, for blocks
+// that often finish without doing the work the phase is for; that saves the two system calls a switch costs.
+//
+class PerfPhaseScope
+{
+public:
+    PerfPhaseScope(PerfCounters *i_counters, PerfPhase phase) : counters(i_counters), entered(false) {
+        enter(phase);
+    }
+
+    PerfPhaseScope(PerfCounters *i_counters) : counters(i_counters), entered(false) {}
+
+    inline void enter(PerfPhase phase) {
+        if (NULL != counters && !entered) {
+            previousPhase = counters->enterPhase(phase);
+            entered = true;
+        }
+    }
+
+    ~PerfPhaseScope() {
+        if (entered) {
+            counters->enterPhase(previousPhase);
+        }
+    }
+
+private:
+    PerfCounters    *counters;
+    PerfPhase        previousPhase;
+    bool             entered;
+};
@@ -0,0 +1,648 @@
+/*++
+
+Module Name:
+
+    PipeReadSupplier.cpp
+
+Abstract:
+
+    Code for reading text input (FASTQ, interleaved FASTQ and SAM) from a pipe with all of the aligner threads parsing.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+
+--*/
+
+#include "stdafx.h"
+#include "Compat.h"
+#include "BigAlloc.h"
+#include "PipeReadSupplier.h"
+#include "FASTQ.h"
+#include "SAM.h"
+#include "Error.h"
+#include "exit.h"
+
+//
+// A DataReader that serves whole chunks from a PipeInput, taking a new one each time its consumer moves on
+// to the next batch.  Since the chunks end on record boundaries there's never any overflow into the next one.
+//
+class PipeDataReader : public DataReader
+{
+public:
+    PipeDataReader(PipeInput *i_input) : input(i_input), chunk(-1), started(false), buffer(NULL), validBytes(0), offset(0),
+        streamOffset(0), batchID(0), isLast(false) {}
+
+    virtual ~PipeDataReader()
+    {
+        if (-1 != chunk) {
+            input->finishChunk(chunk);
+        }
+    }
+
+    virtual bool init(const char* fileName)
+    {
+        if (strcmp(fileName, "-")) {
+            WriteErrorMessage("PipeDataReader: must have filename of '-', got '%s'\n", fileName);
+            soft_exit(1);
+        }
+        return true;
+    }
+
+    virtual char* readHeader(_int64* io_headerSize);
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+    virtual bool getData(char** o_buffer, _int64* o_validBytes, _int64* o_startBytes = NULL);
+
+    virtual void advance(_int64 bytes)
+    { offset += __min(validBytes - offset, __max((_int64)0, bytes)); }
+
+    virtual void nextBatch()
+    { takeNextChunk(); }
+
+    virtual bool isEOF()
+    { return -1 == chunk || isLast; }
+
+    virtual DataBatch getBatch()
+    { return DataBatch(batchID); }
+
+    virtual void holdBatch(DataBatch batch)
+    { input->holdBatch(batch); }
+
+    virtual bool releaseBatch(DataBatch batch)
+    { return input->releaseBatch(batch); }
+
+    virtual _int64 getFileOffset()
+    { return streamOffset + offset; }
+
+    virtual void getExtra(char** o_extra, _int64* o_length)
+    {
+        *o_extra = NULL;
+        *o_length = 0;
+    }
+
+    virtual const char* getFilename()
+    { return "-"; }
+
+private:
+
+    void takeNextChunk();
+
+    PipeInput  *input;
+    int         chunk;      // -1 if we don't have one
+    bool        started;
+    char       *buffer;
+    _int64      validBytes;
+    _int64      offset;
+    _int64      streamOffset;
+    _uint32     batchID;
+    bool        isLast;
+};
+
+    void
+PipeDataReader::takeNextChunk()
+{
+    if (-1 != chunk) {
+        input->finishChunk(chunk);
+    }
+
+    started = true;
+    offset = 0;
+    chunk = input->claimChunk();
+    if (-1 == chunk) {
+        buffer = NULL;
+        validBytes = 0;
+        isLast = true;
+        return;
+    }
+
+    input->getChunk(chunk, &buffer, &validBytes, &streamOffset, &batchID, &isLast);
+}
+
+    char *
+PipeDataReader::readHeader(_int64* io_headerSize)
+{
+    static char emptyHeader[1] = {0};
+
+    if (!started) {
+        takeNextChunk();
+    }
+
+    //
+    // Only the reader that got the first chunk sees the header; the rest get nothing.
+    //
+    if (-1 == chunk || 0 != streamOffset) {
+        *io_headerSize = 0;
+        return emptyHeader;
+    }
+
+    *io_headerSize = __min(*io_headerSize, validBytes);
+    return buffer;
+}
+
+    void
+PipeDataReader::reinit(_int64 startingOffset, _int64 amountOfFileToProcess)
+{
+    if (0 != amountOfFileToProcess) {
+        WriteErrorMessage("PipeDataReader: can't read a range from a pipe (%lld, %lld)\n", startingOffset, amountOfFileToProcess);
+        soft_exit(1);
+    }
+
+    if (!started) {
+        takeNextChunk();
+    }
+
+    //
+    // The only seek that makes sense is past the header in the first chunk.  Anything else starts at the beginning
+    // of whatever chunk we have, which is where its first record starts.
+    //
+    if (-1 != chunk && startingOffset >= streamOffset && startingOffset <= streamOffset + validBytes) {
+        offset = startingOffset - streamOffset;
+    } else {
+        offset = 0;
+    }
+}
+
+    bool
+PipeDataReader::getData(char** o_buffer, _int64* o_validBytes, _int64* o_startBytes)
+{
+    if (-1 == chunk || offset >= validBytes) {
+        return false;
+    }
+
+    *o_buffer = buffer + offset;
+    *o_validBytes = validBytes - offset;
+    if (NULL != o_startBytes) {
+        *o_startBytes = validBytes - offset;
+    }
+    return true;
+}
+
+class PipeDataSupplier : public DataSupplier
+{
+public:
+    PipeDataSupplier(PipeInput *i_input) : input(i_input) {}
+
+    virtual DataReader* getDataReader(int bufferCount, _int64 overflowBytes, double extraFactor, size_t bufferSpace)
+    { return new PipeDataReader(input); }
+
+private:
+    PipeInput *input;
+};
+
+static bool StdinUsed = false;
+
+PipeInput::PipeInput(int i_linesPerRecord, bool i_hasSAMHeader, int numThreads) :
+    linesPerRecord(i_linesPerRecord), hasSAMHeader(i_hasSAMHeader), nextBatchToRead(1), nextBatchToClaim(1), allChunksRead(false),
+    shuttingDown(false), carryBytes(0)
+{
+    if (StdinUsed) {
+        WriteErrorMessage("You can only use stdin input for one run per execution of SNAP (i.e., if you use ',' to run SNAP more than once without reloading the index, you can only use stdin once)\n");
+        soft_exit_no_print(1);
+    }
+    StdinUsed = true;
+
+#ifdef _MSC_VER
+    if (-1 == _setmode(_fileno(stdin), _O_BINARY)) {
+        WriteErrorMessage("PipeInput: unable to put stdin into untranslated mode\n");
+        soft_exit(1);
+    }
+#endif // _MSC_VER
+
+    //
+    // Enough for each thread to have one in hand and a few read ahead.
+    //
+    nChunks = __max(numThreads, 1) + 4;
+    chunks = new Chunk[nChunks];
+    for (int i = 0; i < nChunks; i++) {
+        chunks[i].bufferSize = ChunkSize;
+        chunks[i].buffer = (char *)BigAlloc(chunks[i].bufferSize + 1);   // +1 for the terminating null that the parsers expect
+        chunks[i].validBytes = 0;
+        chunks[i].streamOffset = 0;
+        chunks[i].batchID = 0;
+        chunks[i].state = Free;
+        chunks[i].refs = 0;
+        chunks[i].isLast = false;
+    }
+
+    carryBufferSize = ChunkSize;
+    carryBuffer = (char *)BigAlloc(carryBufferSize);
+
+    InitializeExclusiveLock(&lock);
+    CreateEventObject(&chunkReady);
+    CreateEventObject(&chunkFree);
+    AllowEventWaitersToProceed(&chunkFree);
+    if (!CreateSingleWaiterObject(&readerFinished)) {
+        WriteErrorMessage("PipeInput: unable to create waiter\n");
+        soft_exit(1);
+    }
+
+    dataSupplier = new PipeDataSupplier(this);
+
+    if (!StartNewThread(ReaderThreadMain, this)) {
+        WriteErrorMessage("PipeInput: unable to start reader thread\n");
+        soft_exit(1);
+    }
+}
+
+PipeInput::~PipeInput()
+{
+    AcquireExclusiveLock(&lock);
+    shuttingDown = true;
+    AllowEventWaitersToProceed(&chunkFree);
+    ReleaseExclusiveLock(&lock);
+
+    WaitForSingleWaiterObject(&readerFinished);
+
+    for (int i = 0; i < nChunks; i++) {
+        BigDealloc(chunks[i].buffer);
+    }
+    delete [] chunks;
+    BigDealloc(carryBuffer);
+
+    delete dataSupplier;
+
+    DestroyExclusiveLock(&lock);
+    DestroyEventObject(&chunkReady);
+    DestroyEventObject(&chunkFree);
+    DestroySingleWaiterObject(&readerFinished);
+}
+
+    void
+PipeInput::ReaderThreadMain(void *param)
+{
+    ((PipeInput *)param)->readerThread();
+}
+
+    void
+PipeInput::readerThread()
+{
+    _int64 streamOffset = 0;
+    bool hitEOF = false;
+
+    while (!hitEOF) {
+        //
+        // Get a free chunk.
+        //
+        AcquireExclusiveLock(&lock);
+        Chunk *chunk = NULL;
+        for (;;) {
+            if (shuttingDown) {
+                break;
+            }
+
+            for (int i = 0; i < nChunks; i++) {
+                if (chunks[i].state == Free) {
+                    chunk = &chunks[i];
+                    break;
+                }
+            }
+
+            if (NULL != chunk) {
+                break;
+            }
+
+            PreventEventWaitersFromProceeding(&chunkFree);
+            ReleaseExclusiveLock(&lock);
+            WaitForEvent(&chunkFree);
+            AcquireExclusiveLock(&lock);
+        }
+
+        if (NULL == chunk) {
+            ReleaseExclusiveLock(&lock);
+            break;
+        }
+        chunk->state = Filling;
+        ReleaseExclusiveLock(&lock);
+
+        //
+        // Start with whatever was left over from the last chunk, and then fill it until we have at least one whole record.
+        //
+        if (carryBytes > chunk->bufferSize) {
+            BigDealloc(chunk->buffer);
+            chunk->bufferSize = carryBufferSize;
+            chunk->buffer = (char *)BigAlloc(chunk->bufferSize + 1);
+        }
+        memcpy(chunk->buffer, carryBuffer, carryBytes);
+        size_t filled = carryBytes;
+        size_t boundary;
+
+        for (;;) {
+            if (filled == chunk->bufferSize) {
+                //
+                // A record (or SAM header) that's bigger than the chunk.  Make the chunk bigger.
+                //
+                char *newBuffer = (char *)BigAlloc(chunk->bufferSize * 2 + 1);
+                memcpy(newBuffer, chunk->buffer, filled);
+                BigDealloc(chunk->buffer);
+                chunk->buffer = newBuffer;
+                chunk->bufferSize *= 2;
+            }
+
+            size_t amountToRead = chunk->bufferSize - filled;
+            size_t bytesRead = fread(chunk->buffer + filled, 1, amountToRead, stdin);
+            filled += bytesRead;
+
+            if (bytesRead != amountToRead) {
+                if (!feof(stdin)) {
+                    WriteErrorMessage("PipeInput: Error reading stdin (but not EOF).\n");
+                    soft_exit(1);
+                }
+                hitEOF = true;
+            }
+
+            chunk->validBytes = filled;
+            boundary = hitEOF ? filled : findLastRecordBoundary(chunk, 0 == streamOffset);
+            if (0 != boundary || hitEOF) {
+                break;
+            }
+        }
+
+        //
+        // Save the partial record at the end for the next chunk.
+        //
+        carryBytes = filled - boundary;
+        if (carryBytes > carryBufferSize) {
+            BigDealloc(carryBuffer);
+            carryBufferSize = chunk->bufferSize;
+            carryBuffer = (char *)BigAlloc(carryBufferSize);
+        }
+        memcpy(carryBuffer, chunk->buffer + boundary, carryBytes);
+
+        chunk->validBytes = boundary;
+        chunk->buffer[boundary] = '\0';
+        chunk->isLast = hitEOF;
+
+        AcquireExclusiveLock(&lock);
+        if (0 == chunk->validBytes) {
+            chunk->state = Free;
+        } else {
+            chunk->streamOffset = streamOffset;
+            chunk->batchID = nextBatchToRead++;
+            chunk->state = Ready;
+            streamOffset += chunk->validBytes;
+        }
+        if (hitEOF) {
+            allChunksRead = true;
+        }
+        AllowEventWaitersToProceed(&chunkReady);
+        ReleaseExclusiveLock(&lock);
+    }
+
+    AcquireExclusiveLock(&lock);
+    allChunksRead = true;
+    AllowEventWaitersToProceed(&chunkReady);
+    ReleaseExclusiveLock(&lock);
+
+    SignalSingleWaiterObject(&readerFinished);
+}
+
+    size_t
+PipeInput::findLastRecordBoundary(Chunk *chunk, bool isFirstChunk)
+{
+    char *buffer = chunk->buffer;
+    char *end = buffer + chunk->validBytes;
+    char *scan = buffer;
+
+    if (hasSAMHeader && isFirstChunk) {
+        //
+        // The first chunk has to have all of the header so that one reader can parse it.  Skip over the
+        // header lines; if we don't see the end of them there's no boundary yet.
+        //
+        while (scan < end && '@' == *scan) {
+            char *newLine = (char *)memchr(scan, '\n', end - scan);
+            if (NULL == newLine) {
+                return 0;
+            }
+            scan = newLine + 1;
+        }
+
+        if (scan == end) {
+            return 0;
+        }
+    }
+
+    //
+    // Every chunk starts on a record boundary, so count lines from the start.
+    //
+    char *lastBoundary = buffer;
+    int linesInRecord = 0;
+    while (scan < end) {
+        char *newLine = (char *)memchr(scan, '\n', end - scan);
+        if (NULL == newLine) {
+            break;
+        }
+        scan = newLine + 1;
+        if (++linesInRecord == linesPerRecord) {
+            linesInRecord = 0;
+            lastBoundary = scan;
+        }
+    }
+
+    return lastBoundary - buffer;
+}
+
+    int
+PipeInput::claimChunk()
+{
+    AcquireExclusiveLock(&lock);
+    for (;;) {
+        for (int i = 0; i < nChunks; i++) {
+            if (chunks[i].state == Ready && chunks[i].batchID == nextBatchToClaim) {
+                chunks[i].state = Claimed;
+                chunks[i].refs = 1;
+                nextBatchToClaim++;
+                ReleaseExclusiveLock(&lock);
+                return i;
+            }
+        }
+
+        if (allChunksRead) {
+            ReleaseExclusiveLock(&lock);
+            return -1;
+        }
+
+        PreventEventWaitersFromProceeding(&chunkReady);
+        ReleaseExclusiveLock(&lock);
+        _int64 start = timeInNanos();
+        WaitForEvent(&chunkReady);
+        InterlockedAdd64AndReturnNewValue(&DataReader::ReadWaitTime, timeInNanos() - start);
+        AcquireExclusiveLock(&lock);
+    }
+}
+
+    void
+PipeInput::getChunk(int chunk, char **o_buffer, _int64 *o_validBytes, _int64 *o_streamOffset, _uint32 *o_batchID, bool *o_isLast)
+{
+    _ASSERT(chunk >= 0 && chunk < nChunks && chunks[chunk].state == Claimed);
+    *o_buffer = chunks[chunk].buffer;
+    *o_validBytes = chunks[chunk].validBytes;
+    *o_streamOffset = chunks[chunk].streamOffset;
+    *o_batchID = chunks[chunk].batchID;
+    *o_isLast = chunks[chunk].isLast;
+}
+
+    void
+PipeInput::unreference(Chunk *chunk)
+{
+    AssertExclusiveLockHeld(&lock);
+    _ASSERT(chunk->state == Claimed && chunk->refs > 0);
+    chunk->refs--;
+    if (0 == chunk->refs) {
+        chunk->state = Free;
+        AllowEventWaitersToProceed(&chunkFree);
+    }
+}
+
+    void
+PipeInput::finishChunk(int chunk)
+{
+    AcquireExclusiveLock(&lock);
+    unreference(&chunks[chunk]);
+    ReleaseExclusiveLock(&lock);
+}
+
+    PipeInput::Chunk *
+PipeInput::findChunkForBatch(DataBatch batch)
+{
+    for (int i = 0; i < nChunks; i++) {
+        if (chunks[i].state == Claimed && chunks[i].batchID == batch.batchID) {
+            return &chunks[i];
+        }
+    }
+    return NULL;
+}
+
+    void
+PipeInput::holdBatch(DataBatch batch)
+{
+    AcquireExclusiveLock(&lock);
+    Chunk *chunk = findChunkForBatch(batch);
+    _ASSERT(NULL != chunk);
+    if (NULL != chunk) {
+        chunk->refs++;
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+    bool
+PipeInput::releaseBatch(DataBatch batch)
+{
+    AcquireExclusiveLock(&lock);
+    Chunk *chunk = findChunkForBatch(batch);
+    bool released = true;
+    if (NULL != chunk) {
+        unreference(chunk);
+        released = chunk->state == Free;
+    }
+    ReleaseExclusiveLock(&lock);
+    return released;
+}
+
+//
+// The per-thread suppliers just wrap a reader of their own.
+//
+class PipeReadSupplier : public ReadSupplier {
+public:
+    PipeReadSupplier(ReadReader *i_reader) : reader(i_reader) {}
+    ~PipeReadSupplier() {delete reader;}
+
+    Read *getNextRead()
+    { return reader->getNextRead(&read) ? &read : NULL; }
+
+    virtual void holdBatch(DataBatch batch)
+    { reader->holdBatch(batch); }
+
+    virtual bool releaseBatch(DataBatch batch)
+    { return reader->releaseBatch(batch); }
+
+private:
+    ReadReader *reader;
+    Read        read;
+};
+
+class PipePairedReadSupplier : public PairedReadSupplier {
+public:
+    PipePairedReadSupplier(PairedReadReader *i_reader) : reader(i_reader) {}
+    ~PipePairedReadSupplier() {delete reader;}
+
+    virtual bool getNextReadPair(Read **read0, Read **read1)
+    {
+        *read0 = &internalRead0;
+        *read1 = &internalRead1;
+        return reader->getNextReadPair(&internalRead0, &internalRead1);
+    }
+
+    virtual void holdBatch(DataBatch batch)
+    { reader->holdBatch(batch); }
+
+    virtual bool releaseBatch(DataBatch batch)
+    { return reader->releaseBatch(batch); }
+
+private:
+    PairedReadReader   *reader;
+    Read                internalRead0;
+    Read                internalRead1;
+};
+
+PipeReadSupplierGenerator::PipeReadSupplierGenerator(bool i_isSAM, int numThreads, const ReaderContext& i_context) :
+    isSAM(i_isSAM), context(i_context), firstReader(NULL)
+{
+    InitializeExclusiveLock(&lock);
+    input = new PipeInput(isSAM ? 1 : 4, isSAM, numThreads);
+
+    if (isSAM) {
+        //
+        // Parse the header now, so that we can hand it to the rest of the readers (and the output) in the context.
+        //
+        firstReader = SAMReader::create(input->getDataSupplier(), "-", 2, context, 0, 0);
+        context = *firstReader->getContext();
+    }
+}
+
+PipeReadSupplierGenerator::~PipeReadSupplierGenerator()
+{
+    delete firstReader;
+    delete input;
+    DestroyExclusiveLock(&lock);
+}
+
+    ReadSupplier *
+PipeReadSupplierGenerator::generateNewReadSupplier()
+{
+    AcquireExclusiveLock(&lock);
+    ReadReader *reader = firstReader;
+    firstReader = NULL;
+    ReleaseExclusiveLock(&lock);
+
+    if (NULL == reader) {
+        if (isSAM) {
+            reader = SAMReader::create(input->getDataSupplier(), "-", 2, context, context.headerBytes, 0);
+        } else {
+            reader = FASTQReader::create(input->getDataSupplier(), "-", 2, 0, 0, context);
+        }
+    }
+
+    return new PipeReadSupplier(reader);
+}
+
+PipePairedReadSupplierGenerator::PipePairedReadSupplierGenerator(int numThreads, const ReaderContext& i_context) :
+    context(i_context)
+{
+    input = new PipeInput(8, false, numThreads);  // Keep both halves of each pair in the same chunk
+}
+
+PipePairedReadSupplierGenerator::~PipePairedReadSupplierGenerator()
+{
+    delete input;
+}
+
+    PairedReadSupplier *
+PipePairedReadSupplierGenerator::generateNewPairedReadSupplier()
+{
+    return new PipePairedReadSupplier(PairedInterleavedFASTQReader::create(input->getDataSupplier(), "-", 2, 0, 0, context));
+}
@@ -0,0 +1,139 @@
+/*++
+
+Module Name:
+
+    PipeReadSupplier.h
+
+Abstract:
+
+    Headers for reading text input (FASTQ, interleaved FASTQ and SAM) from a pipe with all of the aligner threads parsing.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+
+--*/
+
+#pragma once
+#include "Read.h"
+#include "Compat.h"
+#include "DataReader.h"
+
+//
+// Stdin can't be split into ranges the way a file can, so normally it goes through a single reader feeding a
+// ReadSupplierQueue, which means that one thread does all of the parsing.  PipeInput instead has a dedicated
+// thread that does nothing but read the pipe into a ring of large chunks.  It cuts each chunk at a record
+// boundary (it knows how many lines make up a record, so it doesn't have to guess the way the range splitter
+// does), carrying the partial record at the end over into the next chunk.  Each aligner thread has its own
+// parser that takes whole chunks from the ring as it needs them, so the parsing runs in parallel.
+//
+// Each chunk is one DataBatch, with batch IDs assigned in stream order.  A chunk goes back to the reading thread
+// once the parser that took it has moved on and all holds on its batch are released.
+//
+class PipeInput {
+public:
+    //
+    // linesPerRecord is 4 for FASTQ, 8 for interleaved paired FASTQ (so that pairs stay together) and 1 for SAM.
+    // If hasSAMHeader is set the first chunk is extended to include all of the header lines.
+    //
+    PipeInput(int i_linesPerRecord, bool i_hasSAMHeader, int numThreads);
+    ~PipeInput();
+
+    //
+    // Take the next chunk in stream order, waiting for it to be read if necessary.  Returns -1 at the end
+    // of the input.
+    //
+    int claimChunk();
+
+    // The parser that claimed the chunk is done with it.
+    void finishChunk(int chunk);
+
+    void getChunk(int chunk, char **o_buffer, _int64 *o_validBytes, _int64 *o_streamOffset, _uint32 *o_batchID, bool *o_isLast);
+
+    void holdBatch(DataBatch batch);
+    bool releaseBatch(DataBatch batch);
+
+    // Returns a DataSupplier whose readers take their data from this input.  It belongs to the PipeInput.
+    DataSupplier *getDataSupplier() {return dataSupplier;}
+
+    static const size_t ChunkSize = 4 * 1024 * 1024;
+
+private:
+
+    enum ChunkState {Free, Filling, Ready, Claimed};
+
+    struct Chunk {
+        char           *buffer;
+        size_t          bufferSize;
+        size_t          validBytes;
+        _int64          streamOffset;
+        _uint32         batchID;
+        ChunkState      state;
+        int             refs;       // One for the parser that claimed it, plus any holds on its batch
+        bool            isLast;
+    };
+
+    static void ReaderThreadMain(void *param);
+    void readerThread();
+
+    // Returns the index of the byte just past the last whole record in the chunk, or 0 if there isn't one.
+    size_t findLastRecordBoundary(Chunk *chunk, bool isFirstChunk);
+
+    // must hold the lock to call
+    Chunk *findChunkForBatch(DataBatch batch);
+    void unreference(Chunk *chunk);
+
+    const int           linesPerRecord;
+    const bool          hasSAMHeader;
+
+    int                 nChunks;
+    Chunk              *chunks;
+
+    char               *carryBuffer;        // The partial record at the end of the last chunk read
+    size_t              carryBufferSize;
+    size_t              carryBytes;
+
+    _uint32             nextBatchToRead;
+    _uint32             nextBatchToClaim;
+    bool                allChunksRead;
+    bool                shuttingDown;
+
+    ExclusiveLock       lock;
+    EventObject         chunkReady;
+    EventObject         chunkFree;
+    SingleWaiterObject  readerFinished;
+
+    DataSupplier       *dataSupplier;
+};
+
+class PipeReadSupplierGenerator : public ReadSupplierGenerator {
+public:
+    PipeReadSupplierGenerator(bool i_isSAM, int numThreads, const ReaderContext& i_context);
+    ~PipeReadSupplierGenerator();
+
+    ReadSupplier *generateNewReadSupplier();
+    ReaderContext* getContext() {return &context;}
+
+private:
+    const bool          isSAM;
+    PipeInput          *input;
+    ReaderContext       context;
+    ReadReader         *firstReader;    // For SAM, the reader that parsed the header, which is given to the first supplier
+    ExclusiveLock       lock;
+};
+
+class PipePairedReadSupplierGenerator : public PairedReadSupplierGenerator {
+public:
+    PipePairedReadSupplierGenerator(int numThreads, const ReaderContext& i_context);
+    ~PipePairedReadSupplierGenerator();
+
+    PairedReadSupplier *generateNewPairedReadSupplier();
+    ReaderContext* getContext() {return &context;}
+
+private:
+    PipeInput          *input;
+    ReaderContext       context;
+};
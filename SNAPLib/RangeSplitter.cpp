@@ -117,7 +117,7 @@ RangeSplittingReadSupplierGenerator::RangeSplittingReadSupplierGenerator(
 	//
 	_int64 headerSize;
 	if (isSAM) {
-		SAMReader *reader = SAMReader::create(DataSupplier::Default, fileName, ReadSupplierQueue::BufferCount(numThreads), context, 0, 0);
+		SAMReader *reader = SAMReader::create(DataSupplier::Input(context.useIoUring, context.directIo), fileName, ReadSupplierQueue::BufferCount(numThreads), context, 0, 0);
 		if (!reader) {
 			WriteErrorMessage("Unable to create reader for SAM file '%s'\n", fileName);
 			soft_exit(1);
@@ -144,9 +144,9 @@ RangeSplittingReadSupplierGenerator::generateNewReadSupplier()
     ReadReader *underlyingReader;
     // todo: implement layered factory model
     if (isSAM) {
-        underlyingReader = SAMReader::create(DataSupplier::Default, fileName, 2, context, rangeStart, rangeLength);
+        underlyingReader = SAMReader::create(DataSupplier::Input(context.useIoUring, context.directIo), fileName, 2, context, rangeStart, rangeLength);
     } else {
-        underlyingReader = FASTQReader::create(DataSupplier::Default, fileName, 2, rangeStart, rangeLength, context);
+        underlyingReader = FASTQReader::create(DataSupplier::Input(context.useIoUring, context.directIo), fileName, 2, rangeStart, rangeLength, context);
     }
     return new RangeSplittingReadSupplier(splitter,underlyingReader);
 }
@@ -239,15 +239,15 @@ RangeSplittingPairedReadSupplierGenerator::generateNewPairedReadSupplier()
     PairedReadReader *underlyingReader;
     switch (fileType) {
     case SAMFile:
-         underlyingReader = SAMReader::createPairedReader(DataSupplier::Default, fileName1, 2, rangeStart, rangeLength, quicklyDropUnpairedReads, context);
+         underlyingReader = SAMReader::createPairedReader(DataSupplier::Input(context.useIoUring, context.directIo), fileName1, 2, rangeStart, rangeLength, quicklyDropUnpairedReads, context);
          break;
 
     case FASTQFile:
-         underlyingReader = PairedFASTQReader::create(DataSupplier::Default, fileName1, fileName2, 2, rangeStart, rangeLength, context);
+         underlyingReader = PairedFASTQReader::create(DataSupplier::Input(context.useIoUring, context.directIo), fileName1, fileName2, 2, rangeStart, rangeLength, context);
          break;
 
     case InterleavedFASTQFile:
-        underlyingReader = PairedInterleavedFASTQReader::create(DataSupplier::Default, fileName1, 2, rangeStart, rangeLength, context);
+        underlyingReader = PairedInterleavedFASTQReader::create(DataSupplier::Input(context.useIoUring, context.directIo), fileName1, 2, rangeStart, rangeLength, context);
         break;
 
     default:
@@ -126,6 +126,8 @@ struct ReaderContext
     char*               rgLines;
     size_t*             rgLineOffsets;
     int                 numRGLines;
+    bool                useIoUring;     // read the input files through io_uring (-iou), with O_DIRECT (-iod)
+    bool                directIo;
 };
 
 class ReadReader {
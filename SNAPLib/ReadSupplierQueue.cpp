@@ -30,6 +30,8 @@ Revision History:
 
 //#define PAIR_MATCH_DEBUG
 
+volatile _int64 ReadSupplierQueue::ReadyElements = 0;
+
  ReadSupplierQueue::ReadSupplierQueue(ReadReader *reader)
      : tracker(64)
 {
@@ -230,6 +232,7 @@ ReadSupplierQueue::getElement()
     ReadQueueElement *element = readyQueue[0].next;
     _ASSERT(element != &readyQueue[0]);
     element->removeFromQueue();
+    InterlockedAdd64AndReturnNewValue(&ReadyElements, -1);
 
     if (!areAnyReadsReady() && !allReadsQueued) {
         //WriteErrorMessage("Thread %u: getElement block readsReady\n", GetThreadId());
@@ -282,6 +285,7 @@ ReadSupplierQueue::getElements(ReadQueueElement **element1, ReadQueueElement **e
     if ((*element1)->totalReads == (*element2)->totalReads) {
         (*element1)->removeFromQueue();
         (*element2)->removeFromQueue();
+        InterlockedAdd64AndReturnNewValue(&ReadyElements, -2);
     } else {
         //fprintf(stderr,"getElements different sizes %d %d\n", (*element1)->totalReads, (*element2)->totalReads);
         // need to balance out reads between the two
@@ -309,6 +313,7 @@ ReadSupplierQueue::getElements(ReadQueueElement **element1, ReadQueueElement **e
             (*element1)->removeFromQueue();
             *element2 = copyOut;
         }
+        InterlockedAdd64AndReturnNewValue(&ReadyElements, -1);   // The larger one stays queued with what's left of it
         //WriteErrorMessage("Thread %u: balanced sizes %d %d\n", GetThreadId(), sizes[0], sizes[1]);
     }
     //fprintf(stderr,"getElements %x/%x with %d/%d reads\n", (int) (*element1), (int) (*element2), (*element1)->totalReads, (*element2)->totalReads);
@@ -583,6 +588,7 @@ ReadSupplierQueue::ReaderThread(ReaderThreadParams *params)
 
         if (element->totalReads > 0) {
             element->addToTail(&readyQueue[firstOrSecond]);
+            InterlockedAdd64AndReturnNewValue(&ReadyElements, 1);
             if (isSingleReader || &readyQueue[1-firstOrSecond] != readyQueue[1-firstOrSecond].next) {
                 //
                 // Signal that an element is ready.
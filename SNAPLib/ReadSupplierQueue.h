@@ -123,6 +123,12 @@ public:
     static int BufferCount(int numThreads)
     { return (__max(numThreads,2) + 1) * BatchesPerElement; }
 
+    //
+    // Elements of reads waiting for an aligner thread to pick them up, over all queues.  Near zero means the aligners are
+    // starved for input.
+    //
+    static volatile _int64 ReadyElements;
+
 private:
 
     static const int BatchesPerElement = 4;
@@ -27,6 +27,7 @@ Environment:
 #include "ParallelTask.h"
 #include "Util.h"
 #include "ReadSupplierQueue.h"
+#include "PipeReadSupplier.h"
 #include "FileFormat.h"
 #include "AlignerOptions.h"
 #include "directions.h"
@@ -36,6 +37,108 @@ using std::max;
 using std::min;
 using util::strnchr;
 
+//
+// Builds a SAM line in place in the output buffer.  Formatting each record with one big snprintf (plus a few small ones for
+// the tags) cost about as much as aligning an easy read, mostly in parsing the format string and converting integers.  This
+// converts integers two digits at a time from a table and copies strings with memcpy.  Like snprintf, it keeps counting
+// after the buffer is full, so that the caller can tell that the line didn't fit.
+//
+class SAMLineBuilder
+{
+public:
+    SAMLineBuilder(char* i_buffer, size_t i_bufferSpace) : buffer(i_buffer), bufferSpace(i_bufferSpace), used(0) {}
+
+    inline void append(const char* string, size_t length) {
+        if (used + length <= bufferSpace) {
+            memcpy(buffer + used, string, length);
+        }
+        used += length;
+    }
+
+    inline void append(const char* string) {
+        append(string, strlen(string));
+    }
+
+    inline void append(char c) {
+        if (used < bufferSpace) {
+            buffer[used] = c;
+        }
+        used++;
+    }
+
+    // Like printf's %.*s, which stops at a null
+    inline void appendUpTo(const char* string, size_t maxLength) {
+        const char* end = (const char*)memchr(string, 0, maxLength);
+        append(string, end == NULL ? maxLength : end - string);
+    }
+
+    void appendUnsigned(_uint64 value) {
+        static const char digitPairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+        char digits[20];
+        int start = sizeof(digits);
+        while (value >= 100) {
+            unsigned pair = (unsigned)(value % 100);
+            value /= 100;
+            start -= 2;
+            memcpy(digits + start, digitPairs + 2 * pair, 2);
+        }
+        if (value >= 10) {
+            start -= 2;
+            memcpy(digits + start, digitPairs + 2 * value, 2);
+        } else {
+            digits[--start] = (char)('0' + value);
+        }
+        append(digits + start, sizeof(digits) - start);
+    }
+
+    void appendInt(_int64 value) {
+        if (value < 0) {
+            append('-');
+            appendUnsigned((_uint64)0 - (_uint64)value);
+        } else {
+            appendUnsigned((_uint64)value);
+        }
+    }
+
+    // A tab-separated integer field
+    inline void appendField(_int64 value) {
+        append('\t');
+        appendInt(value);
+    }
+
+    inline void appendField(const char* string) {
+        append('\t');
+        append(string);
+    }
+
+    // An optional field of type i, such as \tNM:i:2
+    void appendIntTag(const char* tag, _int64 value) {
+        append('\t');
+        append(tag);
+        append(":i:", 3);
+        appendInt(value);
+    }
+
+    //
+    // Ends the line, and returns its length or 0 if it didn't fit.  As with snprintf, the line is followed by a null if there's room.
+    //
+    size_t finish() {
+        append('\n');
+        if (used > bufferSpace) {
+            return 0;
+        }
+        if (used < bufferSpace) {
+            buffer[used] = '\0';
+        }
+        return used;
+    }
+
+private:
+    char*       buffer;
+    size_t      bufferSpace;
+    size_t      used;
+}; // SAMLineBuilder
+
 bool readIdsMatch(const char* id0, const char* id1, size_t len)
 {
     const char* id0Base = id0;
@@ -942,7 +1045,12 @@ SAMReader::createReadSupplierGenerator(
     //
     // single-ended SAM files always can be read with the range splitter, unless reading from stdin, which needs a queue
     //
-    if (!strcmp(fileName, "-")) {
+    if (!strcmp(fileName, "-") && DataSupplier::ParallelStdinParsing) {
+        //
+        // Stdin can't use the range splitter, but the pipe reader can cut it into chunks of whole lines for all of the threads to parse.
+        //
+        return new PipeReadSupplierGenerator(true, numThreads, context);
+    } else if (!strcmp(fileName, "-")) {
         //
         // Stdin must run from a queue, not range splitter.
         //
@@ -979,7 +1087,7 @@ SAMReader::createPairedReader(
     if (!strcmp("-", fileName)) {
         data = DataSupplier::Stdio;
     } else {
-        data = DataSupplier::Default;
+        data = DataSupplier::Input(context.useIoUring, context.directIo);
     }
 
     SAMReader* reader = SAMReader::create(data, fileName, bufferCount + PairedReadReader::MatchBuffers, context, 0, 0);
@@ -1001,7 +1109,7 @@ SAMReader::createPairedReadSupplierGenerator(
     // need to use a queue so that pairs can be matched
     //
 
-    PairedReadReader* paired = SAMReader::createPairedReader(DataSupplier::Default, fileName,
+    PairedReadReader* paired = SAMReader::createPairedReader(DataSupplier::Input(context.useIoUring, context.directIo), fileName,
         ReadSupplierQueue::BufferCount(numThreads), 0, 0, quicklyDropUnpairedReads, context);
     if (paired == NULL) {
         WriteErrorMessage( "Cannot create reader on %s\n", fileName);
@@ -1191,9 +1299,16 @@ SAMFormat::getWriterSupplier(
             filters = DataWriterSupplier::samMarkDuplicates(genome);
         }
         dataSupplier = DataWriterSupplier::sorted(this, genome, DataWriterSupplier::generateSortIntermediateFilePathName(options), options->sortMemory * (1ULL << 30),
-            options->numThreads, options->outputFile.fileName, filters, options->writeBufferSize, options->emitInternalScore, options->internalScoreTag);
+            options->numThreads, options->outputFile.fileName, filters, options->writeBufferSize, options->emitInternalScore, options->internalScoreTag,
+            options->useIoUring, options->directIo);
     } else {
-        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, options->writeBufferSize, options->emitInternalScore, options->internalScoreTag);
+        if (options->markUnsortedDuplicates) {
+            // setting the flag can make a SAM line longer, so it can't be patched in place the way BAM is
+            WriteErrorMessage("-du only works for BAM output; sort SAM output with -so to mark its duplicates\n");
+            soft_exit(1);
+        }
+        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, options->writeBufferSize, options->emitInternalScore, options->internalScoreTag,
+            NULL, NULL, 4, options->useIoUring, options->directIo);
     }
 
     return ReadWriterSupplier::create(this, dataSupplier, genome, options->killIfTooSlow, options->emitInternalScore, options->internalScoreTag, options->ignoreAlignmentAdjustmentsForOm,
@@ -1752,10 +1867,6 @@ SAMFormat::writePairs(
             qnameLen[whichRead] = (unsigned)(firstSpace - read->getId());
         }
 
-        const int nmStringSize = 30;// Big enough that it won't buffer overflow regardless of the value of editDistance
-        char nmString[nmStringSize];  
-        snprintf(nmString, nmStringSize, "\tNM:i:%d",editDistance[whichRead]);
-
         unsigned auxLen;
         bool auxSAM;
         char* aux = read->getAuxiliaryData(&auxLen, &auxSAM);
@@ -1794,35 +1905,6 @@ SAMFormat::writePairs(
             }
         }
 
-        const int internalScoreBufferSize = 100;    // Should be plenty for \tXX:i:%d
-        char internalScoreBuffer[internalScoreBufferSize];
-        if (emitInternalScore) {
-            int charsInInternalScore = snprintf(internalScoreBuffer, internalScoreBufferSize - 1, "\t%s:i:%d", internalScoreTag, (flags[whichRead] & SAM_UNMAPPED) ? -1 : result->scorePriorToClipping[whichRead]);
-            if (charsInInternalScore >= internalScoreBufferSize) {
-                WriteErrorMessage("SAMFormat::writeRead overran internal buffer for internal score tag, which is kind of surprising.  %d\n", charsInInternalScore);
-            }
-        } else {
-            internalScoreBuffer[0] = '\0';
-        }
-
-        const int alignmentTimeBufferSize = 100;    // Should be plenty for \tAT:i:%d
-        char alignmentTimeBuffer[alignmentTimeBufferSize];
-        if (attachAlignmentTime) {
-            int alignmentTimeInMicroseconds;
-            if (result->alignmentTimeInNanoseconds / 1000 > MAXINT32) {
-                alignmentTimeInMicroseconds = MAXINT32;
-            } else {
-                alignmentTimeInMicroseconds = (int)(result->alignmentTimeInNanoseconds / 1000);
-            }
-            int charsInAlignmentTime = snprintf(alignmentTimeBuffer, alignmentTimeBufferSize - 1, "\tAT:i:%d", alignmentTimeInMicroseconds);
-            if (charsInAlignmentTime >= alignmentTimeBufferSize) {
-                WriteErrorMessage("SAMFormat::writeRead overran internal buffer for alignment time tag, which is kind of surprising.  %d\n", charsInAlignmentTime);
-            }
-        } else {
-            alignmentTimeBuffer[0] = '\0';
-        }
-
-
         // QS
         int mqs = 0;
         _uint8* p = (_uint8*)quality[1 - whichRead];
@@ -1832,56 +1914,67 @@ SAMFormat::writePairs(
             // Picard MarkDup uses a score threshold of 15 (default)
             mqs += (q >= 15) ? (q != 255) * q : 0; // avoid branch?
         }
-        const int mqsStringSize = 30;// Big enough that it won't buffer overflow regardless of the value of mateQualityScore
-        char mqsString[nmStringSize];
-        snprintf(mqsString, mqsStringSize, "\tQS:i:%d", mqs);
 
-        // LB
-        const int libraryStringSize = 512;
-        char libraryString[libraryStringSize];
         const char* library = read->getLibrary();
-        if (library != NULL) {
-            size_t libraryLength = read->getLibraryLength();
-            if (libraryLength >= libraryStringSize) {
-                WriteErrorMessage("LB field too long\n");
-                soft_exit(1);
+        if (library != NULL && read->getLibraryLength() >= 512) {
+            WriteErrorMessage("LB field too long\n");
+            soft_exit(1);
+        }
+
+        SAMLineBuilder line(buffer, bufferSpace);
+        line.appendUpTo(read->getId(), (unsigned)qnameLen[whichRead]);
+        line.appendField(flags[whichRead]);
+        line.appendField(contigName[whichRead]);
+        line.append('\t');
+        line.appendUnsigned(positionInContig[whichRead]);
+        line.appendField(result->mapq[whichRead]);
+        line.appendField(cigar[whichRead]);
+        line.appendField(mateContigName[whichRead]);
+        line.append('\t');
+        line.appendUnsigned(matePositionInContig[whichRead]);
+        line.appendField((_int32) templateLength[whichRead]);
+        line.append('\t');
+        line.appendUpTo(data[whichRead], fullLength[whichRead]);
+        line.append('\t');
+        line.appendUpTo(quality[whichRead], fullLength[whichRead]);
+        if (aux != NULL) {
+            line.append('\t');
+            line.appendUpTo(aux, auxLen);
+        }
+        line.append(readGroupSeparator);
+        line.append(readGroupString);
+        line.append("\tPG:Z:SNAP", 10);
+        line.appendIntTag("NM", editDistance[whichRead]);
+        line.appendUpTo(rglineAux, rglineAuxLen);
+        if (emitInternalScore) {
+            line.appendIntTag(internalScoreTag, (flags[whichRead] & SAM_UNMAPPED) ? -1 : result->scorePriorToClipping[whichRead]);
+        }
+        if (attachAlignmentTime) {
+            int alignmentTimeInMicroseconds;
+            if (result->alignmentTimeInNanoseconds / 1000 > MAXINT32) {
+                alignmentTimeInMicroseconds = MAXINT32;
+            } else {
+                alignmentTimeInMicroseconds = (int)(result->alignmentTimeInNanoseconds / 1000);
             }
-            snprintf(libraryString, libraryStringSize, "\tLB:Z:%.*s", (int)libraryLength, library);
-        } else {
-            libraryString[0] = '\0';
+            line.appendIntTag("AT", alignmentTimeInMicroseconds);
+        }
+        line.appendIntTag("QS", mqs);
+        if (library != NULL) {
+            line.append("\tLB:Z:", 6);
+            line.appendUpTo(library, read->getLibraryLength());
+        }
+        if (FASTQCommentLength[whichRead] != 0) {
+            line.append('\t');
+            line.appendUpTo(FASTQComment[whichRead], FASTQCommentLength[whichRead]);
         }
 
-        int charsInString = snprintf(buffer, bufferSpace, "%.*s\t%d\t%s\t%llu\t%d\t%s\t%s\t%llu\t%d\t%.*s\t%.*s%s%.*s%s%s\tPG:Z:SNAP%s%.*s%s%s%s%s%s%.*s\n",
-            (unsigned)qnameLen[whichRead], read->getId(),
-            flags[whichRead],
-            contigName[whichRead],
-            positionInContig[whichRead],
-            result->mapq[whichRead],
-            cigar[whichRead],
-            mateContigName[whichRead],
-            matePositionInContig[whichRead],
-            (_int32) templateLength[whichRead],
-            fullLength[whichRead], data[whichRead],
-            fullLength[whichRead], quality[whichRead],
-            aux != NULL ? "\t" : "", auxLen, aux != NULL ? aux : "",
-            readGroupSeparator, readGroupString,
-            nmString, rglineAuxLen, rglineAux,
-            internalScoreBuffer,
-            alignmentTimeBuffer,
-            mqsString,
-            libraryString,
-            (FASTQCommentLength[whichRead] == 0) ? "" : "\t",
-            FASTQCommentLength[whichRead],
-            FASTQComment[whichRead]);
-
-        if (charsInString > bufferSpace) {
+        size_t charsInString = line.finish();
+        if (charsInString == 0) {
             //
             // Out of buffer space.
             //
             *outOfSpace = true;
             return false;
-        } else if (charsInString == bufferSpace) {
-            buffer[bufferSpace-1] = '\n'; // overwrite trailing null with newline
         }
 
         if (NULL != spaceUsed) {
@@ -2006,10 +2099,6 @@ SAMFormat::writeRead(
         qnameLen = (unsigned)(firstSpace - read->getId());
     }
 
-    const int nmStringSize = 30;// Big enough that it won't buffer overflow regardless of the value of editDistance
-    char nmString[nmStringSize];  
-    snprintf(nmString, nmStringSize, "\tNM:i:%d",editDistance);
-
     unsigned auxLen;
     bool auxSAM;
     char* aux = read->getAuxiliaryData(&auxLen, &auxSAM);
@@ -2047,64 +2136,54 @@ SAMFormat::writeRead(
         }
     }
 
-    const int internalScoreBufferSize = 100;    // Should be plenty for \tXX:i:%d
-    char internalScoreBuffer[internalScoreBufferSize];
+    SAMLineBuilder line(buffer, bufferSpace);
+    line.appendUpTo(read->getId(), (unsigned)qnameLen);
+    line.appendField(flags);
+    line.appendField(contigName);
+    line.append('\t');
+    line.appendUnsigned(positionInContig);
+    line.appendField(mapQuality);
+    line.appendField(cigar);
+    line.appendField(matecontigName);
+    line.append('\t');
+    line.appendUnsigned(matePositionInContig);
+    line.appendField(templateLength);
+    line.append('\t');
+    line.appendUpTo(data, fullLength);
+    line.append('\t');
+    line.appendUpTo(quality, fullLength);
+    if (aux != NULL) {
+        line.append('\t');
+        line.appendUpTo(aux, auxLen);
+    }
+    line.append(readGroupSeparator);
+    line.append(readGroupString);
+    line.append("\tPG:Z:SNAP", 10);
+    line.appendIntTag("NM", editDistance);
+    line.appendUpTo(rglineAux, rglineAuxLen);
     if (emitInternalScore) {
-        int charsInInternalScore = snprintf(internalScoreBuffer, internalScoreBufferSize - 1, "\t%s:i:%d", internalScoreTag, (flags & SAM_UNMAPPED) ? -1 : internalScore);
-        if (charsInInternalScore >= internalScoreBufferSize) {
-            WriteErrorMessage("SAMFormat::writeRead overran internal buffer for internal score tag, which is kind of surprising.  %d\n", charsInInternalScore);
-        }
-    } else {
-        internalScoreBuffer[0] = '\0';
+        line.appendIntTag(internalScoreTag, (flags & SAM_UNMAPPED) ? -1 : internalScore);
     }
-
-    const int alignmentTimeBufferSize = 100;    // Should be plenty for AT:i:123456789
-    char alignmentTimeBuffer[alignmentTimeBufferSize];
     if (attachAlignmentTime) {
         _int64 alignmentTimeInMicroseconds = (alignmentTimeInNanoseconds + 500) / 1000;
         if (alignmentTimeInMicroseconds >= MAXINT32) {  // MAXINT is about 2 billion, so this would be ~35 minutes for one read (pair)
             alignmentTimeInMicroseconds = 0;
-        };
-        int charsInAligmentTime = snprintf(alignmentTimeBuffer, alignmentTimeBufferSize - 1, "\tAT:i:%d", (int)alignmentTimeInMicroseconds);
-        if (charsInAligmentTime >= alignmentTimeBufferSize) {
-            WriteErrorMessage("SAMFormat::writeRead overran internal buffer for alignment time tag, which is kind of surprising.  %d\n", charsInAligmentTime);
         }
-    } else {
-        alignmentTimeBuffer[0] = '\0';
-    }
-
-    int charsInString = snprintf(buffer, bufferSpace, "%.*s\t%d\t%s\t%llu\t%d\t%s\t%s\t%llu\t%lld\t%.*s\t%.*s%s%.*s%s%s\tPG:Z:SNAP%s%.*s%s%s%s%.*s\n",
-        (unsigned)qnameLen, read->getId(),
-        flags,
-        contigName,
-        positionInContig,
-        mapQuality,
-        cigar,
-        matecontigName,
-        matePositionInContig,
-        templateLength,
-        fullLength, data,
-        fullLength, quality,
-        aux != NULL ? "\t" : "", auxLen, aux != NULL ? aux : "",
-        readGroupSeparator, readGroupString,
-        nmString, rglineAuxLen, rglineAux,
-        internalScoreBuffer,
-        alignmentTimeBuffer,
-        (FASTQCommentLength == 0) ? "" : "\t",
-        FASTQCommentLength,
-        FASTQComment
-       );
-
-    if (charsInString > bufferSpace) {
+        line.appendIntTag("AT", (int)alignmentTimeInMicroseconds);
+    }
+    if (FASTQCommentLength != 0) {
+        line.append('\t');
+        line.appendUpTo(FASTQComment, FASTQCommentLength);
+    }
+
+    size_t charsInString = line.finish();
+    if (charsInString == 0) {
         //
         // Out of buffer space.
         //
         return false;
-    } else if (charsInString == bufferSpace) {
-      buffer[bufferSpace-1] = '\n'; // overwrite trailing null with newline
     }
 
-
     if (NULL != spaceUsed) {
         *spaceUsed = charsInString;
     }
@@ -2242,10 +2321,6 @@ SAMFormat::writeRead(
         qnameLen = (unsigned)(firstSpace - read->getId());
     }
 
-    const int nmStringSize = 30;// Big enough that it won't buffer overflow regardless of the value of editDistance
-    char nmString[nmStringSize];
-    snprintf(nmString, nmStringSize, "\tNM:i:%d", editDistance);
-
     unsigned auxLen;
     bool auxSAM;
     char* aux = read->getAuxiliaryData(&auxLen, &auxSAM);
@@ -2283,63 +2358,53 @@ SAMFormat::writeRead(
             readGroupString = read->getReadGroup();
         }
     }
-    const int internalScoreBufferSize = 100;    // Should be plenty for \tXX:i:%d
-    char internalScoreBuffer[internalScoreBufferSize];
+    SAMLineBuilder line(buffer, bufferSpace);
+    line.appendUpTo(read->getId(), (unsigned)qnameLen);
+    line.appendField(flags);
+    line.appendField(contigName);
+    line.append('\t');
+    line.appendUnsigned(positionInContig);
+    line.appendField(mapQuality);
+    line.appendField(cigar);
+    line.appendField(matecontigName);
+    line.append('\t');
+    line.appendUnsigned(matePositionInContig);
+    line.appendField(templateLength);
+    line.append('\t');
+    line.appendUpTo(data, fullLength);
+    line.append('\t');
+    line.appendUpTo(quality, fullLength);
+    if (aux != NULL) {
+        line.append('\t');
+        line.appendUpTo(aux, auxLen);
+    }
+    line.append(readGroupSeparator);
+    line.append(readGroupString);
+    line.append("\tPG:Z:SNAP", 10);
+    line.appendIntTag("NM", editDistance);
+    line.appendUpTo(rglineAux, rglineAuxLen);
     if (emitInternalScore) {
-        int charsInInternalScore = snprintf(internalScoreBuffer, internalScoreBufferSize - 1, "\t%s:i:%d", internalScoreTag, (flags & SAM_UNMAPPED) ? -1 : internalScore);
-        if (charsInInternalScore >= internalScoreBufferSize) {
-            WriteErrorMessage("SAMFormat::writeRead overran internal buffer for internal score tag, which is kind of surprising.  %d\n", charsInInternalScore);
-        }
-    } else {
-        internalScoreBuffer[0] = '\0';
+        line.appendIntTag(internalScoreTag, (flags & SAM_UNMAPPED) ? -1 : internalScore);
     }
-
-    const int alignmentTimeBufferSize = 100;    // Should be plenty for AT:i:123456789
-    char alignmentTimeBuffer[alignmentTimeBufferSize];
     if (attachAlignmentTime) {
         _int64 alignmentTimeInMicroseconds = (alignmentTimeInNanoseconds + 500) / 1000;
         if (alignmentTimeInMicroseconds >= MAXINT32) {  // MAXINT is about 2 billion, so this would be ~35 minutes for one read (pair)
             alignmentTimeInMicroseconds = 0;
-        };
-        int charsInAligmentTime = snprintf(alignmentTimeBuffer, alignmentTimeBufferSize - 1, "\tAT:i:%d", (int)alignmentTimeInMicroseconds);
-        if (charsInAligmentTime >= alignmentTimeBufferSize) {
-            WriteErrorMessage("SAMFormat::writeRead overran internal buffer for alignment time tag, which is kind of surprising.  %d\n", charsInAligmentTime);
         }
-    } else {
-        alignmentTimeBuffer[0] = '\0';
-    }
-
-    int charsInString = snprintf(buffer, bufferSpace, "%.*s\t%d\t%s\t%llu\t%d\t%s\t%s\t%llu\t%lld\t%.*s\t%.*s%s%.*s%s%s\tPG:Z:SNAP%s%.*s%s%s%s%.*s\n",
-        (unsigned)qnameLen, read->getId(),
-        flags,
-        contigName,
-        positionInContig,
-        mapQuality,
-        cigar,
-        matecontigName,
-        matePositionInContig,
-        templateLength,
-        fullLength, data,
-        fullLength, quality,
-        aux != NULL ? "\t" : "", auxLen, aux != NULL ? aux : "",
-        readGroupSeparator, readGroupString,
-        nmString, rglineAuxLen, rglineAux,
-        internalScoreBuffer,
-        alignmentTimeBuffer,
-        (FASTQCommentLength == 0) ? "" : "\t",
-        FASTQCommentLength,
-        FASTQComment);
-
-    if (charsInString > bufferSpace) {
+        line.appendIntTag("AT", (int)alignmentTimeInMicroseconds);
+    }
+    if (FASTQCommentLength != 0) {
+        line.append('\t');
+        line.appendUpTo(FASTQComment, FASTQCommentLength);
+    }
+
+    size_t charsInString = line.finish();
+    if (charsInString == 0) {
         //
         // Out of buffer space.
         //
         return false;
     }
-    else if (charsInString == bufferSpace) {
-        buffer[bufferSpace - 1] = '\n'; // overwrite trailing null with newline
-    }
-
 
     if (NULL != spaceUsed) {
         *spaceUsed = charsInString;
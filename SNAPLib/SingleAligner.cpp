@@ -107,6 +107,7 @@ SingleAlignerContext::runIterationThreadImpl(Read *& read)
         // no alignment, just input/output
         while (NULL != (read = supplier->getNextRead())) {
             stats->totalReads++;
+            stats->totalBases += read->getDataLength();
             SingleAlignmentResult result;
             result.status = NotFound;
             result.direction = FORWARD;
@@ -133,17 +134,18 @@ SingleAlignerContext::runIterationThreadImpl(Read *& read)
     int maxReadSize = MAX_READ_LENGTH;
 
     SingleAlignmentResult *alignmentResults = NULL;
-    bool alignmentResultsReallocated = false;
-    _int64 alignmentResultBufferCount;
+    _int64 initialAlignmentResultBufferCount;
     if (maxSecondaryAlignmentAdditionalEditDistance < 0) {
-        alignmentResultBufferCount = 1;
+        initialAlignmentResultBufferCount = 1;
     } else {
-        alignmentResultBufferCount = 32;    // Just a nice number that's not too small.  We reallocate on demand.
+        initialAlignmentResultBufferCount = __max((_int64)32, (_int64)(ResultBufferSlabSize / sizeof(*alignmentResults)));
     }
-    size_t alignmentResultBufferSize = sizeof(*alignmentResults) * alignmentResultBufferCount; 
+    _int64 alignmentResultBufferCount = initialAlignmentResultBufferCount;
 
-    BigAllocator *allocator = new BigAllocator(BaseAligner::getBigAllocatorReservation(index, true, maxHits, maxReadSize, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage, maxSecondaryAlignmentsPerContig, extraSearchDepth) 
-        + alignmentResultBufferSize, 16); // FIXME: Used larger allocation granularity for __m128i that needs to be aligned at 16 byte boundaries
+    BigAllocator *allocator = new BigAllocator(BaseAligner::getBigAllocatorReservation(index, true, maxHits, maxReadSize, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage, maxSecondaryAlignmentsPerContig, extraSearchDepth),
+        16); // FIXME: Used larger allocation granularity for __m128i that needs to be aligned at 16 byte boundaries
+    ArenaAllocator *arena = new ArenaAllocator(ResultArenaReservation);
+    DataBatch arenaBatch;
    
     BaseAligner *aligner = new (allocator) BaseAligner(
             index,
@@ -172,12 +174,13 @@ SingleAlignerContext::runIterationThreadImpl(Read *& read)
             stats,
             allocator);
 
-    alignmentResults = (SingleAlignmentResult *)allocator->allocate(alignmentResultBufferSize);
+    alignmentResults = (SingleAlignmentResult *)arena->allocate(alignmentResultBufferCount * sizeof(*alignmentResults));
  
     allocator->checkCanaries();
 
     aligner->setExplorePopularSeeds(options->explorePopularSeeds);
     aligner->setStopOnFirstHit(options->stopOnFirstHit);
+    aligner->setPerfCounters(perfCounters);
 
 #ifdef  _MSC_VER
     if (options->useTimingBarrier) {
@@ -196,12 +199,23 @@ SingleAlignerContext::runIterationThreadImpl(Read *& read)
     _int64 startTime = timeInMillis();
     while (NULL != (read = supplier->getNextRead())) {
         _int64 readFinishedTime;
-        if (options->profile) {
+        if (timeStages) {
             readFinishedTime = timeInMillis();
             stats->millisReading += (readFinishedTime - startTime);
         }
 
         stats->totalReads++;
+        stats->totalBases += read->getDataLength();
+
+        if (read->getBatch() != arenaBatch) {
+            //
+            // Anything a read from the last batch overflowed into goes away here, and the buffer goes back to its slab.
+            //
+            arenaBatch = read->getBatch();
+            arena->reset();
+            alignmentResultBufferCount = initialAlignmentResultBufferCount;
+            alignmentResults = (SingleAlignmentResult *)arena->allocate(alignmentResultBufferCount * sizeof(*alignmentResults));
+        }
 
         if (AlignerOptions::useHadoopErrorMessages && stats->totalReads % 10000 == 0 && timeInMillis() - lastReportTime > 10000) {
             fprintf(stderr,"reporter:counter:SNAP,readsAligned,%llu\n",stats->totalReads - readsWhenLastReported);
@@ -225,6 +239,7 @@ SingleAlignerContext::runIterationThreadImpl(Read *& read)
                     result.basesClippedBefore = 0;
                     result.basesClippedAfter = 0;
                     result.supplementary = false;
+                    PerfPhaseScope outputScope(perfCounters, PerfPhaseOutput);
                     readWriter->writeReads(readerContext, read, &result, 1, true, useAffineGap);
                 }
                 stats->uselessReads++;
@@ -232,10 +247,10 @@ SingleAlignerContext::runIterationThreadImpl(Read *& read)
             continue;
         }
 
-        _int64 startTime;
+        _int64 alignStartTimeInNanos;
 
         if (TIME_HISTOGRAM || options->attachAlignmentTimes) {
-            startTime = timeInNanos();
+            alignStartTimeInNanos = timeInNanos();
         }
 
         _int64 nSecondaryResults = 0;
@@ -246,27 +261,30 @@ SingleAlignerContext::runIterationThreadImpl(Read *& read)
             aligner->setMaxK(min(MAX_K, (int)(read->getDataLength() * options->maxDistFraction)));
         }
 #endif
+        if (numaReplicas != NULL) {
+            if (GetCurrentNumaNode() == numaNode) {
+                stats->numaLocalAlignments++;
+            } else {
+                stats->numaRemoteAlignments++;
+            }
+        }
+
         SingleAlignmentResult firstALTResult;
         while (!aligner->AlignRead(read, alignmentResults, &firstALTResult, maxSecondaryAlignmentAdditionalEditDistance, alignmentResultBufferCount - 1, &nSecondaryResults, maxSecondaryAlignments, alignmentResults + 1, 0, NULL, NULL)) {
             //
-            // Out of secondary alignment buffer.  Reallocate.
+            // Out of secondary alignment buffer even with the whole slab.  Grow it and realign.
             //
-            if (alignmentResultsReallocated) {
-                BigDealloc(alignmentResults);
-                alignmentResults = NULL;
-            }
-
+            alignmentResults = (SingleAlignmentResult *)arena->grow(alignmentResults, alignmentResultBufferCount * sizeof(*alignmentResults),
+                2 * alignmentResultBufferCount * sizeof(*alignmentResults));
             alignmentResultBufferCount *= 2;
-            alignmentResultBufferSize = alignmentResultBufferCount * sizeof(SingleAlignmentResult);
-            alignmentResults = (SingleAlignmentResult *)BigAlloc(alignmentResultBufferSize);
-            alignmentResultsReallocated = true;
+            stats->alignmentsRerun++;
         }
 #ifdef LONG_READS
         aligner->setMaxK(oldMaxK);
 #endif
 
         _int64 alignFinishedTime;
-        if (options->profile) {
+        if (timeStages) {
             alignFinishedTime = timeInMillis();
             stats->millisAligning += (alignFinishedTime - readFinishedTime);            
         }
@@ -274,7 +292,7 @@ SingleAlignerContext::runIterationThreadImpl(Read *& read)
         _int64 runTime;
 
         if (TIME_HISTOGRAM || options->attachAlignmentTimes) {
-            runTime = timeInNanos() - startTime;
+            runTime = timeInNanos() - alignStartTimeInNanos;
             if (runTime < 0) {
                 runTime = 0;
             }
@@ -315,6 +333,7 @@ SingleAlignerContext::runIterationThreadImpl(Read *& read)
             } // For each result
 
             stats->extraAlignments += nSecondaryResults + (containsPrimary ? 0 : 1);    // If it doesn't contain the primary, then it's a secondary.
+            PerfPhaseScope outputScope(perfCounters, PerfPhaseOutput);
             readWriter->writeReads(readerContext, read, alignmentResults, nSecondaryResults + 1, containsPrimary, useAffineGap);
 
             if (altAwareness && firstALTResult.status != NotFound && options->passFilter(read, firstALTResult.status, false, false)) {
@@ -322,9 +341,9 @@ SingleAlignerContext::runIterationThreadImpl(Read *& read)
             }
         } // If we're writing reads at all
 
-        if (options->profile) {
+        if (timeStages) {
             startTime = timeInMillis();
-            stats->millisWriting = (startTime - alignFinishedTime);
+            stats->millisWriting += (startTime - alignFinishedTime);
         }
 
         if (containsPrimary) {
@@ -343,9 +362,8 @@ SingleAlignerContext::runIterationThreadImpl(Read *& read)
         delete supplier;
     }
 
-    if (alignmentResultsReallocated) {
-        BigDealloc(alignmentResults);
-    }
+    recordArenaStats(arena);
+    delete arena;
 
     delete allocator;   // This is what actually frees the memory.
 }
@@ -384,14 +402,11 @@ SingleAlignerContext::typeSpecificBeginIteration()
     } else {
         //
         // We've got multiple inputs, so use a MultiInputReadSupplier to combine the individual inputs.
+        // The scheduler opens the inputs ahead of when they're needed and the per-thread suppliers spread their reading across them.
         //
-        ReadSupplierGenerator **generators = new ReadSupplierGenerator *[options->nInputs];
-        // use separate context for each supplier, initialized from common
-        for (int i = 0; i < options->nInputs; i++) {
-            ReaderContext context(readerContext);
-            generators[i] = options->inputs[i].createReadSupplierGenerator(options->numThreads, context);
-        }
-        readSupplierGenerator = new MultiInputReadSupplierGenerator(options->nInputs,generators);
+        inputScheduler = new InputScheduler(options->nInputs, options->inputs, options->numThreads, false, false, readerContext,
+            options->activeInputs, options->inputsToWarm);
+        readSupplierGenerator = new MultiInputReadSupplierGenerator(inputScheduler);
     }
     ReaderContext* context = readSupplierGenerator->getContext();
     readerContext.header = context->header;
@@ -419,6 +434,7 @@ SingleAlignerContext::typeSpecificNextIteration()
         readerContext.rgLineOffsets = NULL;
     }
     delete readSupplierGenerator;
+    inputScheduler = NULL;
     readSupplierGenerator = NULL;
 }
 
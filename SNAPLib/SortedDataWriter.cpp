@@ -28,6 +28,7 @@ Environment:
 #include "exit.h"
 #include "Bam.h"
 #include "Error.h"
+#include "FastBlockCodec.h"
 
 //#define VALIDATE_SORT 1
 
@@ -52,19 +53,143 @@ struct SortEntry
 
 typedef VariableSizeVector<SortEntry,150,true> SortVector;
 
+//
+// Sorts entries by location with an LSD radix sort on the 64 bit sort key, a byte at a time.  It's stable like the
+// stable_sort it replaces, and a good deal faster for the millions of reads in a batch.  Bytes that are the same in
+// every key (such as the high bytes of the contig number) are skipped.  scratch must have room for count entries.
+//
+    static void
+RadixSortEntries(
+    SortEntry* entries,
+    _int64 count,
+    SortEntry* scratch)
+{
+    if (count < 2) {
+        return;
+    }
+
+    static const int KeyBytes = sizeof(_uint64);
+    _int64 (*counts)[256] = new _int64[KeyBytes][256];
+    memset(counts, 0, sizeof(_int64) * KeyBytes * 256);
+    for (_int64 i = 0; i < count; i++) {
+        _uint64 key = entries[i].contigAndPos.getSortKey();
+        for (int b = 0; b < KeyBytes; b++) {
+            counts[b][(key >> (8 * b)) & 0xff]++;
+        }
+    }
+
+    _uint64 firstKey = entries[0].contigAndPos.getSortKey();
+    SortEntry* from = entries;
+    SortEntry* to = scratch;
+    for (int b = 0; b < KeyBytes; b++) {
+        if (counts[b][(firstKey >> (8 * b)) & 0xff] == count) {
+            continue;   // They're all the same
+        }
+
+        _int64 next[256];
+        _int64 total = 0;
+        for (int digit = 0; digit < 256; digit++) {
+            next[digit] = total;
+            total += counts[b][digit];
+        }
+        for (_int64 i = 0; i < count; i++) {
+            to[next[(from[i].contigAndPos.getSortKey() >> (8 * b)) & 0xff]++] = from[i];
+        }
+
+        SortEntry* t = from;
+        from = to;
+        to = t;
+    }
+
+    if (from != entries) {
+        memcpy(entries, from, sizeof(SortEntry) * count);
+    }
+    delete[] counts;
+}
+
+//
+// When the intermediate file is compressed, each sorted run is written as a sequence of frames, each of which is
+// this header followed by the frame's data.  A frame holds at most FastBlockCodec::MaxBlockSize bytes of reads
+// (which may span frames), and frames that don't compress are stored as is, with storedBytes == logicalBytes.
+//
+#pragma pack(push, 4)
+struct SpillFrameHeader
+{
+    _uint32     logicalBytes;
+    _uint32     storedBytes;
+};
+#pragma pack(pop)
+
+//
+// Writes a frame to output, compressed if that helps.  Returns the number of bytes used, or 0 if it didn't fit in room.
+//
+    static size_t
+WriteSpillFrame(
+    const char* frame,
+    size_t frameBytes,
+    char* output,
+    size_t room)
+{
+    if (room < sizeof(SpillFrameHeader)) {
+        return 0;
+    }
+
+    char* data = output + sizeof(SpillFrameHeader);
+    room -= sizeof(SpillFrameHeader);
+
+    SpillFrameHeader frameHeader;
+    frameHeader.logicalBytes = (_uint32)frameBytes;
+    frameHeader.storedBytes = (_uint32)FastBlockCodec::compress(frame, frameBytes, data, __min(room, frameBytes - 1));
+    if (frameHeader.storedBytes == 0) {
+        if (room < frameBytes) {
+            return 0;
+        }
+        memcpy(data, frame, frameBytes);
+        frameHeader.storedBytes = (_uint32)frameBytes;
+    }
+
+    memcpy(output, &frameHeader, sizeof(frameHeader));
+    return sizeof(frameHeader) + frameHeader.storedBytes;
+}
+
+//
+// Where to start reading a sorted run to get to the reads at a given key, which lets the merge split the genome into ranges
+// and merge them in parallel.  offset is from the start of the run (for a compressed run it's the start of a frame) and
+// skip is the number of bytes after that to the read.
+//
+struct SortSample
+{
+    SortSample() : offset(0), skip(0) {}
+    SortSample(ContigAndPos i_contigAndPos, size_t i_offset, size_t i_skip) : contigAndPos(i_contigAndPos), offset(i_offset), skip(i_skip) {}
+
+    ContigAndPos    contigAndPos;
+    size_t          offset;
+    size_t          skip;
+};
+
+typedef VariableSizeVector<SortSample> SortSampleVector;
+
 struct SortBlock
 {
 #ifdef VALIDATE_SORT
     SortBlock() : start(0), bytes(0), location(0), length(0), reader(NULL), minLocation(0), maxLocation(0) {}
 #else
-    SortBlock() : start(0), bytes(0), length(0), reader(NULL), dataReaderIsBuffer(false), data(NULL) {}
-    SortBlock(DataReader* bufferDataReader) : start(0), bytes(0), length(0), reader(bufferDataReader), dataReaderIsBuffer(bufferDataReader != NULL), data(NULL) {}
+    SortBlock() : start(0), bytes(0), logicalBytes(0), compressed(false), samples(NULL), fileName(NULL), level(0), written(false), merging(false), length(0), reader(NULL), dataReaderIsBuffer(false), data(NULL) {}
+    SortBlock(DataReader* bufferDataReader) : start(0), bytes(0), logicalBytes(0), compressed(false), samples(NULL), fileName(NULL), level(0), written(false), merging(false),
+        length(0), reader(bufferDataReader), dataReaderIsBuffer(bufferDataReader != NULL), data(NULL) {}
 #endif
 	SortBlock(const SortBlock& other) { *this = other; }
     void operator=(const SortBlock& other);
 
     size_t      start;
-    size_t      bytes;
+    size_t      bytes;          // in the intermediate file
+    size_t      logicalBytes;   // of reads, which is the same as bytes unless the block is compressed
+    bool        compressed;
+    SortSampleVector* samples;  // every SampleInterval bytes of reads, if the merge may be split into ranges
+    char*       fileName;       // for a run merged in the background, NULL if it's in the intermediate file
+    int         level;          // the number of background merges that went into the run
+    bool        written;        // the write to the intermediate file has finished, so it can be merged in the background
+    bool        merging;        // a background merge is reading it
 #ifdef VALIDATE_SORT
 	GenomeLocation	minLocation, maxLocation;
 #endif
@@ -82,6 +207,13 @@ SortBlock::operator=(
 {
     start = other.start;
     bytes = other.bytes;
+    logicalBytes = other.logicalBytes;
+    compressed = other.compressed;
+    samples = other.samples;
+    fileName = other.fileName;
+    level = other.level;
+    written = other.written;
+    merging = other.merging;
     length = other.length;
     reader = other.reader;
     dataReaderIsBuffer = other.dataReaderIsBuffer;
@@ -98,23 +230,84 @@ class SortedDataFilterSupplier;
 class SortedDataFilter : public DataWriter::Filter
 {
 public:
-    SortedDataFilter(SortedDataFilterSupplier* i_parent)
-        : Filter(DataWriter::CopyFilter), parent(i_parent), locations(10000000), seenLastBatch(false)
+    SortedDataFilter(SortedDataFilterSupplier* i_parent, bool i_compress)
+        : Filter(i_compress ? DataWriter::TransformFilter : DataWriter::CopyFilter), parent(i_parent), locations(10000000), seenLastBatch(false),
+          compress(i_compress), frame(NULL), blockPending(false), samples(NULL), sortScratch(NULL), sortScratchCount(0), headerNext(false)
     {}
 
     virtual ~SortedDataFilter() 
     {
-        _ASSERT(seenLastBatch);
+        _ASSERT(seenLastBatch && !blockPending && samples == NULL);
+        if (frame != NULL) {
+            BigDealloc(frame);
+            frame = NULL;
+        }
+        if (sortScratch != NULL) {
+            BigDealloc(sortScratch);
+            sortScratch = NULL;
+        }
     }
 
     virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, GenomeDistance bytes, GenomeLocation location);
 
     virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes, bool lastBatch = false, bool* needMoreBuffer = NULL, size_t* fromBufferUsed = NULL);
 
+    virtual void onBatchPlaced(size_t fileOffset, size_t bytes);
+
+    virtual void onBatchWritten(size_t fileOffset, size_t bytes);
+
+    // The header is written as a batch of its own
+    virtual void inHeader(bool flag)
+    {
+        headerNext |= flag;
+    }
+
 private:
+    //
+    // Copies the reads into toBuffer in sorted order as compressed frames.  Returns the number of bytes used, or 0 if
+    // they didn't fit (which can only happen when the data is nearly incompressible and the buffer is full).
+    //
+    size_t copySortedCompressed(char* fromBuffer, char* toBuffer, size_t toSize);
+    bool writeFrame(size_t frameBytes, char* toBuffer, size_t toSize, size_t* io_target);
+
+    // Records a sample for the read at logicalOffset in the run if it's time for one
+    void sample(const SortEntry& entry, size_t logicalOffset, size_t offset, size_t skip)
+    {
+        if (samples != NULL && logicalOffset >= nextSample) {
+            samples->push_back(SortSample(entry.contigAndPos, offset, skip));
+            nextSample = logicalOffset + SampleInterval;
+        }
+    }
+
+    static const size_t SampleInterval = 64 * 1024;
+
     SortedDataFilterSupplier*   parent;
     SortVector                  locations;
     bool                        seenLastBatch;
+
+    const bool                  compress;
+    char*                       frame;          // Reads gathered for the next compressed frame
+
+    //
+    // When compressing, the writer doesn't know where a sorted run goes in the file until after onNextBatch
+    // returns its size, so the block is recorded in onBatchPlaced().
+    //
+    bool                        blockPending;
+    size_t                      pendingHeader;
+    size_t                      pendingLogicalBytes;
+    bool                        pendingCompressed;
+
+    SortSampleVector*           samples;        // for the run being written, which go with it to the SortBlock
+    size_t                      nextSample;
+
+    SortEntry*                  sortScratch;
+    _int64                      sortScratchCount;
+
+    //
+    // Whether the next batch starts with the header.  This can't go by the batch's offset, because when the batches are kept in
+    // memory nothing may have been placed in the file yet.
+    //
+    bool                        headerNext;
 };
 
 class SortedDataFilterSupplier : public DataWriter::FilterSupplier
@@ -132,11 +325,17 @@ public:
         bool i_emitInternalScore,
         char *i_internalScoreTag,
         FileEncoder* i_encoder,
-        int i_numThreads)
+        int i_numThreads,
+        bool i_compressIntermediate,
+        SegmentedOutputSupplier* i_segmentedOutput,
+        bool i_backgroundMerge,
+        bool i_sortInMemory,
+        bool i_useIoUring,
+        bool i_directIo)
         :
         format(i_fileFormat),
         genome(i_genome),
-        FilterSupplier(DataWriter::CopyFilter),
+        FilterSupplier(i_compressIntermediate ? DataWriter::TransformFilter : DataWriter::CopyFilter),
         encoder(i_encoder),
         tempFileName(i_tempFileName),
         sortedFileName(i_sortedFileName),
@@ -146,7 +345,21 @@ public:
         blocks(),
         emitInternalScore(i_emitInternalScore),
         totalReadsSorted(0),
-        numThreads(i_numThreads)
+        numThreads(i_numThreads),
+        compressIntermediate(i_compressIntermediate),
+        intermediateBytes(0),
+        intermediateLogicalBytes(0),
+        segmentedOutput(i_segmentedOutput),
+        backgroundMerge(i_backgroundMerge),
+        mergerStarted(false),
+        stopMerging(false),
+        nRunsMerged(0),
+        nextRunNumber(0),
+        sortInMemory(i_sortInMemory),
+        useIoUring(i_useIoUring),
+        directIo(i_directIo),
+        residentBytes(0),
+        headerBuffer(NULL)
     {
         if (emitInternalScore) {
             if (strlen(i_internalScoreTag) != 2) {  // This should never happen, since the command line parser should catch it first.  Still, since we're about to strcpy into a fixed-length buffer, safety first.
@@ -158,12 +371,24 @@ public:
             internalScoreTag[0] = '\0';
         }
         InitializeExclusiveLock(&lock);
+        if (backgroundMerge) {
+            CreateEventObject(&mergeWork);
+            CreateSingleWaiterObject(&mergerDone);
+        }
     }
 
     virtual ~SortedDataFilterSupplier()
     {
         DestroyExclusiveLock(&lock);
+        if (backgroundMerge) {
+            DestroyEventObject(&mergeWork);
+            DestroySingleWaiterObject(&mergerDone);
+        }
+        if (headerBuffer != NULL) {
+            BigDealloc(headerBuffer);
+        }
         delete encoder;
+        delete segmentedOutput;
     }
 
     virtual DataWriter::Filter* getFilter();
@@ -179,14 +404,65 @@ public:
     }
 
 #ifndef VALIDATE_SORT
-	void addBlock(size_t start, size_t bytes, DataReader *reader = NULL);
+	void addBlock(size_t start, size_t bytes, DataReader *reader = NULL, size_t logicalBytes = 0, bool compressed = false, SortSampleVector* samples = NULL);
 #else
     void addBlock(size_t start, size_t bytes, GenomeLocationOrderedByOriginalContigs minLocation, GenomeLocationOrderedByOriginalContigs maxLocation);
 #endif
 
+    // Whether the merge might be split into ranges, in which case the sorted runs need to be sampled
+    bool wantsSamples() {
+        return segmentedOutput != NULL;
+    }
+
+    // The part of the intermediate file in [fileOffset, fileOffset + bytes) is on disk, so its runs can be merged in the background
+    void onBatchWritten(size_t fileOffset, size_t bytes);
+
+    // When sorting in memory, whether a sorted batch of this size fits in what's left of the sort memory, in which case it's taken
+    bool reserveResident(size_t bytes);
+
+    // Keeps a copy of the header, which otherwise would be read back from the intermediate file
+    void setHeader(const char* data, size_t bytes);
+
 private:
     bool mergeSort();
-    void mergeSortThread(SortBlockVector* blocksForThisThread, DataWriter *writer);
+    bool mergeSortSerial();
+
+    // Copies the header to the writer, using the block's reader (and then putting it back) if it's not NULL and is at the header
+    void writeHeader(DataWriter* writer, SortBlock* sharedReaderBlock);
+
+    //
+    // Picks the keys that split the genome into ranges with about the same amount of data, based on the samples.
+    // Returns false if there isn't enough data to be worth splitting.
+    //
+    bool chooseRanges(VariableSizeVector<ContigAndPos>* o_rangeStarts);
+    void mergeSortRanges(VariableSizeVector<ContigAndPos>* rangeStarts);
+
+    // Opens a reader positioned at or before the first read in the block that's not less than rangeStart
+    DataReader* openReaderForRange(SortBlock* block, const ContigAndPos* rangeStart, size_t bufferSpacePerReader);
+
+    // Opens a reader on the block's data starting offset bytes into it (which must be at a frame if it's compressed)
+    DataReader* openBlockReader(SortBlock* block, size_t offset, size_t bufferSpacePerReader);
+
+    const char* blockFileName(SortBlock* block) {
+        return block->fileName != NULL ? block->fileName : tempFileName;
+    }
+
+    //
+    // Background merging.  While the aligner is still writing, a thread merges each FanIn runs that have been written at the
+    // same level into one run in a file of its own, so that the final merge has fewer, larger runs to read.
+    //
+    static void MergerThreadMain(void* threadParameter);
+    void mergerThread();
+    void stopMerger();
+
+    // Picks runs to merge and marks them as merging, or returns false if there aren't enough yet.  Must hold the lock.
+    bool chooseBackgroundMerge(SortBlockVector* o_sources);
+    void mergeInBackground(SortBlockVector* sources);
+
+    static const int                FanIn = 8;
+
+    // Returns the number of reads merged
+    _int64 mergeSortThread(SortBlockVector* blocksForThisThread, DataWriter *writer, const ContigAndPos* rangeStart, const ContigAndPos* rangeEnd);
     static void MergeSortThreadMain(void* threadParameter);
 
     void mergeSortNode(DataReader* readers, int nReaders, DataWriter* writer);  // Merges the data from the readers, and writes it to the writers.
@@ -206,8 +482,29 @@ private:
     char                            internalScoreTag[3];
     _int64                          totalReadsSorted;
     int                             numThreads;
+    bool                            compressIntermediate;
+    _int64                          intermediateBytes;          // In the intermediate file
+    _int64                          intermediateLogicalBytes;   // Before compression
+    SegmentedOutputSupplier*        segmentedOutput;
+
+    static const size_t             MinRangeBytes = 32 * 1024 * 1024;
+
+    const bool                      backgroundMerge;
+    bool                            mergerStarted;
+    bool                            stopMerging;
+    EventObject                     mergeWork;      // open when there may be runs to merge, or it's time to stop
+    SingleWaiterObject              mergerDone;
+    int                             nRunsMerged;
+    int                             nextRunNumber;
+
+    const bool                      sortInMemory;
+    const bool                      useIoUring;     // for the sorted file; the intermediate file never uses it
+    const bool                      directIo;
+    size_t                          residentBytes;  // of sorted batches kept in memory
+    char*                           headerBuffer;   // NULL unless it was kept in memory
 
 	friend class SortedDataFilter;
+    friend class SortRunWriter;
 };
 
 class ParallelQueue
@@ -773,7 +1070,7 @@ DataQueueReader::nextBatch()
 class BufferDataReader : public DataReader
 {
 public:
-    BufferDataReader(size_t dataSize_) : dataSize(dataSize_), readOffsetInBuffer(0)
+    BufferDataReader(size_t dataSize_) : dataSize(dataSize_), readOffsetInBuffer(0), ownsBuffer(true)
     {
         buffer = (char*)BigAlloc(dataSize + 4096);   // Allow a little empty space at the end
         memset(buffer, 0, dataSize + 4096);         // Write it sequentially, because random causes a lot of system work.
@@ -782,6 +1079,9 @@ public:
         //
     }
 
+    // Reads part of another BufferDataReader's buffer, which stays with its owner.
+    BufferDataReader(char* i_buffer, size_t dataSize_) : buffer(i_buffer), dataSize(dataSize_), readOffsetInBuffer(0), ownsBuffer(false) {}
+
     char* getBuffer() 
     {
         return buffer;
@@ -789,7 +1089,7 @@ public:
 
     ~BufferDataReader()
     {
-        if (buffer != NULL) {
+        if (buffer != NULL && ownsBuffer) {
             BigDealloc(buffer);
             buffer = NULL;
         }
@@ -898,8 +1198,311 @@ private:
     char* buffer;
     size_t dataSize;
     size_t readOffsetInBuffer;
+    bool ownsBuffer;
 }; // BufferDataReader
 
+//
+// Reads a compressed block of the intermediate file for the merge, decompressing its frames into a buffer that always
+// holds at least a whole read (unless it's at the end of the block).
+//
+class CompressedSpillDataReader : public DataReader
+{
+public:
+    CompressedSpillDataReader(DataReader* i_inner) : inner(i_inner), validBytes(0), consumed(0), innerDone(false)
+    {
+        bufferSize = MinimumBytes + 4 * FastBlockCodec::MaxBlockSize;
+        buffer = (char*)BigAlloc(bufferSize);
+    }
+
+    ~CompressedSpillDataReader()
+    {
+        delete inner;
+        BigDealloc(buffer);
+        buffer = NULL;
+    }
+
+    // Overflow that the underlying reader needs so that any frame that starts in a batch is entirely in it.
+    static const _int64 InnerOverflowBytes = sizeof(SpillFrameHeader) + FastBlockCodec::MaxBlockSize;
+
+    bool init(const char* fileName) { return inner->init(fileName); }
+
+    char* readHeader(_int64* io_headerSize)
+    {
+        WriteErrorMessage("CompressedSpillDataReader: readHeader() called.\n");
+        soft_exit(1);
+        return NULL;
+    }
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess)
+    {
+        inner->reinit(startingOffset, amountOfFileToProcess);
+        validBytes = 0;
+        consumed = 0;
+        innerDone = false;
+    }
+
+    virtual bool getData(char** o_buffer, _int64* o_validBytes, _int64* o_startBytes = NULL)
+    {
+        if (validBytes - consumed < MinimumBytes) {
+            fill();
+        }
+
+        *o_buffer = buffer + consumed;
+        *o_validBytes = validBytes - consumed;
+        if (o_startBytes != NULL) {
+            *o_startBytes = *o_validBytes;
+        }
+
+        return *o_validBytes > 0;
+    }
+
+    virtual void advance(_int64 bytes)
+    {
+        _ASSERT(bytes >= 0 && consumed + bytes <= validBytes);
+        consumed += bytes;
+    }
+
+    virtual void nextBatch()
+    {
+        fill();
+    }
+
+    virtual bool isEOF()
+    {
+        return innerDone && consumed >= validBytes;
+    }
+
+    virtual DataBatch getBatch()
+    {
+        return DataBatch();
+    }
+
+    virtual void holdBatch(DataBatch batch)
+    {
+        WriteErrorMessage("CompressedSpillDataReader: holdbatch not supported\n");
+        soft_exit(1);
+    }
+
+    virtual bool releaseBatch(DataBatch batch)
+    {
+        WriteErrorMessage("CompressedSpillDataReader: releaseBatch not supported\n");
+        soft_exit(1);
+        return true;
+    }
+
+    virtual _int64 getFileOffset()
+    {
+        WriteErrorMessage("CompressedSpillDataReader: getFileOffset not supported\n");
+        soft_exit(1);
+        return -1;
+    }
+
+    virtual void getExtra(char** o_extra, _int64* o_length)
+    {
+        WriteErrorMessage("CompressedSpillDataReader: getExtra not supported\n");
+        soft_exit(1);
+    }
+
+    virtual const char* getFilename()
+    {
+        return inner->getFilename();
+    }
+
+private:
+    static const size_t MinimumBytes = MAX_READ_LENGTH * 8;
+
+    // Move what's left to the front of the buffer and decompress as many frames after it as fit.
+    void fill()
+    {
+        memmove(buffer, buffer + consumed, validBytes - consumed);
+        validBytes -= consumed;
+        consumed = 0;
+
+        while (!innerDone && bufferSize - validBytes >= FastBlockCodec::MaxBlockSize) {
+            char* data;
+            _int64 bytes;
+            if (!inner->getData(&data, &bytes)) {
+                inner->nextBatch();
+                if (!inner->getData(&data, &bytes)) {
+                    innerDone = true;
+                    break;
+                }
+            }
+
+            SpillFrameHeader frameHeader;
+            if (bytes < (_int64)sizeof(frameHeader)) {
+                WriteErrorMessage("CompressedSpillDataReader: truncated frame header in %s\n", inner->getFilename());
+                soft_exit(1);
+            }
+            memcpy(&frameHeader, data, sizeof(frameHeader));
+            if (frameHeader.logicalBytes > FastBlockCodec::MaxBlockSize || frameHeader.storedBytes > frameHeader.logicalBytes ||
+                (_int64)(sizeof(frameHeader) + frameHeader.storedBytes) > bytes) {
+                WriteErrorMessage("CompressedSpillDataReader: corrupt frame in %s\n", inner->getFilename());
+                soft_exit(1);
+            }
+
+            char* frameData = data + sizeof(frameHeader);
+            if (frameHeader.storedBytes == frameHeader.logicalBytes) {
+                memcpy(buffer + validBytes, frameData, frameHeader.logicalBytes);
+            } else if (!FastBlockCodec::decompress(frameData, frameHeader.storedBytes, buffer + validBytes, frameHeader.logicalBytes)) {
+                WriteErrorMessage("CompressedSpillDataReader: frame failed to decompress in %s\n", inner->getFilename());
+                soft_exit(1);
+            }
+
+            validBytes += frameHeader.logicalBytes;
+            inner->advance(sizeof(frameHeader) + frameHeader.storedBytes);
+        }
+    }
+
+    DataReader*     inner;
+    char*           buffer;
+    size_t          bufferSize;
+    size_t          validBytes;
+    size_t          consumed;
+    bool            innerDone;
+}; // CompressedSpillDataReader
+
+//
+// Writes a run that's merged in the background into a file of its own, in the same format as a run in the intermediate
+// file, so that it can be read the same way.  Closing it fills in the SortBlock that describes the run.
+//
+class SortRunWriter : public DataWriter
+{
+public:
+    SortRunWriter(SortedDataFilterSupplier* i_parent, char* i_fileName, SortBlock* i_result)
+        : DataWriter(NULL), parent(i_parent), fileName(i_fileName), result(i_result), used(0), fileBytes(0), logicalBytes(0),
+          samples(i_parent->wantsSamples() ? new SortSampleVector() : NULL), nextSample(0), firstUnplacedSample(0), output(NULL)
+    {
+        file = fopen(fileName, "wb");
+        if (file == NULL) {
+            WriteErrorMessage("SortRunWriter: unable to open %s for write\n", fileName);
+            soft_exit(1);
+        }
+        buffer = (char*)BigAlloc(BufferSize);
+        if (parent->compressIntermediate) {
+            output = (char*)BigAlloc(FastBlockCodec::MaxBlockSize + sizeof(SpillFrameHeader));
+        }
+    }
+
+    virtual ~SortRunWriter()
+    {
+        BigDealloc(buffer);
+        if (output != NULL) {
+            BigDealloc(output);
+        }
+    }
+
+    virtual bool getBuffer(char** o_buffer, size_t* o_size)
+    {
+        *o_buffer = buffer + used;
+        *o_size = BufferSize - used;
+        return *o_size > 0;
+    }
+
+    virtual void advance(_int64 bytes, GenomeLocation location = 0)
+    {
+        _ASSERT(used + bytes <= BufferSize);
+        if (samples != NULL && logicalBytes >= nextSample) {
+            OriginalContigNum originalContigNum;
+            int pos;
+            parent->format->getSortInfo(parent->genome, buffer + used, bytes, NULL, NULL, &originalContigNum, &pos);
+            samples->push_back(SortSample(ContigAndPos(originalContigNum, pos), logicalBytes, 0));  // offset is logical until its frame is written
+            nextSample = logicalBytes + SampleInterval;
+        }
+        used += bytes;
+        logicalBytes += bytes;
+    }
+
+    virtual bool getBatch(int relative, char** o_buffer, size_t* o_size = NULL, size_t* o_used = NULL, size_t* o_offset = NULL, size_t* o_logicalUsed = 0, size_t* o_logicalOffset = NULL)
+    {
+        WriteErrorMessage("SortRunWriter: getBatch not implemented\n");
+        soft_exit(1);
+        return false;
+    }
+
+    virtual bool nextBatch(bool lastBatch = false)
+    {
+        flush(lastBatch);
+        return true;
+    }
+
+    virtual void close()
+    {
+        flush(true);
+        if (fclose(file) != 0) {
+            WriteErrorMessage("SortRunWriter: error closing %s\n", fileName);
+            soft_exit(1);
+        }
+        file = NULL;
+
+        result->start = 0;
+        result->bytes = fileBytes;
+        result->logicalBytes = logicalBytes;
+        result->compressed = output != NULL;
+        result->samples = samples;
+        result->fileName = fileName;
+        result->written = true;
+    }
+
+private:
+    //
+    // Writes out the buffer.  Compressed runs are cut into frames every MaxBlockSize bytes of reads from the start of the run,
+    // so unless it's the end of the run a partial frame stays in the buffer for next time.
+    //
+    void flush(bool all)
+    {
+        if (output == NULL) {
+            write(buffer, used);
+            used = 0;
+            return;
+        }
+
+        size_t frameStart = 0;
+        while (used - frameStart >= FastBlockCodec::MaxBlockSize || (all && frameStart < used)) {
+            size_t frameBytes = __min(used - frameStart, FastBlockCodec::MaxBlockSize);
+            size_t frameLogicalOffset = logicalBytes - used + frameStart;
+            for (; samples != NULL && firstUnplacedSample < samples->size() && (*samples)[firstUnplacedSample].offset < frameLogicalOffset + frameBytes; firstUnplacedSample++) {
+                SortSample* sample = &(*samples)[firstUnplacedSample];
+                sample->skip = sample->offset - frameLogicalOffset;
+                sample->offset = fileBytes;
+            }
+
+            size_t stored = WriteSpillFrame(buffer + frameStart, frameBytes, output, FastBlockCodec::MaxBlockSize + sizeof(SpillFrameHeader));
+            _ASSERT(stored > 0);    // There's always room to store it as is
+            write(output, stored);
+            frameStart += frameBytes;
+        }
+
+        memmove(buffer, buffer + frameStart, used - frameStart);
+        used -= frameStart;
+    }
+
+    void write(const char* data, size_t bytes)
+    {
+        if (bytes > 0 && fwrite(data, 1, bytes, file) != bytes) {
+            WriteErrorMessage("SortRunWriter: error writing %lld bytes to %s\n", (_int64)bytes, fileName);
+            soft_exit(1);
+        }
+        fileBytes += bytes;
+    }
+
+    static const size_t SampleInterval = 64 * 1024;
+    static const size_t BufferSize = 4 * 1024 * 1024;
+
+    SortedDataFilterSupplier*   parent;
+    char*                       fileName;
+    SortBlock*                  result;
+    FILE*                       file;
+    char*                       buffer;
+    size_t                      used;
+    size_t                      fileBytes;
+    size_t                      logicalBytes;
+    SortSampleVector*           samples;
+    size_t                      nextSample;
+    _int64                      firstUnplacedSample;
+    char*                       output;         // for a compressed frame
+}; // SortRunWriter
+
 
     void
 SortedDataFilter::onAdvance(
@@ -951,7 +1554,14 @@ SortedDataFilter::onNextBatch(
     seenLastBatch |= lastBatch;
 
     // sort buffered reads by location for later merge sort
-    std::stable_sort(locations.begin(), locations.end(), SortEntry::comparator);
+    if (sortScratchCount < locations.size()) {
+        if (sortScratch != NULL) {
+            BigDealloc(sortScratch);
+        }
+        sortScratchCount = locations.size();
+        sortScratch = (SortEntry*)BigAlloc(sizeof(SortEntry) * sortScratchCount);
+    }
+    RadixSortEntries(locations.begin(), locations.size(), sortScratch);
     
     // copy from previous buffer into current in sorted order
     char* fromBuffer;
@@ -965,7 +1575,15 @@ SortedDataFilter::onNextBatch(
         WriteErrorMessage("SortedDataFilter::onNextBatch getBatch of old buffer failed\n");
     }
 
-    if (!lastBatch || offset == 0 || bytes == 0 || *needMoreBuffer) {    // Don't do the last batch optimization at offset 0, because we have special handling for the header.
+    // handle header specially
+    size_t header = headerNext && locations.size() > 0 ? locations[0].length : 0;
+    headerNext = false;
+
+    //
+    // Don't do the last batch optimization for the header, because we have special handling for it.  When sorting in
+    // memory, any batch that fits is kept, and if it has the header, that's kept separately.
+    //
+    if (bytes == 0 || *needMoreBuffer || !((lastBatch && header == 0) || parent->reserveResident(bytes - header))) {
         if (!writer->getBatch(0, &toBuffer, &toSize, &toUsed))
         {
             WriteErrorMessage("SortedDataFilter::onNextBatch getBatch of new buffer failed\n");
@@ -974,18 +1592,41 @@ SortedDataFilter::onNextBatch(
         reader = NULL;
     } else {
         //
-        // For the last batch, we just copy the data into memory instead of writing it to disk and use a BufferDataReader.
-        // Get the data reader here, which allocates the buffer that we'll then copy the data into in sorted order.
+        // Copy the data into memory instead of writing it to disk and use a BufferDataReader.  Get the data reader here,
+        // which allocates the buffer that we'll then copy the data into in sorted order.
         //
-        reader = new BufferDataReader(bytes);
-        toSize = fromSize;
+        if (header > 0) {
+            parent->setHeader(fromBuffer + locations[0].offset, header);
+        }
+        reader = new BufferDataReader(bytes - header);
+        toSize = bytes - header;
         toBuffer = reader->getBuffer();
         toUsed = 0;
     }
 
-    size_t target = 0;
-	GenomeLocation previous = 0;
-    for (VariableSizeVector<SortEntry>::iterator i = locations.begin(); i != locations.end(); i++) {
+    if (parent->wantsSamples()) {
+        samples = new SortSampleVector();
+        nextSample = 0;
+    }
+
+    //
+    // Compress everything but the header (which the merge copies straight out of the file) and the last batch (which stays
+    // in memory anyway).
+    //
+    size_t target = 0;
+    bool compressed = false;
+    if (compress && reader == NULL && header == 0 && bytes > 0) {
+        target = copySortedCompressed(fromBuffer, toBuffer, toSize);
+        compressed = target > 0;
+        if (!compressed && samples != NULL) {
+            samples->clear();   // It'll be copied as is, so the samples have to start over
+            nextSample = 0;
+        }
+    }
+
+    size_t runStart = reader == NULL ? header : 0;   // The header's only in toBuffer if it's going to the file
+	GenomeLocation previous = 0;
+    for (VariableSizeVector<SortEntry>::iterator i = locations.begin() + (reader != NULL && header > 0 ? 1 : 0); !compressed && i != locations.end(); i++) {
 #ifdef VALIDATE_SORT
 		if (locations.size() > 1) { // skip header block
             GenomeLocation loc;
@@ -995,34 +1636,116 @@ SortedDataFilter::onNextBatch(
 			previous = loc;
 		}
 #endif
+        if (target >= runStart) {
+            sample(*i, target - runStart, target - runStart, 0);
+        }
         memcpy(toBuffer + target, fromBuffer + i->offset, i->length);
         target += i->length;
     }
     
     // remember block extent for later merge sort
 
-    // handle header specially
-    size_t header = offset > 0 ? 0 : locations[0].length;
     if (header > 0) {
         parent->setHeaderSize(header);
     }
-	int first = offset == 0;
+	int first = header > 0;
 #ifdef VALIDATE_SORT
     GenomeLocationOrderedByOriginalContigs minLocation = locations.size() > first ? locations[first].location : 0;
     GenomeLocationOrderedByOriginalContigs maxLocation = GenomeLocationOrderedByOriginalContigs(locations.size() > first ? locations[locations.size() - 1].location : UINT32_MAX, genome);
     parent->addBlock(offset + header, bytes - header, minLocation, maxLocation);
 #else
-    parent->addBlock(offset + header, bytes - header, reader);
+    if (compress && reader == NULL) {
+        blockPending = true;
+        pendingHeader = header;
+        pendingLogicalBytes = bytes;
+        pendingCompressed = compressed;
+    } else {
+        parent->addBlock(offset + header, bytes - header, reader, bytes - header, false, samples);
+        samples = NULL;
+    }
 #endif
     locations.clear();
 
     return reader == NULL ? target : UINT64_MAX;
 }
+
+    void
+SortedDataFilter::onBatchPlaced(
+    size_t fileOffset,
+    size_t bytes)
+{
+    if (!blockPending) {
+        return;    // The last batch, which stayed in memory
+    }
+    blockPending = false;
+
+    parent->addBlock(fileOffset + pendingHeader, bytes - pendingHeader, NULL, pendingLogicalBytes - pendingHeader, pendingCompressed, samples);
+    samples = NULL;
+}
+
+    void
+SortedDataFilter::onBatchWritten(
+    size_t fileOffset,
+    size_t bytes)
+{
+    parent->onBatchWritten(fileOffset, bytes);
+}
+
+    size_t
+SortedDataFilter::copySortedCompressed(
+    char* fromBuffer,
+    char* toBuffer,
+    size_t toSize)
+{
+    if (frame == NULL) {
+        frame = (char*)BigAlloc(FastBlockCodec::MaxBlockSize);
+    }
+
+    size_t target = 0;
+    size_t frameBytes = 0;
+    size_t logical = 0;
+    for (VariableSizeVector<SortEntry>::iterator i = locations.begin(); i != locations.end(); i++) {
+        sample(*i, logical, target, frameBytes);   // The current frame will start at target
+        logical += i->length;
+        for (_int64 copied = 0; copied < i->length; ) {
+            size_t n = __min((size_t)(i->length - copied), FastBlockCodec::MaxBlockSize - frameBytes);
+            memcpy(frame + frameBytes, fromBuffer + i->offset + copied, n);
+            frameBytes += n;
+            copied += n;
+
+            if (frameBytes == FastBlockCodec::MaxBlockSize) {
+                if (!writeFrame(frameBytes, toBuffer, toSize, &target)) {
+                    return 0;
+                }
+                frameBytes = 0;
+            }
+        }
+    }
+
+    if (frameBytes > 0 && !writeFrame(frameBytes, toBuffer, toSize, &target)) {
+        return 0;
+    }
+
+    return target;
+}
+
+    bool
+SortedDataFilter::writeFrame(
+    size_t frameBytes,
+    char* toBuffer,
+    size_t toSize,
+    size_t* io_target)
+{
+    size_t used = WriteSpillFrame(frame, frameBytes, toBuffer + *io_target, toSize - *io_target);
+    *io_target += used;
+
+    return used > 0;
+}
     
     DataWriter::Filter*
 SortedDataFilterSupplier::getFilter()
 {
-    return new SortedDataFilter(this);
+    return new SortedDataFilter(this, compressIntermediate);
 }
 
     void
@@ -1038,6 +1761,8 @@ SortedDataFilterSupplier::onClosed(
         }
         return;
     }
+    stopMerger();
+
     // merge sort into final file
     if (! mergeSort()) {
         WriteErrorMessage( "merge sort failed\n");
@@ -1054,10 +1779,20 @@ SortedDataFilterSupplier::addBlock(
 	, GenomeLocationOrderedByOriginalContigs maxLocation
 #endif
     , DataReader *reader
+    , size_t logicalBytes
+    , bool compressed
+    , SortSampleVector* samples
 	)
 {
-    if (bytes > 0) {
+    if (bytes == 0) {
+        delete samples;
+    } else {
         AcquireExclusiveLock(&lock);
+        if (reader == NULL) {
+            intermediateBytes += bytes;
+            intermediateLogicalBytes += logicalBytes;
+            InterlockedAdd64AndReturnNewValue(&DataWriter::SortSpillBytes, bytes);
+        }
 #if VALIDATE_SORT
 		for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
 			_ASSERT(i->start + i->length <= start || start + bytes <= i->start);
@@ -1066,6 +1801,9 @@ SortedDataFilterSupplier::addBlock(
         SortBlock block(reader);
         block.start = start;
         block.bytes = bytes;
+        block.logicalBytes = logicalBytes;
+        block.compressed = compressed;
+        block.samples = samples;
 #if VALIDATE_SORT
 		block.minLocation = minLocation;
 		block.maxLocation = maxLocation;
@@ -1075,12 +1813,207 @@ SortedDataFilterSupplier::addBlock(
     }
 }
 
+    void
+SortedDataFilterSupplier::onBatchWritten(
+    size_t fileOffset,
+    size_t bytes)
+{
+    if (!backgroundMerge) {
+        return;
+    }
+
+    AcquireExclusiveLock(&lock);
+    bool anyWritten = false;
+    for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
+        if (i->fileName == NULL && i->reader == NULL && !i->written && i->start >= fileOffset && i->start < fileOffset + bytes) {
+            i->written = true;
+            anyWritten = true;
+        }
+    }
+
+    if (anyWritten && !stopMerging) {
+        if (!mergerStarted) {
+            mergerStarted = true;
+            if (!StartNewThread(MergerThreadMain, this)) {
+                WriteErrorMessage("SortedDataFilterSupplier: StartNewThread failed for background merge\n");
+                soft_exit(1);
+            }
+        }
+        AllowEventWaitersToProceed(&mergeWork);
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+    bool
+SortedDataFilterSupplier::reserveResident(
+    size_t bytes)
+{
+    if (!sortInMemory) {
+        return false;
+    }
+
+    AcquireExclusiveLock(&lock);
+    bool fits = residentBytes + bytes <= bufferSpace;
+    if (fits) {
+        residentBytes += bytes;
+    }
+    ReleaseExclusiveLock(&lock);
+
+    return fits;
+}
+
+    void
+SortedDataFilterSupplier::setHeader(
+    const char* data,
+    size_t bytes)
+{
+    _ASSERT(headerBuffer == NULL);
+    headerBuffer = (char*)BigAlloc(bytes);
+    memcpy(headerBuffer, data, bytes);
+}
+
+    void
+SortedDataFilterSupplier::MergerThreadMain(void* threadParameter)
+{
+    ((SortedDataFilterSupplier*)threadParameter)->mergerThread();
+}
+
+    void
+SortedDataFilterSupplier::mergerThread()
+{
+    for (;;) {
+        WaitForEvent(&mergeWork);
+
+        SortBlockVector sources;
+        AcquireExclusiveLock(&lock);
+        if (stopMerging) {
+            ReleaseExclusiveLock(&lock);
+            break;
+        }
+        bool found = chooseBackgroundMerge(&sources);
+        if (!found) {
+            PreventEventWaitersFromProceeding(&mergeWork);
+        }
+        ReleaseExclusiveLock(&lock);
+
+        if (found) {
+            mergeInBackground(&sources);
+        }
+    }
+
+    SignalSingleWaiterObject(&mergerDone);
+}
+
+    void
+SortedDataFilterSupplier::stopMerger()
+{
+    if (!backgroundMerge) {
+        return;
+    }
+
+    //
+    // This lets a merge that's under way finish, since its output replaces its inputs.
+    //
+    AcquireExclusiveLock(&lock);
+    stopMerging = true;
+    bool started = mergerStarted;
+    if (started) {
+        AllowEventWaitersToProceed(&mergeWork);
+    }
+    ReleaseExclusiveLock(&lock);
+
+    if (started) {
+        WaitForSingleWaiterObject(&mergerDone);
+    }
+}
+
+    bool
+SortedDataFilterSupplier::chooseBackgroundMerge(
+    SortBlockVector* o_sources)
+{
+    //
+    // Merge the lowest level first, so that runs only get merged with others of about the same size.  The runs that stay in
+    // memory are left for the final merge.
+    //
+    for (int level = 0; ; level++) {
+        int nAtLevel = 0;
+        bool anyHigher = false;
+        for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
+            if (i->reader == NULL && i->written && !i->merging) {
+                nAtLevel += i->level == level;
+                anyHigher |= i->level > level;
+            }
+        }
+
+        if (nAtLevel >= FanIn) {
+            for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end() && o_sources->size() < FanIn; i++) {
+                if (i->reader == NULL && i->written && !i->merging && i->level == level) {
+                    i->merging = true;
+                    o_sources->push_back(*i);
+                }
+            }
+            return true;
+        }
+
+        if (!anyHigher) {
+            return false;
+        }
+    }
+}
+
+    void
+SortedDataFilterSupplier::mergeInBackground(
+    SortBlockVector* sources)
+{
+    size_t bufferSpacePerReader = __min(1UL << 22, __max(1UL << 17, bufferSpace / (8 * FanIn)));  // 128kB to 4MB
+    int level = 0;
+    for (SortBlockVector::iterator b = sources->begin(); b != sources->end(); b++) {
+        level = __max(level, b->level);
+        b->reader = openBlockReader(&(*b), 0, bufferSpacePerReader);
+    }
+
+    char* runFileName = new char[strlen(tempFileName) + 20];
+    sprintf(runFileName, "%s.run%d", tempFileName, nextRunNumber++);
+
+    SortBlock run;
+    mergeSortThread(sources, new SortRunWriter(this, runFileName, &run), NULL, NULL);   // deletes the writer and readers
+    run.level = level + 1;
+
+    AcquireExclusiveLock(&lock);
+    for (SortBlockVector::iterator b = sources->begin(); b != sources->end(); b++) {
+        for (_int64 i = 0; i < blocks.size(); i++) {
+            if (blocks[i].fileName == b->fileName && blocks[i].start == b->start && blocks[i].reader == NULL) {
+                blocks.erase(i);
+                break;
+            }
+        }
+    }
+    blocks.push_back(run);
+    nRunsMerged += (int)sources->size();
+    ReleaseExclusiveLock(&lock);
+
+    for (SortBlockVector::iterator b = sources->begin(); b != sources->end(); b++) {
+        delete b->samples;
+        if (b->fileName != NULL) {
+            if (!DeleteSingleFile(b->fileName)) {
+                WriteErrorMessage("warning: failure deleting temp file %s\n", b->fileName);
+            }
+            delete[] b->fileName;
+        }
+    }
+}
+
 struct MergeSortThreadState
 {
     SortedDataFilterSupplier* filterSupplier;
     bool deleteSortBlockVector;
     SortBlockVector* blocksForThisThread;
     DataWriter* writer;
+    const ContigAndPos* rangeStart;   // NULL for the beginning of the genome
+    const ContigAndPos* rangeEnd;     // NULL for the end, otherwise the first key that's not in the range
+    SingleWaiterObject* done;
+
+    MergeSortThreadState() : rangeStart(NULL), rangeEnd(NULL), done(NULL) {}
 };
 
 _int64 mergeSortStartTime;
@@ -1090,19 +2023,23 @@ SortedDataFilterSupplier::MergeSortThreadMain(void* threadParameter)
 {
     MergeSortThreadState* state = (MergeSortThreadState*)threadParameter;
  //   fprintf(stderr, "%lld: MergeSortThread %d, deleteSortBlockVector %d\n", timeInMillis() - mergeSortStartTime, GetCurrentThreadId(), state->deleteSortBlockVector);
-    state->filterSupplier->mergeSortThread(state->blocksForThisThread, state->writer);
+    _int64 total = state->filterSupplier->mergeSortThread(state->blocksForThisThread, state->writer, state->rangeStart, state->rangeEnd);
+    InterlockedAdd64AndReturnNewValue(&state->filterSupplier->totalReadsSorted, total);
 
     if (state->deleteSortBlockVector)
     {
         delete state->blocksForThisThread;
     }
+    if (state->done != NULL) {
+        SignalSingleWaiterObject(state->done);
+    }
     delete state;
 }
     //
     // Merge a set of reads coming from readers (either queue or file) into a writer (also either a queue or a file).
     //
-    void
-SortedDataFilterSupplier::mergeSortThread(SortBlockVector* blocksForThisThread, DataWriter* writer) 
+    _int64
+SortedDataFilterSupplier::mergeSortThread(SortBlockVector* blocksForThisThread, DataWriter* writer, const ContigAndPos* rangeStart, const ContigAndPos* rangeEnd) 
 {
     _int64 readWaitTime = 0;
     _int64 writeWaitTime = 0;
@@ -1131,6 +2068,29 @@ SortedDataFilterSupplier::mergeSortThread(SortBlockVector* blocksForThisThread,
         format->getSortInfo(genome, b->data, bytes, NULL, &b->length, &originalContigNum, &pos);
         b->contigAndPos = ContigAndPos(originalContigNum, pos);
 
+        //
+        // A reader for a range starts a little before it, so skip up to the range.
+        //
+        bool inRange = true;
+        while (rangeStart != NULL && b->contigAndPos < *rangeStart) {
+            b->reader->advance(b->length);
+            if (!b->reader->getData(&b->data, &bytes)) {
+                b->reader->nextBatch();
+                if (!b->reader->getData(&b->data, &bytes)) {
+                    inRange = false;
+                    break;
+                }
+            }
+            format->getSortInfo(genome, b->data, bytes, NULL, &b->length, &originalContigNum, &pos);
+            b->contigAndPos = ContigAndPos(originalContigNum, pos);
+        }
+
+        if (!inRange || (rangeEnd != NULL && b->contigAndPos >= *rangeEnd)) {
+            delete b->reader;
+            b->reader = NULL;
+            continue;
+        }
+
         queue.add((_uint32)(b - blocksForThisThread->begin()), b->contigAndPos);
     }
 
@@ -1211,14 +2171,17 @@ SortedDataFilterSupplier::mergeSortThread(SortBlockVector* blocksForThisThread,
             format->getSortInfo(genome, b->data, readBytes, NULL, &b->length, &originalContigNum, &pos);
             b->contigAndPos = ContigAndPos(originalContigNum, pos);
             _ASSERT(b->length <= readBytes && b->contigAndPos >= previous);
+            if (rangeEnd != NULL && b->contigAndPos >= *rangeEnd) {
+                delete b->reader;
+                b->reader = NULL;
+                break;
+            }
         }
         if (b->reader != NULL) {
             queue.add(smallestIndex, b->contigAndPos);
         }
     }
 
-    InterlockedAdd64AndReturnNewValue(&totalReadsSorted, total);
-
     // writer->nextBatch();
     // close everything
     _int64 start = timeInMillis();
@@ -1227,6 +2190,8 @@ SortedDataFilterSupplier::mergeSortThread(SortBlockVector* blocksForThisThread,
     delete writer;
 
     //fprintf(stderr, "%lld: Thread %d read %lldms, write %lldms\n", timeInMillis() - mergeSortStartTime, GetCurrentThreadId(), readWaitTime, writeWaitTime);
+
+    return total;
 }
 
     bool
@@ -1242,9 +2207,69 @@ SortedDataFilterSupplier::mergeSort()
     _int64 startWriteWaitTime = DataWriter::WaitTime;
     _int64 startWriteFilterTime = DataWriter::FilterTime;
 
+    if (headerSize > 0xffffffff) {
+        WriteErrorMessage("SortedDataFilterSupplier: headerSize too big\n");
+        soft_exit(1);
+    }
+
+    VariableSizeVector<ContigAndPos> rangeStarts;
+    if (segmentedOutput != NULL && chooseRanges(&rangeStarts)) {
+        mergeSortRanges(&rangeStarts);
+    } else if (!mergeSortSerial()) {
+        return false;
+    }
+
+    for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
+        delete i->samples;
+        i->samples = NULL;
+        if (i->fileName != NULL) {
+            if (!DeleteSingleFile(i->fileName)) {
+                WriteErrorMessage("warning: failure deleting temp file %s\n", i->fileName);
+            }
+            delete[] i->fileName;
+            i->fileName = NULL;
+        }
+    }
+
+    if (! DeleteSingleFile(tempFileName)) {
+        WriteErrorMessage( "warning: failure deleting temp file %s\n", tempFileName);
+    }
+
+    WriteStatusMessage("sorted %lld reads in %u blocks, %lld s\n"
+        /*"read wait align %.3f s + merge %.3f s, read release align %.3f s + merge %.3f s\n"
+        "write wait %.3f s align + %.3f s merge, write filter %.3f s align + %.3f s merge\n"*/,
+        totalReadsSorted, blocks.size(), (timeInMillis() - start)/1000 /*,
+        startReadWaitTime * 1e-9, (DataReader::ReadWaitTime - startReadWaitTime) * 1e-9,
+        startReleaseWaitTime * 1e-9, (DataReader::ReleaseWaitTime - startReleaseWaitTime) * 1e-9,
+        startWriteWaitTime * 1e-9, (DataWriter::WaitTime - startWriteWaitTime) * 1e-9,
+        startWriteFilterTime * 1e-9, (DataWriter::FilterTime - startWriteFilterTime) * 1e-9*/);
+
+    if (compressIntermediate && intermediateLogicalBytes > 0) {
+        WriteStatusMessage("sort intermediate data compressed from %lld to %lld MB (%.2fx)\n", intermediateLogicalBytes >> 20, intermediateBytes >> 20,
+            (double)intermediateLogicalBytes / __max((_int64)1, intermediateBytes));
+    }
+    if (sortInMemory) {
+        if (intermediateLogicalBytes == 0) {
+            WriteStatusMessage("sorted entirely in memory\n");
+        } else {
+            WriteStatusMessage("kept %lld MB of sorted reads in memory, and %lld MB that didn't fit went to the intermediate file\n", (_int64)residentBytes >> 20, intermediateLogicalBytes >> 20);
+        }
+    }
+    if (nRunsMerged > 0) {
+        WriteStatusMessage("merged %d sorted runs in the background during alignment\n", nRunsMerged);
+    }
+    if (rangeStarts.size() > 0) {
+        WriteStatusMessage("merged %d ranges of the genome in parallel\n", (int)rangeStarts.size() + 1);
+    }
+    return true;
+}
+
+    bool
+SortedDataFilterSupplier::mergeSortSerial()
+{
     // set up buffered output
     DataWriterSupplier* writerSupplier = DataWriterSupplier::create(sortedFileName, bufferSize, emitInternalScore, internalScoreTag ,sortedFilterSupplier,
-        encoder, encoder != NULL ? 6 : 4); // use more buffers to let encoder run async
+        encoder, encoder != NULL ? 6 : 4, useIoUring, directIo); // use more buffers to let encoder run async
     DataWriter* writer = writerSupplier->getWriter();
     if (writer == NULL) {
         WriteErrorMessage( "open sorted file for write failed\n");
@@ -1258,75 +2283,12 @@ SortedDataFilterSupplier::mergeSort()
     for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
         if (i->reader == NULL) // Otheriwse, it's the last block that's in memory
         {
-            i->reader = readerSupplier->getDataReader(1, MAX_READ_LENGTH * 8, 0.0,
-                __min(1UL << 23, __max(1UL << 17, bufferSpace / blocks.size()))); // 128kB to 8MB buffer space per block
-            if (!i->reader->init(tempFileName)) {
-                WriteErrorMessage("SortedDataFilterSupplier::mergeSort: reader->init(%s) failed\n", tempFileName);
-                soft_exit(1);
-            }
-            i->reader->reinit(i->start, i->bytes);
+            i->reader = openBlockReader(&(*i), 0, __min(1UL << 23, __max(1UL << 17, bufferSpace / blocks.size()))); // 128kB to 8MB buffer space per block
         }
     }
 
-    // write out header
-    if (headerSize > 0xffffffff) {
-        WriteErrorMessage("SortedDataFilterSupplier: headerSize too big\n");
-        soft_exit(1);
-    }
     if (headerSize > 0) {
-        DataReader* headerReader;
-        if (blocks[0].dataReaderIsBuffer) 
-        {
-            headerReader = readerSupplier->getDataReader(1, 0, 0.0, 0);
-            if (!headerReader->init(tempFileName)) {
-                WriteErrorMessage("SortedDataFilterSupplier::mergeSort: reader->init(%s) failed for headerReader\n", tempFileName);
-                soft_exit(1);
-            }
-        } else {
-            headerReader = blocks[0].reader;
-        }
-        headerReader->reinit(0, headerSize);
-		writer->inHeader(true);
-        char* rbuffer;
-        _int64 rbytes;
-        char* wbuffer;
-        size_t wbytes;
-		for (size_t left = headerSize; left > 0; ) {
-			if ((!headerReader->getData(&rbuffer, &rbytes)) || rbytes == 0) {
-                headerReader->nextBatch();
-				if (!headerReader->getData(&rbuffer, &rbytes)) {
-					WriteErrorMessage( "read header failed, left %lld, headerSize %lld\n", left, headerSize);
-                    headerReader->dumpState();
-					soft_exit(1);
-				}
-			}
-
-			if ((! writer->getBuffer(&wbuffer, &wbytes)) || wbytes == 0) {
-				writer->nextBatch();
-				if (! writer->getBuffer(&wbuffer, &wbytes)) {
-					WriteErrorMessage( "write header failed\n");
-					soft_exit(1);
-				}
-			}
-			size_t xfer = min(left, min((size_t) rbytes, wbytes));
-			_ASSERT(xfer > 0 && xfer <= UINT32_MAX);
-			memcpy(wbuffer, rbuffer, xfer);
-
-            headerReader->advance(xfer);
-			writer->advance((unsigned) xfer);
-			left -= xfer;
-		}
-
-        if (blocks[0].dataReaderIsBuffer) 
-        {
-            delete headerReader;
-        } else {
-            blocks[0].reader->reinit(blocks[0].start, blocks[0].bytes);
-        }
-        headerReader = NULL;
-
-		writer->nextBatch();
-		writer->inHeader(false);
+        writeHeader(writer, blocks.size() > 0 ? &blocks[0] : NULL);
     }
 
     //
@@ -1412,21 +2374,258 @@ SortedDataFilterSupplier::mergeSort()
 
     writerSupplier->close();
     delete writerSupplier;
-    if (! DeleteSingleFile(tempFileName)) {
-        WriteErrorMessage( "warning: failure deleting temp file %s\n", tempFileName);
-    }
 
-    WriteStatusMessage("sorted %lld reads in %u blocks, %lld s\n"
-        /*"read wait align %.3f s + merge %.3f s, read release align %.3f s + merge %.3f s\n"
-        "write wait %.3f s align + %.3f s merge, write filter %.3f s align + %.3f s merge\n"*/,
-        totalReadsSorted, blocks.size(), (timeInMillis() - start)/1000 /*,
-        startReadWaitTime * 1e-9, (DataReader::ReadWaitTime - startReadWaitTime) * 1e-9,
-        startReleaseWaitTime * 1e-9, (DataReader::ReleaseWaitTime - startReleaseWaitTime) * 1e-9,
-        startWriteWaitTime * 1e-9, (DataWriter::WaitTime - startWriteWaitTime) * 1e-9,
-        startWriteFilterTime * 1e-9, (DataWriter::FilterTime - startWriteFilterTime) * 1e-9*/);
     return true;
 }
 
+    void
+SortedDataFilterSupplier::writeHeader(
+    DataWriter* writer,
+    SortBlock* sharedReaderBlock)
+{
+    DataReader* headerReader;
+    bool separateHeaderReader = sharedReaderBlock == NULL || sharedReaderBlock->dataReaderIsBuffer || sharedReaderBlock->compressed   // The header itself is never compressed
+        || sharedReaderBlock->fileName != NULL || headerBuffer != NULL;
+    if (headerBuffer != NULL) {
+        headerReader = new BufferDataReader(headerBuffer, headerSize);
+    } else if (separateHeaderReader) 
+    {
+        headerReader = DataSupplier::Default->getDataReader(1, 0, 0.0, 0);
+        if (!headerReader->init(tempFileName)) {
+            WriteErrorMessage("SortedDataFilterSupplier::mergeSort: reader->init(%s) failed for headerReader\n", tempFileName);
+            soft_exit(1);
+        }
+        headerReader->reinit(0, headerSize);
+    } else {
+        headerReader = sharedReaderBlock->reader;
+        headerReader->reinit(0, headerSize);
+    }
+	writer->inHeader(true);
+    char* rbuffer;
+    _int64 rbytes;
+    char* wbuffer;
+    size_t wbytes;
+	for (size_t left = headerSize; left > 0; ) {
+		if ((!headerReader->getData(&rbuffer, &rbytes)) || rbytes == 0) {
+            headerReader->nextBatch();
+			if (!headerReader->getData(&rbuffer, &rbytes)) {
+				WriteErrorMessage( "read header failed, left %lld, headerSize %lld\n", left, headerSize);
+                headerReader->dumpState();
+				soft_exit(1);
+			}
+		}
+
+		if ((! writer->getBuffer(&wbuffer, &wbytes)) || wbytes == 0) {
+			writer->nextBatch();
+			if (! writer->getBuffer(&wbuffer, &wbytes)) {
+				WriteErrorMessage( "write header failed\n");
+				soft_exit(1);
+			}
+		}
+		size_t xfer = min(left, min((size_t) rbytes, wbytes));
+		_ASSERT(xfer > 0 && xfer <= UINT32_MAX);
+		memcpy(wbuffer, rbuffer, xfer);
+
+        headerReader->advance(xfer);
+		writer->advance((unsigned) xfer);
+		left -= xfer;
+	}
+
+    if (separateHeaderReader) 
+    {
+        delete headerReader;
+    } else {
+        sharedReaderBlock->reader->reinit(sharedReaderBlock->start, sharedReaderBlock->bytes);
+    }
+
+	writer->nextBatch();
+	writer->inHeader(false);
+}
+
+    bool
+SortedDataFilterSupplier::chooseRanges(
+    VariableSizeVector<ContigAndPos>* o_rangeStarts)
+{
+    _int64 totalBytes = 0;
+    VariableSizeVector<ContigAndPos> keys;
+    for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
+        if (i->samples == NULL) {
+            return false;
+        }
+        totalBytes += i->logicalBytes;
+        for (SortSampleVector::iterator j = i->samples->begin(); j != i->samples->end(); j++) {
+            keys.push_back(j->contigAndPos);
+        }
+    }
+
+    int nRanges = (int)__min((_int64)numThreads, totalBytes / (_int64)MinRangeBytes);
+    if (nRanges < 2 || keys.size() < nRanges) {
+        return false;
+    }
+
+    //
+    // The samples are about evenly spaced through the data, so their quantiles split it evenly.  Duplicate keys (e.g., a
+    // pileup at one locus, or the unmapped reads) can't be split, and just make for fewer ranges.
+    //
+    std::sort(keys.begin(), keys.end());
+    for (int i = 1; i < nRanges; i++) {
+        ContigAndPos key = keys[(_int64)keys.size() * i / nRanges];
+        if (o_rangeStarts->size() == 0 ? key > keys[0] : key > (*o_rangeStarts)[o_rangeStarts->size() - 1]) {
+            o_rangeStarts->push_back(key);
+        }
+    }
+
+    return o_rangeStarts->size() > 0;
+}
+
+    DataReader*
+SortedDataFilterSupplier::openReaderForRange(
+    SortBlock* block,
+    const ContigAndPos* rangeStart,
+    size_t bufferSpacePerReader)
+{
+    //
+    // Start at the last sample before the range, since there may be reads in the range between it and the next one.
+    //
+    SortSample startingSample;
+    if (rangeStart != NULL) {
+        _int64 low = 0, high = block->samples->size();  // The first sample that's not before the range is in [low, high]
+        while (low < high) {
+            _int64 mid = (low + high) / 2;
+            if ((*block->samples)[mid].contigAndPos < *rangeStart) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if (low > 0) {
+            startingSample = (*block->samples)[low - 1];
+        }
+    }
+
+    if (block->dataReaderIsBuffer) {
+        return new BufferDataReader(((BufferDataReader*)block->reader)->getBuffer() + startingSample.offset, block->logicalBytes - startingSample.offset);
+    }
+
+    DataReader* reader = openBlockReader(block, startingSample.offset, bufferSpacePerReader);
+
+    if (startingSample.skip > 0) {
+        char* data;
+        _int64 bytes;
+        if (!reader->getData(&data, &bytes) || bytes < (_int64)startingSample.skip) {
+            WriteErrorMessage("SortedDataFilterSupplier::mergeSort: unable to skip to sample in %s\n", blockFileName(block));
+            soft_exit(1);
+        }
+        reader->advance(startingSample.skip);
+    }
+
+    return reader;
+}
+
+    DataReader*
+SortedDataFilterSupplier::openBlockReader(
+    SortBlock* block,
+    size_t offset,
+    size_t bufferSpacePerReader)
+{
+    DataReader* reader = DataSupplier::Default->getDataReader(1, block->compressed ? CompressedSpillDataReader::InnerOverflowBytes : MAX_READ_LENGTH * 8, 0.0,
+        bufferSpacePerReader);
+    if (!reader->init(blockFileName(block))) {
+        WriteErrorMessage("SortedDataFilterSupplier::mergeSort: reader->init(%s) failed\n", blockFileName(block));
+        soft_exit(1);
+    }
+    if (block->compressed) {
+        reader = new CompressedSpillDataReader(reader);
+    }
+    reader->reinit(block->start + offset, block->bytes - offset);
+
+    return reader;
+}
+
+    void
+SortedDataFilterSupplier::mergeSortRanges(
+    VariableSizeVector<ContigAndPos>* rangeStarts)
+{
+    int nRanges = (int)rangeStarts->size() + 1;
+    size_t bufferSpacePerReader = __min(1UL << 23, __max(1UL << 17, bufferSpace / (blocks.size() * nRanges)));  // 128kB to 8MB buffer space per reader
+    size_t segmentBufferSize = __max((size_t)4 * 1024 * 1024, bufferSize / nRanges);
+
+    char** segmentFileNames = new char*[nRanges];
+    DataWriterSupplier** segmentSuppliers = new DataWriterSupplier*[nRanges];
+    SingleWaiterObject* done = new SingleWaiterObject[nRanges];
+
+    for (int i = 0; i < nRanges; i++) {
+        if (i == 0) {
+            segmentFileNames[i] = (char*)sortedFileName;
+        } else {
+            segmentFileNames[i] = new char[strlen(tempFileName) + 20];
+            sprintf(segmentFileNames[i], "%s.%d", tempFileName, i);
+        }
+
+        segmentSuppliers[i] = segmentedOutput->createSegment(i, nRanges, segmentFileNames[i], segmentBufferSize);
+        DataWriter* writer = segmentSuppliers[i]->getWriter();
+        if (writer == NULL) {
+            WriteErrorMessage("open sorted file segment %s for write failed\n", segmentFileNames[i]);
+            soft_exit(1);
+        }
+        if (i == 0 && headerSize > 0) {
+            writeHeader(writer, NULL);
+        }
+
+        MergeSortThreadState* state = new MergeSortThreadState();
+        state->filterSupplier = this;
+        state->writer = writer;
+        state->rangeStart = i == 0 ? NULL : &(*rangeStarts)[i - 1];
+        state->rangeEnd = i == nRanges - 1 ? NULL : &(*rangeStarts)[i];
+        state->blocksForThisThread = new SortBlockVector();
+        state->deleteSortBlockVector = true;
+        for (SortBlockVector::iterator b = blocks.begin(); b != blocks.end(); b++) {
+            if (state->rangeEnd != NULL && !((*b->samples)[0].contigAndPos < *state->rangeEnd)) {
+                continue;   // The whole block is after the range
+            }
+            SortBlock block(*b);
+            block.reader = openReaderForRange(&(*b), state->rangeStart, bufferSpacePerReader);
+            block.dataReaderIsBuffer = false;
+            state->blocksForThisThread->push_back(block);
+        }
+
+        CreateSingleWaiterObject(&done[i]);
+        state->done = &done[i];
+        if (!StartNewThread(MergeSortThreadMain, state)) {
+            WriteErrorMessage("merge sort: StartNewThread failed.\n");
+            soft_exit(1);
+        }
+    }
+
+    for (int i = 0; i < nRanges; i++) {
+        WaitForSingleWaiterObject(&done[i]);
+        DestroySingleWaiterObject(&done[i]);
+        segmentSuppliers[i]->close();
+        delete segmentSuppliers[i];
+    }
+
+    for (SortBlockVector::iterator b = blocks.begin(); b != blocks.end(); b++) {
+        if (b->dataReaderIsBuffer) {
+            delete b->reader;   // The ranges had readers of their own on its buffer
+            b->reader = NULL;
+        }
+    }
+
+    segmentedOutput->finish(sortedFileName, nRanges, segmentFileNames);
+
+    for (int i = 1; i < nRanges; i++) {
+        if (!DeleteSingleFile(segmentFileNames[i])) {
+            WriteErrorMessage("warning: failure deleting temp file %s\n", segmentFileNames[i]);
+        }
+        delete[] segmentFileNames[i];
+    }
+    delete[] segmentFileNames;
+    delete[] segmentSuppliers;
+    delete[] done;
+
+    encoder = NULL; // leaked: it was for unsegmented output, and its threads were never started, so it can't be stopped
+}
+
     DataWriterSupplier*
 DataWriterSupplier::sorted(
     const FileFormat* format,
@@ -1439,12 +2638,17 @@ DataWriterSupplier::sorted(
     size_t maxBufferSize,
     bool emitInternalScore,
     char *internalScoreTag,
-    FileEncoder* encoder)
+    bool useIoUring,
+    bool directIo,
+    FileEncoder* encoder,
+    SegmentedOutputSupplier* segmentedOutput)
 {
     const int bufferCount = 3;
     const size_t bufferSpace = tempBufferMemory > 0 ? tempBufferMemory : (numThreads * (size_t)1 << 30);
     const size_t bufferSize = bufferSpace / ((size_t)bufferCount * numThreads);
     DataWriter::FilterSupplier* filterSupplier =
-        new SortedDataFilterSupplier(format, genome, tempFileName, sortedFileName, sortedFilterSuppler, bufferSize, bufferSpace, emitInternalScore, internalScoreTag, encoder, numThreads);
+        new SortedDataFilterSupplier(format, genome, tempFileName, sortedFileName, sortedFilterSuppler, bufferSize, bufferSpace, emitInternalScore, internalScoreTag, encoder, numThreads,
+            DataWriterSupplier::CompressSortIntermediate, segmentedOutput, DataWriterSupplier::SortBackgroundMerge,
+            DataWriterSupplier::SortInMemory, useIoUring, directIo);
     return DataWriterSupplier::create(tempFileName, bufferSize, emitInternalScore, internalScoreTag, filterSupplier, NULL, bufferCount);
 }
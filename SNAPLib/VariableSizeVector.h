@@ -101,7 +101,7 @@ public:
         return count;
     }
 
-    void truncate(int newCount)
+    void truncate(_int64 newCount)
     {
 		if (newCount < count) {
 			count = newCount;
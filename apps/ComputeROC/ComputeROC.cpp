@@ -375,6 +375,8 @@ int main(int argc, char * argv[])
 	readerContext.header = NULL;
 	readerContext.headerLength = 0;
 	readerContext.headerBytes = 0;
+    readerContext.useIoUring = false;
+    readerContext.directIo = false;
 
     if (NULL != strrchr(inputFileName, '.') && !_stricmp(strrchr(inputFileName, '.'), ".bam")) {
         readSupplierGenerator = BAMReader::createReadSupplierGenerator(inputFileName, nThreads, readerContext);
@@ -0,0 +1,569 @@
+/*++
+
+Module Name:
+
+    KernelBench.cpp
+
+Abstract:
+
+    Micro-benchmark for the scoring kernels: Landau-Vishkin, the affine gap variants and the CIGAR producing
+    classes that the SAM and BAM writers use.  It times each kernel call individually over a set of (read, reference
+    window, k) triples, which are either simulated here or taken from the alignments in a SAM file that SNAP
+    wrote, and prints latency percentiles and ns/cell by read length.
+
+    Cells are counted the same way for every kernel, as read length * (2k + 1), which is the band the dynamic
+    programs cover.  That makes ns/cell comparable across kernels and read lengths even though LV does much less
+    work than that when the read matches well.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+
+--*/
+
+#include "stdafx.h"
+#include "Compat.h"
+#include "Genome.h"
+#include "LandauVishkin.h"
+#include "AffineGap.h"
+#include "AffineGapVectorized.h"
+#include "Read.h"
+#include "SAM.h"
+#include "BigAlloc.h"
+#include "exit.h"
+
+using std::vector;
+
+void usage()
+{
+    fprintf(stderr, "usage: KernelBench [options]\n");
+    fprintf(stderr, "  -lengths l1,l2,...  read lengths to simulate, at most %d (default 100,150,250,500,%d).  With -sam these are\n", MAX_READ_LENGTH, MAX_READ_LENGTH);
+    fprintf(stderr, "                      the upper bounds of the length buckets.\n");
+    fprintf(stderr, "  -k n                score limit passed to the kernels, less than %d (default 20)\n", MAX_K);
+    fprintf(stderr, "  -n n                simulated triples per read length (default 2000)\n");
+    fprintf(stderr, "  -passes n           timed passes over the triples, after one untimed warmup pass (default 5)\n");
+    fprintf(stderr, "  -sub rate           simulated substitution rate per base (default 0.01)\n");
+    fprintf(stderr, "  -indel rate         simulated rate per base of starting a 1-3 base insertion or deletion (default 0.001)\n");
+    fprintf(stderr, "  -decoys fraction    fraction of triples scored against an unrelated reference window, as most candidate\n");
+    fprintf(stderr, "                      locations the aligner scores are (default 0)\n");
+    fprintf(stderr, "  -seed n             random seed (default 1)\n");
+    fprintf(stderr, "  -kernels k1,k2,...  kernels to run (default all): lv, lv-cigar, ag, ag-cigar, agv, agv-banded, agv-cigar\n");
+    fprintf(stderr, "  -sam indexDir file  replay the primary alignments in a SAM file against the genome in indexDir instead of simulating\n");
+    fprintf(stderr, "  -maxReads n         with -sam, the number of alignments to use (default 100000)\n");
+    soft_exit_no_print(1);
+}
+
+//
+// A simple deterministic generator, so the simulated triples are the same on every platform.
+//
+class BenchRandom {
+public:
+    BenchRandom(_uint64 seed) : state(seed * 0x9e3779b97f4a7c15ull + 1) {}
+
+    _uint64 next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    unsigned below(unsigned n) {
+        return (unsigned)(next() % n);
+    }
+
+    double uniform() {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+    _uint64 state;
+};
+
+static const char Bases[] = "ACGT";
+
+//
+// The kernels look a few bytes past either end of the read (SNAP's read buffers have room), so give them the same slack.
+//
+static const int PatternPadding = 16;
+
+static char *allocatePadded(int length)
+{
+    char *buffer = new char[length + 2 * PatternPadding];
+    memset(buffer, 'N', length + 2 * PatternPadding);
+    return buffer + PatternPadding;
+}
+
+struct Triple {
+    const char     *pattern;
+    const char     *quality;
+    int             patternLen;
+    const char     *text;           // patternLen + MAX_K bases, which is what the SAM writer passes
+    int             k;
+    int             bucket;
+};
+
+enum Kernel {LV, LVCigar, AG, AGCigar, AGV, AGVBanded, AGVCigar, NKernels};
+static const char *KernelNames[NKernels] = {"lv", "lv-cigar", "ag", "ag-cigar", "agv", "agv-banded", "agv-cigar"};
+
+//
+// One instance of each kernel class, with SNAP's default scoring parameters.
+//
+struct Kernels {
+    LandauVishkin<1>                *lv;
+    LandauVishkinWithCigar          *lvCigar;
+    AffineGap<1>                    *ag;
+    AffineGapWithCigar              *agCigar;
+    AffineGapVectorized<1>          *agv;
+    AffineGapVectorizedWithCigar    *agvCigar;
+
+    //
+    // Allocated the way the aligners do it, from a BigAllocator with 16 byte granularity for the __m128i members.
+    //
+    Kernels() {
+        allocator = new BigAllocator(LandauVishkin<1>::getBigAllocatorReservation() + AffineGap<1>::getBigAllocatorReservation() +
+            AffineGapVectorized<1>::getBigAllocatorReservation() + 3 * 16, 16);
+        lv = new (allocator) LandauVishkin<1>();
+        ag = new (allocator) AffineGap<1>(1, 4, 6, 1);
+        agv = new (allocator) AffineGapVectorized<1>(1, 4, 6, 1, 10, 5);
+
+        lvCigar = new LandauVishkinWithCigar();
+        agCigar = new AffineGapWithCigar(1, 4, 6, 1);
+        agvCigar = new AffineGapVectorizedWithCigar(1, 4, 6, 1);
+    }
+
+    BigAllocator                    *allocator;
+};
+
+//
+// The banded kernel is only used when the read is long enough relative to the band (see BaseAligner::score).
+//
+static bool appliesTo(Kernel kernel, const Triple &triple)
+{
+    return kernel != AGVBanded || triple.patternLen >= 3 * (2 * triple.k + 1);
+}
+
+static inline int runKernel(Kernel kernel, Kernels &kernels, const Triple &triple)
+{
+    const int cigarBufLen = 2 * MAX_READ_LENGTH;
+    char cigarBuf[cigarBufLen];
+    int cigarBufUsed, textUsed, addFrontClipping, nEdits;
+    double matchProbability;
+    int textLen = triple.patternLen + MAX_K;
+
+    switch (kernel) {
+        case LV:
+            return kernels.lv->computeEditDistance(triple.text, textLen, triple.pattern, triple.quality, triple.patternLen, triple.k, &matchProbability);
+
+        case LVCigar:
+            return kernels.lvCigar->computeEditDistanceNormalized(triple.text, textLen, triple.pattern, triple.patternLen, triple.k, cigarBuf, cigarBufLen,
+                false, COMPACT_CIGAR_STRING, &cigarBufUsed, &textUsed);
+
+        case AG:
+            return kernels.ag->computeScore(triple.text, textLen, triple.pattern, triple.quality, triple.patternLen, triple.k, triple.patternLen, NULL, NULL,
+                &nEdits, &matchProbability);
+
+        case AGCigar:
+            //
+            // Not the normalized version: nothing uses this class any more, and its normalization can produce repeated CIGAR ops.
+            // useM is set because this class only counts edits for M CIGARs, and otherwise the checksum would always be 0.
+            //
+            return kernels.agCigar->computeGlobalScore(triple.text, textLen, triple.pattern, triple.patternLen, triple.k, cigarBuf, cigarBufLen,
+                true, COMPACT_CIGAR_STRING, &cigarBufUsed);
+
+        case AGV:
+            return kernels.agv->computeScore(triple.text, textLen, triple.pattern, triple.quality, triple.patternLen, triple.k, triple.patternLen, false, NULL, NULL,
+                &nEdits, &matchProbability);
+
+        case AGVBanded:
+            return kernels.agv->computeScoreBanded(triple.text, textLen, triple.pattern, triple.quality, triple.patternLen, triple.k, triple.patternLen, false, NULL, NULL,
+                &nEdits, &matchProbability);
+
+        case AGVCigar:
+            return kernels.agvCigar->computeGlobalScoreNormalized(triple.text, textLen, triple.pattern, triple.quality, triple.patternLen, triple.k, cigarBuf, cigarBufLen,
+                false, COMPACT_CIGAR_STRING, &cigarBufUsed, &addFrontClipping);
+
+        default:
+            return 0;
+    }
+}
+
+//
+// Simulated triples: random reference windows, with reads drawn from them with substitutions and indels.
+//
+static void simulateTriples(vector<Triple> &triples, const vector<int> &lengths, int n, int k, double subRate, double indelRate, double decoyRate, BenchRandom &random)
+{
+    const size_t referenceSize = 4 * 1024 * 1024;
+    char *reference = new char[referenceSize];
+    for (size_t i = 0; i < referenceSize; i++) {
+        reference[i] = Bases[random.below(4)];
+    }
+
+    for (size_t bucket = 0; bucket < lengths.size(); bucket++) {
+        int patternLen = lengths[bucket];
+        size_t windowLen = patternLen + MAX_K;
+
+        for (int i = 0; i < n; i++) {
+            size_t start = MAX_K + random.below((unsigned)(referenceSize - 2 * windowLen - MAX_K));   // Leave room to look before the window
+            char *pattern = allocatePadded(patternLen);
+            char *quality = allocatePadded(patternLen);
+
+            const char *source = reference + start;
+            int readPos = 0, refPos = 0;
+            while (readPos < patternLen) {
+                double r = random.uniform();
+                if (r < indelRate / 2) {
+                    for (int j = 1 + random.below(3); j > 0 && readPos < patternLen; j--) {
+                        quality[readPos] = '5';
+                        pattern[readPos++] = Bases[random.below(4)];    // Insertion
+                    }
+                } else if (r < indelRate) {
+                    refPos += 1 + random.below(3);                      // Deletion
+                } else {
+                    char base = source[refPos++];
+                    quality[readPos] = 'I';
+                    if (random.uniform() < subRate) {
+                        base = Bases[random.below(4)];
+                        quality[readPos] = '5';
+                    }
+                    pattern[readPos++] = base;
+                }
+            }
+
+            Triple triple;
+            triple.pattern = pattern;
+            triple.quality = quality;
+            triple.patternLen = patternLen;
+            triple.text = random.uniform() < decoyRate ? reference + MAX_K + random.below((unsigned)(referenceSize - 2 * windowLen - MAX_K)) : source;
+            triple.k = k;
+            triple.bucket = (int)bucket;
+            triples.push_back(triple);
+        }
+    }
+}
+
+//
+// Triples from SNAP's own output: the aligned part of each primary alignment's read (soft clips removed) against the
+// reference at the alignment's position.
+//
+static void loadTriplesFromSAM(vector<Triple> &triples, const vector<int> &lengths, const char *indexDir, const char *samFileName, int k, int maxReads)
+{
+    static const char *genomeSuffix = "Genome";
+    size_t fileNameLen = strlen(indexDir) + 1 + strlen(genomeSuffix) + 1;
+    char *fileName = new char[fileNameLen];
+    snprintf(fileName, fileNameLen, "%s%c%s", indexDir, PATH_SEP, genomeSuffix);
+    const Genome *genome = Genome::loadFromFile(fileName, 0);
+    if (NULL == genome) {
+        fprintf(stderr, "Unable to load genome from file '%s'\n", fileName);
+        soft_exit_no_print(1);
+    }
+    delete[] fileName;
+
+    FILE *samFile = fopen(samFileName, "r");
+    if (NULL == samFile) {
+        fprintf(stderr, "Unable to open SAM file '%s'\n", samFileName);
+        soft_exit_no_print(1);
+    }
+
+    const size_t lineBufferSize = 16 * MAX_READ_LENGTH + 64 * 1024;
+    char *line = new char[lineBufferSize];
+    int nSkipped = 0;
+
+    while ((int)triples.size() < maxReads && NULL != fgets(line, (int)lineBufferSize, samFile)) {
+        if (line[0] == '@') {
+            continue;
+        }
+
+        char *fields[11];
+        char *next = line;
+        int nFields;
+        for (nFields = 0; nFields < 11 && NULL != next; nFields++) {
+            fields[nFields] = next;
+            next = strchr(next, '\t');
+            if (NULL != next) {
+                *next++ = '\0';
+            }
+        }
+        if (nFields < 11) {
+            nSkipped++;
+            continue;
+        }
+
+        unsigned flag = (unsigned)atoi(fields[1]);
+        int pos = atoi(fields[3]);
+        if ((flag & (SAM_UNMAPPED | SAM_SECONDARY | SAM_SUPPLEMENTARY)) || pos <= 0 || !strcmp(fields[5], "*")) {
+            continue;
+        }
+
+        //
+        // Drop soft clipped bases; POS is already the first aligned base.
+        //
+        int clipBefore = 0, clipAfter = 0;
+        const char *cigar = fields[5];
+        int count = atoi(cigar);
+        while (isdigit(*cigar)) cigar++;
+        if (*cigar == 'S') {
+            clipBefore = count;
+        }
+        size_t cigarLen = strlen(fields[5]);
+        if (cigarLen > 0 && fields[5][cigarLen - 1] == 'S') {
+            const char *lastCount = fields[5] + cigarLen - 1;
+            while (lastCount > fields[5] && isdigit(*(lastCount - 1))) lastCount--;
+            if (lastCount != fields[5]) {
+                clipAfter = atoi(lastCount);
+            }
+        }
+
+        int readLen = (int)strlen(fields[9]);
+        int patternLen = readLen - clipBefore - clipAfter;
+        size_t bucket = 0;
+        while (bucket < lengths.size() && lengths[bucket] < patternLen) {
+            bucket++;
+        }
+
+        GenomeLocation contigStart;
+        if (patternLen <= 0 || bucket == lengths.size() || (int)strlen(fields[10]) != readLen || !genome->getLocationOfContig(fields[2], &contigStart)) {
+            nSkipped++;
+            continue;
+        }
+
+        const char *text = genome->getSubstring(contigStart + (pos - 1), patternLen + MAX_K);
+        if (NULL == text) {
+            nSkipped++;
+            continue;
+        }
+
+        char *pattern = allocatePadded(patternLen);
+        char *quality = allocatePadded(patternLen);
+        memcpy(pattern, fields[9] + clipBefore, patternLen);
+        if (fields[10][0] == '*') {
+            memset(quality, 'I', patternLen);
+        } else {
+            memcpy(quality, fields[10] + clipBefore, patternLen);
+        }
+
+        Triple triple;
+        triple.pattern = pattern;
+        triple.quality = quality;
+        triple.patternLen = patternLen;
+        triple.text = text;
+        triple.k = k;
+        triple.bucket = (int)bucket;
+        triples.push_back(triple);
+    }
+
+    fclose(samFile);
+    delete[] line;
+
+    if (nSkipped > 0) {
+        fprintf(stderr, "Skipped %d SAM lines that were malformed, too long or off the end of a contig\n", nSkipped);
+    }
+}
+
+static bool parseList(const char *list, vector<int> &values)
+{
+    values.clear();
+    while (*list != '\0') {
+        if (!isdigit(*list)) {
+            return false;
+        }
+        values.push_back(atoi(list));
+        while (isdigit(*list)) list++;
+        if (*list == ',') list++;
+    }
+    return values.size() > 0;
+}
+
+static _int64 percentile(const vector<_int64> &sorted, double fraction)
+{
+    size_t index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+int main(int argc, const char **argv)
+{
+    BigAllocUseHugePages = false;
+
+    vector<int> lengths;
+    lengths.push_back(100);
+    lengths.push_back(150);
+    lengths.push_back(250);
+    if (MAX_READ_LENGTH > 500) {
+        lengths.push_back(500);
+    }
+    lengths.push_back(MAX_READ_LENGTH);
+
+    int k = 20;
+    int n = 2000;
+    int passes = 5;
+    double subRate = 0.01;
+    double indelRate = 0.001;
+    double decoyRate = 0.0;
+    _uint64 seed = 1;
+    bool runKernelN[NKernels];
+    for (int i = 0; i < NKernels; i++) {
+        runKernelN[i] = true;
+    }
+    const char *indexDir = NULL;
+    const char *samFileName = NULL;
+    int maxReads = 100000;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "-lengths") && hasValue) {
+            if (!parseList(argv[++i], lengths)) {
+                usage();
+            }
+            for (size_t j = 0; j < lengths.size(); j++) {
+                if (lengths[j] <= 0 || lengths[j] > MAX_READ_LENGTH) {
+                    fprintf(stderr, "Read lengths must be between 1 and MAX_READ_LENGTH (%d)\n", MAX_READ_LENGTH);
+                    soft_exit_no_print(1);
+                }
+            }
+            std::sort(lengths.begin(), lengths.end());
+        } else if (!strcmp(argv[i], "-k") && hasValue) {
+            k = atoi(argv[++i]);
+            if (k < 0 || k >= MAX_K) {
+                fprintf(stderr, "k must be between 0 and %d\n", MAX_K - 1);
+                soft_exit_no_print(1);
+            }
+        } else if (!strcmp(argv[i], "-n") && hasValue) {
+            n = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-passes") && hasValue) {
+            passes = atoi(argv[++i]);
+            if (passes < 1) {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "-sub") && hasValue) {
+            subRate = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-indel") && hasValue) {
+            indelRate = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-decoys") && hasValue) {
+            decoyRate = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-seed") && hasValue) {
+            seed = (_uint64)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-kernels") && hasValue) {
+            for (int j = 0; j < NKernels; j++) {
+                runKernelN[j] = false;
+            }
+            char *list = new char[strlen(argv[i + 1]) + 1];
+            strcpy(list, argv[++i]);
+            for (char *name = strtok(list, ","); NULL != name; name = strtok(NULL, ",")) {
+                int j;
+                for (j = 0; j < NKernels && strcmp(name, KernelNames[j]); j++) {
+                }
+                if (j == NKernels) {
+                    fprintf(stderr, "Unknown kernel '%s'\n", name);
+                    usage();
+                }
+                runKernelN[j] = true;
+            }
+            delete[] list;
+        } else if (!strcmp(argv[i], "-sam") && i + 2 < argc) {
+            indexDir = argv[++i];
+            samFileName = argv[++i];
+        } else if (!strcmp(argv[i], "-maxReads") && hasValue) {
+            maxReads = atoi(argv[++i]);
+        } else {
+            usage();
+        }
+    }
+
+    initializeLVProbabilitiesToPhredPlus33();
+
+    vector<Triple> triples;
+    if (NULL != samFileName) {
+        loadTriplesFromSAM(triples, lengths, indexDir, samFileName, k, maxReads);
+    } else {
+        BenchRandom random(seed);
+        simulateTriples(triples, lengths, n, k, subRate, indelRate, decoyRate, random);
+    }
+
+    if (triples.size() == 0) {
+        fprintf(stderr, "No triples to run\n");
+        soft_exit_no_print(1);
+    }
+
+    Kernels kernels;
+
+    //
+    // Every call is timed on its own, so the clock itself is part of each sample.  Report what it costs so that
+    // it can be discounted for the fastest kernels.
+    //
+    const int nTimerSamples = 100000;
+    _int64 timerStart = timeInNanos();
+    _int64 sink = 0;
+    for (int i = 0; i < nTimerSamples; i++) {
+        sink += timeInNanos();
+    }
+    double timerOverhead = (double)(timeInNanos() - timerStart) / nTimerSamples;
+
+    printf("%lld triples, k = %d, %d passes; timer overhead %.0f ns per call is included in the latencies\n", (long long)triples.size(), k, passes, timerOverhead);
+    printf("kernel\tlength\tcalls\tp50_ns\tp90_ns\tp99_ns\tmax_ns\tns_per_cell\tchecksum\n");
+
+    vector<_int64> *latencies = new vector<_int64>[lengths.size()];
+    for (int kernelIndex = 0; kernelIndex < NKernels; kernelIndex++) {
+        if (!runKernelN[kernelIndex]) {
+            continue;
+        }
+        Kernel kernel = (Kernel)kernelIndex;
+
+        _int64 *cells = new _int64[lengths.size()];
+        _int64 *checksum = new _int64[lengths.size()];
+        for (size_t bucket = 0; bucket < lengths.size(); bucket++) {
+            latencies[bucket].clear();
+            cells[bucket] = 0;
+            checksum[bucket] = 0;
+        }
+
+        for (int pass = 0; pass <= passes; pass++) {    // Pass 0 is the untimed warmup
+            for (size_t i = 0; i < triples.size(); i++) {
+                const Triple &triple = triples[i];
+                if (!appliesTo(kernel, triple)) {
+                    continue;
+                }
+
+                _int64 start = timeInNanos();
+                int score = runKernel(kernel, kernels, triple);
+                _int64 elapsed = timeInNanos() - start;
+
+                if (pass > 0) {
+                    latencies[triple.bucket].push_back(elapsed);
+                    cells[triple.bucket] += (_int64)triple.patternLen * (2 * triple.k + 1);
+                    if (pass == 1) {
+                        checksum[triple.bucket] += score;  // So the calls can't be optimized away, and to spot kernel changes that change results
+                    }
+                }
+            }
+        }
+
+        for (size_t bucket = 0; bucket < lengths.size(); bucket++) {
+            vector<_int64> &sorted = latencies[bucket];
+            if (sorted.size() == 0) {
+                continue;   // No triples of this length, or none the kernel applies to
+            }
+            std::sort(sorted.begin(), sorted.end());
+
+            _int64 total = 0;
+            for (size_t i = 0; i < sorted.size(); i++) {
+                total += sorted[i];
+            }
+
+            printf("%s\t%d\t%lld\t%lld\t%lld\t%lld\t%lld\t%.3f\t%lld\n", KernelNames[kernel], lengths[bucket], (long long)sorted.size(),
+                (long long)percentile(sorted, 0.5), (long long)percentile(sorted, 0.9), (long long)percentile(sorted, 0.99), (long long)sorted[sorted.size() - 1],
+                (double)total / (double)cells[bucket], (long long)checksum[bucket]);
+        }
+
+        delete[] cells;
+        delete[] checksum;
+    }
+    delete[] latencies;
+
+    if (sink == 42) {
+        printf("\n");   // Keep the timer loop from being optimized out
+    }
+
+    return 0;
+}
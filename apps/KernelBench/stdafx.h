@@ -0,0 +1,5 @@
+#ifdef _MSC_VER
+#include "..\..\SNAPLib\stdafx.h"
+#else
+#include "../../SNAPLib/stdafx.h"
+#endif
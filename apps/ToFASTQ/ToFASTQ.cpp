@@ -168,6 +168,8 @@ int main(int argc, char * argv[])
 	readerContext.header = NULL;
 	readerContext.headerLength = 0;
 	readerContext.headerBytes = 0;
+    readerContext.useIoUring = false;
+    readerContext.directIo = false;
 
     if (5 == argc) {
         if (!strcmp(argv[4], "-i")) {
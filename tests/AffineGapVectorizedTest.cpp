@@ -66,6 +66,34 @@ TEST_F(AffineGapVectorizedTest, "synthetic") {
     ASSERT_EQ(83, computeScore("CTCTGTCTCTCTCTCTGTCTCTCTCTTTTAACAGGGTATAAACAGACTTAGGGTAACTAAAAAACGGATTAACAATAAGTGATACGA", 87, "CTCTGTCTCTGTCTCTCTCTCTGTCTCTCTCTTTTAACAGGGTATAAACAGACTTAGGGTAACTAAAAAACGGATTAACA", NULL, 80, 8, 21));
 }
 
+TEST_F(AffineGapVectorizedTest, "gapless CIGAR matches the dynamic program") {
+    const char *text = "GAGTCCCCTTTTTTTTTTTTTCCTTTATAAAAGGCTTTCGATCAGACTCGGTCCGTCATACTTTCTGTGACTTCTATTTTCTCGTCAGAACTTGAGATGTACGTACGTACGTACGTACGTACGTACGT";
+    char pattern[100];
+    char quality[100];
+    memcpy(pattern, text, 100);
+    memset(quality, 'I', 100);
+    pattern[40] = pattern[40] == 'A' ? 'C' : 'A';
+
+    AffineGapVectorizedWithCigar *agc = new AffineGapVectorizedWithCigar(1, 4, 6, 1);
+    char cigarBuf[1024];
+    int cigarBufUsed, addFrontClipping;
+
+    // k = 1 writes the gapless alignment directly, k = 5 runs the dynamic program; they have to agree
+    ASSERT_EQ(1, agc->computeGlobalScoreNormalized(text, 130, pattern, quality, 100, 1, cigarBuf, sizeof(cigarBuf), false, COMPACT_CIGAR_STRING, &cigarBufUsed, &addFrontClipping));
+    ASSERT_STREQ("40=1X59=", cigarBuf);
+    ASSERT_EQ(1, agc->computeGlobalScoreNormalized(text, 130, pattern, quality, 100, 5, cigarBuf, sizeof(cigarBuf), false, COMPACT_CIGAR_STRING, &cigarBufUsed, &addFrontClipping));
+    ASSERT_STREQ("40=1X59=", cigarBuf);
+    ASSERT_EQ(1, agc->computeGlobalScoreNormalized(text, 130, pattern, quality, 100, 1, cigarBuf, sizeof(cigarBuf), true, COMPACT_CIGAR_STRING, &cigarBufUsed, &addFrontClipping));
+    ASSERT_STREQ("100M", cigarBuf);
+
+    // A deletion has to go through the dynamic program
+    memcpy(pattern, text, 50);
+    memcpy(pattern + 50, text + 51, 50);
+    ASSERT_EQ(1, agc->computeGlobalScoreNormalized(text, 130, pattern, quality, 100, 1, cigarBuf, sizeof(cigarBuf), false, COMPACT_CIGAR_STRING, &cigarBufUsed, &addFrontClipping));
+    ASSERT(strchr(cigarBuf, 'D') != NULL);
+
+    delete agc;
+}
 
 /* Edit distance tests */
 /*
@@ -0,0 +1,56 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "AlignerOptions.h"
+
+// Parses a single option (with its arguments) the way the command line processing does, and returns what parse() said.
+static bool parseOption(AlignerOptions *options, const char **argv, int argc)
+{
+    int n = 0;
+    bool done = false;
+    return options->parse(argv, argc, n, &done);
+}
+
+TEST("-csi depth") {
+    AlignerOptions defaults("test");
+    const char *noArgs[] = {"-csi"};
+    ASSERT(parseOption(&defaults, noArgs, 1));
+    ASSERT_EQ(14, defaults.csiMinShift);
+    ASSERT_EQ(0, defaults.csiDepth);        // Enough for the longest contig
+
+    AlignerOptions explicitDepth("test");
+    const char *shiftAndDepth[] = {"-csi", "12", "7"};
+    ASSERT(parseOption(&explicitDepth, shiftAndDepth, 3));
+    ASSERT_EQ(12, explicitDepth.csiMinShift);
+    ASSERT_EQ(7, explicitDepth.csiDepth);
+
+    AlignerOptions zeroDepth("test");
+    const char *depthZero[] = {"-csi", "14", "0"};
+    ASSERT(!parseOption(&zeroDepth, depthZero, 3));
+
+    AlignerOptions deepDepth("test");
+    const char *depthEleven[] = {"-csi", "14", "11"};
+    ASSERT(!parseOption(&deepDepth, depthEleven, 3));
+}
+
+TEST("-du combinations") {
+    AlignerOptions unsorted("test");
+    const char *output[] = {"-o", "out.bam"};
+    const char *du[] = {"-du"};
+    const char *so[] = {"-so"};
+    ASSERT(parseOption(&unsorted, output, 2));
+    ASSERT(parseOption(&unsorted, du, 1));
+    ASSERT(unsorted.checkCombinations());
+
+    AlignerOptions sorted("test");
+    ASSERT(parseOption(&sorted, output, 2));
+    ASSERT(parseOption(&sorted, du, 1));
+    ASSERT(parseOption(&sorted, so, 1));
+    ASSERT(!sorted.checkCombinations());
+
+    AlignerOptions toStdout("test");
+    const char *stdoutOutput[] = {"-o", "-bam", "-"};
+    ASSERT(parseOption(&toStdout, stdoutOutput, 3));
+    ASSERT(parseOption(&toStdout, du, 1));
+    ASSERT(!toStdout.checkCombinations());
+}
@@ -0,0 +1,48 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "BigAlloc.h"
+
+// Test fixture for the per-thread result arena.  Uses a small reservation so that spilling is easy to reach.
+struct ArenaAllocatorTest {
+    static const size_t Reservation = 1024 * 1024;
+
+    ArenaAllocator arena;
+
+    ArenaAllocatorTest() : arena(Reservation) {}
+};
+
+TEST_F(ArenaAllocatorTest, "last allocation grows in place") {
+    char *a = (char *)arena.allocate(1000);
+    char *b = (char *)arena.allocate(1000);
+    ASSERT(b >= a + 1000);
+    ASSERT((size_t)b % 16 == 0);
+
+    memset(b, 'x', 1000);
+    char *grown = (char *)arena.grow(b, 1000, 200 * 1000);
+    ASSERT(grown == b);
+    ASSERT(grown[999] == 'x');
+    grown[200 * 1000 - 1] = 'y';
+
+    memset(a, 'z', 1000);
+    char *moved = (char *)arena.grow(a, 1000, 2000);
+    ASSERT(moved != a);
+    ASSERT(moved[0] == 'z' && moved[999] == 'z');
+
+    ASSERT_EQ((size_t)3, arena.getHits());
+    ASSERT_EQ((size_t)0, arena.getMisses());
+    ASSERT_EQ((size_t)1, arena.getGrownInPlace());
+}
+
+TEST_F(ArenaAllocatorTest, "spill and reset") {
+    char *a = (char *)arena.allocate(Reservation / 2);
+    char *spilled = (char *)arena.allocate(Reservation);
+    ASSERT(spilled != NULL);
+    spilled[0] = spilled[Reservation - 1] = 'x';
+    ASSERT_EQ((size_t)1, arena.getMisses());
+
+    arena.reset();
+    char *b = (char *)arena.allocate(Reservation / 2);
+    ASSERT(b == a);
+    ASSERT_EQ((size_t)2, arena.getHits());
+}
@@ -0,0 +1,78 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "Tables.h"
+#include "Bam.h"
+
+// Test fixture for the BAM sequence and quality decoders.  Runs both the table-driven and (if the CPU
+// has it) the vectorized decoder against a straightforward nibble-at-a-time decode.
+struct BAMDecodeTest {
+    bool simdSupported;
+    static const int MaxBases = 200;
+
+    _uint8 nibbles[MaxBases / 2 + 16];
+    char quality[MaxBases + 16];
+    char expected[MaxBases + 16];
+    char actual[MaxBases + 16];
+
+    BAMDecodeTest() : simdSupported(BAMAlignment::UseSimdDecode) {
+        for (int i = 0; i < (int)sizeof(nibbles); i++) {
+            nibbles[i] = (_uint8)(i * 37 + 11);
+        }
+        for (int i = 0; i < (int)sizeof(quality); i++) {
+            quality[i] = (char)(i * 13);   // Runs through the whole byte range, including values past '~' and 0xff
+        }
+    }
+
+    ~BAMDecodeTest() {
+        BAMAlignment::UseSimdDecode = simdSupported;
+    }
+
+    int nibbleAt(int i) {
+        return (nibbles[i / 2] >> ((i & 1) ? 0 : 4)) & 0xf;
+    }
+};
+
+TEST_F(BAMDecodeTest, "sequence") {
+    for (int simd = 0; simd < 2; simd++) {
+        BAMAlignment::UseSimdDecode = simd && simdSupported;
+        for (int bases = 0; bases <= MaxBases; bases++) {
+            memset(actual, 0, sizeof(actual));
+            BAMAlignment::decodeSeq(actual, nibbles, bases);
+            for (int i = 0; i < bases; i++) {
+                ASSERT_EQ(BAMAlignment::CodeToSeq[nibbleAt(i)], actual[i]);
+            }
+            ASSERT_EQ(0, actual[bases]);
+        }
+    }
+}
+
+TEST_F(BAMDecodeTest, "reverse complement sequence") {
+    for (int simd = 0; simd < 2; simd++) {
+        BAMAlignment::UseSimdDecode = simd && simdSupported;
+        for (int bases = 0; bases <= MaxBases; bases++) {
+            memset(actual, 0, sizeof(actual));
+            BAMAlignment::decodeSeqRC(actual, nibbles, bases);
+            for (int i = 0; i < bases; i++) {
+                ASSERT_EQ(BAMAlignment::CodeToSeqRC[nibbleAt(i)], actual[bases - i - 1]);
+            }
+            ASSERT_EQ(0, actual[bases]);
+        }
+    }
+}
+
+TEST_F(BAMDecodeTest, "quality") {
+    for (int simd = 0; simd < 2; simd++) {
+        BAMAlignment::UseSimdDecode = simd && simdSupported;
+        for (int bases = 0; bases <= MaxBases; bases++) {
+            memset(actual, 0, sizeof(actual));
+            BAMAlignment::decodeQual(actual, quality, bases);
+            BAMAlignment::decodeQualRC(expected, quality, bases);
+            for (int i = 0; i < bases; i++) {
+                ASSERT_EQ(CIGAR_QUAL_TO_SAM[(_uint8)quality[i]], actual[i]);
+                ASSERT_EQ(CIGAR_QUAL_TO_SAM[(_uint8)quality[i]], expected[bases - i - 1]);
+            }
+            ASSERT_EQ(0, actual[bases]);
+        }
+    }
+}
@@ -0,0 +1,18 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "Bam.h"
+
+TEST("CSI binning") {
+    // At BAI's minimum shift and depth the bins are BAI's
+    const int lengths[] = {1, 100, 16384, 20000, 1 << 17, 1 << 20, 1 << 26};
+    for (int beg = 0; beg < (1 << 29) - (1 << 26); beg += 999983) {
+        for (int i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++) {
+            ASSERT_EQ((_uint32)BAMAlignment::reg2bin(beg, beg + lengths[i]), BAMAlignment::reg2bin((_int64)beg, (_int64)beg + lengths[i], 14, 5));
+        }
+    }
+
+    // One more level reaches 4Gbp; a window past BAI's 512Mbp lands in the new bottom level, after the 37449 bins above it
+    ASSERT_EQ((_uint32)37449 + (1 << 16), BAMAlignment::reg2bin((_int64)1 << 30, ((_int64)1 << 30) + 100, 14, 6));
+    ASSERT_EQ((_uint32)0, BAMAlignment::reg2bin((_int64)0, (_int64)1 << 31, 14, 6));
+}
@@ -0,0 +1,130 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "Cram.h"
+
+// Test fixture for the pieces of CRAM that don't need a genome: the integer encodings, MD5 and rANS, which
+// readers check byte for byte.
+struct CramTest {
+    CramBuffer buffer;
+
+    bool bytesAre(const char* expected, size_t bytes) {
+        return buffer.size() == bytes && memcmp(buffer.data(), expected, bytes) == 0;
+    }
+};
+
+TEST_F(CramTest, "ITF8") {
+    buffer.putITF8(0);
+    ASSERT(bytesAre("\x00", 1));
+    buffer.clear();
+    buffer.putITF8(0x7f);
+    ASSERT(bytesAre("\x7f", 1));
+    buffer.clear();
+    buffer.putITF8(0x80);
+    ASSERT(bytesAre("\x80\x80", 2));
+    buffer.clear();
+    buffer.putITF8(0x3fff);
+    ASSERT(bytesAre("\xbf\xff", 2));
+    buffer.clear();
+    buffer.putITF8(0x4000);
+    ASSERT(bytesAre("\xc0\x40\x00", 3));
+    buffer.clear();
+    buffer.putITF8(0x12345678);
+    ASSERT(bytesAre("\xf1\x23\x45\x67\x08", 5));
+    buffer.clear();
+    buffer.putITF8(-1);
+    ASSERT(bytesAre("\xff\xff\xff\xff\x0f", 5));
+
+    _int32 values[] = {0, 0x7f, 0x80, 0x3fff, 0x4000, 0x1fffff, 0x200000, 0xfffffff, 0x10000000, -1};
+    for (int i = 0; i < (int)(sizeof(values) / sizeof(values[0])); i++) {
+        buffer.clear();
+        buffer.putITF8(values[i]);
+        ASSERT_EQ(buffer.size(), (size_t)CramBuffer::itf8Size(values[i]));
+    }
+}
+
+TEST_F(CramTest, "LTF8") {
+    buffer.putLTF8(0x7f);
+    ASSERT(bytesAre("\x7f", 1));
+    buffer.clear();
+    buffer.putLTF8(0x80);
+    ASSERT(bytesAre("\x80\x80", 2));
+    buffer.clear();
+    buffer.putLTF8(0x123456789aLL);
+    ASSERT(bytesAre("\xf8\x12\x34\x56\x78\x9a", 6));
+    buffer.clear();
+    buffer.putLTF8(-1);
+    ASSERT(bytesAre("\xff\xff\xff\xff\xff\xff\xff\xff\xff", 9));
+}
+
+TEST_F(CramTest, "MD5") {
+    _uint8 digest[16];
+    CramMD5 empty;
+    empty.final(digest);
+    ASSERT(memcmp(digest, "\xd4\x1d\x8c\xd9\x8f\x00\xb2\x04\xe9\x80\x09\x98\xec\xf8\x42\x7e", 16) == 0);
+
+    // Split across updates and longer than a block
+    const char* text = "12345678901234567890123456789012345678901234567890123456789012345678901234567890";
+    CramMD5 md5;
+    md5.update(text, 7);
+    md5.update(text + 7, strlen(text) - 7);
+    md5.final(digest);
+    ASSERT(memcmp(digest, "\x57\xed\xf4\xa2\x2b\xe3\xc9\x55\xac\x49\xda\x2e\x21\x07\xb6\x7a", 16) == 0);
+}
+
+TEST_F(CramTest, "CursorReadsBack") {
+    _int32 values[] = {0, 0x7f, 0x80, 0x3fff, 0x4000, 0x1fffff, 0x200000, 0xfffffff, 0x10000000, -1, -2};
+    int count = (int)(sizeof(values) / sizeof(values[0]));
+    for (int i = 0; i < count; i++) {
+        buffer.putITF8(values[i]);
+    }
+    buffer.putLTF8(0x123456789aLL);
+    buffer.putLTF8(-1);
+
+    CramCursor cursor(buffer.data(), buffer.size());
+    for (int i = 0; i < count; i++) {
+        ASSERT_EQ(values[i], cursor.getITF8());
+    }
+    ASSERT_EQ(0x123456789aLL, cursor.getLTF8());
+    ASSERT_EQ(-1LL, cursor.getLTF8());
+    ASSERT_EQ((size_t)0, cursor.remaining());
+    ASSERT(!cursor.overrun);
+    cursor.getITF8();
+    ASSERT(cursor.overrun);
+}
+
+// rANS 4x8 streams, including lengths that leave symbols over after the four interleaved states
+TEST_F(CramTest, "RansOrder0") {
+    const char* stream =
+        "\x00\x2a\x00\x00\x00\x18\x00\x00\x00\x20\x80\xaa\x21\x00\x80\xaa\x61\x86\xae\x62\x02\x82\xaa\x81\x55\x81\x55"
+        "\x72\x82\xaa\x00\xbd\x45\x52\x3a\xc7\x18\x95\x0e\x5f\x6d\x51\x3a\x04\xd3\x52\x25\x38\x38\x68\x78";
+    ASSERT(CramContainerDecoder::uncompressRans(stream, 51, &buffer));
+    ASSERT(bytesAre("abracadabra abracadabra!", 24));
+
+    stream =
+        "\x00\x1f\x00\x00\x00\x0b\x00\x00\x00\x61\x87\x48\x62\x02\x82\xe8\x81\x74\x81\x74\x72\x82\xe8\x00\xec\xd6"
+        "\x9a\x42\x20\x89\x4d\x21\x4c\xbe\x99\x42\x60\x05\x6a\x02";
+    buffer.clear();
+    ASSERT(CramContainerDecoder::uncompressRans(stream, 40, &buffer));
+    ASSERT(bytesAre("abracadabra", 11));
+
+    buffer.clear();
+    ASSERT(!CramContainerDecoder::uncompressRans(stream, 30, &buffer));
+}
+
+TEST_F(CramTest, "RansOrder1") {
+    const char* stream =
+        "\x01\x3c\x00\x00\x00\x18\x00\x00\x00\x00\x61\x88\x00\x64\x88\x00\x00\x61\x20\x82\x00\x21\x00\x82\x00\x62"
+        "\x88\x00\x63\x00\x84\x00\x00\x62\x02\x72\x90\x00\x00\x61\x90\x00\x00\x61\x90\x00\x00\x72\x61\x90\x00\x00"
+        "\x00\x00\x30\x00\x08\x00\x0c\x00\x10\x00\x30\x00\x08\x00\x0e\x00\x10";
+    ASSERT(CramContainerDecoder::uncompressRans(stream, 69, &buffer));
+    ASSERT(bytesAre("abracadabra abracadabra!", 24));
+
+    stream =
+        "\x01\x38\x00\x00\x00\x0b\x00\x00\x00\x00\x61\x84\x00\x63\x84\x00\x64\x00\x84\x00\x72\x84\x00\x00\x61\x62"
+        "\x90\x00\x00\x62\x02\x72\x90\x00\x00\x61\x90\x00\x00\x61\x90\x00\x00\x72\x61\x90\x00\x00\x00\x00\x00\x00"
+        "\x02\x00\x0c\x00\x02\x00\x04\x00\x02\x00\x08\x00\x02";
+    buffer.clear();
+    ASSERT(CramContainerDecoder::uncompressRans(stream, 65, &buffer));
+    ASSERT(bytesAre("abracadabra", 11));
+}
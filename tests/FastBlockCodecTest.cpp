@@ -0,0 +1,58 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "FastBlockCodec.h"
+
+// Test fixture for the block compressor used for the sort intermediate file.  Compresses blocks of varying
+// compressibility and checks that they come back exactly.
+struct FastBlockCodecTest {
+    static const size_t Size = FastBlockCodec::MaxBlockSize;
+
+    char input[Size];
+    char compressed[Size + Size / 255 + 16];
+    char output[Size];
+
+    // Returns the compressed size (0 if it didn't compress) after checking the round trip.
+    size_t roundTrip(size_t bytes) {
+        size_t compressedBytes = FastBlockCodec::compress(input, bytes, compressed, sizeof(compressed));
+        if (compressedBytes == 0 || !FastBlockCodec::decompress(compressed, compressedBytes, output, bytes)) {
+            return 0;
+        }
+        return memcmp(input, output, bytes) == 0 ? compressedBytes : 0;
+    }
+};
+
+TEST_F(FastBlockCodecTest, "repetitive data") {
+    const char *text = "ACGTTGCAAGGCTTACGATCGATCGGGATTTACA\tIIIIIHHHGGGFFF\n";
+    for (size_t i = 0; i < Size; i++) {
+        input[i] = text[i % strlen(text)];
+    }
+    size_t sizes[] = {1, 4, 12, 13, 17, 100, 4096, Size - 1, Size};
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        size_t compressedBytes = roundTrip(sizes[i]);
+        ASSERT(compressedBytes > 0);
+        if (sizes[i] >= 4096) {
+            ASSERT(compressedBytes < sizes[i] / 10);
+        }
+    }
+}
+
+TEST_F(FastBlockCodecTest, "runs and random data") {
+    _uint32 state = 12345;
+    for (size_t i = 0; i < Size; i++) {
+        state = state * 1103515245 + 12345;
+        input[i] = (i / 1000) % 3 == 0 ? 'N' : (char)(state >> 16);   // Stretches of random bytes broken up by runs
+    }
+    ASSERT(roundTrip(Size) > 0);
+    ASSERT(roundTrip(Size / 2 + 7) > 0);
+}
+
+TEST_F(FastBlockCodecTest, "incompressible data doesn't fit") {
+    _uint32 state = 54321;
+    for (size_t i = 0; i < Size; i++) {
+        state = state * 1103515245 + 12345;
+        input[i] = (char)(state >> 16);
+    }
+    ASSERT_EQ((size_t)0, FastBlockCodec::compress(input, Size, compressed, Size - 1));
+    ASSERT(!FastBlockCodec::decompress(input, 1000, output, 1000));
+}
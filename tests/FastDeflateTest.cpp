@@ -0,0 +1,79 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "FastDeflate.h"
+#include "zlib.h"
+
+// Test fixture for the deflate encoder used for BGZF output.  Everything it writes has to inflate with zlib.
+struct FastDeflateTest {
+    static const size_t Size = FastDeflate::MaxBlockSize;
+
+    char input[Size];
+    char compressed[Size + 1024];
+    char output[Size];
+
+    // Returns the compressed size (0 if it didn't come back exactly) after inflating with zlib.
+    size_t roundTrip(int level, size_t bytes) {
+        FastDeflate deflater(level);
+        size_t compressedBytes = deflater.compress(input, bytes, compressed, sizeof(compressed));
+        if (compressedBytes == 0) {
+            return 0;
+        }
+
+        z_stream zstream;
+        memset(&zstream, 0, sizeof(zstream));
+        if (inflateInit2(&zstream, -15) != Z_OK) {  // raw deflate
+            return 0;
+        }
+        zstream.next_in = (Bytef *)compressed;
+        zstream.avail_in = (uInt)compressedBytes;
+        zstream.next_out = (Bytef *)output;
+        zstream.avail_out = (uInt)sizeof(output);
+        int status = inflate(&zstream, Z_FINISH);
+        size_t outputBytes = sizeof(output) - zstream.avail_out;
+        bool consumedAll = zstream.avail_in == 0;
+        inflateEnd(&zstream);
+
+        if (status != Z_STREAM_END || !consumedAll || outputBytes != bytes || memcmp(input, output, bytes) != 0) {
+            return 0;
+        }
+        return compressedBytes;
+    }
+};
+
+TEST_F(FastDeflateTest, "SAM-like text at every level") {
+    const char *text = "read.17\t99\tchr1\t10468\t60\t101M\t=\t10672\t305\tACGTTGCAAGGCTTACGATCGATCGGGATTTACA\tIIIIIHHHGGGFFF\n";
+    _uint32 state = 777;
+    for (size_t i = 0; i < Size; i++) {
+        state = state * 1103515245 + 12345;
+        input[i] = (state >> 16) % 23 == 0 ? "ACGT"[(state >> 8) & 3] : text[i % strlen(text)];  // Repetitive, with mutations
+    }
+    for (int level = 0; level <= 9; level++) {
+        size_t compressedBytes = roundTrip(level, Size);
+        ASSERT(compressedBytes > 0);
+        if (level > 0) {
+            ASSERT(compressedBytes < Size / 4);
+        }
+    }
+    size_t sizes[] = {0, 1, 3, 4, 5, 258, 259, 4096, Size - 1};
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        ASSERT(roundTrip(1, sizes[i]) > 0);
+        ASSERT(roundTrip(6, sizes[i]) > 0);
+    }
+}
+
+TEST_F(FastDeflateTest, "runs, one symbol and random data") {
+    memset(input, 'N', Size);
+    ASSERT(roundTrip(6, Size) > 0);     // Only one literal and one distance are used
+
+    _uint32 state = 12345;
+    for (size_t i = 0; i < Size; i++) {
+        state = state * 1103515245 + 12345;
+        input[i] = (char)(state >> 16);
+    }
+    size_t compressedBytes = roundTrip(6, Size);   // Incompressible, so it's stored
+    ASSERT(compressedBytes == FastDeflate::storedSize(Size));
+
+    FastDeflate deflater(6);
+    ASSERT_EQ((size_t)0, deflater.compress(input, Size, compressed, Size));
+}
@@ -0,0 +1,413 @@
+# bench.py
+#
+# Self-contained end-to-end performance benchmark for SNAP.
+#
+# Builds a synthetic reference (with a controllable fraction of diverged repeats) and its index, simulates
+# single- and paired-end reads with substitution and indel errors, then runs snap-aligner over a matrix of
+# thread counts and option sets.  For each run it records reads/s (as reported by SNAP, so it excludes index
+# load), wall time, peak RSS and accuracy, and writes the lot as JSON for regression tracking.
+#
+# Accuracy is evaluated the way ComputeROC does it: the true location is encoded in the read ID, and a
+# primary alignment is correct if it's on the right contig within --slack bases of where the read came
+# from.  Counts are cumulative by MAPQ threshold.  Read IDs are <contig>_<pos1>_<pos2>_<n>:<edits>, with
+# 1-based leftmost reference positions for the first and second mate (equal for single-end reads), which
+# ComputeROC also accepts.
+#
+# The generated data is kept in --dir and reused as long as the generation parameters don't change, so
+# repeated runs only pay for the alignment.
+#
+# Usage: python3 bench.py --snap ../snap-aligner --dir bench-data [--out results.json] [options]
+#
+
+import argparse
+import gzip
+import json
+import os
+import platform
+import random
+import shutil
+import struct
+import subprocess
+import sys
+import time
+
+Complement = str.maketrans("ACGTN", "TGCAN")
+
+def log(message):
+    # Progress goes to stderr, so the JSON on stdout stays clean.
+    sys.stderr.write(message + "\n")
+
+def reverseComplement(bases):
+    return bases.translate(Complement)[::-1]
+
+#
+# Reference
+#
+
+def mutate(rng, bases, rate):
+    if rate <= 0:
+        return bases
+    bases = list(bases)
+    for i in range(len(bases)):
+        if rng.random() < rate:
+            bases[i] = rng.choice("ACGT".replace(bases[i], ""))
+    return "".join(bases)
+
+def makeContig(rng, length, repeatRate, repeatLength, repeatDivergence):
+    #
+    # Alternate between fresh random sequence and diverged copies of sequence we've already generated, so that
+    # about repeatRate of the contig is repeats.
+    #
+    chunks = []
+    generated = 0
+    while generated < length:
+        if generated > repeatLength and rng.random() < repeatRate:
+            start = rng.randrange(0, generated - repeatLength)
+            chunk = mutate(rng, "".join(chunks)[start:start + repeatLength], repeatDivergence)
+            if rng.random() < 0.5:
+                chunk = reverseComplement(chunk)
+        else:
+            chunk = "".join(rng.choices("ACGT", k=repeatLength))
+        chunk = chunk[:length - generated]
+        chunks.append(chunk)
+        generated += len(chunk)
+    return "".join(chunks)
+
+def writeReference(args, rng, fileName):
+    contigs = []
+    contigLength = args.genome_size // args.contigs
+    with open(fileName, "w") as f:
+        for i in range(args.contigs):
+            name = "chr%d" % (i + 1)
+            bases = makeContig(rng, contigLength, args.repeat_rate, args.repeat_length, args.repeat_divergence)
+            contigs.append((name, bases))
+            f.write(">%s\n" % name)
+            for offset in range(0, len(bases), 80):
+                f.write(bases[offset:offset + 80] + "\n")
+    return contigs
+
+#
+# Reads
+#
+
+def applyErrors(rng, reference, start, readLength, errorRate, indelRate):
+    # Returns the read and the number of edits.  reference[start:] must have room for the deletions.
+    read = []
+    edits = 0
+    refPos = start
+    while len(read) < readLength:
+        r = rng.random()
+        if r < indelRate / 2:
+            # Insertion of 1-3 random bases
+            n = rng.randint(1, 3)
+            read.extend(rng.choices("ACGT", k=n))
+            edits += n
+        elif r < indelRate:
+            # Deletion of 1-3 reference bases
+            n = rng.randint(1, 3)
+            refPos += n
+            edits += n
+        else:
+            base = reference[refPos]
+            if rng.random() < errorRate:
+                base = rng.choice("ACGT".replace(base, ""))
+                edits += 1
+            read.append(base)
+            refPos += 1
+    return "".join(read[:readLength]), edits
+
+def writeFastq(f, readId, bases):
+    f.write("@%s\n%s\n+\n%s\n" % (readId, bases, "I" * len(bases)))
+
+def simulateReads(args, rng, contigs, singleFile, pairedFiles):
+    readLength = args.read_length
+    slop = readLength   # Room for deletions at the end of a read
+    totalLength = sum(len(bases) for (name, bases) in contigs)
+
+    def pickContig(span):
+        while True:
+            x = rng.randrange(totalLength)
+            for (name, bases) in contigs:
+                if x < len(bases):
+                    if len(bases) > span + slop:
+                        return (name, bases)
+                    break
+                x -= len(bases)
+
+    with open(singleFile, "w") as f:
+        for n in range(args.single_reads):
+            (name, bases) = pickContig(readLength)
+            start = rng.randrange(0, len(bases) - readLength - slop)
+            read, edits = applyErrors(rng, bases, start, readLength, args.error_rate, args.indel_rate)
+            if rng.random() < 0.5:
+                read = reverseComplement(read)
+            writeFastq(f, "%s_%d_%d_%d:%d" % (name, start + 1, start + 1, n, edits), read)
+
+    with open(pairedFiles[0], "w") as f1, open(pairedFiles[1], "w") as f2:
+        for n in range(args.pairs):
+            fragmentLength = max(readLength, int(rng.gauss(args.fragment_mean, args.fragment_sd)))
+            (name, bases) = pickContig(fragmentLength)
+            start = rng.randrange(0, len(bases) - fragmentLength - slop)
+            leftStart = start
+            rightStart = start + fragmentLength - readLength
+            left, leftEdits = applyErrors(rng, bases, leftStart, readLength, args.error_rate, args.indel_rate)
+            right, rightEdits = applyErrors(rng, bases, rightStart, readLength, args.error_rate, args.indel_rate)
+            right = reverseComplement(right)
+            if rng.random() < 0.5:
+                # The first mate comes from the reverse strand
+                first, firstStart, second, secondStart = right, rightStart, left, leftStart
+            else:
+                first, firstStart, second, secondStart = left, leftStart, right, rightStart
+            readId = "%s_%d_%d_%d:%d" % (name, firstStart + 1, secondStart + 1, n, leftEdits + rightEdits)
+            writeFastq(f1, readId + "/1", first)
+            writeFastq(f2, readId + "/2", second)
+
+#
+# Accuracy
+#
+
+RocThresholds = [0, 1, 3, 10, 20, 30, 40, 50, 60, 70]
+
+def parseTruth(readId):
+    # <contig>_<pos1>_<pos2>_<n>:<edits>; the contig name may itself contain '_', so parse from the right.
+    fields = readId.split(":")[0].rsplit("_", 3)
+    return fields[0], int(fields[1]), int(fields[2])
+
+class Accuracy:
+    def __init__(self, slack):
+        self.slack = slack
+        self.reads = 0
+        self.unaligned = 0
+        self.byMapq = {}    # mapq -> [aligned, misaligned]
+
+    def add(self, readId, flag, contig, pos, mapq):
+        if flag & 0x900:    # Secondary or supplementary
+            return
+        self.reads += 1
+        if flag & 0x4:
+            self.unaligned += 1
+            return
+        trueContig, pos1, pos2 = parseTruth(readId)
+        truePos = pos2 if flag & 0x80 else pos1
+        counts = self.byMapq.setdefault(mapq, [0, 0])
+        counts[0] += 1
+        if contig != trueContig or abs(pos - truePos) > self.slack:
+            counts[1] += 1
+
+    def toJson(self):
+        roc = []
+        for threshold in RocThresholds:
+            aligned = sum(c[0] for (q, c) in self.byMapq.items() if q >= threshold)
+            misaligned = sum(c[1] for (q, c) in self.byMapq.items() if q >= threshold)
+            roc.append({"mapq_at_least": threshold, "aligned": aligned, "misaligned": misaligned,
+                        "error_rate": round(misaligned / float(max(aligned, 1)), 6)})
+        return {"reads": self.reads, "unaligned": self.unaligned, "roc": roc}
+
+def evaluateSam(fileName, accuracy):
+    with open(fileName) as f:
+        for line in f:
+            if line.startswith("@"):
+                continue
+            fields = line.split("\t", 5)
+            accuracy.add(fields[0], int(fields[1]), fields[2], int(fields[3]), int(fields[4]))
+
+def evaluateBam(fileName, accuracy):
+    # BGZF is a series of gzip members, so gzip can read it directly.
+    with gzip.open(fileName, "rb") as f:
+        def read(n):
+            data = f.read(n)
+            if len(data) != n:
+                raise IOError("truncated BAM file %s" % fileName)
+            return data
+
+        if read(4) != b"BAM\1":
+            raise IOError("%s isn't a BAM file" % fileName)
+        (textLength,) = struct.unpack("<i", read(4))
+        read(textLength)
+        (nRefs,) = struct.unpack("<i", read(4))
+        refNames = []
+        for i in range(nRefs):
+            (nameLength,) = struct.unpack("<i", read(4))
+            refNames.append(read(nameLength)[:-1].decode())
+            read(4)
+        while True:
+            header = f.read(4)
+            if len(header) < 4:
+                break
+            (blockSize,) = struct.unpack("<i", header)
+            block = read(blockSize)
+            refId, pos, nameLength, mapq, bin, nCigar, flag = struct.unpack("<iiBBHHH", block[:16])
+            readId = block[32:32 + nameLength - 1].decode()
+            contig = refNames[refId] if refId >= 0 else "*"
+            accuracy.add(readId, flag, contig, pos + 1, mapq)
+
+#
+# Running SNAP
+#
+
+def runAndMeasure(command, logFile):
+    # Returns (exit code, wall seconds, peak RSS in KB or None, stdout)
+    start = time.time()
+    with open(logFile, "w") as log:
+        process = subprocess.Popen(command, stdout=subprocess.PIPE, stderr=log, universal_newlines=True)
+        output = process.stdout.read()
+        if hasattr(os, "wait4"):
+            (pid, status, usage) = os.wait4(process.pid, 0)
+            exitCode = os.waitstatus_to_exitcode(status) if hasattr(os, "waitstatus_to_exitcode") else (status >> 8)
+            peakRss = usage.ru_maxrss
+            if sys.platform == "darwin":
+                peakRss //= 1024    # Bytes rather than KB on OS X
+        else:
+            exitCode = process.wait()
+            peakRss = None
+    return exitCode, time.time() - start, peakRss, output
+
+def parseReadsPerSecond(output):
+    # The last two columns of the stats line are Reads/s and Time in Aligner (s).
+    lines = output.splitlines()
+    for i in range(len(lines) - 1):
+        if lines[i].startswith("Total Reads") and "Reads/s" in lines[i]:
+            fields = lines[i + 1].split()
+            return int(fields[-2].replace(",", ""))
+    return None
+
+def ensureData(args):
+    params = {
+        "seed": args.seed, "genome_size": args.genome_size, "contigs": args.contigs, "repeat_rate": args.repeat_rate,
+        "repeat_length": args.repeat_length, "repeat_divergence": args.repeat_divergence, "read_length": args.read_length,
+        "single_reads": args.single_reads, "pairs": args.pairs, "fragment_mean": args.fragment_mean,
+        "fragment_sd": args.fragment_sd, "error_rate": args.error_rate, "indel_rate": args.indel_rate,
+        "seed_size": args.seed_size,
+    }
+    paramsFile = os.path.join(args.dir, "params.json")
+    if os.path.exists(paramsFile):
+        with open(paramsFile) as f:
+            if json.load(f) == params:
+                log("Reusing generated data in %s" % args.dir)
+                return params
+        shutil.rmtree(args.dir)
+
+    if not os.path.exists(args.dir):
+        os.makedirs(args.dir)
+
+    rng = random.Random(args.seed)
+    log("Generating a %d base reference with %d contigs" % (args.genome_size, args.contigs))
+    contigs = writeReference(args, rng, os.path.join(args.dir, "ref.fa"))
+    log("Simulating %d single-end reads and %d pairs" % (args.single_reads, args.pairs))
+    simulateReads(args, rng, contigs, os.path.join(args.dir, "single.fq"),
+                  [os.path.join(args.dir, "paired_1.fq"), os.path.join(args.dir, "paired_2.fq")])
+
+    log("Building the index")
+    command = [args.snap, "index", os.path.join(args.dir, "ref.fa"), os.path.join(args.dir, "index"), "-s", str(args.seed_size)]
+    exitCode, seconds, peakRss, output = runAndMeasure(command, os.path.join(args.dir, "index.log"))
+    if exitCode != 0:
+        log("Index build failed:\n" + output)
+        exit(1)
+
+    # Written last, so an interrupted generation is redone.
+    with open(paramsFile, "w") as f:
+        json.dump(params, f)
+    return params
+
+Variants = {
+    # name: (output extension, extra SNAP options)
+    "sam": ("sam", []),
+    "bam": ("bam", []),
+    "bam-sorted": ("bam", ["-so"]),
+    "sam-no-affine-gap": ("sam", ["-G-"]),
+}
+
+def main():
+    parser = argparse.ArgumentParser(description="End-to-end SNAP alignment benchmark on simulated data.")
+    parser.add_argument("--snap", default="./snap-aligner", help="snap-aligner binary to benchmark")
+    parser.add_argument("--dir", default="bench-data", help="directory for the generated reference, index, reads and outputs")
+    parser.add_argument("--out", default=None, help="write the JSON results here rather than to stdout")
+    parser.add_argument("--threads", default=None, help="comma separated thread counts (default: 1 and the number of processors)")
+    parser.add_argument("--variants", default=",".join(sorted(Variants.keys())), help="comma separated option sets: " + ", ".join(sorted(Variants.keys())))
+    parser.add_argument("--modes", default="single,paired", help="single, paired or both")
+    parser.add_argument("--repeat", type=int, default=1, help="runs per configuration; the fastest is reported")
+    parser.add_argument("--slack", type=int, default=20, help="distance from the true location still counted as correct")
+    parser.add_argument("--seed", type=int, default=1, help="random seed for the simulation")
+    parser.add_argument("--genome-size", type=int, default=4000000)
+    parser.add_argument("--contigs", type=int, default=4)
+    parser.add_argument("--repeat-rate", type=float, default=0.1, help="fraction of the reference made of diverged copies of itself")
+    parser.add_argument("--repeat-length", type=int, default=1000)
+    parser.add_argument("--repeat-divergence", type=float, default=0.02, help="substitution rate between a repeat and its source")
+    parser.add_argument("--read-length", type=int, default=150)
+    parser.add_argument("--single-reads", type=int, default=200000)
+    parser.add_argument("--pairs", type=int, default=100000)
+    parser.add_argument("--fragment-mean", type=int, default=400)
+    parser.add_argument("--fragment-sd", type=int, default=50)
+    parser.add_argument("--error-rate", type=float, default=0.005, help="per base substitution rate")
+    parser.add_argument("--indel-rate", type=float, default=0.0005, help="per base rate of starting a 1-3 base insertion or deletion")
+    parser.add_argument("--seed-size", type=int, default=24, help="index seed size")
+    args = parser.parse_args()
+
+    for variant in args.variants.split(","):
+        if variant not in Variants:
+            parser.error("unknown variant '%s'" % variant)
+    if args.threads is None:
+        nProcessors = os.cpu_count() or 1
+        threadCounts = sorted(set([1, nProcessors]))
+    else:
+        threadCounts = [int(t) for t in args.threads.split(",")]
+
+    params = ensureData(args)
+    index = os.path.join(args.dir, "index")
+    inputs = {
+        "single": [os.path.join(args.dir, "single.fq")],
+        "paired": [os.path.join(args.dir, "paired_1.fq"), os.path.join(args.dir, "paired_2.fq")],
+    }
+
+    runs = []
+    failed = False
+    for mode in args.modes.split(","):
+        for variant in args.variants.split(","):
+            extension, options = Variants[variant]
+            for threads in threadCounts:
+                outputFile = os.path.join(args.dir, "out-%s-%s-t%d.%s" % (mode, variant, threads, extension))
+                command = [args.snap, mode, index] + inputs[mode] + ["-o", outputFile, "-t", str(threads)] + options
+                log("> " + " ".join(command))
+
+                best = None
+                for attempt in range(args.repeat):
+                    exitCode, seconds, peakRss, output = runAndMeasure(command, outputFile + ".log")
+                    if exitCode != 0:
+                        log("Run exited with %d; see %s.log" % (exitCode, outputFile))
+                        failed = True
+                        break
+                    readsPerSecond = parseReadsPerSecond(output)
+                    if best is None or (readsPerSecond or 0) > (best["reads_per_s"] or 0):
+                        best = {"mode": mode, "variant": variant, "threads": threads, "options": options,
+                                "reads_per_s": readsPerSecond, "wall_s": round(seconds, 3), "peak_rss_kb": peakRss}
+                if best is None:
+                    continue
+
+                accuracy = Accuracy(args.slack)
+                if extension == "bam":
+                    evaluateBam(outputFile, accuracy)
+                else:
+                    evaluateSam(outputFile, accuracy)
+                best["accuracy"] = accuracy.toJson()
+                runs.append(best)
+                os.remove(outputFile)
+
+    results = {
+        "snap": os.path.abspath(args.snap),
+        "date": time.strftime("%Y-%m-%dT%H:%M:%S"),
+        "host": {"platform": platform.platform(), "processors": os.cpu_count()},
+        "parameters": params,
+        "runs": runs,
+    }
+    if args.out is None:
+        json.dump(results, sys.stdout, indent=1)
+        print()
+    else:
+        with open(args.out, "w") as f:
+            json.dump(results, f, indent=1)
+        log("Wrote %s" % args.out)
+
+    exit(1 if failed else 0)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,65 @@
+# fdlimit.py
+#
+# Checks that a sorted io_uring (-iou) run fits under a low open file limit.
+#
+# Every io_uring file has its own ring and completion thread, so -iou is only for the input and output files.
+# The sort's spill, merge and header readers must stay on the plain async file supplier: the merge opens a
+# reader per spill block per range, and giving each of those a ring runs out of descriptors on large sorts.
+# This simulates pairs with bench.py's generator, sorts them with a small -sm so there are many spill blocks,
+# and runs with a thread count that makes many ranges, under --limit open files.
+#
+# Usage: python3 fdlimit.py --snap ../snap-aligner --dir fdlimit-data [--limit 128] [--threads 8]
+#
+
+import argparse
+import os
+import resource
+import subprocess
+import sys
+
+import bench
+
+def main():
+    parser = argparse.ArgumentParser(description="Run a sorted -iou alignment under a low open file limit")
+    parser.add_argument("--snap", default="./snap-aligner", help="snap-aligner binary to test")
+    parser.add_argument("--dir", default="fdlimit-data", help="directory for the generated reference, index, reads and output")
+    parser.add_argument("--limit", type=int, default=64, help="open file limit for the run")
+    parser.add_argument("--threads", type=int, default=8, help="aligner threads, which is also the number of merge ranges")
+    parser.add_argument("--pairs", type=int, default=900000)
+    parser.add_argument("--options", default="-iou", help="SNAP options for the input and output files, e.g. --options=\"-iou -iod\"")
+    args = parser.parse_args()
+
+    #
+    # The same generation parameters as bench.py's defaults, other than the read counts.
+    #
+    generation = argparse.Namespace(snap=args.snap, dir=args.dir, seed=1, genome_size=4000000, contigs=4,
+        repeat_rate=0.1, repeat_length=1000, repeat_divergence=0.02, read_length=150, single_reads=0, pairs=args.pairs,
+        fragment_mean=400, fragment_sd=50, error_rate=0.005, indel_rate=0.0005, seed_size=24)
+    bench.ensureData(generation)
+
+    outputFile = os.path.join(args.dir, "out.bam")
+    command = [args.snap, "paired", os.path.join(args.dir, "index"), os.path.join(args.dir, "paired_1.fq"),
+               os.path.join(args.dir, "paired_2.fq"), "-o", outputFile, "-t", str(args.threads), "-so", "-sm", "1"] + args.options.split()
+    bench.log("> ulimit -n %d; %s" % (args.limit, " ".join(command)))
+
+    def lowerLimit():
+        hard = resource.getrlimit(resource.RLIMIT_NOFILE)[1]
+        resource.setrlimit(resource.RLIMIT_NOFILE, (args.limit, hard))
+
+    process = subprocess.Popen(command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True, preexec_fn=lowerLimit)
+    output = process.communicate()[0]
+    if process.returncode != 0 or "Too many open files" in output or not os.path.exists(outputFile):
+        bench.log(output)
+        bench.log("FAILED: exit code %d with an open file limit of %d" % (process.returncode, args.limit))
+        exit(1)
+
+    for line in output.split("\n"):
+        if "sorted " in line or line.startswith("merged "):
+            bench.log(line)
+    bench.log("PASSED")
+    os.remove(outputFile)
+    if os.path.exists(outputFile + ".bai"):
+        os.remove(outputFile + ".bai")
+
+if __name__ == "__main__":
+    main()